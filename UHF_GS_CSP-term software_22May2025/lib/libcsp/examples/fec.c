@@ -0,0 +1,142 @@
+/*
+Cubesat Space Protocol - A small network-layer protocol designed for Cubesats
+Copyright (C) 2012 GomSpace ApS (http://www.gomspace.com)
+Copyright (C) 2012 AAUSAT3 Project (http://aausat3.space.aau.dk)
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <csp/csp.h>
+#include <csp/csp_fec.h>
+#include <csp/csp_interface.h>
+
+/* Using un-exported header file.
+ * This is allowed since we are still in libcsp */
+#include <csp/arch/csp_thread.h>
+#include <csp/arch/csp_time.h>
+#include <csp/arch/csp_malloc.h>
+
+/** Example defines */
+#define MY_ADDRESS	1			// Address of local CSP node
+#define MY_PORT		10			// Port to send file to
+#define FILE_SIZE	65536			// Size of test data
+#define FEC_K		32			// Source symbols per block
+#define FEC_R		8			// Repair symbols per block
+#define FEC_MTU		200			// Symbol size
+
+/** Percentage of packets dropped by the lossy interface */
+static int loss = 10;
+
+/**
+ * Lossy loopback interface:
+ * Drops packets at random, and passes the rest back to the router.
+ * Packets to this node are routed here instead of to the loopback interface.
+ */
+static int lossy_tx(csp_iface_t * interface, csp_packet_t * packet, uint32_t timeout) {
+
+	/* Pace packets, so the router queue does not overflow */
+	csp_sleep_ms(1);
+
+	if (rand() % 100 < loss) {
+		interface->drop++;
+		csp_buffer_free(packet);
+		return CSP_ERR_NONE;
+	}
+
+	csp_qfifo_write(packet, interface, NULL);
+	return CSP_ERR_NONE;
+
+}
+
+static csp_iface_t csp_if_lossy = {
+	.name = "LOSSY",
+	.nexthop = lossy_tx,
+};
+
+static uint8_t file[FILE_SIZE];
+
+CSP_DEFINE_TASK(task_server) {
+
+	csp_socket_t *sock = csp_socket(CSP_SO_NONE);
+	csp_bind(sock, MY_PORT);
+	csp_listen(sock, 1);
+
+	while (1) {
+
+		csp_conn_t * conn = csp_accept(sock, 10000);
+		if (conn == NULL)
+			continue;
+
+		void * data = NULL;
+		int size = 0;
+		int result = csp_fec_recv(conn, &data, &size, 1000);
+		if (result == 0 && size == FILE_SIZE && memcmp(data, file, FILE_SIZE) == 0) {
+			printf("Server: received %d bytes intact\r\n", size);
+		} else {
+			printf("Server: transfer failed\r\n");
+		}
+
+		csp_free(data);
+		csp_close(conn);
+
+	}
+
+	return CSP_TASK_RETURN;
+
+}
+
+int main(int argc, char * argv[]) {
+
+	if (argc > 1)
+		loss = atoi(argv[1]);
+
+	for (int i = 0; i < FILE_SIZE; i++)
+		file[i] = rand();
+
+	csp_buffer_init(100, 300);
+	csp_init(MY_ADDRESS);
+	csp_route_start_task(500, 1);
+
+	/* Send traffic to this node through the lossy interface */
+	csp_iflist_add(&csp_if_lossy);
+	csp_route_set(MY_ADDRESS, &csp_if_lossy, CSP_NODE_MAC);
+
+	csp_thread_handle_t handle_server;
+	csp_thread_create(task_server, "SERVER", 1000, NULL, 0, &handle_server);
+
+	printf("Sending %d bytes with %d%% loss, %d+%d symbols of %d bytes per block\r\n",
+		FILE_SIZE, loss, FEC_K, FEC_R, FEC_MTU);
+
+	csp_conn_t * conn = csp_connect(CSP_PRIO_NORM, MY_ADDRESS, MY_PORT, 1000, CSP_O_NONE);
+	if (conn == NULL) {
+		printf("Connection failed\r\n");
+		return 1;
+	}
+
+	uint32_t start = csp_get_ms();
+	int result = csp_fec_send(conn, file, FILE_SIZE, FEC_K, FEC_R, FEC_MTU, 2000);
+	uint32_t time = csp_get_ms() - start;
+	csp_close(conn);
+
+	printf("Result %d, %"PRIu32" ms, %"PRIu32" packets dropped\r\n", result, time, csp_if_lossy.drop);
+
+	return (result == 0) ? 0 : 1;
+
+}
@@ -122,6 +122,7 @@ int main(int argc, char **argv) {
 	static csp_iface_t csp_if_kiss;
 	static csp_kiss_handle_t csp_kiss_driver;
 	csp_kiss_init(&csp_if_kiss, &csp_kiss_driver, usart_putc, usart_insert, "KISS");
+	csp_kiss_set_putstr(&csp_kiss_driver, usart_putstr);
 		
 	/* Setup callback from USART RX to KISS RS */
 	void my_usart_rx(uint8_t * buf, int len, void * pxTaskWoken) {
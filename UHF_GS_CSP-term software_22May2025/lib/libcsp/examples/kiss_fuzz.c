@@ -0,0 +1,530 @@
+/*
+Cubesat Space Protocol - A small network-layer protocol designed for Cubesats
+Copyright (C) 2012 GomSpace ApS (http://www.gomspace.com)
+Copyright (C) 2012 AAUSAT3 Project (http://aausat3.space.aau.dk)
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <csp/csp.h>
+#include <csp/csp_crc32.h>
+#include <csp/csp_endian.h>
+#include <csp/csp_interface.h>
+#include <csp/interfaces/csp_if_kiss.h>
+
+/* The decoders are compared on the frames they put in the router queue */
+#include "../src/csp_qfifo.h"
+
+/**
+ * KISS decoder fuzz test and throughput benchmark:
+ * Frames are encoded by one KISS interface into a buffer, mixed with garbage
+ * and corrupted frames, and fed to a second KISS interface in chunks of
+ * random size. Every intact frame must arrive unchanged, and nothing else
+ * may leak buffers or crash the decoder. The same chunks are fed to a byte
+ * at a time reference decoder, and both must put the same frames in the
+ * router queue. The benchmark then times both decoders on a long stream of
+ * full size frames.
+ *
+ * Usage: kiss_fuzz [ROUNDS] [SEED]
+ */
+
+/** Example defines */
+#define MY_ADDRESS	1			// Address of local CSP node
+#define MY_PORT		10			// Port intact frames are sent to
+#define MAX_CHUNK	64			// Largest chunk passed to csp_kiss_rx
+#define STREAM_SIZE	(4 * 1024 * 1024)	// Size of the encoded stream buffer
+#define BENCH_FRAMES	10000			// Frames decoded by the benchmark
+#define BENCH_SIZE	200			// Payload of benchmark frames
+
+/* The decoder limits the whole frame, header and CRC included, to the MTU */
+#define FRAME_MAX	(CSP_KISS_MTU - CSP_HEADER_LENGTH - sizeof(uint32_t))
+
+/* Largest number of frames decoded from one chunk */
+#define MAX_GROUP	64
+
+/* KISS special characters */
+#define FEND		0xC0
+#define FESC		0xDB
+#define TFEND		0xDC
+#define TFESC		0xDD
+
+/* Markers in the second payload byte */
+#define MARK_INTACT	0x55
+#define MARK_CORRUPT	0xAA
+
+static uint8_t stream[STREAM_SIZE];
+static int stream_len;
+
+static csp_iface_t tx_if, rx_if;
+static csp_kiss_handle_t tx_kiss, rx_kiss;
+static csp_socket_t * sock;
+
+static uint32_t sent_intact, recv_intact, recv_corrupt, recv_bad;
+
+/* Reference decoder state and interface */
+static struct {
+	kiss_mode_e mode;
+	unsigned int length;
+	int first;
+	csp_packet_t * packet;
+} ref;
+static csp_iface_t ref_if;
+
+/* Frames decoded equally by both decoders, and differences */
+static uint32_t compared, mismatch;
+
+/* Frames and errors counted by each decoder, the router counts on rx_if too */
+static uint32_t frames, ref_frames, errors, ref_errors;
+
+/* Time spent in each decoder */
+static double busy, ref_busy;
+
+/* KISS write function of the encoder, appends to the stream */
+static int stream_write(void * user, const uint8_t * buf, int len) {
+
+	if (stream_len + len > STREAM_SIZE)
+		return -1;
+
+	memcpy(&stream[stream_len], buf, len);
+	stream_len += len;
+	return len;
+
+}
+
+/* Payload byte i of a frame with sequence number seq */
+static uint8_t pattern(uint32_t seq, int i) {
+	return (uint8_t) (seq * 31 + i * 7);
+}
+
+/* Encode a frame into the stream */
+static void encode(uint32_t seq, uint8_t mark, int size) {
+
+	csp_packet_t * packet = csp_buffer_get(size);
+	if (packet == NULL) {
+		printf("Out of buffers\r\n");
+		exit(1);
+	}
+
+	/* The first bytes hold the sequence number and the marker */
+	memcpy(packet->data, &seq, sizeof(seq));
+	packet->data[4] = mark;
+	for (int i = 5; i < size; i++)
+		packet->data[i] = pattern(seq, i);
+	packet->length = size;
+
+	packet->id.ext = 0;
+	packet->id.src = 2;
+	packet->id.dst = MY_ADDRESS;
+	packet->id.dport = MY_PORT;
+	packet->id.sport = 20;
+
+	if (tx_if.nexthop(&tx_if, packet, 0) != CSP_ERR_NONE) {
+		printf("Encode failed\r\n");
+		exit(1);
+	}
+
+}
+
+/* Route decoded packets and check what arrives on the socket */
+static void drain(void) {
+
+	while (csp_route_work(0) == 0);
+
+	csp_packet_t * packet;
+	while ((packet = csp_recvfrom(sock, 0)) != NULL) {
+
+		uint32_t seq;
+		int ok = (packet->length >= 5);
+		if (ok) {
+			memcpy(&seq, packet->data, sizeof(seq));
+			for (int i = 5; i < packet->length; i++)
+				if (packet->data[i] != pattern(seq, i))
+					ok = 0;
+		}
+
+		/* A corrupted header passes the CRC, which only covers the data,
+		 * and may turn the frame into something else, so only count it */
+		if (ok && packet->data[4] == MARK_INTACT) {
+			recv_intact++;
+		} else if (ok && packet->data[4] == MARK_CORRUPT) {
+			recv_corrupt++;
+		} else {
+			recv_bad++;
+		}
+
+		csp_buffer_free(packet);
+
+	}
+
+}
+
+/* The TNC command byte, only data frames for port 0 are decoded */
+static void ref_command(uint8_t command) {
+
+	ref.first = 0;
+	if (command != 0x00)
+		ref.mode = KISS_MODE_SKIP_FRAME;
+
+}
+
+/* A complete frame, checked and queued as csp_kiss_rx does */
+static void ref_frame(void) {
+
+	ref.mode = KISS_MODE_NOT_STARTED;
+
+	if (ref.length < CSP_HEADER_LENGTH + sizeof(uint32_t)) {
+		ref_if.rx_error++;
+		return;
+	}
+
+	ref_if.frame++;
+	ref.packet->length = ref.length - CSP_HEADER_LENGTH;
+	ref.packet->id.ext = csp_ntoh32(ref.packet->id.ext);
+
+	if (csp_crc32_verify(ref.packet, false) != CSP_ERR_NONE) {
+		ref_if.rx_error++;
+		return;
+	}
+
+	csp_qfifo_write(ref.packet, &ref_if, NULL);
+	ref.packet = NULL;
+
+}
+
+/* Reference decoder: the byte at a time loop that csp_kiss_rx replaced,
+ * with the command byte and empty frame handling of the current decoder,
+ * so both must decode the same frames */
+static void ref_rx(const uint8_t * buf, int len) {
+
+	while (len--) {
+
+		uint8_t inputbyte = *buf++;
+
+		/* If packet was too long */
+		if (ref.length > ref_if.mtu) {
+			ref_if.rx_error++;
+			ref.mode = KISS_MODE_NOT_STARTED;
+			ref.length = 0;
+		}
+
+		switch (ref.mode) {
+
+		case KISS_MODE_NOT_STARTED:
+			if (inputbyte != FEND)
+				break;
+			if (ref.packet == NULL)
+				ref.packet = csp_buffer_get(ref_if.mtu);
+			if (ref.packet == NULL) {
+				ref.mode = KISS_MODE_SKIP_FRAME;
+				break;
+			}
+			ref.length = 0;
+			ref.mode = KISS_MODE_STARTED;
+			ref.first = 1;
+			break;
+
+		case KISS_MODE_STARTED:
+			if (inputbyte == FESC) {
+				ref.mode = KISS_MODE_ESCAPED;
+				break;
+			}
+			if (inputbyte == FEND) {
+				if (ref.length > 0) {
+					ref_frame();
+				} else {
+					ref.first = 1;
+				}
+				break;
+			}
+			if (ref.first) {
+				ref_command(inputbyte);
+				break;
+			}
+			((uint8_t *) &ref.packet->id.ext)[ref.length++] = inputbyte;
+			break;
+
+		case KISS_MODE_ESCAPED:
+			ref.mode = KISS_MODE_STARTED;
+			if (inputbyte != TFESC && inputbyte != TFEND)
+				break;
+			inputbyte = (inputbyte == TFESC) ? FESC : FEND;
+			if (ref.first) {
+				ref_command(inputbyte);
+				break;
+			}
+			((uint8_t *) &ref.packet->id.ext)[ref.length++] = inputbyte;
+			break;
+
+		case KISS_MODE_SKIP_FRAME:
+			if (inputbyte == FEND)
+				ref.mode = KISS_MODE_NOT_STARTED;
+			break;
+
+		}
+
+	}
+
+}
+
+static int same_frame(csp_packet_t * a, csp_packet_t * b) {
+	return a->id.ext == b->id.ext && a->length == b->length && memcmp(a->data, b->data, a->length) == 0;
+}
+
+/* Take the frames both decoders queued for the last chunk and compare them.
+ * The queue may hand them out in priority order, so each frame is matched
+ * with an equal frame of the reference decoder. The frames of csp_kiss_rx
+ * are then queued again for routing. */
+static void compare(void) {
+
+	csp_packet_t * out[MAX_GROUP], * ref_out[MAX_GROUP];
+	int count = 0, ref_count = 0;
+
+	csp_qfifo_t input;
+	while (csp_qfifo_read(&input, 0) == CSP_ERR_NONE) {
+		if (input.interface == &ref_if && ref_count < MAX_GROUP) {
+			ref_out[ref_count++] = input.packet;
+		} else if (input.interface == &rx_if && count < MAX_GROUP) {
+			out[count++] = input.packet;
+		} else {
+			mismatch++;
+			csp_buffer_free(input.packet);
+		}
+	}
+
+	for (int i = 0; i < count; i++) {
+		int j;
+		for (j = 0; j < ref_count; j++)
+			if (ref_out[j] != NULL && same_frame(out[i], ref_out[j]))
+				break;
+		if (j < ref_count) {
+			csp_buffer_free(ref_out[j]);
+			ref_out[j] = NULL;
+			compared++;
+		} else {
+			mismatch++;
+		}
+		csp_qfifo_write(out[i], &rx_if, NULL);
+	}
+
+	for (int j = 0; j < ref_count; j++) {
+		if (ref_out[j] != NULL) {
+			mismatch++;
+			csp_buffer_free(ref_out[j]);
+		}
+	}
+
+}
+
+static double now(void) {
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+/* Pass a chunk to both decoders, and check and route what they decoded */
+static void feed_chunk(uint8_t * buf, int len) {
+
+	uint32_t frame = rx_if.frame, error = rx_if.rx_error;
+	uint32_t ref_frame = ref_if.frame, ref_error = ref_if.rx_error;
+
+	double start = now();
+	csp_kiss_rx(&rx_if, buf, len, NULL);
+	double mid = now();
+	ref_rx(buf, len);
+	busy += mid - start;
+	ref_busy += now() - mid;
+
+	frames += rx_if.frame - frame;
+	errors += rx_if.rx_error - error;
+	ref_frames += ref_if.frame - ref_frame;
+	ref_errors += ref_if.rx_error - ref_error;
+
+	if (rx_if.frame != frame || ref_if.frame != ref_frame) {
+		compare();
+		drain();
+	}
+
+}
+
+/* Feed the stream to the decoders in chunks of random size */
+static void feed(void) {
+
+	for (int pos = 0; pos < stream_len;) {
+		int chunk = 1 + rand() % MAX_CHUNK;
+		if (chunk > stream_len - pos)
+			chunk = stream_len - pos;
+		feed_chunk(&stream[pos], chunk);
+		pos += chunk;
+	}
+
+	stream_len = 0;
+
+}
+
+/* Append bytes to the stream without encoding */
+static void append(const uint8_t * buf, int len) {
+	memcpy(&stream[stream_len], buf, len);
+	stream_len += len;
+}
+
+static void fuzz_round(uint32_t * seq) {
+
+	static const uint8_t resync[] = {0xC0, 0xC0};
+	int frames = 1 + rand() % 8;
+
+	for (int f = 0; f < frames; f++) {
+
+		int size = 5 + rand() % (FRAME_MAX - 5 + 1);
+
+		switch (rand() % 4) {
+
+		case 0: {
+			/* Garbage without FEND or FESC, and a FEND that ends it
+			 * in case the decoder is inside a frame */
+			int len = rand() % 32;
+			for (int i = 0; i < len; i++) {
+				uint8_t c = rand();
+				if (c != 0xC0 && c != 0xDB)
+					append(&c, 1);
+			}
+			append(resync, 1);
+			encode((*seq)++, MARK_INTACT, size);
+			sent_intact++;
+			break;
+		}
+
+		case 1: {
+			/* A frame with random bytes changed, and a resync */
+			int start = stream_len;
+			encode((*seq)++, MARK_CORRUPT, size);
+			int flips = 1 + rand() % 4;
+			for (int i = 0; i < flips; i++)
+				stream[start + rand() % (stream_len - start)] = rand();
+			append(resync, sizeof(resync));
+			break;
+		}
+
+		case 2: {
+			/* Random bytes, including delimiters and escapes, and a resync */
+			int len = rand() % 300;
+			for (int i = 0; i < len; i++) {
+				static const uint8_t special[] = {0xC0, 0xDB, 0xDC, 0xDD, 0x00};
+				uint8_t c = (rand() % 4) ? (uint8_t) rand() : special[rand() % sizeof(special)];
+				append(&c, 1);
+			}
+			append(resync, sizeof(resync));
+			break;
+		}
+
+		default:
+			encode((*seq)++, MARK_INTACT, size);
+			sent_intact++;
+			break;
+
+		}
+
+	}
+
+	feed();
+
+}
+
+static void bench(void) {
+
+	for (uint32_t seq = 0; seq < BENCH_FRAMES; seq++)
+		encode(seq, MARK_INTACT, BENCH_SIZE);
+
+	/* Only the decoders are timed, comparing and routing happen between chunks */
+	busy = 0;
+	ref_busy = 0;
+	uint32_t first = frames, ref_first = ref_frames;
+	for (int pos = 0; pos < stream_len;) {
+		int chunk = 256;
+		if (chunk > stream_len - pos)
+			chunk = stream_len - pos;
+		feed_chunk(&stream[pos], chunk);
+		pos += chunk;
+	}
+
+	printf("Bench: %"PRIu32" frames, %d bytes decoded in %.1f ms, %.1f MB/s\r\n",
+		frames - first, stream_len, busy * 1e3, stream_len / busy / 1e6);
+	printf("Bench reference: %"PRIu32" frames, %d bytes decoded in %.1f ms, %.1f MB/s\r\n",
+		ref_frames - ref_first, stream_len, ref_busy * 1e3, stream_len / ref_busy / 1e6);
+
+	stream_len = 0;
+
+}
+
+int main(int argc, char * argv[]) {
+
+	int rounds = (argc > 1) ? atoi(argv[1]) : 10000;
+	srand((argc > 2) ? atoi(argv[2]) : 1);
+
+	csp_buffer_init(100, 300);
+	csp_init(MY_ADDRESS);
+
+	/* Corrupted frames are expected, do not log each of them */
+	csp_debug_set_level(CSP_ERROR, false);
+	csp_debug_set_level(CSP_WARN, false);
+
+	csp_kiss_init(&tx_if, &tx_kiss, NULL, NULL, "KISSTX");
+	csp_kiss_set_write(&tx_kiss, stream_write, NULL);
+	csp_kiss_init(&rx_if, &rx_kiss, NULL, NULL, "KISSRX");
+	ref_if.name = "KISSREF";
+	ref_if.mtu = rx_if.mtu;
+
+	sock = csp_socket(CSP_SO_CONN_LESS);
+	csp_bind(sock, MY_PORT);
+
+	/* The decoder keeps one buffer for the next frame */
+	uint32_t seq = 0;
+	encode(seq++, MARK_INTACT, 5);
+	sent_intact++;
+	feed();
+	int buffers = csp_buffer_remaining();
+
+	for (int i = 0; i < rounds; i++)
+		fuzz_round(&seq);
+
+	printf("Fuzz: %d rounds, %"PRIu32"/%"PRIu32" intact frames received, %"PRIu32" corrupted frames passed, %"PRIu32" bad, %"PRIu32" rx errors\r\n",
+		rounds, recv_intact, sent_intact, recv_corrupt, recv_bad, rx_if.rx_error);
+
+	printf("Compare: %"PRIu32" frames decoded equally, %"PRIu32" differences, %"PRIu32"/%"PRIu32" frames, %"PRIu32"/%"PRIu32" rx errors\r\n",
+		compared, mismatch, frames, ref_frames, errors, ref_errors);
+
+	/* Each decoder may hold a buffer for a frame in progress */
+	int leaked = buffers - csp_buffer_remaining() - (rx_kiss.rx_packet != NULL) - (ref.packet != NULL);
+	if (recv_intact != sent_intact || leaked != 0 || mismatch != 0 ||
+			frames != ref_frames || errors != ref_errors) {
+		printf("Fuzz FAILED, %d buffers leaked\r\n", leaked);
+		return 1;
+	}
+
+	bench();
+
+	if (mismatch != 0) {
+		printf("Bench FAILED, %"PRIu32" differences\r\n", mismatch);
+		return 1;
+	}
+
+	return 0;
+
+}
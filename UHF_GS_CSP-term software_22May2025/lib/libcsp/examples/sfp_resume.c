@@ -0,0 +1,257 @@
+/*
+Cubesat Space Protocol - A small network-layer protocol designed for Cubesats
+Copyright (C) 2012 GomSpace ApS (http://www.gomspace.com)
+Copyright (C) 2012 AAUSAT3 Project (http://aausat3.space.aau.dk)
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <csp/csp.h>
+#include <csp/csp_interface.h>
+
+/* Using un-exported header file.
+ * This is allowed since we are still in libcsp */
+#include <csp/arch/csp_thread.h>
+#include <csp/arch/csp_semaphore.h>
+#include <csp/arch/csp_time.h>
+
+/**
+ * Resumable SFP file transfer over a lossy loopback:
+ * A transfer of other data with the same size is interrupted first, and
+ * leaves its state behind. The real transfer must not continue from it.
+ * The real transfer is interrupted too, and then resumed by sending the
+ * ranges the receiver is missing, until the file is complete. Fragments
+ * are dropped and reordered throughout.
+ *
+ * Usage: sfp_resume [PATH] [LOSS]
+ */
+
+/** Example defines */
+#define MY_ADDRESS	1			// Address of local CSP node
+#define MY_PORT		10			// Port to send file to
+#define FILE_SIZE	65536			// Size of test data
+#define SFP_MTU		200			// Fragment size
+#define CUT_STALE	100			// Fragments of the stale transfer before it is interrupted
+#define CUT_FIRST	150			// Fragments of the first pass before it is interrupted
+#define MAX_RANGES	16			// Missing ranges requested per pass
+#define MAX_PASSES	50			// Passes before giving up
+#define STALE_ID	1			// Identity of the stale transfer
+#define FILE_ID		2			// Identity of the real transfer
+
+/** Percentage of packets dropped by the lossy interface */
+static int loss = 10;
+
+/** Packets passed before the link is cut, or -1 */
+static int budget = -1;
+
+/** Packet held back to be delivered after the next one */
+static csp_packet_t * held;
+
+/**
+ * Lossy loopback interface:
+ * Drops packets at random, swaps the order of some, and passes the rest back
+ * to the router. Once the budget is used, all packets are dropped.
+ * Packets to this node are routed here instead of to the loopback interface.
+ */
+static int lossy_tx(csp_iface_t * interface, csp_packet_t * packet, uint32_t timeout) {
+
+	/* Pace packets, so the router queue does not overflow */
+	csp_sleep_ms(1);
+
+	if (budget == 0 || rand() % 100 < loss) {
+		interface->drop++;
+		csp_buffer_free(packet);
+		return CSP_ERR_NONE;
+	}
+	if (budget > 0)
+		budget--;
+
+	if (held == NULL && rand() % 4 == 0) {
+		held = packet;
+		return CSP_ERR_NONE;
+	}
+
+	csp_qfifo_write(packet, interface, NULL);
+	if (held != NULL) {
+		csp_qfifo_write(held, interface, NULL);
+		held = NULL;
+	}
+	return CSP_ERR_NONE;
+
+}
+
+static csp_iface_t csp_if_lossy = {
+	.name = "LOSSY",
+	.nexthop = lossy_tx,
+};
+
+/* Deliver a packet still held back at the end of a pass */
+static void lossy_flush(void) {
+	if (held != NULL) {
+		csp_qfifo_write(held, &csp_if_lossy, NULL);
+		held = NULL;
+	}
+}
+
+static uint8_t file[FILE_SIZE];
+static uint8_t stale[FILE_SIZE];
+static const char * path = "/tmp/sfp_resume.bin";
+
+/* Identity of the transfer the server receives, agreed out of band */
+static volatile uint32_t transfer_id;
+
+/* Result of the last pass received by the server */
+static csp_bin_sem_handle_t pass_done;
+static volatile int pass_result;
+
+CSP_DEFINE_TASK(task_server) {
+
+	csp_socket_t *sock = csp_socket(CSP_SO_NONE);
+	csp_bind(sock, MY_PORT);
+	csp_listen(sock, 1);
+
+	while (1) {
+
+		csp_conn_t * conn = csp_accept(sock, 10000);
+		if (conn == NULL)
+			continue;
+
+		pass_result = csp_sfp_recv_file(conn, path, transfer_id, 500, NULL);
+		csp_close(conn);
+		csp_bin_sem_post(&pass_done);
+
+	}
+
+	return CSP_TASK_RETURN;
+
+}
+
+/* Send ranges of data in one pass, and return the result of the receiver */
+static int send_pass(uint8_t * data, uint32_t id, csp_sfp_range_t * ranges, int count) {
+
+	transfer_id = id;
+
+	csp_conn_t * conn = csp_connect(CSP_PRIO_NORM, MY_ADDRESS, MY_PORT, 1000, CSP_O_NONE);
+	if (conn == NULL)
+		return CSP_ERR_TIMEDOUT;
+
+	for (int i = 0; i < count; i++)
+		csp_sfp_send_range(conn, data, FILE_SIZE, ranges[i].offset, ranges[i].length, SFP_MTU, 1000);
+	lossy_flush();
+	csp_close(conn);
+
+	/* No result if every packet was dropped */
+	if (csp_bin_sem_wait(&pass_done, 3000) != CSP_SEMAPHORE_OK)
+		return CSP_ERR_TIMEDOUT;
+
+	return pass_result;
+
+}
+
+static int check(int ok, const char * what) {
+	printf("%s: %s\r\n", what, ok ? "OK" : "FAILED");
+	return ok;
+}
+
+int main(int argc, char * argv[]) {
+
+	if (argc > 1)
+		path = argv[1];
+	if (argc > 2)
+		loss = atoi(argv[2]);
+
+	for (int i = 0; i < FILE_SIZE; i++) {
+		file[i] = rand();
+		stale[i] = rand();
+	}
+
+	char state_path[256];
+	snprintf(state_path, sizeof(state_path), "%s.sfp", path);
+	unlink(path);
+	unlink(state_path);
+
+	csp_buffer_init(100, 300);
+	csp_init(MY_ADDRESS);
+	csp_route_start_task(500, 1);
+
+	/* Send traffic to this node through the lossy interface */
+	csp_iflist_add(&csp_if_lossy);
+	csp_route_set(MY_ADDRESS, &csp_if_lossy, CSP_NODE_MAC);
+
+	csp_bin_sem_create(&pass_done);
+	csp_bin_sem_wait(&pass_done, 0);
+
+	csp_thread_handle_t handle_server;
+	csp_thread_create(task_server, "SERVER", 1000, NULL, 0, &handle_server);
+
+	printf("Sending %d bytes in fragments of %d bytes with %d%% loss\r\n", FILE_SIZE, SFP_MTU, loss);
+
+	int ok = 1;
+	uint32_t saved_id = 0, saved_size = 0;
+	csp_sfp_range_t ranges[MAX_RANGES] = {{0, FILE_SIZE}};
+
+	/* Another transfer of the same size leaves its state behind */
+	budget = CUT_STALE;
+	ok &= check(send_pass(stale, STALE_ID, ranges, 1) == CSP_ERR_TIMEDOUT, "Stale transfer interrupted");
+	ok &= check(csp_sfp_file_missing(path, &saved_id, &saved_size, ranges, MAX_RANGES) > 0 && saved_id == STALE_ID, "Stale transfer saved");
+
+	/* The real transfer starts over, and is interrupted too */
+	ranges[0].offset = 0;
+	ranges[0].length = FILE_SIZE;
+	budget = CUT_FIRST;
+	ok &= check(send_pass(file, FILE_ID, ranges, 1) == CSP_ERR_TIMEDOUT, "Transfer interrupted");
+	budget = -1;
+
+	/* Resume with the missing ranges until the file is complete */
+	int result = CSP_ERR_TIMEDOUT, pass;
+	uint32_t start = csp_get_ms();
+	for (pass = 1; pass <= MAX_PASSES && result != CSP_ERR_NONE; pass++) {
+		int count = csp_sfp_file_missing(path, &saved_id, &saved_size, ranges, MAX_RANGES);
+		if (count <= 0 || saved_id != FILE_ID || saved_size != FILE_SIZE) {
+			printf("No saved state for the transfer\r\n");
+			break;
+		}
+		uint32_t bytes = 0;
+		for (int i = 0; i < count; i++)
+			bytes += ranges[i].length;
+		result = send_pass(file, FILE_ID, ranges, count);
+		printf("Pass %d: %d ranges, %"PRIu32" bytes, result %d\r\n", pass, count, bytes, result);
+	}
+	ok &= check(result == CSP_ERR_NONE, "Transfer resumed to completion");
+
+	/* The file must hold the data of the real transfer only */
+	static uint8_t received[FILE_SIZE + 1];
+	FILE * fp = fopen(path, "rb");
+	size_t size = 0;
+	if (fp != NULL) {
+		size = fread(received, 1, sizeof(received), fp);
+		fclose(fp);
+	}
+	ok &= check(size == FILE_SIZE && memcmp(received, file, FILE_SIZE) == 0, "File intact");
+	ok &= check(access(state_path, F_OK) != 0, "State removed");
+
+	printf("%"PRIu32" ms, %"PRIu32" packets dropped\r\n", csp_get_ms() - start, csp_if_lossy.drop);
+	printf("%s\r\n", ok ? "All tests passed" : "Tests FAILED");
+
+	unlink(path);
+	return ok ? 0 : 1;
+
+}
@@ -0,0 +1,203 @@
+/*
+Cubesat Space Protocol - A small network-layer protocol designed for Cubesats
+Copyright (C) 2012 GomSpace ApS (http://www.gomspace.com)
+Copyright (C) 2012 AAUSAT3 Project (http://aausat3.space.aau.dk)
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <termios.h>
+
+#include <csp/drivers/usart.h>
+
+/**
+ * Serial driver test on pseudo terminals:
+ * Two devices are opened through symlinks to ptys, as csp-term does with
+ * two radios. Data is passed both ways, one device is stalled by a write
+ * that cannot complete, then unplugged by closing its pty, and plugged in
+ * again on a new pty behind the same symlink. The other device must keep
+ * receiving throughout, and the unplugged one must come back by itself.
+ *
+ * Usage: usart_pty [DIR]
+ */
+
+/** Example defines */
+#define DEVICES		2
+#define STALL_SIZE	(1024 * 1024)		// Write that fills the pty buffer
+#define WAIT_MS		3000			// Longest wait, covers a reopen
+
+static char device[DEVICES][64];
+static int master[DEVICES];
+static usart_handle_t * handle[DEVICES];
+
+/* Received data of each device */
+static pthread_mutex_t rx_lock = PTHREAD_MUTEX_INITIALIZER;
+static char rx_data[DEVICES][64];
+static int rx_len[DEVICES];
+
+static int stall_done, stall_result;
+
+static void rx(uint8_t * buf, int len, void * user) {
+
+	int i = (int) (long) user;
+
+	pthread_mutex_lock(&rx_lock);
+	if (len > (int) sizeof(rx_data[i]) - 1 - rx_len[i])
+		len = sizeof(rx_data[i]) - 1 - rx_len[i];
+	memcpy(&rx_data[i][rx_len[i]], buf, len);
+	rx_len[i] += len;
+	pthread_mutex_unlock(&rx_lock);
+
+}
+
+/* Create a pty and point the device symlink at it, returns the master fd */
+static int plug(int i) {
+
+	int fd = posix_openpt(O_RDWR | O_NOCTTY);
+	if (fd < 0 || grantpt(fd) != 0 || unlockpt(fd) != 0) {
+		perror("pty");
+		exit(1);
+	}
+
+	struct termios options;
+	tcgetattr(fd, &options);
+	cfmakeraw(&options);
+	tcsetattr(fd, TCSANOW, &options);
+
+	unlink(device[i]);
+	if (symlink(ptsname(fd), device[i]) != 0) {
+		perror("symlink");
+		exit(1);
+	}
+
+	return fd;
+
+}
+
+/* Send a string from the far end of a device, until the driver has it.
+ * It is resent since a device that is being reopened flushes its input. */
+static int send_wait(int i, const char * str) {
+
+	pthread_mutex_lock(&rx_lock);
+	memset(rx_data[i], 0, sizeof(rx_data[i]));
+	rx_len[i] = 0;
+	pthread_mutex_unlock(&rx_lock);
+
+	for (int ms = 0; ms < WAIT_MS; ms += 10) {
+		if (ms % 200 == 0 && write(master[i], str, strlen(str)) < 0)
+			return 0;
+		usleep(10000);
+		pthread_mutex_lock(&rx_lock);
+		int ok = (strstr(rx_data[i], str) != NULL);
+		pthread_mutex_unlock(&rx_lock);
+		if (ok)
+			return 1;
+	}
+
+	return 0;
+
+}
+
+/* Write a string to a device and read it at the far end */
+static int write_check(int i, const char * str) {
+
+	char buf[64] = {0};
+	int len = strlen(str);
+
+	if (usart_write(handle[i], str, len) != len)
+		return 0;
+
+	for (int got = 0; got < len;) {
+		struct pollfd fd = {.fd = master[i], .events = POLLIN};
+		if (poll(&fd, 1, WAIT_MS) != 1)
+			return 0;
+		int ret = read(master[i], &buf[got], len - got);
+		if (ret <= 0)
+			return 0;
+		got += ret;
+	}
+
+	return memcmp(buf, str, len) == 0;
+
+}
+
+static void * stall_task(void * param) {
+
+	static char buf[STALL_SIZE];
+	stall_result = usart_write(handle[0], buf, sizeof(buf));
+	__atomic_store_n(&stall_done, 1, __ATOMIC_RELEASE);
+	return NULL;
+
+}
+
+static int check(int ok, const char * what) {
+	printf("%s: %s\r\n", what, ok ? "OK" : "FAILED");
+	return ok;
+}
+
+int main(int argc, char * argv[]) {
+
+	const char * dir = (argc > 1) ? argv[1] : "/tmp";
+	int ok = 1;
+
+	for (int i = 0; i < DEVICES; i++) {
+		snprintf(device[i], sizeof(device[i]), "%s/usart_pty%d", dir, i);
+		master[i] = plug(i);
+		struct usart_conf conf = {.device = device[i], .baudrate = 500000};
+		handle[i] = usart_open(&conf, rx, (void *) (long) i);
+		if (handle[i] == NULL) {
+			printf("Failed to open %s\r\n", device[i]);
+			return 1;
+		}
+	}
+
+	ok &= check(send_wait(0, "rx0") && send_wait(1, "rx1"), "Receive on both devices");
+	ok &= check(write_check(0, "tx0") && write_check(1, "tx1"), "Write to both devices");
+
+	/* Nobody reads the far end of device 0, so the write blocks */
+	pthread_t stall;
+	pthread_create(&stall, NULL, stall_task, NULL);
+	usleep(100000);
+	ok &= check(!__atomic_load_n(&stall_done, __ATOMIC_ACQUIRE), "Write to device 0 stalls");
+	ok &= check(send_wait(1, "stalled"), "Receive on device 1 during stalled write");
+
+	/* Unplug device 0 */
+	close(master[0]);
+	pthread_join(stall, NULL);
+	ok &= check(stall_result < 0, "Stalled write fails when unplugged");
+	ok &= check(usart_write(handle[0], "lost", 4) < 0, "Write to unplugged device fails");
+	ok &= check(send_wait(1, "unplugged"), "Receive on device 1 while device 0 is unplugged");
+
+	/* Plug it in again, the driver reopens it within a second */
+	master[0] = plug(0);
+	ok &= check(send_wait(0, "replugged"), "Receive on device 0 after replug");
+	ok &= check(write_check(0, "again"), "Write to device 0 after replug");
+	ok &= check(send_wait(1, "done"), "Receive on device 1 after replug");
+
+	for (int i = 0; i < DEVICES; i++)
+		unlink(device[i]);
+
+	printf("%s\r\n", ok ? "All tests passed" : "Tests FAILED");
+	return ok ? 0 : 1;
+
+}
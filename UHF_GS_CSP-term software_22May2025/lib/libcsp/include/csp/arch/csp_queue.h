@@ -38,6 +38,8 @@ void csp_queue_remove(csp_queue_handle_t queue);
 int csp_queue_enqueue(csp_queue_handle_t handle, void *value, uint32_t timeout);
 int csp_queue_enqueue_isr(csp_queue_handle_t handle, void * value, CSP_BASE_TYPE * task_woken);
 int csp_queue_dequeue(csp_queue_handle_t handle, void *buf, uint32_t timeout);
+/* Dequeue up to max pointers from a queue of pointers, waiting up to timeout for the first. Returns the number dequeued */
+int csp_queue_dequeue_batch(csp_queue_handle_t handle, void **buf, int max, uint32_t timeout);
 int csp_queue_dequeue_isr(csp_queue_handle_t handle, void * buf, CSP_BASE_TYPE * task_woken);
 int csp_queue_size(csp_queue_handle_t handle);
 int csp_queue_size_isr(csp_queue_handle_t handle);
@@ -129,6 +129,8 @@ csp_packet_t *csp_read(csp_conn_t *conn, uint32_t timeout);
  * @param packet pointer to packet,
  * @param timeout a timeout to wait for TX to complete. NOTE: not all underlying drivers supports flow-control.
  * @return returns 1 if successful and 0 otherwise. you MUST free the frame yourself if the transmission was not successful.
+ * A payload that was compressed is restored when the transmission fails, except on RDP connections,
+ * where the packet is already queued for retransmission and is left compressed with the RDP header.
  */
 int csp_send(csp_conn_t *conn, csp_packet_t *packet, uint32_t timeout);
 
@@ -184,6 +186,19 @@ int csp_transaction_persistent(csp_conn_t *conn, uint32_t timeout, void *outbuf,
  */
 csp_packet_t *csp_recvfrom(csp_socket_t *socket, uint32_t timeout);
 
+/**
+ * Read a batch of packets from a connection-less server socket
+ * Waits up to timeout for the first packet, then returns it together with
+ * any further packets already queued on the socket, up to max.
+ * Do NOT call this from ISR
+ * @param socket connection-less socket
+ * @param packets array to store packet pointers in
+ * @param max size of packets array
+ * @param timeout timeout to wait for the first packet
+ * @return Number of packets stored in packets, which you MUST free yourself.
+ */
+int csp_recvfrom_batch(csp_socket_t *socket, csp_packet_t **packets, int max, uint32_t timeout);
+
 /**
  * Send a packet without previously opening a connection
  * @param prio CSP_PRIO_x
@@ -194,9 +209,29 @@ csp_packet_t *csp_recvfrom(csp_socket_t *socket, uint32_t timeout);
  * @param packet pointer to packet
  * @param timeout timeout used by interfaces with blocking send
  * @return -1 if error (you must free packet), 0 if OK (you must discard pointer)
+ * On error, a payload compressed with CSP_O_COMP is restored. Without compression, HMAC, CRC32 and XTEA are
+ * added to the packet in place, so its data is not restored if the send fails after that.
  */
 int csp_sendto(uint8_t prio, uint8_t dest, uint8_t dport, uint8_t src_port, uint32_t opts, csp_packet_t *packet, uint32_t timeout);
 
+/**
+ * Send a batch of packets to the same destination without opening a connection
+ * The route is looked up once, and the batch is handed to the interface in one
+ * call if it supports batch transmit.
+ * @param prio CSP_PRIO_x
+ * @param dest destination node
+ * @param dport destination port
+ * @param src_port source port
+ * @param opts CSP_O_x
+ * @param packets array of packet pointers
+ * @param count number of packets
+ * @param timeout timeout used by interfaces with blocking send
+ * @return Number of packets sent from the start of the array (you must discard these pointers and free the rest), or negative CSP_ERR if opts are invalid (you must free all)
+ * The data of unsent packets is restored on the same terms as for csp_sendto: a payload compressed with CSP_O_COMP
+ * is restored, while HMAC, CRC32 and XTEA added in place to an uncompressed packet are not undone.
+ */
+int csp_sendto_batch(uint8_t prio, uint8_t dest, uint8_t dport, uint8_t src_port, uint32_t opts, csp_packet_t **packets, int count, uint32_t timeout);
+
 /**
  * Send a packet as a direct reply to the source of an incoming packet,
  * but still without holding an entire connection
@@ -292,9 +327,11 @@ int csp_route_start_task(unsigned int task_stack_size, unsigned int priority);
 int csp_route_work(uint32_t timeout);
 
 /**
- * Start the bridge task.
+ * Start the bridge tasks.
+ * Packets received on one side are queued and forwarded in batches to the other side
+ * by a task per direction, without passing through the router.
  * @param task_stack_size The number of portStackType to allocate. This only affects FreeRTOS systems.
- * @param priority The OS task priority of the router
+ * @param priority The OS task priority of the bridge tasks
  * @param _if_a pointer to first side
  * @param _if_b pointer to second side
  * @return CSP_ERR type
@@ -302,33 +339,127 @@ int csp_route_work(uint32_t timeout);
 int csp_bridge_start(unsigned int task_stack_size, unsigned int task_priority, csp_iface_t * _if_a, csp_iface_t * _if_b);
 
 /**
- * Enable promiscuous mode packet queue
+ * Limit which packets are bridged.
+ * A packet is forwarded if its source or destination node is set in nodes,
+ * and its source or destination port is set in ports. Both default to all ones.
+ * @param nodes bitmask of node addresses
+ * @param ports bitmask of ports
+ */
+void csp_bridge_set_filter(uint32_t nodes, uint64_t ports);
+
+/**
+ * Read bridge counters
+ * @param direction CSP_BRIDGE_A_TO_B or CSP_BRIDGE_B_TO_A
+ * @param stats pointer to counters to fill in
+ * @return CSP_ERR type
+ */
+int csp_bridge_get_stats(int direction, csp_bridge_stats_t * stats);
+
+/**
+ * Print bridge counters and latency histograms
+ */
+void csp_bridge_print_stats(void);
+
+/**
+ * Enable promiscuous mode packet capture
  * This function is used to enable promiscuous mode for the router.
- * If enabled, a copy of all incoming packets are placed in a queue
- * that can be read with csp_promisc_get(). Not all interface drivers
- * support promiscuous mode.
+ * If enabled, a copy of all routed and sent packets that pass the capture
+ * filter are placed in a ring that can be read with csp_promisc_read() or
+ * csp_promisc_pcapng_write(). When the ring is full, the oldest packet is
+ * overwritten. Not all interface drivers support promiscuous mode.
  *
- * @param buf_size Size of buffer for incoming packets
+ * @param buf_size Number of packets the capture ring can hold
  */
 int csp_promisc_enable(unsigned int buf_size);
 
 /**
  * Disable promiscuous mode.
- * If the queue was initialised prior to this, it can be re-enabled
+ * If the ring was initialised prior to this, it can be re-enabled
  * by calling promisc_enable(0)
  */
 void csp_promisc_disable(void);
 
 /**
- * Get packet from promiscuous mode packet queue
- * Returns the first packet from the promiscuous mode packet queue.
- * The queue is FIFO, so the returned packet is the oldest one
- * in the queue.
+ * Get packet from promiscuous mode capture ring
+ * Returns the oldest packet in the capture ring, copied into a new buffer
+ * that must be freed by the caller.
  *
  * @param timeout Timeout in ms to wait for a new packet
  */
 csp_packet_t *csp_promisc_read(uint32_t timeout);
 
+/**
+ * Set promiscuous mode capture filter
+ * A packet is captured if its source or destination node is set in nodes,
+ * its source or destination port is set in ports, and its flags masked
+ * with flags_mask equal flags. The default filter captures everything.
+ *
+ * @param nodes Bitmask of nodes, bit n for node n
+ * @param ports Bitmask of ports, bit n for port n
+ * @param flags_mask Flags to compare
+ * @param flags Required value of the compared flags
+ */
+void csp_promisc_set_filter(uint32_t nodes, uint64_t ports, uint8_t flags_mask, uint8_t flags);
+
+/**
+ * Get number of captured packets overwritten before they were read
+ * @return number of dropped packets
+ */
+uint32_t csp_promisc_dropped(void);
+
+/** pcapng link type of captured packets (LINKTYPE_USER0): CSP header in network order followed by data */
+#define CSP_PROMISC_LINKTYPE 147
+
+/**
+ * Write pcapng section header and interface description
+ * Must be called once on a new file before csp_promisc_pcapng_write().
+ * Timestamps are written with nanosecond resolution.
+ *
+ * @param fd File descriptor to write to
+ * @return 0 on success, CSP_ERR type on failure
+ */
+int csp_promisc_pcapng_header(int fd);
+
+/**
+ * Write captured packets as pcapng enhanced packet blocks
+ * Waits up to timeout ms for a captured packet, and then writes the packets
+ * in the capture ring without waiting further. Call this in a loop from a
+ * capture task to stream packets to a file.
+ *
+ * @param fd File descriptor to write to
+ * @param timeout Timeout in ms to wait for the first packet
+ * @return number of packets written, CSP_ERR type on failure
+ */
+int csp_promisc_pcapng_write(int fd, uint32_t timeout);
+
+/** Hash functions for the duplicate filter */
+typedef enum {
+	CSP_DEDUP_HASH_CRC32 = 0,	/**< CRC32 of header and data, requires CRC32 support */
+	CSP_DEDUP_HASH_FAST = 1,	/**< Word-wise hash of header and data */
+} csp_dedup_hash_t;
+
+/**
+ * Set duplicate filter options
+ * The duplicate filter is only available if CSP was compiled with dedup support.
+ * A packet is discarded if an identical packet was received within the window,
+ * on any interface.
+ *
+ * @param window_ms Time in ms a packet is remembered, 0 disables the filter
+ * @param hash Hash function used to compare packets
+ * @param rdp Also filter RDP packets, which are otherwise left to RDP
+ */
+void csp_dedup_set_opt(uint32_t window_ms, csp_dedup_hash_t hash, bool rdp);
+
+/**
+ * Enable or disable the duplicate filter for a destination port
+ * The filter is enabled for all ports by default. Per interface, the
+ * filter is disabled with the dedup_off field in csp_iface_t.
+ *
+ * @param port Destination port
+ * @param enable true to filter packets to this port
+ */
+void csp_dedup_set_port(uint8_t port, bool enable);
+
 /**
  * Send multiple packets using the simple fragmentation protocol
  * CSP will add total size and offset to all packets
@@ -376,6 +507,66 @@ int csp_sfp_recv(csp_conn_t * conn, void ** dataout, int * datasize, uint32_t ti
  */
 int csp_sfp_recv_fp(csp_conn_t * conn, void ** dataout, int * datasize, uint32_t timeout, csp_packet_t * first_packet);
 
+/**
+ * Send part of the data using the simple fragmentation protocol
+ * Used to resend the ranges missing at the receiver after an interrupted transfer.
+ * Fragments are aligned to the mtu, as with csp_sfp_send.
+ * @param conn pointer to connection
+ * @param data pointer to all data of the transfer
+ * @param totalsize size of all data of the transfer
+ * @param offset offset of the first byte to send
+ * @param length number of bytes to send
+ * @param mtu maximum transfer unit
+ * @param timeout timeout in ms to wait for csp_send()
+ * @return 0 if OK, -1 if ERR
+ */
+int csp_sfp_send_range(csp_conn_t * conn, void * data, int totalsize, int offset, int length, int mtu, uint32_t timeout);
+
+/** Largest transfer accepted by csp_sfp_recv_file */
+#ifndef CSP_SFP_FILE_MAX
+#define CSP_SFP_FILE_MAX	(1024UL * 1024 * 1024)
+#endif
+
+/** Byte range of a transfer */
+typedef struct {
+	uint32_t offset;
+	uint32_t length;
+} csp_sfp_range_t;
+
+/**
+ * Receive SFP data into a file
+ * Fragments are written at their offset, in any order, so memory use does not
+ * depend on the size of the transfer. Received ranges are saved in <path>.sfp,
+ * so a transfer interrupted by a timeout can be continued by calling this
+ * function again, after the sender has been asked for the missing ranges,
+ * see csp_sfp_file_missing(). A saved state is only continued by a transfer
+ * with the same identity, size and fragment size, otherwise the transfer starts
+ * over. The state file is removed when the transfer is complete.
+ * Only available on posix.
+ * @param conn pointer to active conn, on which you expect to receive sfp packed data
+ * @param path destination file
+ * @param id identity of the transfer agreed with the sender, such as a CRC32 of the data
+ * @param timeout timeout in ms to wait for csp_read()
+ * @param first_packet first SFP packet previously received with csp_read, or NULL
+ * @return CSP_ERR_NONE if the file is complete, CSP_ERR_TIMEDOUT if the transfer
+ * is incomplete and can be continued, CSP_ERR_INVAL for a malformed or too large
+ * transfer, CSP_ERR_NOMEM if no state could be allocated, CSP_ERR_DRIVER if the
+ * file could not be opened or written
+ */
+int csp_sfp_recv_file(csp_conn_t * conn, const char * path, uint32_t id, uint32_t timeout, csp_packet_t * first_packet);
+
+/**
+ * Get the ranges missing from an interrupted file transfer
+ * Only available on posix.
+ * @param path destination file passed to csp_sfp_recv_file()
+ * @param id set to the identity of the transfer, if not NULL
+ * @param totalsize set to the size of the transfer, if not NULL
+ * @param ranges array to fill with missing ranges
+ * @param max_ranges size of the ranges array
+ * @return number of missing ranges, -1 if there is no saved transfer
+ */
+int csp_sfp_file_missing(const char * path, uint32_t * id, uint32_t * totalsize, csp_sfp_range_t * ranges, int max_ranges);
+
 /**
  * If the given packet is a service-request (that is uses one of the csp service ports)
  * it will be handled according to the CSP service handler.
@@ -450,7 +641,7 @@ void csp_uptime(uint8_t node, uint32_t timeout);
  * Set RDP options
  * @param window_size Window size
  * @param conn_timeout_ms Connection timeout in ms
- * @param packet_timeout_ms Packet timeout in ms
+ * @param packet_timeout_ms Initial retransmission timeout in ms, until the round trip time is measured
  * @param delayed_acks Enable/disable delayed acknowledgements
  * @param ack_timeout Acknowledgement timeout when delayed ACKs is enabled
  * @param ack_delay_count Send acknowledgement for every ack_delay_count packets
@@ -472,6 +663,54 @@ void csp_rdp_get_opt(unsigned int *window_size, unsigned int *conn_timeout_ms,
 		unsigned int *packet_timeout_ms, unsigned int *delayed_acks,
 		unsigned int *ack_timeout, unsigned int *ack_delay_count);
 
+/** RDP connection state, see csp_rdp_get_conn_info() */
+typedef struct {
+	uint32_t state;			/**< RDP state */
+	uint32_t window_size;		/**< Negotiated window size */
+	uint32_t cwnd;			/**< Current send window, reduced after retransmission timeouts */
+	uint32_t in_flight;		/**< Segments waiting for acknowledgement */
+	uint32_t srtt;			/**< Smoothed round trip time in ms, 0 until measured */
+	uint32_t rttvar;		/**< Round trip time variation in ms */
+	uint32_t rto;			/**< Current retransmission timeout in ms */
+	uint32_t backoff;		/**< Consecutive retransmission timeouts */
+	uint32_t tx_segments;		/**< Data segments sent */
+	uint32_t retransmits;		/**< Segments retransmitted */
+	uint32_t timeouts;		/**< Retransmission timeouts */
+} csp_rdp_conn_info_t;
+
+/**
+ * Get RDP state of a connection
+ * The retransmission timeout of each connection adapts to the measured round
+ * trip time, starting from the packet timeout set with csp_rdp_set_opt().
+ * @param conn RDP connection
+ * @param info Pointer to struct to fill
+ * @return 0 on success, CSP_ERR_INVAL if conn is not an RDP connection
+ */
+int csp_rdp_get_conn_info(csp_conn_t *conn, csp_rdp_conn_info_t *info);
+
+/** Compression statistics of a connection, see csp_conn_get_comp_stats() */
+typedef struct {
+	uint32_t tx_packets;		/**< Packets sent with compression enabled */
+	uint32_t tx_compressed;		/**< Packets sent compressed, the rest did not get smaller and were sent as is */
+	uint32_t tx_bytes_in;		/**< Payload bytes before compression */
+	uint32_t tx_bytes_out;		/**< Payload bytes after compression */
+	uint32_t rx_compressed;		/**< Compressed packets received */
+	uint32_t rx_bytes_in;		/**< Compressed payload bytes received */
+	uint32_t rx_bytes_out;		/**< Payload bytes after decompression */
+	uint32_t rx_errors;		/**< Compressed packets dropped because they did not decompress */
+} csp_comp_stats_t;
+
+/**
+ * Get compression statistics of a connection
+ * Payloads are compressed on connections opened with CSP_O_COMP, and on
+ * server connections of sockets created with CSP_SO_COMPREQ. Compressed
+ * packets are always decompressed before delivery.
+ * @param conn connection
+ * @param stats Pointer to struct to fill
+ * @return 0 on success, CSP_ERR_NOTSUP if CSP was compiled without compression support
+ */
+int csp_conn_get_comp_stats(csp_conn_t *conn, csp_comp_stats_t *stats);
+
 /**
  * Set XTEA key
  * @param key Pointer to key array
@@ -67,6 +67,24 @@ void csp_buffer_free(void *packet);
  */
 void csp_buffer_free_isr(void *packet);
 
+/**
+ * Take an additional reference to a buffer.
+ * The buffer is returned to the pool when every reference has been released
+ * with csp_buffer_free(). A buffer with more than one reference is shared,
+ * and must not be modified: transmit paths send a copy if they need to
+ * change it.
+ * @param buffer Buffer acquired by csp_buffer_get().
+ * @return buffer, or NULL if buffer is not valid
+ */
+void * csp_buffer_refc_inc(void *buffer);
+
+/**
+ * Return the number of references to a buffer.
+ * @param buffer Buffer acquired by csp_buffer_get().
+ * @return number of references, 1 if the buffer is not shared
+ */
+int csp_buffer_refc(void *buffer);
+
 /**
  * Clone an existing packet and increase/decrease cloned packet size.
  * @param buffer Existing buffer to clone.
@@ -0,0 +1,96 @@
+/*
+Cubesat Space Protocol - A small network-layer protocol designed for Cubesats
+Copyright (C) 2012 GomSpace ApS (http://www.gomspace.com)
+Copyright (C) 2012 AAUSAT3 Project (http://aausat3.space.aau.dk)
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#ifndef _CSP_FEC_H_
+#define _CSP_FEC_H_
+
+#include <csp/csp.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Forward error corrected bulk transfer:
+ * Data is split in blocks of k source symbols of mtu bytes, and r repair
+ * symbols are sent after each block, using a systematic Reed-Solomon erasure
+ * code over GF(256). The receiver rebuilds a block from any k of its k + r
+ * symbols, so no acknowledgements are needed during the transfer. A single
+ * status reply is sent by the receiver when the stream has ended.
+ * k + r must not exceed 255.
+ */
+
+/**
+ * Compute repair symbols for a block
+ * @param k number of source symbols
+ * @param r number of repair symbols
+ * @param size symbol size in bytes
+ * @param src array of k pointers to source symbols
+ * @param repair array of r pointers to repair symbols to fill in
+ */
+void csp_fec_encode(int k, int r, int size, uint8_t * const * src, uint8_t * const * repair);
+
+/**
+ * Rebuild missing source symbols of a block
+ * The repair symbols are used as scratch memory and are overwritten.
+ * @param k number of source symbols
+ * @param size symbol size in bytes
+ * @param src array of k pointers to source symbols, missing symbols are written here
+ * @param present array of k flags, non-zero for source symbols received
+ * @param repair array of pointers to received repair symbols
+ * @param repair_index index (0 to r-1) of each received repair symbol
+ * @param repairs number of received repair symbols
+ * @return 0 if all source symbols are present after decoding, -1 otherwise
+ */
+int csp_fec_decode(int k, int size, uint8_t * const * src, const uint8_t * present, uint8_t * const * repair, const uint8_t * repair_index, int repairs);
+
+/**
+ * Send data as forward error corrected symbols, and wait for the receiver status
+ * @param conn pointer to connection
+ * @param data pointer to data to send
+ * @param totalsize size of data to send
+ * @param k source symbols per block
+ * @param r repair symbols per block
+ * @param mtu symbol size, excluding the FEC header
+ * @param timeout timeout for each packet, and for the status reply
+ * @return 0 if the receiver rebuilt all data, number of blocks the receiver could not rebuild, or negative CSP_ERR on error
+ */
+int csp_fec_send(csp_conn_t * conn, const void * data, int totalsize, int k, int r, int mtu, uint32_t timeout);
+
+/** Largest transfer accepted by csp_fec_recv */
+#ifndef CSP_FEC_RECV_MAX
+#define CSP_FEC_RECV_MAX	(16UL * 1024 * 1024)
+#endif
+
+/**
+ * Receive data sent with csp_fec_send, and reply with the transfer status
+ * @param conn pointer to connection
+ * @param dataout pointer to NULL pointer, which is set to memory allocated with csp_malloc, and must be freed by the caller
+ * @param datasize pointer to int, set to the size of the data
+ * @param timeout timeout to wait for each packet
+ * @return 0 if all data was received, -1 otherwise, also if the sender announces more than CSP_FEC_RECV_MAX bytes
+ */
+int csp_fec_recv(csp_conn_t * conn, void ** dataout, int * datasize, uint32_t timeout);
+
+#ifdef __cplusplus
+} /* extern "C" */
+#endif
+
+#endif /* _CSP_FEC_H_ */
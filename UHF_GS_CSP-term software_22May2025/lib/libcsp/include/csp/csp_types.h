@@ -128,8 +128,8 @@ typedef union {
 
 /** CSP Flags */
 #define CSP_FRES1			0x80 // Reserved for future use
-#define CSP_FRES2			0x40 // Reserved for future use
-#define CSP_FRES3			0x20 // Reserved for future use
+#define CSP_FAGGR			0x40 // Frame of aggregated packets
+#define CSP_FCOMP			0x20 // Payload is LZO compressed
 #define CSP_FFRAG			0x10 // Use fragmentation
 #define CSP_FHMAC			0x08 // Use HMAC verification
 #define CSP_FXTEA			0x04 // Use XTEA encryption
@@ -147,6 +147,7 @@ typedef union {
 #define CSP_SO_CRC32REQ			0x0040 // Require CRC32
 #define CSP_SO_CRC32PROHIB		0x0080 // Prohibit CRC32
 #define CSP_SO_CONN_LESS		0x0100 // Enable Connection Less mode
+#define CSP_SO_COMPREQ			0x0200 // Compress outgoing payloads
 
 /** CSP Connect options */
 #define CSP_O_NONE			CSP_SO_NONE // No connection options
@@ -158,6 +159,7 @@ typedef union {
 #define CSP_O_NOXTEA			CSP_SO_XTEAPROHIB // Disable XTEA
 #define CSP_O_CRC32			CSP_SO_CRC32REQ // Enable CRC32
 #define CSP_O_NOCRC32			CSP_SO_CRC32PROHIB // Disable CRC32
+#define CSP_O_COMP			CSP_SO_COMPREQ // Enable compression
 
 /**
  * CSP PACKET STRUCTURE
@@ -180,13 +182,18 @@ typedef struct __attribute__((__packed__)) {
 struct csp_iface_s;
 typedef int (*nexthop_t)(struct csp_iface_s * interface, csp_packet_t *packet, uint32_t timeout);
 
+/** Interface batch TX function, returns the number of packets consumed from the start of the array */
+typedef int (*nexthop_batch_t)(struct csp_iface_s * interface, csp_packet_t **packets, int count, uint32_t timeout);
+
 /** Interface struct */
 typedef struct csp_iface_s {
 	const char *name;			/**< Interface name (keep below 10 bytes) */
 	void * driver;				/**< Pointer to interface handler structure */
 	nexthop_t nexthop;			/**< Next hop function */
+	nexthop_batch_t nexthop_batch;		/**< Next hop function for a batch of packets (optional) */
 	uint16_t mtu;				/**< Maximum Transmission Unit of interface */
 	uint8_t split_horizon_off;	/**< Disable the route-loop prevention on if */
+	uint8_t dedup_off;			/**< Disable the duplicate filter on packets received on if */
 	uint32_t tx;				/**< Successfully transmitted packets */
 	uint32_t rx;				/**< Successfully received packets */
 	uint32_t tx_error;			/**< Transmit errors */
@@ -207,6 +214,23 @@ typedef struct csp_iface_s {
  */
 #define CSP_BUFFER_PACKET_OVERHEAD 	(sizeof(csp_packet_t) - sizeof(((csp_packet_t *)0)->data))
 
+/** Bridge directions */
+#define CSP_BRIDGE_A_TO_B		0
+#define CSP_BRIDGE_B_TO_A		1
+
+/** Number of latency histogram bins, bin 0 is below 1 ms and bin n counts [2^(n-1), 2^n) ms */
+#define CSP_BRIDGE_LATENCY_BINS		12
+
+/** Bridge counters, one set per direction */
+typedef struct {
+	uint32_t forwarded;			/**< Packets sent on the output interface */
+	uint32_t filtered;			/**< Packets dropped by the node/port filter */
+	uint32_t dropped;			/**< Packets dropped because the queue was full */
+	uint32_t tx_error;			/**< Packets refused by the output interface */
+	uint32_t batches;			/**< Batches dequeued by the bridge task */
+	uint32_t latency[CSP_BRIDGE_LATENCY_BINS];	/**< Time from reception to dequeue */
+} csp_bridge_stats_t;
+
 /** Forward declaration of socket and connection structures */
 typedef struct csp_conn_s csp_socket_t;
 typedef struct csp_conn_s csp_conn_t;
@@ -31,9 +31,17 @@ extern "C" {
 #include <csp/interfaces/csp_if_can.h>
 
 /* The can_frame_t and can_id_t types intentionally matches the
- * can_frame struct and can_id types in include/linux/can.h
+ * can_frame struct and can_id types in include/linux/can.h, or the
+ * canfd_frame struct when built with CAN FD support
  */
 
+/** Maximum data bytes in a CAN frame */
+#ifdef CSP_CAN_FD
+#define CAN_FRAME_DATA_MAX	64
+#else
+#define CAN_FRAME_DATA_MAX	8
+#endif
+
 /** CAN Identifier */
 typedef uint32_t can_id_t;
 
@@ -43,11 +51,11 @@ typedef struct {
 	can_id_t id;
 	/** Data Length Code */
 	uint8_t dlc;
-	/**< Frame Data - 0 to 8 bytes */
+	/**< Frame Data - 0 to CAN_FRAME_DATA_MAX bytes */
 	union __attribute__((aligned(8))) {
-		uint8_t data[8];
-		uint16_t data16[4];
-		uint32_t data32[2];
+		uint8_t data[CAN_FRAME_DATA_MAX];
+		uint16_t data16[CAN_FRAME_DATA_MAX / 2];
+		uint32_t data32[CAN_FRAME_DATA_MAX / 4];
 	};
 } can_frame_t;
 
@@ -59,6 +67,15 @@ typedef enum {
 int can_init(uint32_t id, uint32_t mask, struct csp_can_config *conf);
 int can_send(can_id_t id, uint8_t * data, uint8_t dlc);
 
+/**
+ * Send a batch of frames. Drivers that do not implement this
+ * are called through can_send once per frame.
+ * @param frames frames to send, with identifier flags stripped
+ * @param count number of frames
+ * @return number of frames sent
+ */
+int can_send_batch(can_frame_t * frames, int count);
+
 int csp_can_rx_frame(can_frame_t *frame, CSP_BASE_TYPE *task_woken);
 
 #ifdef __cplusplus
@@ -57,6 +57,43 @@ void usart_init(struct usart_conf *conf);
 typedef void (*usart_callback_t) (uint8_t *buf, int len, void *pxTaskWoken);
 void usart_set_callback(usart_callback_t callback);
 
+/**
+ * Handle of a serial device opened with usart_open.
+ * Handles stay valid until the program exits.
+ */
+typedef struct usart_handle_s usart_handle_t;
+
+/**
+ * Receive callback of a serial device opened with usart_open.
+ * Called from the serial thread.
+ * @param buf pointer to received data
+ * @param len length of received data
+ * @param user user pointer passed to usart_open
+ */
+typedef void (*usart_rx_callback_t) (uint8_t *buf, int len, void *user);
+
+/**
+ * Open a serial device. Any number of devices, up to a fixed limit, can be
+ * open at the same time and are served by one thread. A device that is not
+ * present or is lost, such as a USB adapter that re-enumerates, is reopened
+ * automatically. Only supported by the Linux driver.
+ *
+ * @param conf device configuration
+ * @param callback function called with received data
+ * @param user pointer passed to the callback
+ * @return handle, or NULL on failure
+ */
+usart_handle_t * usart_open(const struct usart_conf *conf, usart_rx_callback_t callback, void *user);
+
+/**
+ * Write a block of data to a serial device
+ * @param handle device handle
+ * @param buf pointer to data
+ * @param len length of data
+ * @return len on success, -1 if the device is not open or the write failed
+ */
+int usart_write(usart_handle_t *handle, const void *buf, int len);
+
 /**
  * Insert a character to the RX buffer of a usart
  * @param handle usart[0,1,2,3]
@@ -0,0 +1,73 @@
+/*
+Cubesat Space Protocol - A small network-layer protocol designed for Cubesats
+Copyright (C) 2012 GomSpace ApS (http://www.gomspace.com)
+Copyright (C) 2012 AAUSAT3 Project (http://aausat3.space.aau.dk)
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#ifndef _CSP_IF_AGGR_H_
+#define _CSP_IF_AGGR_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+
+#include <csp/csp.h>
+#include <csp/csp_interface.h>
+
+/**
+ * The aggregation interface sits on top of a point-to-point interface, such
+ * as KISS, and coalesces small packets for the same next hop into one frame
+ * of up to the MTU of the lower interface. A frame is sent when the next
+ * packet does not fit, or when the first packet in it has waited for the
+ * latency budget. Larger packets are sent on the lower interface as they are,
+ * after any pending frame, so the order of packets is kept.
+ *
+ * Frames carry the CSP_FAGGR flag, and are split by the router of the
+ * receiving node, which must be built with aggregation support.
+ *
+ * Route traffic to the aggregation interface instead of the lower interface.
+ *
+ * @param interface pointer to aggregation interface to set up
+ * @param name name of the aggregation interface
+ * @param lower interface frames are sent on
+ * @param max_packet largest packet length that is aggregated
+ * @param latency longest time in ms a packet is held back
+ * @return CSP_ERR_NONE on success, or CSP_ERR type
+ */
+int csp_aggr_init(csp_iface_t * interface, const char * name, csp_iface_t * lower, uint16_t max_packet, uint32_t latency);
+
+/**
+ * Send any pending frame now
+ * @param interface pointer to aggregation interface
+ */
+void csp_aggr_flush(csp_iface_t * interface);
+
+/**
+ * Split an aggregated frame and pass the packets in it to the router.
+ * Called by the router for packets with the CSP_FAGGR flag.
+ * @param interface interface the frame was received on
+ * @param packet aggregated frame, which is freed
+ */
+void csp_aggr_rx(csp_iface_t * interface, csp_packet_t * packet);
+
+#ifdef __cplusplus
+} /* extern "C" */
+#endif
+
+#endif // _CSP_IF_AGGR_H_
@@ -29,6 +29,17 @@ extern "C" {
 
 #include <csp/csp.h>
 #include <csp/csp_interface.h>
+#include <csp/arch/csp_semaphore.h>
+
+/** KISS MTU */
+#define CSP_KISS_MTU			256
+
+/** Number of TNC ports, given by the high nibble of the KISS command byte */
+#define CSP_KISS_PORTS			16
+
+/** Worst case encoded size of one frame: every byte of the TNC command,
+ * header, data and CRC32 escaped, plus the two FEND */
+#define CSP_KISS_TXBUF_SIZE		(2 * (1 + CSP_HEADER_LENGTH + CSP_KISS_MTU + sizeof(uint32_t)) + 2)
 
 /**
  * The KISS interface relies on the USART callback in order to parse incoming
@@ -42,6 +53,9 @@ extern "C" {
  * When a byte is not a part of a kiss packet, it will be returned to your
  * usart driver using the usart_insert funtion that you provide.
  *
+ * Frames are received on the interface of their TNC port, so any interface
+ * of a KISS handle can be passed here.
+ *
  * @param csp_iface pointer to interface
  * @param buf pointer to incoming data
  * @param len length of incoming data
@@ -58,6 +72,27 @@ void csp_kiss_rx(csp_iface_t * interface, uint8_t *buf, int len, void *pxTaskWok
  */
 typedef void (*csp_kiss_putc_f)(char buf);
 
+/**
+ * The putstr function is used by the kiss interface to send
+ * a block of encoded data to the serial port in one write.
+ * It is optional, and set with csp_kiss_set_putstr. Without it,
+ * the data is sent through the putc function a byte at a time.
+ * @param buf pointer to data
+ * @param len length of data
+ */
+typedef void (*csp_kiss_putstr_f)(char *buf, int len);
+
+/**
+ * The write function is a block write with a user pointer, for drivers
+ * that serve several KISS interfaces. It is optional, set with
+ * csp_kiss_set_write, and takes precedence over putstr and putc.
+ * @param user user pointer given to csp_kiss_set_write
+ * @param buf pointer to data
+ * @param len length of data
+ * @return len on success, negative on error
+ */
+typedef int (*csp_kiss_write_f)(void *user, const uint8_t *buf, int len);
+
 /**
  * The characters not accepted by the kiss interface, are discarded
  * using this function, which must be implemented by the user
@@ -92,10 +127,58 @@ typedef struct csp_kiss_handle_s {
 	unsigned int rx_first;
 	volatile unsigned char *rx_cbuf;
 	csp_packet_t * rx_packet;
+	csp_iface_t * rx_iface;
+	csp_kiss_putstr_f kiss_putstr;
+	csp_kiss_write_f kiss_write;
+	void * kiss_write_user;
+	csp_iface_t * ports[CSP_KISS_PORTS];
+	csp_bin_sem_handle_t tx_lock;
+	unsigned int tx_length;
+	uint8_t tx_buf[CSP_KISS_TXBUF_SIZE];
 } csp_kiss_handle_t;
 
+/**
+ * Set up a KISS handle and its interface for TNC port 0.
+ * Each handle has its own transmit lock, so separate serial links
+ * transmit concurrently.
+ * @param csp_iface pointer to interface
+ * @param csp_kiss_handle pointer to KISS handle
+ * @param kiss_putc_f byte write function
+ * @param kiss_discard_f function for bytes outside of KISS frames
+ * @param name interface name
+ */
 void csp_kiss_init(csp_iface_t * csp_iface, csp_kiss_handle_t * csp_kiss_handle, csp_kiss_putc_f kiss_putc_f, csp_kiss_discard_f kiss_discard_f, const char * name);
 
+/**
+ * Add an interface for another TNC port of a KISS handle, so several
+ * radios of a multi-port TNC are reached over one serial link. Each port
+ * has its own interface statistics. Call after csp_kiss_init.
+ * @param csp_kiss_handle pointer to KISS handle
+ * @param csp_iface pointer to interface
+ * @param port TNC port, 1 to 15
+ * @param name interface name
+ * @return CSP_ERR_NONE on success, CSP_ERR_INVAL if the port is invalid or in use
+ */
+int csp_kiss_add_port(csp_kiss_handle_t * csp_kiss_handle, csp_iface_t * csp_iface, uint8_t port, const char * name);
+
+/**
+ * Set the block write function of a KISS interface. Frames are then
+ * encoded into a buffer and written with one call, instead of one
+ * call to putc per byte. Call after csp_kiss_init.
+ * @param csp_kiss_handle pointer to KISS handle
+ * @param kiss_putstr_f block write function, or NULL to use putc
+ */
+void csp_kiss_set_putstr(csp_kiss_handle_t * csp_kiss_handle, csp_kiss_putstr_f kiss_putstr_f);
+
+/**
+ * Set the block write function of a KISS interface, with a user pointer
+ * that is passed to it. Call after csp_kiss_init.
+ * @param csp_kiss_handle pointer to KISS handle
+ * @param kiss_write_f block write function, or NULL to use putstr or putc
+ * @param user pointer passed to the write function
+ */
+void csp_kiss_set_write(csp_kiss_handle_t * csp_kiss_handle, csp_kiss_write_f kiss_write_f, void * user);
+
 #ifdef __cplusplus
 } /* extern "C" */
 #endif
@@ -0,0 +1,55 @@
+/*
+Cubesat Space Protocol - A small network-layer protocol designed for Cubesats
+Copyright (C) 2012 GomSpace ApS (http://www.gomspace.com)
+Copyright (C) 2012 AAUSAT3 Project (http://aausat3.space.aau.dk)
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#ifndef _CSP_IF_KISS_TCP_H_
+#define _CSP_IF_KISS_TCP_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+
+#include <csp/csp.h>
+#include <csp/csp_interface.h>
+
+/**
+ * KISS over TCP, for software TNCs, SDR modems and test peers.
+ *
+ * Frames are encoded and decoded by the KISS interface, and carried over
+ * a TCP connection instead of a serial port. In client mode the interface
+ * connects to host and port, in server mode it listens on port and serves
+ * one peer at a time, a new peer replacing the current one. A lost
+ * connection is re-established automatically; packets sent while there is
+ * no connection are dropped. Only available on POSIX systems.
+ *
+ * @param interface pointer to interface to set up
+ * @param name name of the interface
+ * @param host host to connect to, or NULL to listen for connections
+ * @param port TCP port to connect to, or to listen on
+ * @return CSP_ERR_NONE on success, or CSP_ERR type
+ */
+int csp_kiss_tcp_init(csp_iface_t * interface, const char * name, const char * host, uint16_t port);
+
+#ifdef __cplusplus
+} /* extern "C" */
+#endif
+
+#endif /* _CSP_IF_KISS_TCP_H_ */
@@ -0,0 +1,98 @@
+/*
+Cubesat Space Protocol - A small network-layer protocol designed for Cubesats
+Copyright (C) 2012 GomSpace ApS (http://www.gomspace.com)
+Copyright (C) 2012 AAUSAT3 Project (http://aausat3.space.aau.dk)
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#ifndef _CSP_IF_MULTI_H_
+#define _CSP_IF_MULTI_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+
+#include <csp/csp.h>
+#include <csp/csp_interface.h>
+
+/** Multi interface modes */
+#define CSP_MULTI_FAILOVER	0	/**< Send on the best member */
+#define CSP_MULTI_BALANCE	1	/**< Share packets between members in proportion to their score */
+#define CSP_MULTI_DUPLICATE	2	/**< Send on every usable member */
+
+/** Maximum number of members of a multi interface */
+#define CSP_MULTI_MAX_MEMBERS	4
+
+/**
+ * The multi interface sends packets on one or more of several member
+ * interfaces, such as two radios serving the same satellite.
+ *
+ * Each member is scored from 0 to 100 from the change of its interface
+ * counters: transmitted and received packets count for it, and transmit
+ * errors, receive errors and drops count against it. A member that receives
+ * nothing while another member receives is scored as failing, which
+ * catches a dead receive chain behind a serial port that still accepts
+ * data. A reported RSSI scales the score down as the signal weakens.
+ *
+ * A member whose send fails is taken out of use for a second, and the
+ * packet is sent on the next member at once. In failover mode traffic
+ * only moves to another member when it scores clearly better, so it does
+ * not flap between members of similar quality.
+ *
+ * In duplicate mode the receiving node gets each packet several times, so
+ * it must be built with the duplicate filter.
+ *
+ * Route traffic to the multi interface instead of the members.
+ *
+ * @param interface pointer to multi interface to set up
+ * @param name name of the multi interface
+ * @param mode CSP_MULTI_FAILOVER, CSP_MULTI_BALANCE or CSP_MULTI_DUPLICATE
+ * @return CSP_ERR_NONE on success, or CSP_ERR type
+ */
+int csp_multi_init(csp_iface_t * interface, const char * name, uint8_t mode);
+
+/**
+ * Add a member interface, in order of preference
+ * @param interface pointer to multi interface
+ * @param member interface to send on
+ * @return CSP_ERR_NONE on success, or CSP_ERR type
+ */
+int csp_multi_add(csp_iface_t * interface, csp_iface_t * member);
+
+/**
+ * Report the signal strength of a member, for example from radio telemetry.
+ * Reports older than ten seconds are ignored.
+ * @param interface pointer to multi interface
+ * @param member member interface
+ * @param rssi received signal strength in dBm
+ */
+void csp_multi_set_rssi(csp_iface_t * interface, csp_iface_t * member, int16_t rssi);
+
+/**
+ * Get the current score of a member
+ * @param interface pointer to multi interface
+ * @param member member interface
+ * @return score from 0 to 100, 0 while the member is out of use, or -1 if not a member
+ */
+int csp_multi_get_score(csp_iface_t * interface, csp_iface_t * member);
+
+#ifdef __cplusplus
+} /* extern "C" */
+#endif
+
+#endif // _CSP_IF_MULTI_H_
@@ -0,0 +1,64 @@
+/*
+Cubesat Space Protocol - A small network-layer protocol designed for Cubesats
+Copyright (C) 2012 GomSpace ApS (http://www.gomspace.com)
+Copyright (C) 2012 AAUSAT3 Project (http://aausat3.space.aau.dk)
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#ifndef _CSP_IF_SHM_H_
+#define _CSP_IF_SHM_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+
+#include <csp/csp.h>
+#include <csp/csp_interface.h>
+
+/* Shared memory configuration struct */
+struct csp_shm_config {
+	const char * name;	/**< Name of the segment, e.g. "/csp-term" for /dev/shm/csp-term */
+	int create;		/**< Create the segment, else attach to an existing one */
+	uint32_t slots;		/**< Packets in each direction, a power of two, 0 for 256. Used when creating */
+	uint16_t mtu;		/**< MTU, 0 for the CSP buffer size. Used when creating */
+};
+
+/**
+ * Shared memory link between two processes on the same host.
+ *
+ * The segment holds one ring of packet slots in each direction. Each ring
+ * has a single producer and a single consumer, and is used without locks;
+ * a sleeping receiver is woken with a futex. A packet is copied into a
+ * slot when it is sent and out of it when it is received, without any
+ * system call while the receiver is busy. A full ring drops packets.
+ *
+ * One process creates the segment and the other attaches to it, so the
+ * segment connects exactly two processes. Only available on Linux.
+ *
+ * @param interface pointer to interface to set up
+ * @param name name of the interface
+ * @param conf pointer to configuration struct
+ * @return CSP_ERR_NONE on success, or CSP_ERR type
+ */
+int csp_shm_init(csp_iface_t * interface, const char * name, const struct csp_shm_config * conf);
+
+#ifdef __cplusplus
+} /* extern "C" */
+#endif
+
+#endif /* _CSP_IF_SHM_H_ */
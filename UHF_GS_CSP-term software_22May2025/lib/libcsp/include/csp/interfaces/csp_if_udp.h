@@ -0,0 +1,72 @@
+/*
+Cubesat Space Protocol - A small network-layer protocol designed for Cubesats
+Copyright (C) 2012 GomSpace ApS (http://www.gomspace.com)
+Copyright (C) 2012 AAUSAT3 Project (http://aausat3.space.aau.dk)
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#ifndef _CSP_IF_UDP_H_
+#define _CSP_IF_UDP_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+
+#include <csp/csp.h>
+#include <csp/csp_interface.h>
+
+/* UDP configuration struct */
+struct csp_udp_config {
+	uint16_t lport;		/**< Local port to receive on, 0 for any */
+	const char * host;	/**< Default peer, or NULL for none */
+	uint16_t port;		/**< Port of the default peer */
+	uint16_t mtu;		/**< MTU, 0 for the largest the CSP buffers allow */
+	int busy_poll;		/**< SO_BUSY_POLL time in us, 0 to disable */
+};
+
+/**
+ * CSP over UDP, for links between processes and hosts on the ground.
+ *
+ * Each datagram carries one packet: the CSP identifier in network byte
+ * order, followed by the data. Packets are sent to the peer added for the
+ * next hop node (the via address of the route, or the destination), or to
+ * the default peer if there is none. Broadcasts are sent to every peer.
+ * Datagrams are received from any sender. Only available on Linux.
+ *
+ * @param interface pointer to interface to set up
+ * @param name name of the interface
+ * @param conf pointer to configuration struct
+ * @return CSP_ERR_NONE on success, or CSP_ERR type
+ */
+int csp_udp_init(csp_iface_t * interface, const char * name, const struct csp_udp_config * conf);
+
+/**
+ * Add or replace the peer that packets for a node are sent to
+ * @param interface UDP interface
+ * @param node CSP node, or CSP_BROADCAST_ADDR to set the default peer
+ * @param host host name or address of the peer
+ * @param port UDP port of the peer
+ * @return CSP_ERR_NONE on success, or CSP_ERR type
+ */
+int csp_udp_peer_add(csp_iface_t * interface, uint8_t node, const char * host, uint16_t port);
+
+#ifdef __cplusplus
+} /* extern "C" */
+#endif
+
+#endif /* _CSP_IF_UDP_H_ */
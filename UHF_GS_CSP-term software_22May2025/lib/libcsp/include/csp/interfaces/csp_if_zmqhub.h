@@ -23,4 +23,17 @@ int csp_zmqhub_init(char addr, char * host);
 int csp_zmqhub_init_w_endpoints(char _addr, char * publisher_url,
 		char * subscriber_url);
 
+/**
+ * Setup an additional ZMQ interface, connected to its own hub.
+ * Any number of hub interfaces can be set up, and share one ZMQ context.
+ * @param interface pointer to interface to set up
+ * @param name name of the interface
+ * @param addr only receive messages matching this address (255 means all)
+ * @param publisher_endpoint Pointer to string containing zmqproxy publisher endpoint
+ * @param subscriber_endpoint Pointer to string containing zmqproxy subscriber endpoint
+ * @return CSP_ERR
+ */
+int csp_zmqhub_init_iface(csp_iface_t * interface, const char * name, char addr,
+		const char * publisher_endpoint, const char * subscriber_endpoint);
+
 #endif /* CSP_IF_ZMQHUB_H_ */
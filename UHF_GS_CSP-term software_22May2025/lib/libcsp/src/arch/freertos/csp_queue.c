@@ -53,6 +53,16 @@ int csp_queue_dequeue(csp_queue_handle_t handle, void * buf, uint32_t timeout) {
 	return xQueueReceive(handle, buf, timeout);
 }
 
+int csp_queue_dequeue_batch(csp_queue_handle_t handle, void ** buf, int max, uint32_t timeout) {
+	int count = 0;
+	if (max > 0 && csp_queue_dequeue(handle, &buf[count], timeout) == pdTRUE) {
+		count++;
+		while (count < max && xQueueReceive(handle, &buf[count], 0) == pdTRUE)
+			count++;
+	}
+	return count;
+}
+
 int csp_queue_dequeue_isr(csp_queue_handle_t handle, void * buf, CSP_BASE_TYPE * task_woken) {
 	return xQueueReceiveFromISR(handle, buf, (signed CSP_BASE_TYPE *)task_woken);
 }
@@ -168,6 +168,56 @@ int pthread_queue_dequeue(pthread_queue_t * queue, void * buf, uint32_t timeout)
 	
 }
 
+int pthread_queue_dequeue_batch(pthread_queue_t * queue, void * buf, int max, uint32_t timeout) {
+
+	int ret, count = 0;
+	
+	/* Calculate timeout */
+	struct timespec ts;
+	clock_serv_t cclock;
+	mach_timespec_t mts;
+	host_get_clock_service(mach_host_self(), CALENDAR_CLOCK, &cclock);
+	clock_get_time(cclock, &mts);
+	mach_port_deallocate(mach_task_self(), cclock);
+	ts.tv_sec = mts.tv_sec;
+	ts.tv_nsec = mts.tv_nsec;
+	
+	uint32_t sec = timeout / 1000;
+	uint32_t nsec = (timeout - 1000 * sec) * 1000000;
+
+	ts.tv_sec += sec;
+	
+	if (ts.tv_nsec + nsec > 1000000000)
+		ts.tv_sec++;
+
+	ts.tv_nsec = (ts.tv_nsec + nsec) % 1000000000;
+	
+	/* Get queue lock */
+	pthread_mutex_lock(&(queue->mutex));
+	while (queue->items == 0) {
+		ret = pthread_cond_timedwait(&(queue->cond_empty), &(queue->mutex), &ts);
+		if (ret != 0) {
+			pthread_mutex_unlock(&(queue->mutex));
+			return 0;
+		}
+	}
+
+	/* Copy all available objects, up to max, under one lock */
+	while (queue->items > 0 && count < max) {
+		memcpy(buf + (count * queue->item_size), queue->buffer+(queue->out * queue->item_size), queue->item_size);
+		queue->items--;
+		queue->out = (queue->out + 1) % queue->size;
+		count++;
+	}
+	pthread_mutex_unlock(&(queue->mutex));
+	
+	/* Nofify blocked threads once for the batch */
+	pthread_cond_broadcast(&(queue->cond_full));
+
+	return count;
+	
+}
+
 int pthread_queue_items(pthread_queue_t * queue) {
 
 	pthread_mutex_lock(&(queue->mutex));
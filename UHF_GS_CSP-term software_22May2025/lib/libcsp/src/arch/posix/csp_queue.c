@@ -50,6 +50,10 @@ int csp_queue_dequeue(csp_queue_handle_t handle, void *buf, uint32_t timeout) {
 	return pthread_queue_dequeue(handle, buf, timeout);
 }
 
+int csp_queue_dequeue_batch(csp_queue_handle_t handle, void **buf, int max, uint32_t timeout) {
+	return pthread_queue_dequeue_batch(handle, buf, max, timeout);
+}
+
 int csp_queue_dequeue_isr(csp_queue_handle_t handle, void *buf, CSP_BASE_TYPE * task_woken) {
 	*task_woken = 0;
 	return csp_queue_dequeue(handle, buf, 0);
@@ -25,6 +25,16 @@ int csp_queue_dequeue(csp_queue_handle_t handle, void *buf, uint32_t timeout) {
 	return windows_queue_dequeue(handle, buf, timeout);
 }
 
+int csp_queue_dequeue_batch(csp_queue_handle_t handle, void **buf, int max, uint32_t timeout) {
+	int count = 0;
+	if (max > 0 && windows_queue_dequeue(handle, &buf[count], timeout) == WINDOWS_QUEUE_OK) {
+		count++;
+		while (count < max && windows_queue_dequeue(handle, &buf[count], 0) == WINDOWS_QUEUE_OK)
+			count++;
+	}
+	return count;
+}
+
 int csp_queue_dequeue_isr(csp_queue_handle_t handle, void * buf, CSP_BASE_TYPE * task_woken) {
 	if( task_woken != NULL )
 		*task_woken = 0;
@@ -178,6 +178,9 @@ int csp_hmac_verify(csp_packet_t * packet, bool include_header) {
 	if (packet == NULL)
 		return CSP_ERR_INVAL;
 
+	if (packet->length < CSP_HMAC_LENGTH)
+		return CSP_ERR_HMAC;
+
 	uint8_t hmac[SHA1_DIGESTSIZE];
 
 	/* Calculate HMAC */
@@ -18,73 +18,281 @@ License along with this library; if not, write to the Free Software
 Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
 */
 
+#include <stdio.h>
+#include <string.h>
+
 #include <csp/csp.h>
 #include <csp/csp_interface.h>
 #include <csp/arch/csp_thread.h>
-#include "csp_route.h"
+#include <csp/arch/csp_queue.h>
+#include <csp/arch/csp_time.h>
+#include "csp_bridge.h"
 #include "csp_qfifo.h"
-#include "csp_io.h"
 #include "csp_promisc.h"
 
-static csp_iface_t* if_a = NULL;
-static csp_iface_t* if_b = NULL;
+/* Number of packets dequeued and handed to the output interface at a time */
+#define CSP_BRIDGE_BATCH 16
+
+typedef struct __attribute__((__packed__)) {
+	/* The queueing time is placed in the padding bytes */
+	uint8_t padding[CSP_PADDING_BYTES - sizeof(uint32_t)];
+	uint32_t timestamp;	// Time the packet was queued for forwarding
+	uint16_t length;	// Length field must be just before CSP ID
+	csp_id_t id;		// CSP id must be just before data
+	uint8_t data[];		// This just points to the rest of the buffer, without a size indication.
+} bridge_packet_t;
+
+/* One direction of the bridge, with its own queue and task */
+typedef struct {
+	csp_iface_t * ifin;
+	csp_iface_t * ifout;
+	csp_queue_handle_t queue;
+	csp_bridge_stats_t stats;
+} bridge_dir_t;
+
+static bridge_dir_t bridge[2];
+
+/* Forward everything until a filter is set */
+static uint32_t filter_nodes = 0xFFFFFFFF;
+static uint64_t filter_ports = 0xFFFFFFFFFFFFFFFFULL;
+
+static int csp_bridge_filter(csp_packet_t * packet) {
+
+	if (!((filter_nodes >> packet->id.src) & 1) && !((filter_nodes >> packet->id.dst) & 1))
+		return 0;
+
+	if (!((filter_ports >> packet->id.sport) & 1) && !((filter_ports >> packet->id.dport) & 1))
+		return 0;
+
+	return 1;
+
+}
+
+/* Latency bins are powers of two in ms: bin 0 is below 1 ms, bin n holds [2^(n-1), 2^n) */
+static void csp_bridge_latency(bridge_dir_t * dir, csp_packet_t * packet, uint32_t now) {
+
+	uint32_t delay = now - ((bridge_packet_t *) packet)->timestamp;
+
+	int bin = 0;
+	while (delay > 0 && bin < CSP_BRIDGE_LATENCY_BINS - 1) {
+		delay >>= 1;
+		bin++;
+	}
+
+	dir->stats.latency[bin]++;
+
+}
+
+/* Send packets one at a time, for interfaces without a batch hook */
+static int csp_bridge_send_single(csp_iface_t * ifout, csp_packet_t ** packets, int count) {
+
+	int sent;
+	for (sent = 0; sent < count; sent++) {
+		uint16_t bytes = packets[sent]->length;
+		if ((*ifout->nexthop)(ifout, packets[sent], 0) != CSP_ERR_NONE)
+			break;
+		ifout->tx++;
+		ifout->txbytes += bytes;
+	}
+
+	return sent;
+
+}
+
+static void csp_bridge_send(bridge_dir_t * dir, csp_packet_t ** packets, int count) {
+
+	csp_iface_t * ifout = dir->ifout;
+
+	while (count > 0) {
+		int sent;
+		if (ifout->nexthop_batch != NULL) {
+			uint32_t bytes = 0;
+			for (int i = 0; i < count; i++)
+				bytes += packets[i]->length;
+
+			sent = (*ifout->nexthop_batch)(ifout, packets, count, 0);
+			if (sent < 0)
+				sent = 0;
+
+			/* Only the packets that went out count towards txbytes */
+			for (int i = sent; i < count; i++)
+				bytes -= packets[i]->length;
+			ifout->tx += sent;
+			ifout->txbytes += bytes;
+		} else {
+			sent = csp_bridge_send_single(ifout, packets, count);
+		}
+
+		dir->stats.forwarded += sent;
+		packets += sent;
+		count -= sent;
+
+		/* The interface refused the next packet, drop it and go on with the rest */
+		if (count > 0) {
+			ifout->tx_error++;
+			dir->stats.tx_error++;
+			csp_buffer_free(packets[0]);
+			packets++;
+			count--;
+		}
+	}
+
+}
 
 CSP_DEFINE_TASK(csp_bridge) {
 
-	csp_qfifo_t input;
-	csp_packet_t * packet;
+	bridge_dir_t * dir = param;
+	csp_packet_t * packets[CSP_BRIDGE_BATCH];
 
 	/* Here there be bridging */
 	while (1) {
 
-		/* Get next packet to route */
-		if (csp_qfifo_read(&input) != CSP_ERR_NONE)
+		/* Wait for the next batch of packets to forward */
+		int count = csp_queue_dequeue_batch(dir->queue, (void **) packets, CSP_BRIDGE_BATCH, FIFO_TIMEOUT);
+		if (count <= 0)
 			continue;
 
-		packet = input.packet;
+		dir->stats.batches++;
+
+		uint32_t now = csp_get_ms();
+		for (int i = 0; i < count; i++) {
+			csp_packet_t * packet = packets[i];
 
-		csp_log_packet("Input: Src %u, Dst %u, Dport %u, Sport %u, Pri %u, Flags 0x%02X, Size %"PRIu16,
-				packet->id.src, packet->id.dst, packet->id.dport,
-				packet->id.sport, packet->id.pri, packet->id.flags, packet->length);
+			csp_log_packet("Bridge %s: Src %u, Dst %u, Dport %u, Sport %u, Pri %u, Flags 0x%02X, Size %"PRIu16,
+					dir->ifin->name, packet->id.src, packet->id.dst, packet->id.dport,
+					packet->id.sport, packet->id.pri, packet->id.flags, packet->length);
 
-		/* Here there be promiscuous mode */
+			csp_bridge_latency(dir, packet, now);
+
+			/* Here there be promiscuous mode */
 #ifdef CSP_USE_PROMISC
-		csp_promisc_add(packet);
+			csp_promisc_add(packet);
 #endif
-
-		/* Find the opposing interface */
-		csp_iface_t * ifout;
-		if (input.interface == if_a) {
-			ifout = if_b;
-		} else {
-			ifout = if_a;
 		}
 
-		/* Send to the interface directly, no hassle */
-		if (csp_send_direct(packet->id, packet, ifout, 0) != CSP_ERR_NONE) {
-			csp_log_warn("Router failed to send");
-			csp_buffer_free(packet);
-		}
+		/* Send to the opposing interface directly, no hassle */
+		csp_bridge_send(dir, packets, count);
+
+	}
+
+	return CSP_TASK_RETURN;
+
+}
+
+int csp_bridge_input(csp_packet_t * packet, csp_iface_t * interface, CSP_BASE_TYPE * pxTaskWoken) {
+
+	bridge_dir_t * dir;
+	if (interface == bridge[0].ifin) {
+		dir = &bridge[0];
+	} else if (interface == bridge[1].ifin) {
+		dir = &bridge[1];
+	} else {
+		return 0;
+	}
+
+	if (!csp_bridge_filter(packet)) {
+		dir->stats.filtered++;
+		goto drop;
+	}
+
+	int result;
+	if (pxTaskWoken == NULL) {
+		((bridge_packet_t *) packet)->timestamp = csp_get_ms();
+		result = csp_queue_enqueue(dir->queue, &packet, 0);
+	} else {
+		((bridge_packet_t *) packet)->timestamp = csp_get_ms_isr();
+		result = csp_queue_enqueue_isr(dir->queue, &packet, pxTaskWoken);
+	}
+
+	if (result != CSP_QUEUE_OK) {
+		dir->stats.dropped++;
+		interface->drop++;
+		goto drop;
+	}
+
+	interface->rx++;
+	interface->rxbytes += packet->length;
+	return 1;
+
+drop:
+	if (pxTaskWoken == NULL)
+		csp_buffer_free(packet);
+	else
+		csp_buffer_free_isr(packet);
+	return 1;
+
+}
 
-		/* Next message, please */
-		continue;
+void csp_bridge_set_filter(uint32_t nodes, uint64_t ports) {
 
+	filter_nodes = nodes;
+	filter_ports = ports;
+
+}
+
+int csp_bridge_get_stats(int direction, csp_bridge_stats_t * stats) {
+
+	if ((direction != CSP_BRIDGE_A_TO_B && direction != CSP_BRIDGE_B_TO_A) || stats == NULL)
+		return CSP_ERR_INVAL;
+
+	*stats = bridge[direction].stats;
+
+	return CSP_ERR_NONE;
+
+}
+
+void csp_bridge_print_stats(void) {
+
+	for (int i = 0; i < 2; i++) {
+		bridge_dir_t * dir = &bridge[i];
+		if (dir->ifin == NULL)
+			continue;
+
+		printf("%-10s -> %-10s fwd %"PRIu32" filtered %"PRIu32" drop %"PRIu32" txerr %"PRIu32" batches %"PRIu32"\r\n",
+				dir->ifin->name, dir->ifout->name, dir->stats.forwarded, dir->stats.filtered,
+				dir->stats.dropped, dir->stats.tx_error, dir->stats.batches);
+
+		printf("  latency ms:");
+		for (int bin = 0; bin < CSP_BRIDGE_LATENCY_BINS; bin++) {
+			if (bin == 0) {
+				printf(" <1:%"PRIu32, dir->stats.latency[bin]);
+			} else if (bin == CSP_BRIDGE_LATENCY_BINS - 1) {
+				printf(" >=%u:%"PRIu32, 1 << (bin - 1), dir->stats.latency[bin]);
+			} else {
+				printf(" %u:%"PRIu32, 1 << (bin - 1), dir->stats.latency[bin]);
+			}
+		}
+		printf("\r\n");
 	}
 
 }
 
 int csp_bridge_start(unsigned int task_stack_size, unsigned int task_priority, csp_iface_t * _if_a, csp_iface_t * _if_b) {
 
-	/* Set static references to A/B side of bridge */
-	if_a = _if_a;
-	if_b = _if_b;
+	if (_if_a == NULL || _if_b == NULL || _if_a == _if_b)
+		return CSP_ERR_INVAL;
 
-	static csp_thread_handle_t handle;
-	int ret = csp_thread_create(csp_bridge, "BRIDGE", task_stack_size, NULL, task_priority, &handle);
+	static const char * const names[2] = {"BRIDGE_AB", "BRIDGE_BA"};
+	csp_iface_t * ifs[2] = {_if_a, _if_b};
+
+	for (int i = 0; i < 2; i++) {
+		bridge_dir_t * dir = &bridge[i];
+
+		dir->queue = csp_queue_create(CSP_FIFO_INPUT, sizeof(csp_packet_t *));
+		if (dir->queue == NULL)
+			return CSP_ERR_NOMEM;
+
+		dir->ifout = ifs[1 - i];
+
+		static csp_thread_handle_t handle[2];
+		int ret = csp_thread_create(csp_bridge, names[i], task_stack_size, dir, task_priority, &handle[i]);
+		if (ret != 0) {
+			csp_log_error("Failed to start task");
+			return CSP_ERR_NOMEM;
+		}
 
-	if (ret != 0) {
-		csp_log_error("Failed to start task");
-		return CSP_ERR_NOMEM;
+		/* Set last, packets are diverted to the bridge from here on */
+		dir->ifin = ifs[i];
 	}
 
 	return CSP_ERR_NONE;
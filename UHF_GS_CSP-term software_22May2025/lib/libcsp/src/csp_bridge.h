@@ -0,0 +1,34 @@
+/*
+Cubesat Space Protocol - A small network-layer protocol designed for Cubesats
+Copyright (C) 2012 Gomspace ApS (http://www.gomspace.com)
+Copyright (C) 2012 AAUSAT3 Project (http://aausat3.space.aau.dk)
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#ifndef CSP_BRIDGE_H_
+#define CSP_BRIDGE_H_
+
+/**
+ * Divert a received packet to the bridge, if it came in on a bridged interface.
+ * The packet is consumed (queued or freed) when 1 is returned.
+ * @param packet Received packet
+ * @param interface Interface the packet was received on
+ * @param pxTaskWoken NULL from task context, otherwise called from an ISR
+ * @return 1 if the packet was taken by the bridge, 0 if it should be routed
+ */
+int csp_bridge_input(csp_packet_t * packet, csp_iface_t * interface, CSP_BASE_TYPE * pxTaskWoken);
+
+#endif /* CSP_BRIDGE_H_ */
@@ -184,21 +184,54 @@ void csp_buffer_free(void *packet) {
 		return;
 	}
 
-	if (buf->refcount == 0) {
-		csp_log_error("FREE: Buffer already free %p", buf);
-		return;
-	} else if (buf->refcount > 1) {
+	CSP_ENTER_CRITICAL(csp_critical_lock);
+	unsigned int refcount = buf->refcount;
+	if (refcount > 0)
 		buf->refcount--;
-		csp_log_error("FREE: Buffer %p in use by %u users", buf, buf->refcount);
-		return;
+	CSP_EXIT_CRITICAL(csp_critical_lock);
+
+	if (refcount == 0) {
+		csp_log_error("FREE: Buffer already free %p", buf);
+	} else if (refcount > 1) {
+		csp_log_buffer("FREE: Buffer %p still in use by %u users", buf, refcount - 1);
 	} else {
-		buf->refcount = 0;
 		csp_log_buffer("FREE: %p", buf);
 		csp_queue_enqueue(csp_buffers, &buf, 0);
 	}
 
 }
 
+void * csp_buffer_refc_inc(void *buffer) {
+
+	if (!buffer)
+		return NULL;
+
+	csp_skbf_t * buf = buffer - sizeof(csp_skbf_t);
+
+	if (buf->skbf_addr != buf) {
+		csp_log_error("Invalid CSP buffer pointer %p", buffer);
+		return NULL;
+	}
+
+	CSP_ENTER_CRITICAL(csp_critical_lock);
+	buf->refcount++;
+	CSP_EXIT_CRITICAL(csp_critical_lock);
+
+	return buffer;
+
+}
+
+int csp_buffer_refc(void *buffer) {
+
+	csp_skbf_t * buf = buffer - sizeof(csp_skbf_t);
+
+	if (buf->skbf_addr != buf)
+		return 0;
+
+	return buf->refcount;
+
+}
+
 void *csp_buffer_clone(void *buffer) {
 
 	csp_packet_t *packet = (csp_packet_t *) buffer;
@@ -0,0 +1,111 @@
+/*
+Cubesat Space Protocol - A small network-layer protocol designed for Cubesats
+Copyright (C) 2012 GomSpace ApS (http://www.gomspace.com)
+Copyright (C) 2012 AAUSAT3 Project (http://aausat3.space.aau.dk)
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#include <stdint.h>
+#include <string.h>
+
+#include <csp/csp.h>
+#include <csp/arch/csp_malloc.h>
+#include <csp/arch/csp_semaphore.h>
+
+#include <lzo/minilzo.h>
+
+#include "csp_compress.h"
+
+/* LZO1X output size for incompressible input of len bytes */
+#define CSP_COMPRESS_BOUND(len)	((len) + (len) / 16 + 64 + 3)
+
+/* Compressor work memory and output buffer, shared by all tasks */
+static lzo_voidp comp_wrkmem = NULL;
+static uint8_t * comp_buf = NULL;
+static csp_mutex_t comp_lock;
+
+int csp_compress_init(void) {
+
+	if (lzo_init() != LZO_E_OK) {
+		csp_log_error("LZO init failed");
+		return CSP_ERR_NOTSUP;
+	}
+
+	comp_wrkmem = csp_malloc(LZO1X_1_MEM_COMPRESS);
+	comp_buf = csp_malloc(CSP_COMPRESS_BOUND(csp_buffer_size() - CSP_BUFFER_PACKET_OVERHEAD));
+	if (comp_wrkmem == NULL || comp_buf == NULL) {
+		csp_free(comp_wrkmem);
+		csp_free(comp_buf);
+		comp_wrkmem = NULL;
+		comp_buf = NULL;
+		return CSP_ERR_NOMEM;
+	}
+
+	if (csp_mutex_create(&comp_lock) != CSP_MUTEX_OK)
+		return CSP_ERR_NOMEM;
+
+	return CSP_ERR_NONE;
+
+}
+
+int csp_compress(csp_packet_t * packet) {
+
+	if (comp_buf == NULL || packet->length == 0)
+		return CSP_ERR_INVAL;
+
+	if (csp_mutex_lock(&comp_lock, CSP_MAX_DELAY) != CSP_MUTEX_OK)
+		return CSP_ERR_INVAL;
+
+	lzo_uint out_len = 0;
+	int ret = lzo1x_1_compress(packet->data, packet->length, comp_buf, &out_len, comp_wrkmem);
+
+	/* Keep the data as is, unless it gets smaller */
+	if (ret != LZO_E_OK || out_len >= packet->length) {
+		csp_mutex_unlock(&comp_lock);
+		return CSP_ERR_INVAL;
+	}
+
+	memcpy(packet->data, comp_buf, out_len);
+	packet->length = out_len;
+	csp_mutex_unlock(&comp_lock);
+
+	return CSP_ERR_NONE;
+
+}
+
+int csp_decompress(csp_packet_t * packet) {
+
+	if (comp_buf == NULL)
+		return CSP_ERR_INVAL;
+
+	if (csp_mutex_lock(&comp_lock, CSP_MAX_DELAY) != CSP_MUTEX_OK)
+		return CSP_ERR_INVAL;
+
+	lzo_uint out_len = csp_buffer_size() - CSP_BUFFER_PACKET_OVERHEAD;
+	int ret = lzo1x_decompress_safe(packet->data, packet->length, comp_buf, &out_len, NULL);
+	if (ret != LZO_E_OK) {
+		csp_mutex_unlock(&comp_lock);
+		csp_log_error("LZO decompression failed (%d)", ret);
+		return CSP_ERR_INVAL;
+	}
+
+	memcpy(packet->data, comp_buf, out_len);
+	packet->length = out_len;
+	csp_mutex_unlock(&comp_lock);
+
+	return CSP_ERR_NONE;
+
+}
@@ -0,0 +1,44 @@
+/*
+Cubesat Space Protocol - A small network-layer protocol designed for Cubesats
+Copyright (C) 2012 GomSpace ApS (http://www.gomspace.com)
+Copyright (C) 2012 AAUSAT3 Project (http://aausat3.space.aau.dk)
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#ifndef CSP_COMPRESS_H_
+#define CSP_COMPRESS_H_
+
+/**
+ * Set up the LZO compressor
+ * @return CSP_ERR_NONE on success, CSP_ERR_NOMEM if out of memory
+ */
+int csp_compress_init(void);
+
+/**
+ * Compress packet data in place
+ * @param packet pointer to packet
+ * @return CSP_ERR_NONE if compressed, or CSP_ERR_INVAL if the data was left as is because it would not get smaller
+ */
+int csp_compress(csp_packet_t *packet);
+
+/**
+ * Decompress packet data in place
+ * @param packet pointer to packet
+ * @return CSP_ERR_NONE on success, or CSP_ERR_INVAL if the data is corrupt or too large for the buffer
+ */
+int csp_decompress(csp_packet_t *packet);
+
+#endif /* CSP_COMPRESS_H_ */
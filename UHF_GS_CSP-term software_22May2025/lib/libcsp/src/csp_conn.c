@@ -34,6 +34,7 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
 #include <csp/arch/csp_time.h>
 
 #include "csp_conn.h"
+#include "csp_compress.h"
 #include "transport/csp_transport.h"
 
 /* Static connection pool */
@@ -45,17 +46,107 @@ static csp_bin_sem_handle_t conn_lock;
 /* Source port */
 static uint8_t sport;
 
+/* Ephemeral ports in use by outgoing connections, one bit per port */
+static uint64_t sport_used;
+
 /* Source port lock */
 static csp_bin_sem_handle_t sport_lock;
 
-void csp_conn_check_timeouts(void) {
-#ifdef CSP_USE_RDP
-	int i;
-	for (i = 0; i < CSP_CONN_MAX; i++)
-		if (arr_conn[i].state == CONN_OPEN)
-			if (arr_conn[i].idin.flags & CSP_FRDP)
-				csp_rdp_check_timeouts(&arr_conn[i]);
-#endif
+/* Free connection slots, handed out in the order they were released */
+static uint16_t conn_free[CSP_CONN_MAX];
+static uint16_t conn_free_head;
+static uint16_t conn_free_count;
+
+/* Lookup index on the incoming identifier (CSP_ID_CONN_MASK) of client
+ * connections. Open addressing with linear probing. Entries are never moved,
+ * only marked deleted, so the router can search the index without taking
+ * the connection pool lock. */
+#define CONN_HASH_SIZE		(2 * CSP_CONN_MAX)
+#define CONN_HASH_EMPTY		-1
+#define CONN_HASH_DELETED	-2
+static int16_t conn_hash[CONN_HASH_SIZE];
+
+static inline unsigned int csp_conn_hash(uint32_t id) {
+
+	return ((uint32_t) ((id & CSP_ID_CONN_MASK) * 2654435761UL) >> 16) % CONN_HASH_SIZE;
+
+}
+
+/* Must be called with conn_lock held */
+static void csp_conn_hash_insert(csp_conn_t * conn) {
+
+	unsigned int i = csp_conn_hash(conn->idin.ext);
+
+	/* The index is twice the size of the pool, so a free slot always exists */
+	while (conn_hash[i] >= 0)
+		i = (i + 1) % CONN_HASH_SIZE;
+
+	conn_hash[i] = conn - arr_conn;
+
+}
+
+/* Must be called with conn_lock held */
+static void csp_conn_hash_remove(csp_conn_t * conn) {
+
+	int16_t index = conn - arr_conn;
+	unsigned int i = csp_conn_hash(conn->idin.ext);
+	unsigned int n;
+
+	for (n = 0; n < CONN_HASH_SIZE; n++) {
+		if (conn_hash[i] == index)
+			break;
+		if (conn_hash[i] == CONN_HASH_EMPTY)
+			return;
+		i = (i + 1) % CONN_HASH_SIZE;
+	}
+
+	if (n == CONN_HASH_SIZE)
+		return;
+
+	if (conn_hash[(i + 1) % CONN_HASH_SIZE] != CONN_HASH_EMPTY) {
+		conn_hash[i] = CONN_HASH_DELETED;
+		return;
+	}
+
+	/* End of a probe sequence: this slot and any deleted slots before it can be emptied */
+	do {
+		conn_hash[i] = CONN_HASH_EMPTY;
+		i = (i + CONN_HASH_SIZE - 1) % CONN_HASH_SIZE;
+	} while (conn_hash[i] == CONN_HASH_DELETED);
+
+}
+
+/* Must be called with sport_lock held */
+static int csp_conn_sport_get(void) {
+
+	uint64_t avail = ~sport_used & (UINT64_MAX << (CSP_MAX_BIND_PORT + 1));
+	uint64_t next;
+
+	if (avail == 0)
+		return -1;
+
+	/* Continue after the last port given, wrap around to the lowest free port */
+	next = (sport < CSP_ID_PORT_MAX) ? avail & (UINT64_MAX << (sport + 1)) : 0;
+	sport = __builtin_ctzll(next ? next : avail);
+	sport_used |= (uint64_t) 1 << sport;
+
+	return sport;
+
+}
+
+static void csp_conn_sport_put(uint8_t port) {
+
+	if (port <= CSP_MAX_BIND_PORT || port > CSP_ID_PORT_MAX)
+		return;
+
+	if (csp_bin_sem_wait(&sport_lock, 1000) != CSP_SEMAPHORE_OK) {
+		csp_log_error("Failed to lock sport, port %u not released", port);
+		return;
+	}
+
+	sport_used &= ~((uint64_t) 1 << port);
+	csp_bin_sem_post(&sport_lock);
+
 }
 
 int csp_conn_get_rxq(int prio) {
@@ -92,6 +183,23 @@ int csp_conn_enqueue_packet(csp_conn_t * conn, csp_packet_t * packet) {
 
 	int rxq;
 	if (packet != NULL) {
+#ifdef CSP_USE_COMPRESSION
+		/* Decompress before delivery */
+		if (packet->id.flags & CSP_FCOMP) {
+			uint16_t length = packet->length;
+			/* A bad packet is dropped here, the transport has received
+			 * it and must not treat it as a full RX queue */
+			if (csp_decompress(packet) != CSP_ERR_NONE) {
+				conn->comp.rx_errors++;
+				csp_buffer_free(packet);
+				return CSP_ERR_NONE;
+			}
+			packet->id.flags &= ~CSP_FCOMP;
+			conn->comp.rx_compressed++;
+			conn->comp.rx_bytes_in += length;
+			conn->comp.rx_bytes_out += packet->length;
+		}
+#endif
 		rxq = csp_conn_get_rxq(packet->id.pri);
 	} else {
 		rxq = CSP_RX_QUEUES - 1;
@@ -125,7 +233,11 @@ int csp_conn_init(void) {
 	}
 
 	int i, prio;
+	for (i = 0; i < CONN_HASH_SIZE; i++)
+		conn_hash[i] = CONN_HASH_EMPTY;
+
 	for (i = 0; i < CSP_CONN_MAX; i++) {
+		conn_free[i] = i;
 		for (prio = 0; prio < CSP_RX_QUEUES; prio++)
 			arr_conn[i].rx_queue[prio] = csp_queue_create(CSP_RX_QUEUE_LENGTH, sizeof(csp_packet_t *));
 
@@ -146,6 +258,8 @@ int csp_conn_init(void) {
 		}
 #endif
 	}
+	conn_free_head = 0;
+	conn_free_count = CSP_CONN_MAX;
 
 	if (csp_bin_sem_create(&conn_lock) != CSP_SEMAPHORE_OK) {
 		csp_log_error("No more memory for conn semaphore");
@@ -162,12 +276,29 @@ csp_conn_t * csp_conn_find(uint32_t id, uint32_t mask) {
 	int i;
 	csp_conn_t * conn;
 
-	for (i = 0; i < CSP_CONN_MAX; i++) {
-		conn = &arr_conn[i];
-		if ((conn->state != CONN_CLOSED) && (conn->type == CONN_CLIENT) && (conn->idin.ext & mask) == (id & mask))
-			return conn;
+	if (mask != CSP_ID_CONN_MASK) {
+		for (i = 0; i < CSP_CONN_MAX; i++) {
+			conn = &arr_conn[i];
+			if ((conn->state != CONN_CLOSED) && (conn->type == CONN_CLIENT) && (conn->idin.ext & mask) == (id & mask))
+				return conn;
+		}
+		return NULL;
 	}
-	
+
+	unsigned int n, slot = csp_conn_hash(id);
+
+	for (n = 0; n < CONN_HASH_SIZE; n++) {
+		int16_t index = conn_hash[slot];
+		if (index == CONN_HASH_EMPTY)
+			break;
+		if (index >= 0) {
+			conn = &arr_conn[index];
+			if ((conn->state != CONN_CLOSED) && (conn->type == CONN_CLIENT) && (conn->idin.ext & mask) == (id & mask))
+				return conn;
+		}
+		slot = (slot + 1) % CONN_HASH_SIZE;
+	}
+
 	return NULL;
 
 }
@@ -195,64 +326,87 @@ int csp_conn_flush_rx_queue(csp_conn_t * conn) {
 
 }
 
-csp_conn_t * csp_conn_allocate(csp_conn_type_t type) {
+/* Must be called with conn_lock held */
+static csp_conn_t * csp_conn_take(csp_conn_type_t type) {
 
-	int i, j;
-	static uint8_t csp_conn_last_given = 0;
 	csp_conn_t * conn;
 
-	if (csp_bin_sem_wait(&conn_lock, 100) != CSP_SEMAPHORE_OK) {
-		csp_log_error("Failed to lock conn array");
+	if (conn_free_count == 0) {
+		csp_log_error("No more free connections");
 		return NULL;
 	}
 
-	/* Search for free connection */
-	i = csp_conn_last_given;
-	i = (i + 1) % CSP_CONN_MAX;
+	conn = &arr_conn[conn_free[conn_free_head]];
+	conn_free_head = (conn_free_head + 1) % CSP_CONN_MAX;
+	conn_free_count--;
 
-	for (j = 0; j < CSP_CONN_MAX; j++) {
-		conn = &arr_conn[i];
-		if (conn->state == CONN_CLOSED)
-			break;
-		i = (i + 1) % CSP_CONN_MAX;
-	}
+	conn->state = CONN_OPEN;
+	conn->socket = NULL;
+	conn->type = type;
+	conn->sport_owned = 0;
 
-	if (conn->state == CONN_OPEN) {
-		csp_log_error("No more free connections");
-		csp_bin_sem_post(&conn_lock);
+	return conn;
+
+}
+
+csp_conn_t * csp_conn_allocate(csp_conn_type_t type) {
+
+	csp_conn_t * conn;
+
+	if (csp_bin_sem_wait(&conn_lock, 100) != CSP_SEMAPHORE_OK) {
+		csp_log_error("Failed to lock conn array");
 		return NULL;
 	}
 
-	conn->state = CONN_OPEN;
-	conn->socket = NULL;
-	conn->type = type;
-	csp_conn_last_given = i;
+	conn = csp_conn_take(type);
 	csp_bin_sem_post(&conn_lock);
 
 	return conn;
 
 }
 
-csp_conn_t * csp_conn_new(csp_id_t idin, csp_id_t idout) {
+/* Allocate a client connection, sport_owned is set when the ephemeral port
+ * in idin.dport was allocated for it and must be released on close */
+static csp_conn_t * csp_conn_create(csp_id_t idin, csp_id_t idout, uint8_t sport_owned) {
+
+	csp_conn_t * conn;
+
+	if (csp_bin_sem_wait(&conn_lock, 100) != CSP_SEMAPHORE_OK) {
+		csp_log_error("Failed to lock conn array");
+		return NULL;
+	}
 
 	/* Allocate connection structure */
-	csp_conn_t * conn = csp_conn_allocate(CONN_CLIENT);
+	conn = csp_conn_take(CONN_CLIENT);
 
 	if (conn) {
-		/* No lock is needed here, because nobody else *
-		 * has a reference to this connection yet.     */
 		conn->idin.ext = idin.ext;
 		conn->idout.ext = idout.ext;
 		conn->timestamp = csp_get_ms();
+		conn->sport_owned = sport_owned;
+#ifdef CSP_USE_COMPRESSION
+		memset(&conn->comp, 0, sizeof(conn->comp));
+#endif
 
 		/* Ensure connection queue is empty */
 		csp_conn_flush_rx_queue(conn);
+
+		/* Make the connection visible to the router */
+		csp_conn_hash_insert(conn);
 	}
 
+	csp_bin_sem_post(&conn_lock);
+
 	return conn;
 
 }
 
+csp_conn_t * csp_conn_new(csp_id_t idin, csp_id_t idout) {
+
+	return csp_conn_create(idin, idout, 0);
+
+}
+
 int csp_close(csp_conn_t * conn) {
 
 	if (conn == NULL) {
@@ -278,6 +432,20 @@ int csp_close(csp_conn_t * conn) {
 		return CSP_ERR_TIMEDOUT;
 	}
 
+	/* Another task may have closed it while we waited for the lock */
+	if (conn->state == CONN_CLOSED) {
+		csp_bin_sem_post(&conn_lock);
+		return CSP_ERR_NONE;
+	}
+
+	/* Remove from lookup index */
+	if (conn->type == CONN_CLIENT)
+		csp_conn_hash_remove(conn);
+
+	/* The slot may be reused once the lock is released */
+	int sport = conn->sport_owned ? conn->idin.dport : -1;
+	conn->sport_owned = 0;
+
 	/* Set to closed */
 	conn->state = CONN_CLOSED;
 
@@ -290,9 +458,17 @@ int csp_close(csp_conn_t * conn) {
 		csp_rdp_flush_all(conn);
 #endif
 
+	/* Return slot to the free list */
+	conn_free[(conn_free_head + conn_free_count) % CSP_CONN_MAX] = conn - arr_conn;
+	conn_free_count++;
+
 	/* Unlock connection array */
 	csp_bin_sem_post(&conn_lock);
 
+	/* Release the ephemeral port allocated by csp_connect */
+	if (sport >= 0)
+		csp_conn_sport_put(sport);
+
 	return CSP_ERR_NONE;
 }
 
@@ -354,41 +530,43 @@ csp_conn_t * csp_connect(uint8_t prio, uint8_t dest, uint8_t dport, uint32_t tim
 		return NULL;
 #endif
 	}
+
+	/* Compression is decided per packet, so it sets no connection flags */
+#ifndef CSP_USE_COMPRESSION
+	if (opts & CSP_O_COMP) {
+		csp_log_error("Attempt to create compressed connection, but CSP was compiled without compression support");
+		return NULL;
+	}
+#endif
 	
 	/* Find an unused ephemeral port */
 	csp_conn_t * conn;
+	int port;
 
 	/* Wait for sport lock */
 	if (csp_bin_sem_wait(&sport_lock, 1000) != CSP_SEMAPHORE_OK)
 		return NULL;
 
-	uint8_t start = sport;
-	while (++sport != start) {
-		if (sport > CSP_ID_PORT_MAX)
-			sport = CSP_MAX_BIND_PORT + 1;
-
-		outgoing_id.sport = sport;
-		incoming_id.dport = sport;
-		
-		/* Match on destination port of _incoming_ identifier */
-		conn = csp_conn_find(incoming_id.ext, CSP_ID_DPORT_MASK);
-
-		/* Break if we found an unused ephemeral port */
-		if (conn == NULL)
-			break;
-	}
+	port = csp_conn_sport_get();
 
 	/* Post sport lock */
 	csp_bin_sem_post(&sport_lock);
 
 	/* If no available ephemeral port was found */
-	if (sport == start)
+	if (port < 0) {
+		csp_log_error("No more free ephemeral ports");
 		return NULL;
+	}
+
+	outgoing_id.sport = port;
+	incoming_id.dport = port;
 
 	/* Get storage for new connection */
-	conn = csp_conn_new(incoming_id, outgoing_id);
-	if (conn == NULL)
+	conn = csp_conn_create(incoming_id, outgoing_id, 1);
+	if (conn == NULL) {
+		csp_conn_sport_put(port);
 		return NULL;
+	}
 
 	/* Set connection options */
 	conn->opts = opts;
@@ -440,6 +618,20 @@ inline int csp_conn_flags(csp_conn_t * conn) {
 
 }
 
+int csp_conn_get_comp_stats(csp_conn_t * conn, csp_comp_stats_t * stats) {
+
+#ifdef CSP_USE_COMPRESSION
+	if (conn == NULL || stats == NULL)
+		return CSP_ERR_INVAL;
+
+	*stats = conn->comp;
+	return CSP_ERR_NONE;
+#else
+	return CSP_ERR_NOTSUP;
+#endif
+
+}
+
 #ifdef CSP_DEBUG
 void csp_conn_print_table(void) {
 
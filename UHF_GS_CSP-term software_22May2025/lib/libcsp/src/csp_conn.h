@@ -32,6 +32,8 @@ extern "C" {
 #include <csp/arch/csp_queue.h>
 #include <csp/arch/csp_semaphore.h>
 
+#include "csp_timer.h"
+
 /** @brief Connection states */
 typedef enum {
 	CONN_CLOSED = 0,
@@ -69,9 +71,26 @@ typedef struct {
 	uint32_t ack_timeout;
 	uint32_t ack_delay_count;
 	uint32_t ack_timestamp;
+	uint32_t rto;			/**< Retransmission timeout, including backoff */
+	uint32_t srtt;			/**< Smoothed round trip time, scaled by 8 */
+	uint32_t rttvar;		/**< Round trip time variation, scaled by 4 */
+	uint32_t rtt_timestamp;		/**< Time the timed segment was sent */
+	uint16_t rtt_seq;		/**< Sequence number of the timed segment */
+	uint8_t rtt_active;		/**< A segment is being timed */
+	uint8_t backoff;		/**< Number of consecutive retransmission timeouts */
+	uint32_t cwnd;			/**< Effective send window, at most window_size */
+	uint32_t cwnd_acked;		/**< Segments acknowledged since the send window grew */
+	uint32_t tx_segments;		/**< Data segments sent */
+	uint32_t retransmits;		/**< Segments retransmitted */
+	uint32_t timeouts;		/**< Retransmission timeouts */
 	csp_bin_sem_handle_t tx_wait;
-	csp_queue_handle_t tx_queue;
-	csp_queue_handle_t rx_queue;
+	uint16_t win_mask;		/**< Number of window slots minus one, slots are a power of two */
+	uint16_t tx_count;		/**< Number of segments in the TX window */
+	csp_packet_t ** tx_win;		/**< Unacknowledged segments, indexed by sequence number */
+	csp_packet_t ** rx_win;		/**< Out of sequence segments, indexed by sequence number */
+	csp_timer_t timer_tx;		/**< Retransmission of the oldest unacknowledged segment */
+	csp_timer_t timer_ack;		/**< Delayed ACK */
+	csp_timer_t timer_conn;		/**< Connection and CLOSE-WAIT timeout */
 } csp_rdp_t;
 
 /** @brief Connection struct */
@@ -88,9 +107,13 @@ struct csp_conn_s {
 	csp_queue_handle_t socket;	/* Socket to be "woken" when first packet is ready */
 	uint32_t timestamp;		/* Time the connection was opened */
 	uint32_t opts;			/* Connection or socket options */
+	uint8_t sport_owned;		/* Ephemeral port in idin.dport was allocated by csp_connect */
 #ifdef CSP_USE_RDP
 	csp_rdp_t rdp;			/* RDP state */
 #endif
+#ifdef CSP_USE_COMPRESSION
+	csp_comp_stats_t comp;		/* Compression statistics */
+#endif
 };
 
 int csp_conn_lock(csp_conn_t * conn, uint32_t timeout);
@@ -100,7 +123,6 @@ int csp_conn_init(void);
 csp_conn_t * csp_conn_allocate(csp_conn_type_t type);
 csp_conn_t * csp_conn_find(uint32_t id, uint32_t mask);
 csp_conn_t * csp_conn_new(csp_id_t idin, csp_id_t idout);
-void csp_conn_check_timeouts(void);
 int csp_conn_get_rxq(int prio);
 
 #ifdef __cplusplus
@@ -21,44 +21,159 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
 #include <stdlib.h>
 #include <stddef.h>
 #include <stdio.h>
+#include <string.h>
 #include <inttypes.h>
 
 #include <csp/csp.h>
 #include <csp/arch/csp_time.h>
 #include <csp/csp_crc32.h>
 
-/* Check the last CSP_DEDUP_COUNT packets for duplicates */
-#define CSP_DEDUP_COUNT		16
+#include "csp_dedup.h"
 
-/* Only consider packet a duplicate if received under CSP_DEDUP_WINDOW_MS ago */
-#define CSP_DEDUP_WINDOW_MS	1000
+/* Packets are remembered in a set-associative table: a packet hash selects a
+ * set of CSP_DEDUP_WAYS entries, so a lookup only touches that set. A new
+ * packet takes the place of an expired or the oldest entry of its set. */
+#define CSP_DEDUP_WAYS		4
+#if CSP_DEDUP_SIZE < CSP_DEDUP_WAYS
+#error "CSP_DEDUP_SIZE must be at least 4"
+#endif
+#define CSP_DEDUP_SETS		(CSP_DEDUP_SIZE / CSP_DEDUP_WAYS)
 
-/* Store packet CRC's in a ringbuffer */
-static uint32_t csp_dedup_array[CSP_DEDUP_COUNT] = {};
-static uint32_t csp_dedup_timestamp[CSP_DEDUP_COUNT] = {};
-static int csp_dedup_in = 0;
+typedef struct {
+	uint32_t hash;		/* Packet hash, 0 if unused */
+	uint32_t timestamp;	/* Time the packet was first seen */
+} csp_dedup_entry_t;
 
-bool csp_dedup_is_duplicate(csp_packet_t *packet)
-{
-	/* Calculate CRC32 for packet */
-	uint32_t crc = csp_crc32_memory((const uint8_t *) &packet->id, packet->length + sizeof(packet->id));
+static csp_dedup_entry_t csp_dedup_table[CSP_DEDUP_SETS][CSP_DEDUP_WAYS];
+
+/* Only consider packet a duplicate if received under csp_dedup_window ms ago */
+static uint32_t csp_dedup_window = 1000;
+
+#ifdef CSP_USE_CRC32
+static csp_dedup_hash_t csp_dedup_hash = CSP_DEDUP_HASH_CRC32;
+#else
+static csp_dedup_hash_t csp_dedup_hash = CSP_DEDUP_HASH_FAST;
+#endif
+
+/* RDP discards duplicate segments itself */
+static bool csp_dedup_rdp = false;
+
+/* Destination ports to check, one bit per port */
+static uint64_t csp_dedup_ports = UINT64_MAX;
+
+/* FNV-1a on 32-bit words with a final avalanche */
+static uint32_t csp_dedup_hash_fast(const uint8_t * data, unsigned int length) {
+
+	uint32_t hash = 2166136261UL ^ length;
+	uint32_t word;
+
+	while (length >= sizeof(word)) {
+		memcpy(&word, data, sizeof(word));
+		hash = (hash ^ word) * 16777619UL;
+		hash ^= hash >> 15;
+		data += sizeof(word);
+		length -= sizeof(word);
+	}
+
+	while (length--)
+		hash = (hash ^ *data++) * 16777619UL;
+
+	hash ^= hash >> 13;
+	hash *= 0x5bd1e995UL;
+	hash ^= hash >> 15;
+
+	return hash;
+
+}
+
+void csp_dedup_set_opt(uint32_t window_ms, csp_dedup_hash_t hash, bool rdp) {
+
+#ifndef CSP_USE_CRC32
+	if (hash == CSP_DEDUP_HASH_CRC32) {
+		csp_log_warn("Deduplicator: CSP was compiled without CRC32 support, using fast hash");
+		hash = CSP_DEDUP_HASH_FAST;
+	}
+#endif
+
+	/* Entries hashed differently are no longer comparable */
+	if (hash != csp_dedup_hash)
+		memset(csp_dedup_table, 0, sizeof(csp_dedup_table));
+
+	csp_dedup_window = window_ms;
+	csp_dedup_hash = hash;
+	csp_dedup_rdp = rdp;
+
+}
+
+void csp_dedup_set_port(uint8_t port, bool enable) {
+
+	if (port > CSP_ID_PORT_MAX)
+		return;
+
+	if (enable) {
+		csp_dedup_ports |= (uint64_t) 1 << port;
+	} else {
+		csp_dedup_ports &= ~((uint64_t) 1 << port);
+	}
+
+}
+
+bool csp_dedup_is_duplicate(csp_iface_t * interface, csp_packet_t * packet) {
+
+	uint32_t hash, now, age, oldest = 0;
+	csp_dedup_entry_t * set, * victim;
+	int i;
+
+	/* Check if packet is subject to deduplication */
+	if (csp_dedup_window == 0 || interface->dedup_off)
+		return false;
+	if ((packet->id.flags & CSP_FRDP) && !csp_dedup_rdp)
+		return false;
+	if (!(csp_dedup_ports & ((uint64_t) 1 << packet->id.dport)))
+		return false;
+
+	/* Calculate hash for packet */
+#ifdef CSP_USE_CRC32
+	if (csp_dedup_hash == CSP_DEDUP_HASH_CRC32) {
+		hash = csp_crc32_memory((const uint8_t *) &packet->id, packet->length + sizeof(packet->id));
+	} else
+#endif
+	{
+		hash = csp_dedup_hash_fast((const uint8_t *) &packet->id, packet->length + sizeof(packet->id));
+	}
+
+	/* Zero marks an unused entry */
+	if (hash == 0)
+		hash = 1;
+
+	now = csp_get_ms();
+	set = csp_dedup_table[hash % CSP_DEDUP_SETS];
+	victim = &set[0];
 
 	/* Check if we have received this packet before */
-	for (int i = 0; i < CSP_DEDUP_COUNT; i++) {
+	for (i = 0; i < CSP_DEDUP_WAYS; i++) {
+
+		if (set[i].hash == 0) {
+			victim = &set[i];
+			oldest = UINT32_MAX;
+			continue;
+		}
 
-		/* Check for match */
-		if (crc == csp_dedup_array[i]) {
+		age = now - set[i].timestamp;
+		if (set[i].hash == hash && age < csp_dedup_window)
+			return true;
 
-			/* Check the timestamp */
-			if (csp_get_ms() < csp_dedup_timestamp[i] + CSP_DEDUP_WINDOW_MS)
-				return true;
+		/* Replace expired or oldest entry */
+		if (age > oldest) {
+			victim = &set[i];
+			oldest = age;
 		}
 	}
 
 	/* If not, insert packet into duplicate list */
-	csp_dedup_array[csp_dedup_in] = crc;
-	csp_dedup_timestamp[csp_dedup_in] = csp_get_ms();
-	csp_dedup_in = (csp_dedup_in + 1) % CSP_DEDUP_COUNT;
+	victim->hash = hash;
+	victim->timestamp = now;
 
 	return false;
+
 }
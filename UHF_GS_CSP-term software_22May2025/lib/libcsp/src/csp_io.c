@@ -43,9 +43,11 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
 #include "csp_io.h"
 #include "csp_port.h"
 #include "csp_conn.h"
+#include "csp_compress.h"
 #include "csp_route.h"
 #include "csp_promisc.h"
 #include "csp_qfifo.h"
+#include "csp_timer.h"
 #include "transport/csp_transport.h"
 
 /** CSP address of this node */
@@ -56,10 +58,6 @@ static char *csp_hostname = NULL;
 static char *csp_model = NULL;
 static char *csp_revision = GIT_REV;
 
-#ifdef CSP_USE_PROMISC
-extern csp_queue_handle_t csp_promisc_queue;
-#endif
-
 void csp_set_address(uint8_t addr)
 {
 	csp_my_address = addr;
@@ -107,6 +105,10 @@ int csp_init(unsigned char address) {
 	/* Initialize CSP */
 	csp_set_address(address);
 
+	ret = csp_timer_init();
+	if (ret != CSP_ERR_NONE)
+		return ret;
+
 	ret = csp_conn_init();
 	if (ret != CSP_ERR_NONE)
 		return ret;
@@ -119,6 +121,12 @@ int csp_init(unsigned char address) {
 	if (ret != CSP_ERR_NONE)
 		return ret;
 
+#ifdef CSP_USE_COMPRESSION
+	ret = csp_compress_init();
+	if (ret != CSP_ERR_NONE)
+		return ret;
+#endif
+
 	/* Loopback */
 	csp_iflist_add(&csp_if_lo);
 
@@ -162,9 +170,16 @@ csp_socket_t * csp_socket(uint32_t opts) {
 		return NULL;
 	} 
 #endif
+
+#ifndef CSP_USE_COMPRESSION
+	if (opts & CSP_SO_COMPREQ) {
+		csp_log_error("Attempt to create socket with compression, but CSP was compiled without compression support");
+		return NULL;
+	}
+#endif
 	
 	/* Drop packet if reserved flags are set */
-	if (opts & ~(CSP_SO_RDPREQ | CSP_SO_XTEAREQ | CSP_SO_HMACREQ | CSP_SO_CRC32REQ | CSP_SO_CONN_LESS)) {
+	if (opts & ~(CSP_SO_RDPREQ | CSP_SO_XTEAREQ | CSP_SO_HMACREQ | CSP_SO_CRC32REQ | CSP_SO_CONN_LESS | CSP_SO_COMPREQ)) {
 		csp_log_error("Invalid socket option");
 		return NULL;
 	}
@@ -235,34 +250,42 @@ csp_packet_t * csp_read(csp_conn_t * conn, uint32_t timeout) {
 
 }
 
-int csp_send_direct(csp_id_t idout, csp_packet_t * packet, csp_iface_t * ifout, uint32_t timeout) {
+/* Prepare a packet for transmission: copy the identifier to the packet, and
+ * add HMAC, CRC32 and encryption to packets from this node. A shared buffer is
+ * read-only, so if it must be changed this is done on a copy, which replaces
+ * *ppacket, and the shared buffer is returned in *shared. On error, *ppacket
+ * is the caller's buffer. */
+static int csp_send_prepare(csp_id_t idout, csp_packet_t ** ppacket, csp_packet_t ** shared, csp_iface_t * ifout) {
 
-	if (packet == NULL) {
-		csp_log_error("csp_send_direct called with NULL packet");
-		goto err;
-	}
-
-	if ((ifout == NULL) || (ifout->nexthop == NULL)) {
-		csp_log_error("No route to host: %#08x", idout.ext);
-		goto err;
-	}
+	csp_packet_t * packet = *ppacket;
+	*shared = NULL;
 
 	csp_log_packet("OUT: S %u, D %u, Dp %u, Sp %u, Pr %u, Fl 0x%02X, Sz %u VIA: %s",
 		idout.src, idout.dst, idout.dport, idout.sport, idout.pri, idout.flags, packet->length, ifout->name);
 
+	/* Only encrypt packets from the current node */
+	int secure = (idout.src == csp_get_address()) && (idout.flags & (CSP_FHMAC | CSP_FCRC32 | CSP_FXTEA));
+
+	/* Copy a shared buffer if the identifier or data changes */
+	if ((secure || packet->id.ext != idout.ext) && csp_buffer_refc(packet) > 1) {
+		packet = csp_buffer_clone(packet);
+		if (packet == NULL) {
+			csp_log_warn("No buffer for copy of shared packet");
+			goto err;
+		}
+		*shared = *ppacket;
+	}
+
 	/* Copy identifier to packet (before crc, xtea and hmac) */
 	packet->id.ext = idout.ext;
 
 #ifdef CSP_USE_PROMISC
 	/* Loopback traffic is added to promisc queue by the router */
-	if (idout.dst != csp_get_address() && idout.src == csp_get_address()) {
-		packet->id.ext = idout.ext;
+	if (idout.dst != csp_get_address() && idout.src == csp_get_address())
 		csp_promisc_add(packet);
-	}
 #endif
 
-	/* Only encrypt packets from the current node */
-	if (idout.src == csp_get_address()) {
+	if (secure) {
 		/* Append HMAC */
 		if (idout.flags & CSP_FHMAC) {
 #ifdef CSP_USE_HMAC
@@ -270,11 +293,11 @@ int csp_send_direct(csp_id_t idout, csp_packet_t * packet, csp_iface_t * ifout,
 			if (csp_hmac_append(packet, false) != 0) {
 				/* HMAC append failed */
 				csp_log_warn("HMAC append failed!");
-				goto tx_err;
+				goto err;
 			}
 #else
 			csp_log_warn("Attempt to send packet with HMAC, but CSP was compiled without HMAC support. Discarding packet");
-			goto tx_err;
+			goto err;
 #endif
 		}
 
@@ -285,7 +308,7 @@ int csp_send_direct(csp_id_t idout, csp_packet_t * packet, csp_iface_t * ifout,
 			if (csp_crc32_append(packet, false) != 0) {
 				/* CRC32 append failed */
 				csp_log_warn("CRC32 append failed!");
-				goto tx_err;
+				goto err;
 			}
 #else
 			csp_log_warn("Attempt to send packet with CRC32, but CSP was compiled without CRC32 support. Sending without CRC32r");
@@ -308,26 +331,63 @@ int csp_send_direct(csp_id_t idout, csp_packet_t * packet, csp_iface_t * ifout,
 			if (csp_xtea_encrypt(packet->data, packet->length, iv) != 0) {
 				/* Encryption failed */
 				csp_log_warn("Encryption failed! Discarding packet");
-				goto tx_err;
+				goto err;
 			}
 
 			packet->length += sizeof(nonce_n);
 #else
 			csp_log_warn("Attempt to send XTEA encrypted packet, but CSP was compiled without XTEA support. Discarding packet");
-			goto tx_err;
+			goto err;
 #endif
 		}
 	}
 
+	if (ifout->mtu > 0 && packet->length > ifout->mtu)
+		goto err;
+
+	*ppacket = packet;
+	return CSP_ERR_NONE;
+
+err:
+	if (*shared != NULL) {
+		csp_buffer_free(packet);
+		*ppacket = *shared;
+		*shared = NULL;
+	}
+	return CSP_ERR_TX;
+
+}
+
+int csp_send_direct(csp_id_t idout, csp_packet_t * packet, csp_iface_t * ifout, uint32_t timeout) {
+
+	csp_packet_t * shared;
+
+	if (packet == NULL) {
+		csp_log_error("csp_send_direct called with NULL packet");
+		goto err;
+	}
+
+	if ((ifout == NULL) || (ifout->nexthop == NULL)) {
+		csp_log_error("No route to host: %#08x", idout.ext);
+		goto err;
+	}
+
+	if (csp_send_prepare(idout, &packet, &shared, ifout) != CSP_ERR_NONE)
+		goto tx_err;
+
 	/* Store length before passing to interface */
 	uint16_t bytes = packet->length;
-	uint16_t mtu = ifout->mtu;
 
-	if (mtu > 0 && bytes > mtu)
+	if ((*ifout->nexthop)(ifout, packet, timeout) != CSP_ERR_NONE) {
+		/* On error, the caller still owns the shared buffer */
+		if (shared != NULL)
+			csp_buffer_free(packet);
 		goto tx_err;
+	}
 
-	if ((*ifout->nexthop)(ifout, packet, timeout) != CSP_ERR_NONE)
-		goto tx_err;
+	/* The copy was consumed by the interface, release the shared buffer */
+	if (shared != NULL)
+		csp_buffer_free(shared);
 
 	ifout->tx++;
 	ifout->txbytes += bytes;
@@ -340,6 +400,60 @@ err:
 
 }
 
+/* Compress a packet before sending, unless it is shared or does not get
+ * smaller, and return the flags with CSP_FCOMP added if it was compressed.
+ * HMAC, CRC32 and XTEA are added in place after compression and cannot be
+ * undone if the send fails, so such packets are compressed into a copy,
+ * which replaces *ppacket, and the caller's buffer is returned in *orig. */
+static uint8_t csp_send_compress(uint8_t flags, csp_packet_t ** ppacket, csp_packet_t ** orig) {
+
+	*orig = NULL;
+
+#ifdef CSP_USE_COMPRESSION
+	csp_packet_t * packet = *ppacket;
+	if (csp_buffer_refc(packet) != 1)
+		return flags;
+
+	if (flags & (CSP_FHMAC | CSP_FCRC32 | CSP_FXTEA)) {
+		packet = csp_buffer_clone(packet);
+		if (packet == NULL)
+			return flags;
+	}
+
+	if (csp_compress(packet) != CSP_ERR_NONE) {
+		if (packet != *ppacket)
+			csp_buffer_free(packet);
+		return flags;
+	}
+
+	if (packet != *ppacket) {
+		*orig = *ppacket;
+		*ppacket = packet;
+	}
+	flags |= CSP_FCOMP;
+#endif
+
+	return flags;
+
+}
+
+/* Give the caller back the data it passed in, for a packet that was not sent.
+ * flags, packet and orig are those of csp_send_compress. */
+static void csp_send_uncompress(uint8_t flags, csp_packet_t * packet, csp_packet_t * orig) {
+
+	if (orig != NULL) {
+		csp_buffer_free(packet);
+		return;
+	}
+
+#ifdef CSP_USE_COMPRESSION
+	/* Only the identifier was written to a packet compressed in place */
+	if ((flags & CSP_FCOMP) && csp_decompress(packet) != CSP_ERR_NONE)
+		csp_log_error("Cannot restore data of unsent packet");
+#endif
+
+}
+
 int csp_send(csp_conn_t * conn, csp_packet_t * packet, uint32_t timeout) {
 
 	int ret;
@@ -349,22 +463,58 @@ int csp_send(csp_conn_t * conn, csp_packet_t * packet, uint32_t timeout) {
 		return 0;
 	}
 
+	csp_id_t idout = conn->idout;
+	csp_packet_t * orig = NULL;
+
+#ifdef CSP_USE_COMPRESSION
+	/* Compress the payload, unless it is shared or does not get smaller */
+	if ((conn->opts & CSP_SO_COMPREQ) && csp_buffer_refc(packet) == 1) {
+		uint16_t length = packet->length;
+		idout.flags = csp_send_compress(idout.flags, &packet, &orig);
+		if (idout.flags & CSP_FCOMP)
+			conn->comp.tx_compressed++;
+		conn->comp.tx_packets++;
+		conn->comp.tx_bytes_in += length;
+		conn->comp.tx_bytes_out += packet->length;
+	}
+
+	/* RDP retransmits with the flags kept in the packet */
+	packet->id.ext = idout.ext;
+#endif
+
 #ifdef CSP_USE_RDP
-	if (conn->idout.flags & CSP_FRDP) {
+	if (idout.flags & CSP_FRDP) {
 		if (csp_rdp_send(conn, packet, timeout) != CSP_ERR_NONE) {
-			csp_iface_t * ifout = csp_rtable_find_iface(conn->idout.dst);
+			csp_iface_t * ifout = csp_rtable_find_iface(idout.dst);
 			if (ifout != NULL)
 				ifout->tx_error++;
 			csp_log_warn("RDP send failed!");
-			return 0;
+			goto err;
 		}
 	}
 #endif
 
-	csp_iface_t * ifout = csp_rtable_find_iface(conn->idout.dst);
-	ret = csp_send_direct(conn->idout, packet, ifout, timeout);
+	csp_iface_t * ifout = csp_rtable_find_iface(idout.dst);
+	ret = csp_send_direct(idout, packet, ifout, timeout);
+	if (ret != CSP_ERR_NONE) {
+		/* Once RDP holds the packet in its TX window it is shared and
+		 * carries the RDP header, and is retransmitted as it is */
+		if (idout.flags & CSP_FRDP) {
+			if (orig != NULL)
+				csp_buffer_free(packet);
+			return 0;
+		}
+		goto err;
+	}
 
-	return (ret == CSP_ERR_NONE) ? 1 : 0;
+	/* The compressed copy was sent, release the caller's buffer */
+	if (orig != NULL)
+		csp_buffer_free(orig);
+	return 1;
+
+err:
+	csp_send_uncompress(idout.flags, packet, orig);
+	return 0;
 
 }
 
@@ -437,9 +587,22 @@ csp_packet_t * csp_recvfrom(csp_socket_t * socket, uint32_t timeout) {
 
 }
 
-int csp_sendto(uint8_t prio, uint8_t dest, uint8_t dport, uint8_t src_port, uint32_t opts, csp_packet_t * packet, uint32_t timeout) {
+int csp_recvfrom_batch(csp_socket_t * socket, csp_packet_t ** packets, int max, uint32_t timeout) {
 
-	packet->id.flags = 0;
+	if ((socket == NULL) || (!(socket->opts & CSP_SO_CONN_LESS)) || max <= 0)
+		return 0;
+
+	return csp_queue_dequeue_batch(socket->socket, (void **) packets, max, timeout);
+
+}
+
+/* Number of packets handed to an interface batch function at a time */
+#define CSP_SENDTO_BATCH_CHUNK 16
+
+/* Get packet flags for connection-less options */
+static int csp_sendto_flags(uint32_t opts, uint8_t * flags) {
+
+	*flags = 0;
 
 	if (opts & CSP_O_RDP) {
 		csp_log_error("Attempt to create RDP packet on connection-less socket");
@@ -448,7 +611,7 @@ int csp_sendto(uint8_t prio, uint8_t dest, uint8_t dport, uint8_t src_port, uint
 
 	if (opts & CSP_O_HMAC) {
 #ifdef CSP_USE_HMAC
-		packet->id.flags |= CSP_FHMAC;
+		*flags |= CSP_FHMAC;
 #else
 		csp_log_error("Attempt to create HMAC authenticated packet, but CSP was compiled without HMAC support");
 		return CSP_ERR_NOTSUP;
@@ -457,7 +620,7 @@ int csp_sendto(uint8_t prio, uint8_t dest, uint8_t dport, uint8_t src_port, uint
 
 	if (opts & CSP_O_XTEA) {
 #ifdef CSP_USE_XTEA
-		packet->id.flags |= CSP_FXTEA;
+		*flags |= CSP_FXTEA;
 #else
 		csp_log_error("Attempt to create XTEA encrypted packet, but CSP was compiled without XTEA support");
 		return CSP_ERR_NOTSUP;
@@ -466,13 +629,36 @@ int csp_sendto(uint8_t prio, uint8_t dest, uint8_t dport, uint8_t src_port, uint
 
 	if (opts & CSP_O_CRC32) {
 #ifdef CSP_USE_CRC32
-		packet->id.flags |= CSP_FCRC32;
+		*flags |= CSP_FCRC32;
 #else
 		csp_log_error("Attempt to create CRC32 validated packet, but CSP was compiled without CRC32 support");
 		return CSP_ERR_NOTSUP;
 #endif
 	}
 
+#ifndef CSP_USE_COMPRESSION
+	if (opts & CSP_O_COMP) {
+		csp_log_error("Attempt to create compressed packet, but CSP was compiled without compression support");
+		return CSP_ERR_NOTSUP;
+	}
+#endif
+
+	return CSP_ERR_NONE;
+
+}
+
+int csp_sendto(uint8_t prio, uint8_t dest, uint8_t dport, uint8_t src_port, uint32_t opts, csp_packet_t * packet, uint32_t timeout) {
+
+	uint8_t flags;
+	int ret = csp_sendto_flags(opts, &flags);
+	if (ret != CSP_ERR_NONE)
+		return ret;
+
+	csp_packet_t * orig = NULL;
+	if (opts & CSP_O_COMP)
+		flags = csp_send_compress(flags, &packet, &orig);
+
+	packet->id.flags = flags;
 	packet->id.dst = dest;
 	packet->id.dport = dport;
 	packet->id.src = csp_get_address();
@@ -480,13 +666,126 @@ int csp_sendto(uint8_t prio, uint8_t dest, uint8_t dport, uint8_t src_port, uint
 	packet->id.pri = prio;
 
 	csp_iface_t * ifout = csp_rtable_find_iface(dest);
-	if (csp_send_direct(packet->id, packet, ifout, timeout) != CSP_ERR_NONE)
+	if (csp_send_direct(packet->id, packet, ifout, timeout) != CSP_ERR_NONE) {
+		csp_send_uncompress(packet->id.flags, packet, orig);
 		return CSP_ERR_NOTSUP;
-	
+	}
+
+	/* The compressed copy was sent, release the caller's buffer */
+	if (orig != NULL)
+		csp_buffer_free(orig);
 	return CSP_ERR_NONE;
 
 }
 
+int csp_sendto_batch(uint8_t prio, uint8_t dest, uint8_t dport, uint8_t src_port, uint32_t opts, csp_packet_t ** packets, int count, uint32_t timeout) {
+
+	uint8_t flags;
+	int ret = csp_sendto_flags(opts, &flags);
+	if (ret != CSP_ERR_NONE)
+		return ret;
+
+	csp_id_t idout;
+	idout.flags = flags;
+	idout.dst = dest;
+	idout.dport = dport;
+	idout.src = csp_get_address();
+	idout.sport = src_port;
+	idout.pri = prio;
+
+	/* One route lookup for the batch */
+	csp_iface_t * ifout = csp_rtable_find_iface(dest);
+	if ((ifout == NULL) || (ifout->nexthop == NULL)) {
+		csp_log_error("No route to host: %#08x", idout.ext);
+		return CSP_ERR_NOTSUP;
+	}
+
+	/* Interfaces without a batch hook send one packet at a time */
+	if (ifout->nexthop_batch == NULL) {
+		int sent;
+		for (sent = 0; sent < count; sent++) {
+			csp_packet_t * packet = packets[sent];
+			csp_packet_t * orig = NULL;
+			csp_id_t id = idout;
+			if (opts & CSP_O_COMP)
+				id.flags = csp_send_compress(flags, &packet, &orig);
+			if (csp_send_direct(id, packet, ifout, timeout) != CSP_ERR_NONE) {
+				csp_send_uncompress(id.flags, packet, orig);
+				break;
+			}
+			if (orig != NULL)
+				csp_buffer_free(orig);
+		}
+		return sent;
+	}
+
+	/* Hand packets to the interface in chunks, to bound stack use */
+	int total = 0;
+	while (total < count) {
+		csp_packet_t * shared[CSP_SENDTO_BATCH_CHUNK];
+		csp_packet_t * out[CSP_SENDTO_BATCH_CHUNK];
+		csp_packet_t * orig[CSP_SENDTO_BATCH_CHUNK];
+		uint8_t outflags[CSP_SENDTO_BATCH_CHUNK];
+		int chunk = count - total;
+		if (chunk > CSP_SENDTO_BATCH_CHUNK)
+			chunk = CSP_SENDTO_BATCH_CHUNK;
+
+		/* Prepare packets, stopping at the first that cannot be sent */
+		uint32_t bytes = 0;
+		int prepared;
+		for (prepared = 0; prepared < chunk; prepared++) {
+			csp_id_t id = idout;
+			out[prepared] = packets[total + prepared];
+			orig[prepared] = NULL;
+			if (opts & CSP_O_COMP)
+				id.flags = csp_send_compress(flags, &out[prepared], &orig[prepared]);
+			outflags[prepared] = id.flags;
+			if (csp_send_prepare(id, &out[prepared], &shared[prepared], ifout) != CSP_ERR_NONE) {
+				ifout->tx_error++;
+				break;
+			}
+			bytes += out[prepared]->length;
+		}
+
+		int sent = 0;
+		if (prepared > 0)
+			sent = (*ifout->nexthop_batch)(ifout, out, prepared, timeout);
+		if (sent < 0)
+			sent = 0;
+
+		if (sent < prepared) {
+			ifout->tx_error++;
+			for (int i = sent; i < prepared; i++)
+				bytes -= out[i]->length;
+		}
+
+		/* Release the caller's buffers of sent packets, and copies of unsent ones.
+		 * Unsent packets that were compressed in place are decompressed again. */
+		for (int i = 0; i < chunk && i <= prepared; i++) {
+			if (i < sent) {
+				if (shared[i] != NULL)
+					csp_buffer_free(shared[i]);
+				if (orig[i] != NULL)
+					csp_buffer_free(orig[i]);
+			} else if (shared[i] != NULL) {
+				csp_buffer_free(out[i]);
+			} else {
+				csp_send_uncompress(outflags[i], out[i], orig[i]);
+			}
+		}
+
+		ifout->tx += sent;
+		ifout->txbytes += bytes;
+		total += sent;
+
+		if (sent < chunk)
+			break;
+	}
+
+	return total;
+
+}
+
 int csp_sendto_reply(csp_packet_t * request_packet, csp_packet_t * reply_packet, uint32_t opts, uint32_t timeout) {
 	if (request_packet == NULL)
 		return CSP_ERR_INVAL;
@@ -18,28 +18,95 @@ License along with this library; if not, write to the Free Software
 Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
 */
 
+#include <stdlib.h>
+#include <string.h>
+
 #include <csp/csp.h>
-#include <csp/arch/csp_queue.h>
+#include <csp/csp_endian.h>
+#include <csp/arch/csp_malloc.h>
+#include <csp/arch/csp_semaphore.h>
+#include <csp/arch/csp_time.h>
 
 #ifdef CSP_USE_PROMISC
 
-static csp_queue_handle_t csp_promisc_queue = NULL;
+#if defined(CSP_POSIX) || defined(CSP_MACOSX)
+#include <time.h>
+#include <unistd.h>
+#include <errno.h>
+#endif
+
+/* Captured packets are copied into a ring of fixed size slots allocated when
+ * promiscuous mode is first enabled, so capturing needs no buffer from the
+ * pool and no queue operation. When the ring is full, the oldest packet is
+ * overwritten and counted as dropped. */
+typedef struct {
+	uint64_t timestamp;	/* Capture time in ns */
+	uint32_t id;		/* CSP identifier */
+	uint16_t length;	/* Captured data length */
+	uint8_t data[0];
+} csp_promisc_slot_t;
+
+static uint8_t * csp_promisc_ring = NULL;
+static uint8_t * csp_promisc_scratch = NULL;
+static unsigned int csp_promisc_slots, csp_promisc_slot_size, csp_promisc_snaplen;
+static unsigned int csp_promisc_head, csp_promisc_count;
+static uint32_t csp_promisc_dropped_count;
 static int csp_promisc_enabled = 0;
 
+/* Capture filter */
+static uint32_t csp_promisc_nodes = UINT32_MAX;
+static uint64_t csp_promisc_ports = UINT64_MAX;
+static uint8_t csp_promisc_flags_mask = 0;
+static uint8_t csp_promisc_flags = 0;
+
+CSP_DEFINE_CRITICAL(csp_promisc_lock);
+static csp_bin_sem_handle_t csp_promisc_ready;
+
+#define csp_promisc_slot(n) ((csp_promisc_slot_t *) (csp_promisc_ring + (n) * csp_promisc_slot_size))
+
+static uint64_t csp_promisc_timestamp(void) {
+#if defined(CSP_POSIX) || defined(CSP_MACOSX)
+	struct timespec ts;
+	if (clock_gettime(CLOCK_REALTIME, &ts) == 0)
+		return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+	return (uint64_t) csp_get_ms() * 1000000ULL;
+}
+
 int csp_promisc_enable(unsigned int buf_size) {
 
-	/* If queue already initialised */
-	if (csp_promisc_queue != NULL) {
+	/* If ring already initialised */
+	if (csp_promisc_ring != NULL) {
 		csp_promisc_enabled = 1;
 		return CSP_ERR_NONE;
 	}
 
-	/* Create packet queue */
-	csp_promisc_queue = csp_queue_create(buf_size, sizeof(csp_packet_t *));
-
-	if (csp_promisc_queue == NULL)
+	if (buf_size == 0)
 		return CSP_ERR_INVAL;
 
+	/* Buffer size includes the packet header */
+	csp_promisc_snaplen = csp_buffer_size() - CSP_BUFFER_PACKET_OVERHEAD;
+	csp_promisc_slot_size = (sizeof(csp_promisc_slot_t) + csp_promisc_snaplen + 7) & ~7;
+	csp_promisc_slots = buf_size;
+
+	if (CSP_INIT_CRITICAL(csp_promisc_lock) != CSP_ERR_NONE)
+		return CSP_ERR_NOMEM;
+	if (csp_bin_sem_create(&csp_promisc_ready) != CSP_SEMAPHORE_OK)
+		return CSP_ERR_NOMEM;
+	/* Semaphore is created available */
+	csp_bin_sem_wait(&csp_promisc_ready, 0);
+
+	/* Allocate ring and a padded data buffer for the pcapng writer */
+	csp_promisc_scratch = csp_malloc(csp_promisc_snaplen + 4);
+	csp_promisc_ring = csp_malloc(csp_promisc_slots * csp_promisc_slot_size);
+	if (csp_promisc_ring == NULL || csp_promisc_scratch == NULL) {
+		csp_free(csp_promisc_scratch);
+		csp_free(csp_promisc_ring);
+		csp_promisc_scratch = NULL;
+		csp_promisc_ring = NULL;
+		return CSP_ERR_NOMEM;
+	}
+
 	csp_promisc_enabled = 1;
 	return CSP_ERR_NONE;
 
@@ -49,14 +116,65 @@ void csp_promisc_disable(void) {
 	csp_promisc_enabled = 0;
 }
 
+void csp_promisc_set_filter(uint32_t nodes, uint64_t ports, uint8_t flags_mask, uint8_t flags) {
+	csp_promisc_nodes = nodes;
+	csp_promisc_ports = ports;
+	csp_promisc_flags_mask = flags_mask;
+	csp_promisc_flags = flags & flags_mask;
+}
+
+uint32_t csp_promisc_dropped(void) {
+	return csp_promisc_dropped_count;
+}
+
+/* Take the oldest packet from the ring, waiting up to timeout ms for one */
+static int csp_promisc_pop(uint64_t * timestamp, csp_id_t * id, uint16_t * length, uint8_t * data, uint32_t timeout) {
+
+	uint32_t start = csp_get_ms();
+
+	while (1) {
+		CSP_ENTER_CRITICAL(csp_promisc_lock);
+		if (csp_promisc_count > 0) {
+			unsigned int tail = (csp_promisc_head + csp_promisc_slots - csp_promisc_count) % csp_promisc_slots;
+			csp_promisc_slot_t * slot = csp_promisc_slot(tail);
+			*timestamp = slot->timestamp;
+			id->ext = slot->id;
+			*length = slot->length;
+			memcpy(data, slot->data, slot->length);
+			csp_promisc_count--;
+			CSP_EXIT_CRITICAL(csp_promisc_lock);
+			return 1;
+		}
+		CSP_EXIT_CRITICAL(csp_promisc_lock);
+
+		uint32_t elapsed = csp_get_ms() - start;
+		if (elapsed >= timeout)
+			return 0;
+		if (csp_bin_sem_wait(&csp_promisc_ready, (timeout == CSP_MAX_DELAY) ? CSP_MAX_DELAY : timeout - elapsed) != CSP_SEMAPHORE_OK)
+			timeout = 0;
+	}
+
+}
+
 csp_packet_t * csp_promisc_read(uint32_t timeout) {
 
-	if (csp_promisc_queue == NULL)
+	if (csp_promisc_ring == NULL)
+		return NULL;
+
+	csp_packet_t * packet = csp_buffer_get(csp_promisc_snaplen);
+	if (packet == NULL)
 		return NULL;
 
-	csp_packet_t * packet = NULL;
-	csp_queue_dequeue(csp_promisc_queue, &packet, timeout);
+	uint64_t timestamp;
+	csp_id_t id;
+	uint16_t length;
+	if (!csp_promisc_pop(&timestamp, &id, &length, packet->data, timeout)) {
+		csp_buffer_free(packet);
+		return NULL;
+	}
 
+	packet->id.ext = id.ext;
+	packet->length = length;
 	return packet;
 
 }
@@ -66,17 +184,140 @@ void csp_promisc_add(csp_packet_t * packet) {
 	if (csp_promisc_enabled == 0)
 		return;
 
-	if (csp_promisc_queue != NULL) {
-		/* Make a copy of the message and queue it to the promiscuous task */
-		csp_packet_t *packet_copy = csp_buffer_clone(packet);
-		if (packet_copy != NULL) {
-			if (csp_queue_enqueue(csp_promisc_queue, &packet_copy, 0) != CSP_QUEUE_OK) {
-				csp_log_error("Promiscuous mode input queue full");
-				csp_buffer_free(packet_copy);
-			}
+	/* Apply capture filter before taking the lock */
+	csp_id_t id = packet->id;
+	if (!(csp_promisc_nodes & ((1UL << id.src) | (1UL << id.dst))))
+		return;
+	if (!(csp_promisc_ports & ((1ULL << id.sport) | (1ULL << id.dport))))
+		return;
+	if ((id.flags & csp_promisc_flags_mask) != csp_promisc_flags)
+		return;
+
+	uint16_t length = packet->length;
+	if (length > csp_promisc_snaplen)
+		length = csp_promisc_snaplen;
+	uint64_t timestamp = csp_promisc_timestamp();
+
+	CSP_ENTER_CRITICAL(csp_promisc_lock);
+	csp_promisc_slot_t * slot = csp_promisc_slot(csp_promisc_head);
+	slot->timestamp = timestamp;
+	slot->id = id.ext;
+	slot->length = length;
+	memcpy(slot->data, packet->data, length);
+	csp_promisc_head = (csp_promisc_head + 1) % csp_promisc_slots;
+	if (csp_promisc_count < csp_promisc_slots) {
+		csp_promisc_count++;
+	} else {
+		csp_promisc_dropped_count++;
+	}
+	CSP_EXIT_CRITICAL(csp_promisc_lock);
+
+	csp_bin_sem_post(&csp_promisc_ready);
+
+}
+
+#if defined(CSP_POSIX) || defined(CSP_MACOSX)
+
+/* pcapng block types and options */
+#define PCAPNG_SHB		0x0A0D0D0A
+#define PCAPNG_IDB		0x00000001
+#define PCAPNG_EPB		0x00000006
+#define PCAPNG_BYTE_ORDER	0x1A2B3C4D
+#define PCAPNG_OPT_TSRESOL	9
+
+static int csp_promisc_write_all(int fd, const void * buf, size_t len) {
+	const uint8_t * p = buf;
+	while (len > 0) {
+		ssize_t res = write(fd, p, len);
+		if (res < 0) {
+			if (errno == EINTR)
+				continue;
+			csp_log_error("pcapng write failed: %s", strerror(errno));
+			return CSP_ERR_DRIVER;
 		}
+		p += res;
+		len -= res;
+	}
+	return CSP_ERR_NONE;
+}
+
+int csp_promisc_pcapng_header(int fd) {
+
+	if (csp_promisc_ring == NULL)
+		return CSP_ERR_INVAL;
+
+	/* Section header block */
+	uint32_t shb[7] = {PCAPNG_SHB, sizeof(shb), PCAPNG_BYTE_ORDER, 0, 0xFFFFFFFF, 0xFFFFFFFF, sizeof(shb)};
+
+	/* Interface description block with nanosecond timestamps */
+	uint32_t idb[8] = {PCAPNG_IDB, sizeof(idb), 0, sizeof(csp_id_t) + csp_promisc_snaplen, 0, 0, 0, sizeof(idb)};
+
+	/* Major version 1, minor version 0 */
+	uint16_t version[2] = {1, 0};
+	memcpy(&shb[3], version, sizeof(version));
+
+	/* Link type and a reserved field */
+	uint16_t linktype[2] = {CSP_PROMISC_LINKTYPE, 0};
+	memcpy(&idb[2], linktype, sizeof(linktype));
+
+	/* Option if_tsresol holds one byte, 10^-9 s, padded to 4 bytes */
+	uint16_t tsresol[2] = {PCAPNG_OPT_TSRESOL, 1};
+	uint8_t tsresol_value[4] = {9, 0, 0, 0};
+	memcpy(&idb[4], tsresol, sizeof(tsresol));
+	memcpy(&idb[5], tsresol_value, sizeof(tsresol_value));
+
+	if (csp_promisc_write_all(fd, shb, sizeof(shb)) != CSP_ERR_NONE)
+		return CSP_ERR_DRIVER;
+	return csp_promisc_write_all(fd, idb, sizeof(idb));
+
+}
+
+int csp_promisc_pcapng_write(int fd, uint32_t timeout) {
+
+	if (csp_promisc_ring == NULL)
+		return CSP_ERR_INVAL;
+
+	/* Wait for the first packet, then drain what is in the ring */
+	unsigned int written;
+	for (written = 0; written < csp_promisc_slots; written++) {
+
+		uint64_t timestamp;
+		csp_id_t id;
+		uint16_t length;
+		uint8_t * data = csp_promisc_scratch;
+		if (!csp_promisc_pop(&timestamp, &id, &length, data, written ? 0 : timeout))
+			break;
+
+		/* Enhanced packet block, data is the CSP header in network order followed by the payload */
+		uint32_t caplen = sizeof(csp_id_t) + length;
+		uint32_t padded = (caplen + 3) & ~3;
+		uint32_t total = sizeof(uint32_t[8]) + padded;
+		uint32_t epb[7];
+		epb[0] = PCAPNG_EPB;
+		epb[1] = total;
+		epb[2] = 0;
+		epb[3] = timestamp >> 32;
+		epb[4] = timestamp & 0xFFFFFFFF;
+		epb[5] = caplen;
+		epb[6] = caplen;
+
+		if (csp_promisc_write_all(fd, epb, sizeof(epb)) != CSP_ERR_NONE)
+			return CSP_ERR_DRIVER;
+		uint32_t header = csp_hton32(id.ext);
+		if (csp_promisc_write_all(fd, &header, sizeof(header)) != CSP_ERR_NONE)
+			return CSP_ERR_DRIVER;
+		memset(data + length, 0, padded - caplen);
+		if (csp_promisc_write_all(fd, data, length + padded - caplen) != CSP_ERR_NONE)
+			return CSP_ERR_DRIVER;
+		if (csp_promisc_write_all(fd, &total, sizeof(total)) != CSP_ERR_NONE)
+			return CSP_ERR_DRIVER;
+
 	}
 
+	return written;
+
 }
 
 #endif
+
+#endif
@@ -21,6 +21,7 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
 #include <csp/csp.h>
 #include <csp/arch/csp_queue.h>
 #include "csp_qfifo.h"
+#include "csp_bridge.h"
 
 static csp_queue_handle_t qfifo[CSP_ROUTE_FIFOS];
 #ifdef CSP_USE_QOS
@@ -50,13 +51,13 @@ int csp_qfifo_init(void) {
 
 }
 
-int csp_qfifo_read(csp_qfifo_t * input) {
+int csp_qfifo_read(csp_qfifo_t * input, uint32_t timeout) {
 
 #ifdef CSP_USE_QOS
 	int prio, found, event;
 
 	/* Wait for packet in any queue */
-	if (csp_queue_dequeue(qfifo_events, &event, FIFO_TIMEOUT) != CSP_QUEUE_OK)
+	if (csp_queue_dequeue(qfifo_events, &event, timeout) != CSP_QUEUE_OK)
 		return CSP_ERR_TIMEDOUT;
 
 	/* Find packet with highest priority */
@@ -68,12 +69,15 @@ int csp_qfifo_read(csp_qfifo_t * input) {
 		}
 	}
 
-	if (!found) {
-		csp_log_warn("Spurious wakeup: No packet found");
+	/* Woken up without a packet */
+	if (!found)
 		return CSP_ERR_TIMEDOUT;
-	}
 #else
-	if (csp_queue_dequeue(qfifo[0], input, FIFO_TIMEOUT) != CSP_QUEUE_OK)
+	if (csp_queue_dequeue(qfifo[0], input, timeout) != CSP_QUEUE_OK)
+		return CSP_ERR_TIMEDOUT;
+
+	/* Woken up without a packet */
+	if (input->packet == NULL)
 		return CSP_ERR_TIMEDOUT;
 #endif
 
@@ -81,6 +85,18 @@ int csp_qfifo_read(csp_qfifo_t * input) {
 
 }
 
+void csp_qfifo_wake_up(void) {
+
+#ifdef CSP_USE_QOS
+	int event = 0;
+	csp_queue_enqueue(qfifo_events, &event, 0);
+#else
+	csp_qfifo_t queue_element = {.interface = NULL, .packet = NULL};
+	csp_queue_enqueue(qfifo[0], &queue_element, 0);
+#endif
+
+}
+
 void csp_qfifo_write(csp_packet_t * packet, csp_iface_t * interface, CSP_BASE_TYPE * pxTaskWoken) {
 
 	int result;
@@ -97,6 +113,22 @@ void csp_qfifo_write(csp_packet_t * packet, csp_iface_t * interface, CSP_BASE_TY
 		return;
 	}
 
+	/* The router modifies received packets, so a shared buffer looped
+	 * back from a transmit path is copied. ISRs never pass shared buffers. */
+	if (pxTaskWoken == NULL && csp_buffer_refc(packet) > 1) {
+		csp_packet_t * copy = csp_buffer_clone(packet);
+		csp_buffer_free(packet);
+		if (copy == NULL) {
+			interface->drop++;
+			return;
+		}
+		packet = copy;
+	}
+
+	/* Packets from a bridged interface bypass the router */
+	if (csp_bridge_input(packet, interface, pxTaskWoken))
+		return;
+
 	csp_qfifo_t queue_element;
 	queue_element.interface = interface;
 	queue_element.packet = packet;
@@ -21,11 +21,7 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
 #ifndef CSP_QFIFO_H_
 #define CSP_QFIFO_H_
 
-#ifdef CSP_USE_RDP
-#define FIFO_TIMEOUT 100				//! If RDP is enabled, the router needs to awake some times to check timeouts
-#else
-#define FIFO_TIMEOUT CSP_MAX_DELAY		//! If no RDP, the router can sleep untill data arrives
-#endif
+#define FIFO_TIMEOUT CSP_MAX_DELAY		//! The router sleeps until data arrives or the next timer expires
 
 /**
  * Init FIFO/QOS queues
@@ -41,8 +37,14 @@ typedef struct {
 /**
  * Read next packet from router input queue
  * @param input pointer to router queue item element
+ * @param timeout timeout in ms
  * @return CSP_ERR type
  */
-int csp_qfifo_read(csp_qfifo_t * input);
+int csp_qfifo_read(csp_qfifo_t * input, uint32_t timeout);
+
+/**
+ * Wake up a task blocked in csp_qfifo_read without passing a packet
+ */
+void csp_qfifo_wake_up(void);
 
 #endif /* CSP_QFIFO_H_ */
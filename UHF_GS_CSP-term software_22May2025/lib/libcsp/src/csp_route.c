@@ -26,6 +26,7 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
 #include <csp/csp.h>
 #include <csp/csp_crc32.h>
 #include <csp/csp_endian.h>
+#include <csp/interfaces/csp_if_aggr.h>
 
 #include <csp/arch/csp_thread.h>
 #include <csp/arch/csp_queue.h>
@@ -34,11 +35,14 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
 #include "crypto/csp_xtea.h"
 
 #include "csp_port.h"
+#include "csp_route.h"
 #include "csp_conn.h"
 #include "csp_io.h"
 #include "csp_promisc.h"
 #include "csp_qfifo.h"
 #include "csp_dedup.h"
+#include "csp_compress.h"
+#include "csp_timer.h"
 #include "transport/csp_transport.h"
 
 /**
@@ -67,6 +71,24 @@ static int csp_route_check_options(csp_iface_t *interface, csp_packet_t *packet)
 	}
 #endif
 
+#ifndef CSP_USE_AGGR
+	/* Drop aggregated frames */
+	if (packet->id.flags & CSP_FAGGR) {
+		csp_log_error("Received aggregated frame, but CSP was compiled without aggregation support. Discarding packet");
+		interface->rx_error++;
+		return CSP_ERR_NOTSUP;
+	}
+#endif
+
+#ifndef CSP_USE_COMPRESSION
+	/* Drop compressed packets */
+	if (packet->id.flags & CSP_FCOMP) {
+		csp_log_error("Received compressed packet, but CSP was compiled without compression support. Discarding packet");
+		interface->rx_error++;
+		return CSP_ERR_NOTSUP;
+	}
+#endif
+
 #ifndef CSP_USE_RDP
 	/* Drop RDP packets */
 	if (packet->id.flags & CSP_FRDP) {
@@ -92,6 +114,11 @@ static int csp_route_security_check(uint32_t security_opts, csp_iface_t * interf
 	if (packet->id.flags & CSP_FXTEA) {
 		/* Read nonce */
 		uint32_t nonce;
+		if (packet->length < sizeof(nonce)) {
+			csp_log_error("Too short packet for XTEA, %u", packet->length);
+			interface->autherr++;
+			return CSP_ERR_XTEA;
+		}
 		memcpy(&nonce, &packet->data[packet->length - sizeof(nonce)], sizeof(nonce));
 		nonce = csp_ntoh32(nonce);
 		packet->length -= sizeof(nonce);
@@ -116,8 +143,11 @@ static int csp_route_security_check(uint32_t security_opts, csp_iface_t * interf
 	/* CRC32 verified packet */
 	if (packet->id.flags & CSP_FCRC32) {
 #ifdef CSP_USE_CRC32
-		if (packet->length < 4)
+		if (packet->length < sizeof(uint32_t)) {
 			csp_log_error("Too short packet for CRC32, %u", packet->length);
+			interface->rx_error++;
+			return CSP_ERR_CRC32;
+		}
 		/* Verify CRC32 (does not include header for backwards compatability with csp1.x) */
 		if (csp_crc32_verify(packet, false) != 0) {
 			/* Checksum failed */
@@ -129,6 +159,11 @@ static int csp_route_security_check(uint32_t security_opts, csp_iface_t * interf
 		csp_log_warn("Received packet without CRC32. Accepting packet");
 #else
 		/* Strip CRC32 field and accept the packet */
+		if (packet->length < sizeof(uint32_t)) {
+			csp_log_error("Too short packet for CRC32, %u", packet->length);
+			interface->rx_error++;
+			return CSP_ERR_CRC32;
+		}
 		csp_log_warn("Received packet with CRC32, but CSP was compiled without CRC32 support. Accepting packet");
 		packet->length -= sizeof(uint32_t);
 #endif
@@ -166,69 +201,15 @@ static int csp_route_security_check(uint32_t security_opts, csp_iface_t * interf
 
 }
 
-int csp_route_work(uint32_t timeout) {
+void csp_route_local(csp_iface_t * interface, csp_packet_t * packet) {
 
-	csp_qfifo_t input;
-	csp_packet_t * packet;
 	csp_conn_t * conn;
 	csp_socket_t * socket;
 
-#ifdef CSP_USE_RDP
-	/* Check connection timeouts (currently only for RDP) */
-	csp_conn_check_timeouts();
-#endif
-
-	/* Get next packet to route */
-	if (csp_qfifo_read(&input) != CSP_ERR_NONE)
-		return -1;
-
-	packet = input.packet;
-
-	csp_log_packet("INP: S %u, D %u, Dp %u, Sp %u, Pr %u, Fl 0x%02X, Sz %"PRIu16" VIA: %s",
-			packet->id.src, packet->id.dst, packet->id.dport,
-			packet->id.sport, packet->id.pri, packet->id.flags, packet->length, input.interface->name);
-
-	/* Here there be promiscuous mode */
-#ifdef CSP_USE_PROMISC
-	csp_promisc_add(packet);
-#endif
-
-#ifdef CSP_USE_DEDUP
-	/* Check for duplicates */
-	if (csp_dedup_is_duplicate(packet)) {
-		/* Discard packet */
-		csp_log_packet("Duplicate packet discarded");
-		csp_buffer_free(packet);
-		return 0;
-	}
-#endif
-
-	/* If the message is not to me, route the message to the correct interface */
-	if ((packet->id.dst != csp_get_address()) && (packet->id.dst != CSP_BROADCAST_ADDR)) {
-
-		/* Find the destination interface */
-		csp_iface_t * dstif = csp_rtable_find_iface(packet->id.dst);
-
-		/* If the message resolves to the input interface, don't loop it back out */
-		if ((dstif == NULL) || ((dstif == input.interface) && (input.interface->split_horizon_off == 0))) {
-			csp_buffer_free(packet);
-			return 0;
-		}
-
-		/* Otherwise, actually send the message */
-		if (csp_send_direct(packet->id, packet, dstif, 0) != CSP_ERR_NONE) {
-			csp_log_warn("Router failed to send");
-			csp_buffer_free(packet);
-		}
-
-		/* Next message, please */
-		return 0;
-	}
-
 	/* Discard packets with unsupported options */
-	if (csp_route_check_options(input.interface, packet) != CSP_ERR_NONE) {
+	if (csp_route_check_options(interface, packet) != CSP_ERR_NONE) {
 		csp_buffer_free(packet);
-		return 0;
+		return;
 	}
 
 	/* The message is to me, search for incoming socket */
@@ -236,16 +217,26 @@ int csp_route_work(uint32_t timeout) {
 
 	/* If the socket is connection-less, deliver now */
 	if (socket && (socket->opts & CSP_SO_CONN_LESS)) {
-		if (csp_route_security_check(socket->opts, input.interface, packet) < 0) {
+		if (csp_route_security_check(socket->opts, interface, packet) < 0) {
 			csp_buffer_free(packet);
-			return 0;
+			return;
+		}
+#ifdef CSP_USE_COMPRESSION
+		if (packet->id.flags & CSP_FCOMP) {
+			if (csp_decompress(packet) != CSP_ERR_NONE) {
+				interface->rx_error++;
+				csp_buffer_free(packet);
+				return;
+			}
+			packet->id.flags &= ~CSP_FCOMP;
 		}
+#endif
 		if (csp_queue_enqueue(socket->socket, &packet, 0) != CSP_QUEUE_OK) {
 			csp_log_error("Conn-less socket queue full");
 			csp_buffer_free(packet);
-			return 0;
+			return;
 		}
-		return 0;
+		return;
 	}
 
 	/* Search for an existing connection */
@@ -257,13 +248,13 @@ int csp_route_work(uint32_t timeout) {
 		/* Reject packet if no matching socket is found */
 		if (!socket) {
 			csp_buffer_free(packet);
-			return 0;
+			return;
 		}
 
 		/* Run security check on incoming packet */
-		if (csp_route_security_check(socket->opts, input.interface, packet) < 0) {
+		if (csp_route_security_check(socket->opts, interface, packet) < 0) {
 			csp_buffer_free(packet);
-			return 0;
+			return;
 		}
 
 		/* New incoming connection accepted */
@@ -274,7 +265,7 @@ int csp_route_work(uint32_t timeout) {
 		idout.dst   = packet->id.src;
 		idout.dport = packet->id.sport;
 		idout.sport = packet->id.dport;
-		idout.flags = packet->id.flags;
+		idout.flags = packet->id.flags & ~CSP_FCOMP;
 
 		/* Create connection */
 		conn = csp_conn_new(packet->id, idout);
@@ -282,7 +273,7 @@ int csp_route_work(uint32_t timeout) {
 		if (!conn) {
 			csp_log_error("No more connections available");
 			csp_buffer_free(packet);
-			return 0;
+			return;
 		}
 
 		/* Store the socket queue and options */
@@ -293,9 +284,9 @@ int csp_route_work(uint32_t timeout) {
 	} else {
 
 		/* Run security check on incoming packet */
-		if (csp_route_security_check(conn->opts, input.interface, packet) < 0) {
+		if (csp_route_security_check(conn->opts, interface, packet) < 0) {
 			csp_buffer_free(packet);
-			return 0;
+			return;
 		}
 
 	}
@@ -304,13 +295,90 @@ int csp_route_work(uint32_t timeout) {
 	/* Pass packet to RDP module */
 	if (packet->id.flags & CSP_FRDP) {
 		csp_rdp_new_packet(conn, packet);
-		return 0;
+		return;
 	}
 #endif
 
 	/* Pass packet to UDP module */
 	csp_udp_new_packet(conn, packet);
+
+}
+
+int csp_route_work(uint32_t timeout) {
+
+	csp_qfifo_t input;
+	csp_packet_t * packet;
+	uint32_t timer_timeout;
+	int result;
+
+	/* Do not sleep past the next timer */
+	timer_timeout = csp_timer_next();
+	if (timer_timeout < timeout)
+		timeout = timer_timeout;
+
+	/* Get next packet to route */
+	result = csp_qfifo_read(&input, timeout);
+
+	/* Handle expired timers (RDP retransmission, ACK and connection timeouts) */
+	csp_timer_run();
+
+	if (result != CSP_ERR_NONE)
+		return -1;
+
+	packet = input.packet;
+
+	csp_log_packet("INP: S %u, D %u, Dp %u, Sp %u, Pr %u, Fl 0x%02X, Sz %"PRIu16" VIA: %s",
+			packet->id.src, packet->id.dst, packet->id.dport,
+			packet->id.sport, packet->id.pri, packet->id.flags, packet->length, input.interface->name);
+
+#ifdef CSP_USE_AGGR
+	/* Split aggregated frames, the packets in them are routed one by one */
+	if (packet->id.flags & CSP_FAGGR) {
+		csp_aggr_rx(input.interface, packet);
+		return 0;
+	}
+#endif
+
+	/* Here there be promiscuous mode */
+#ifdef CSP_USE_PROMISC
+	csp_promisc_add(packet);
+#endif
+
+#ifdef CSP_USE_DEDUP
+	/* Check for duplicates */
+	if (csp_dedup_is_duplicate(input.interface, packet)) {
+		/* Discard packet */
+		csp_log_packet("Duplicate packet discarded");
+		csp_buffer_free(packet);
+		return 0;
+	}
+#endif
+
+	/* If the message is not to me, route the message to the correct interface */
+	if ((packet->id.dst != csp_get_address()) && (packet->id.dst != CSP_BROADCAST_ADDR)) {
+
+		/* Find the destination interface */
+		csp_iface_t * dstif = csp_rtable_find_iface(packet->id.dst);
+
+		/* If the message resolves to the input interface, don't loop it back out */
+		if ((dstif == NULL) || ((dstif == input.interface) && (input.interface->split_horizon_off == 0))) {
+			csp_buffer_free(packet);
+			return 0;
+		}
+
+		/* Otherwise, actually send the message */
+		if (csp_send_direct(packet->id, packet, dstif, 0) != CSP_ERR_NONE) {
+			csp_log_warn("Router failed to send");
+			csp_buffer_free(packet);
+		}
+
+		/* Next message, please */
+		return 0;
+	}
+
+	csp_route_local(input.interface, packet);
 	return 0;
+
 }
 
 CSP_DEFINE_TASK(csp_task_router) {
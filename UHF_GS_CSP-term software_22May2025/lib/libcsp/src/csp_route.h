@@ -21,4 +21,13 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
 #ifndef _CSP_ROUTE_H_
 #define _CSP_ROUTE_H_
 
+#include <csp/csp.h>
+
+/**
+ * Deliver a packet addressed to this node to its socket or connection
+ * @param interface pointer to incoming interface
+ * @param packet pointer to packet, consumed
+ */
+void csp_route_local(csp_iface_t * interface, csp_packet_t * packet);
+
 #endif // _CSP_ROUTE_H_
@@ -20,6 +20,7 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
 
 #include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 #include <csp/csp.h>
 #include <csp/csp_endian.h>
 #include <csp/arch/csp_malloc.h>
@@ -48,20 +49,24 @@ static sfp_header_t * csp_sfp_header_remove(csp_packet_t * packet) {
 	return header;
 }
 
-int csp_sfp_send_own_memcpy(csp_conn_t * conn, void * data, int totalsize, int mtu, uint32_t timeout, void * (*memcpyfcn)(void *, const void *, size_t)) {
+static int csp_sfp_send_range_own_memcpy(csp_conn_t * conn, void * data, int totalsize, int offset, int length, int mtu, uint32_t timeout, void * (*memcpyfcn)(void *, const void *, size_t)) {
+
+	if (offset < 0 || length < 0 || offset + length > totalsize)
+		return -1;
 
-	int count = 0;
-	while(count < totalsize) {
+	int count = offset;
+	int end = offset + length;
+	while(count < end) {
 
 		/* Allocate packet */
 		csp_packet_t * packet = csp_buffer_get(mtu);
 		if (packet == NULL)
 			return -1;
 
-		/* Calculate sending size */
-		int size = totalsize - count;
-		if (size > mtu)
-			size = mtu;
+		/* Calculate sending size, keeping fragments aligned to the mtu */
+		int size = mtu - (count % mtu);
+		if (size > end - count)
+			size = end - count;
 
 		/* Print debug */
 		csp_debug(CSP_PROTOCOL, "Sending SFP at %x size %u", data + count, size);
@@ -93,10 +98,18 @@ int csp_sfp_send_own_memcpy(csp_conn_t * conn, void * data, int totalsize, int m
 
 }
 
+int csp_sfp_send_own_memcpy(csp_conn_t * conn, void * data, int totalsize, int mtu, uint32_t timeout, void * (*memcpyfcn)(void *, const void *, size_t)) {
+	return csp_sfp_send_range_own_memcpy(conn, data, totalsize, 0, totalsize, mtu, timeout, memcpyfcn);
+}
+
 int csp_sfp_send(csp_conn_t * conn, void * data, int totalsize, int mtu, uint32_t timeout) {
 	return csp_sfp_send_own_memcpy(conn, data, totalsize, mtu, timeout, &memcpy);
 }
 
+int csp_sfp_send_range(csp_conn_t * conn, void * data, int totalsize, int offset, int length, int mtu, uint32_t timeout) {
+	return csp_sfp_send_range_own_memcpy(conn, data, totalsize, offset, length, mtu, timeout, &memcpy);
+}
+
 int csp_sfp_recv_fp(csp_conn_t * conn, void ** dataout, int * datasize, uint32_t timeout, csp_packet_t * first_packet) {
 
 	unsigned int last_byte = 0;
@@ -165,3 +178,316 @@ int csp_sfp_recv(csp_conn_t * conn, void ** dataout, int * datasize, uint32_t ti
 	return csp_sfp_recv_fp(conn, dataout, datasize, timeout, NULL);
 }
 
+#if defined(CSP_POSIX) || defined(CSP_MACOSX)
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+
+/**
+ * File receive state:
+ * The file is divided in chunks of the size of the first fragment, and a bitmap
+ * records the chunks that have been written. The state is kept in a file next
+ * to the destination, named <path>.sfp, and updated with each fragment, so an
+ * interrupted transfer can continue where it stopped. The transfer identity,
+ * size and chunk size are saved with it, so the chunks of another transfer are
+ * never merged in. The state file is removed when the transfer is complete.
+ */
+#define SFP_STATE_MAGIC 0x53465032
+
+/* Largest bitmap, the chunk size is chosen by the sender */
+#define SFP_STATE_CHUNKS_MAX (1024 * 1024)
+
+typedef struct {
+	uint32_t magic;
+	uint32_t id;
+	uint32_t totalsize;
+	uint32_t chunk;
+} sfp_state_header_t;
+
+typedef struct {
+	int fd;
+	sfp_state_header_t header;
+	uint32_t chunks;
+	uint32_t received;
+	uint8_t * bitmap;
+} sfp_state_t;
+
+static char * csp_sfp_state_path(const char * path) {
+	char * state_path = csp_malloc(strlen(path) + sizeof(".sfp"));
+	if (state_path != NULL) {
+		strcpy(state_path, path);
+		strcat(state_path, ".sfp");
+	}
+	return state_path;
+}
+
+static int csp_sfp_state_alloc(sfp_state_t * state) {
+	if (state->header.totalsize > CSP_SFP_FILE_MAX)
+		return -1;
+	state->chunks = (state->header.totalsize + state->header.chunk - 1) / state->header.chunk;
+	if (state->chunks > SFP_STATE_CHUNKS_MAX)
+		return -1;
+	state->bitmap = csp_malloc((state->chunks + 7) / 8);
+	if (state->bitmap == NULL)
+		return -1;
+	memset(state->bitmap, 0, (state->chunks + 7) / 8);
+	state->received = 0;
+	return 0;
+}
+
+/* Load saved state, returns -1 if there is none */
+static int csp_sfp_state_load(sfp_state_t * state) {
+
+	if (pread(state->fd, &state->header, sizeof(state->header), 0) != sizeof(state->header))
+		return -1;
+	if (state->header.magic != SFP_STATE_MAGIC || state->header.chunk == 0)
+		return -1;
+	if (csp_sfp_state_alloc(state) < 0)
+		return -1;
+
+	ssize_t bytes = (state->chunks + 7) / 8;
+	if (pread(state->fd, state->bitmap, bytes, sizeof(state->header)) != bytes) {
+		csp_free(state->bitmap);
+		state->bitmap = NULL;
+		return -1;
+	}
+
+	for (uint32_t i = 0; i < state->chunks; i++)
+		if (state->bitmap[i / 8] & (1 << (i % 8)))
+			state->received++;
+
+	return 0;
+
+}
+
+static int csp_sfp_state_create(sfp_state_t * state, uint32_t id, uint32_t totalsize, uint32_t chunk) {
+
+	state->header.magic = SFP_STATE_MAGIC;
+	state->header.id = id;
+	state->header.totalsize = totalsize;
+	state->header.chunk = chunk;
+	if (csp_sfp_state_alloc(state) < 0)
+		return -1;
+
+	if (ftruncate(state->fd, 0) < 0)
+		return -1;
+	if (pwrite(state->fd, &state->header, sizeof(state->header), 0) != sizeof(state->header))
+		return -1;
+	ssize_t bytes = (state->chunks + 7) / 8;
+	if (pwrite(state->fd, state->bitmap, bytes, sizeof(state->header)) != bytes)
+		return -1;
+
+	return 0;
+
+}
+
+/* Check that a fragment belongs to the transfer of the saved state. Fragments
+ * are aligned to the chunk size, and as long as a chunk except the last one. */
+static bool csp_sfp_state_match(const sfp_state_t * state, uint32_t id, uint32_t totalsize, uint32_t offset, uint32_t length) {
+
+	if (state->header.id != id || state->header.totalsize != totalsize)
+		return false;
+	if (offset % state->header.chunk != 0)
+		return false;
+	if (length < totalsize - offset)
+		return length == state->header.chunk;
+	return length <= state->header.chunk;
+
+}
+
+/* Mark the chunks covered by a fragment, and save the changed part of the bitmap */
+static void csp_sfp_state_mark(sfp_state_t * state, uint32_t offset, uint32_t length) {
+
+	uint32_t first = (offset + state->header.chunk - 1) / state->header.chunk;
+	uint32_t last = (offset + length) / state->header.chunk;
+
+	/* The last chunk is shorter than the others */
+	if (offset + length >= state->header.totalsize)
+		last = state->chunks;
+
+	if (first >= last)
+		return;
+
+	for (uint32_t i = first; i < last; i++) {
+		if (!(state->bitmap[i / 8] & (1 << (i % 8)))) {
+			state->bitmap[i / 8] |= 1 << (i % 8);
+			state->received++;
+		}
+	}
+
+	uint32_t from = first / 8, to = (last - 1) / 8;
+	if (pwrite(state->fd, &state->bitmap[from], to - from + 1, sizeof(state->header) + from) < 0)
+		csp_log_warn("SFP failed to save state: %s", strerror(errno));
+
+}
+
+int csp_sfp_recv_file(csp_conn_t * conn, const char * path, uint32_t id, uint32_t timeout, csp_packet_t * first_packet) {
+
+	/* Incomplete until the last chunk is written */
+	int ret = CSP_ERR_TIMEDOUT;
+	sfp_state_t state = {.fd = -1, .bitmap = NULL};
+
+	char * state_path = csp_sfp_state_path(path);
+	if (state_path == NULL)
+		return CSP_ERR_NOMEM;
+
+	int fd = open(path, O_WRONLY | O_CREAT, 0644);
+	if (fd < 0) {
+		csp_log_error("SFP cannot open %s: %s", path, strerror(errno));
+		csp_free(state_path);
+		return CSP_ERR_DRIVER;
+	}
+
+	state.fd = open(state_path, O_RDWR | O_CREAT, 0644);
+	if (state.fd < 0) {
+		csp_log_error("SFP cannot open %s: %s", state_path, strerror(errno));
+		ret = CSP_ERR_DRIVER;
+		goto out;
+	}
+
+	bool loaded = (csp_sfp_state_load(&state) == 0);
+
+	/* Get first packet from user, or from connection */
+	csp_packet_t * packet = first_packet;
+	if (packet == NULL)
+		packet = csp_read(conn, timeout);
+
+	for (; packet != NULL; packet = csp_read(conn, timeout)) {
+
+		/* Check that SFP header is present */
+		if ((packet->id.flags & CSP_FFRAG) == 0 || packet->length < sizeof(sfp_header_t)) {
+			csp_log_error("Missing SFP header");
+			csp_buffer_free(packet);
+			ret = CSP_ERR_INVAL;
+			break;
+		}
+
+		/* Read SFP header */
+		sfp_header_t * sfp_header = csp_sfp_header_remove(packet);
+		uint32_t offset = csp_ntoh32(sfp_header->offset);
+		uint32_t totalsize = csp_ntoh32(sfp_header->totalsize);
+
+		csp_log_protocol("SFP fragment %u/%u", offset + packet->length, totalsize);
+
+		/* Checked without adding to the offset, which could wrap */
+		if (totalsize == 0 || offset > totalsize || packet->length > totalsize - offset) {
+			csp_log_error("SFP fragment outside transfer");
+			csp_buffer_free(packet);
+			ret = CSP_ERR_INVAL;
+			break;
+		}
+
+		if (totalsize > CSP_SFP_FILE_MAX) {
+			csp_log_error("SFP transfer of %u bytes is too large", totalsize);
+			csp_buffer_free(packet);
+			ret = CSP_ERR_INVAL;
+			break;
+		}
+
+		/* Start new state, unless a previous pass of this transfer was saved */
+		uint32_t length = packet->length;
+		if (loaded && !csp_sfp_state_match(&state, id, totalsize, offset, length)) {
+			csp_log_warn("SFP state of %s is for another transfer, restarting transfer", path);
+			csp_free(state.bitmap);
+			state.bitmap = NULL;
+			loaded = false;
+		}
+		bool final = (length >= totalsize - offset);
+		if (!loaded) {
+			/* The chunk size is taken from a full fragment. A short final
+			 * fragment received first is not recorded, and is sent again
+			 * as part of the missing ranges. */
+			if (final && offset > 0) {
+				csp_buffer_free(packet);
+				continue;
+			}
+			uint32_t chunk = final ? totalsize : length;
+			if (chunk == 0 || csp_sfp_state_create(&state, id, totalsize, chunk) < 0) {
+				csp_log_error("SFP cannot create state for %s", path);
+				csp_buffer_free(packet);
+				ret = CSP_ERR_NOMEM;
+				break;
+			}
+			loaded = true;
+		}
+
+		/* Write data at its offset, in any order */
+		if (pwrite(fd, packet->data, length, offset) != (ssize_t) length) {
+			csp_log_error("SFP write to %s failed: %s", path, strerror(errno));
+			csp_buffer_free(packet);
+			ret = CSP_ERR_DRIVER;
+			break;
+		}
+		csp_buffer_free(packet);
+
+		csp_sfp_state_mark(&state, offset, length);
+
+		if (state.received == state.chunks) {
+			csp_log_protocol("SFP complete");
+			ret = CSP_ERR_NONE;
+			break;
+		}
+
+	}
+
+out:
+	if (ret == CSP_ERR_NONE && ftruncate(fd, state.header.totalsize) < 0)
+		ret = CSP_ERR_DRIVER;
+	close(fd);
+	if (state.fd >= 0)
+		close(state.fd);
+	if (ret == CSP_ERR_NONE)
+		unlink(state_path);
+	csp_free(state.bitmap);
+	csp_free(state_path);
+	return ret;
+
+}
+
+int csp_sfp_file_missing(const char * path, uint32_t * id, uint32_t * totalsize, csp_sfp_range_t * ranges, int max_ranges) {
+
+	int count = -1;
+	sfp_state_t state = {.fd = -1, .bitmap = NULL};
+
+	char * state_path = csp_sfp_state_path(path);
+	if (state_path == NULL)
+		return -1;
+
+	state.fd = open(state_path, O_RDONLY);
+	if (state.fd < 0 || csp_sfp_state_load(&state) < 0)
+		goto out;
+
+	if (id)
+		*id = state.header.id;
+	if (totalsize)
+		*totalsize = state.header.totalsize;
+
+	/* Merge missing chunks into ranges */
+	count = 0;
+	for (uint32_t i = 0; i < state.chunks && count < max_ranges; i++) {
+		if (state.bitmap[i / 8] & (1 << (i % 8)))
+			continue;
+		uint32_t offset = i * state.header.chunk;
+		uint32_t length = state.header.chunk;
+		if (offset + length > state.header.totalsize)
+			length = state.header.totalsize - offset;
+		if (count > 0 && ranges[count - 1].offset + ranges[count - 1].length == offset) {
+			ranges[count - 1].length += length;
+		} else {
+			ranges[count].offset = offset;
+			ranges[count].length = length;
+			count++;
+		}
+	}
+
+out:
+	if (state.fd >= 0)
+		close(state.fd);
+	csp_free(state.bitmap);
+	csp_free(state_path);
+	return count;
+
+}
+
+#endif
@@ -0,0 +1,327 @@
+/*
+Cubesat Space Protocol - A small network-layer protocol designed for Cubesats
+Copyright (C) 2012 GomSpace ApS (http://www.gomspace.com)
+Copyright (C) 2012 AAUSAT3 Project (http://aausat3.space.aau.dk)
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <csp/csp.h>
+#include <csp/csp_error.h>
+#include <csp/arch/csp_semaphore.h>
+#include <csp/arch/csp_time.h>
+
+#include "csp_qfifo.h"
+#include "csp_timer.h"
+
+/* Hierarchical timer wheel with a resolution of 1 ms. The first level has a
+ * slot per ms for the next 256 ms, the second and third levels have 64 slots
+ * of 256 ms and 16384 ms each. Timers are moved down a level when the slot
+ * below wraps, so only slots that hold timers are ever touched. Timers more
+ * than TV_MAX ms away are parked in the last level and re-sorted later. */
+#define TV1_BITS	8
+#define TVN_BITS	6
+#define TV1_SIZE	(1 << TV1_BITS)
+#define TVN_SIZE	(1 << TVN_BITS)
+#define TV1_MASK	(TV1_SIZE - 1)
+#define TVN_MASK	(TVN_SIZE - 1)
+#define TV_MAX		(1UL << (TV1_BITS + 2 * TVN_BITS))
+
+static csp_timer_t * tv1[TV1_SIZE];
+static csp_timer_t * tv2[TVN_SIZE];
+static csp_timer_t * tv3[TVN_SIZE];
+
+/* Expired timers waiting for their callback */
+static csp_timer_t * run_list;
+
+/* Bitmaps of occupied slots */
+static uint32_t tv1_map[TV1_SIZE / 32];
+static uint64_t tv2_map;
+static uint64_t tv3_map;
+
+/* Next tick to process */
+static uint32_t wheel_time;
+
+/* The router is waiting for packets until wheel_deadline */
+static int wheel_sleeping;
+static uint32_t wheel_deadline;
+
+static csp_bin_sem_handle_t timer_lock;
+
+static inline int csp_timer_before(uint32_t time, uint32_t cmp) {
+	return (int32_t)(time - cmp) < 0;
+}
+
+static void csp_timer_link(csp_timer_t ** slot, csp_timer_t * timer) {
+
+	timer->next = *slot;
+	if (timer->next)
+		timer->next->pprev = &timer->next;
+	timer->pprev = slot;
+	*slot = timer;
+
+}
+
+static void csp_timer_unlink(csp_timer_t * timer) {
+
+	csp_timer_t ** pprev = timer->pprev;
+
+	*pprev = timer->next;
+	if (timer->next)
+		timer->next->pprev = pprev;
+	timer->next = NULL;
+	timer->pprev = NULL;
+
+	/* Clear bitmap if the wheel slot is now empty */
+	if (*pprev != NULL)
+		return;
+
+	if (pprev >= &tv1[0] && pprev < &tv1[TV1_SIZE]) {
+		unsigned int i = pprev - tv1;
+		tv1_map[i / 32] &= ~((uint32_t) 1 << (i % 32));
+	} else if (pprev >= &tv2[0] && pprev < &tv2[TVN_SIZE]) {
+		tv2_map &= ~((uint64_t) 1 << (pprev - tv2));
+	} else if (pprev >= &tv3[0] && pprev < &tv3[TVN_SIZE]) {
+		tv3_map &= ~((uint64_t) 1 << (pprev - tv3));
+	}
+
+}
+
+static void csp_timer_add(csp_timer_t * timer) {
+
+	uint32_t expires = timer->expires;
+	uint32_t delta = expires - wheel_time;
+	unsigned int i;
+
+	if ((int32_t) delta < 0) {
+		/* Already expired, run on next tick */
+		i = wheel_time & TV1_MASK;
+		tv1_map[i / 32] |= (uint32_t) 1 << (i % 32);
+		csp_timer_link(&tv1[i], timer);
+	} else if (delta < TV1_SIZE) {
+		i = expires & TV1_MASK;
+		tv1_map[i / 32] |= (uint32_t) 1 << (i % 32);
+		csp_timer_link(&tv1[i], timer);
+	} else if (delta < (1UL << (TV1_BITS + TVN_BITS))) {
+		i = (expires >> TV1_BITS) & TVN_MASK;
+		tv2_map |= (uint64_t) 1 << i;
+		csp_timer_link(&tv2[i], timer);
+	} else {
+		if (delta >= TV_MAX)
+			expires = wheel_time + TV_MAX - 1;
+		i = (expires >> (TV1_BITS + TVN_BITS)) & TVN_MASK;
+		tv3_map |= (uint64_t) 1 << i;
+		csp_timer_link(&tv3[i], timer);
+	}
+
+}
+
+static unsigned int csp_timer_cascade(csp_timer_t ** tv, uint64_t * map, unsigned int index) {
+
+	csp_timer_t * timer = tv[index];
+	csp_timer_t * next;
+
+	tv[index] = NULL;
+	*map &= ~((uint64_t) 1 << index);
+
+	while (timer != NULL) {
+		next = timer->next;
+		csp_timer_add(timer);
+		timer = next;
+	}
+
+	return index;
+
+}
+
+/* Number of ticks from wheel_time to the next tick with work, UINT32_MAX if the wheel is empty */
+static uint32_t csp_timer_ticks(void) {
+
+	unsigned int idx = wheel_time & TV1_MASK;
+	unsigned int word = idx / 32;
+	uint32_t bits = tv1_map[word] & (UINT32_MAX << (idx % 32));
+	int other = (tv2_map | tv3_map) != 0;
+
+	while (1) {
+		if (bits)
+			return word * 32 + __builtin_ctzl((unsigned long) bits) - idx;
+		if (++word == TV1_SIZE / 32)
+			break;
+		bits = tv1_map[word];
+	}
+
+	/* Slots before idx belong to the next round of the first level */
+	for (word = 0; word <= idx / 32 && !other; word++)
+		other = tv1_map[word] != 0;
+
+	if (!other)
+		return UINT32_MAX;
+
+	/* Next wrap of the first level */
+	return (TV1_SIZE - idx) & TV1_MASK;
+
+}
+
+int csp_timer_init(void) {
+
+	if (csp_bin_sem_create(&timer_lock) != CSP_SEMAPHORE_OK) {
+		csp_log_error("No more memory for timer semaphore");
+		return CSP_ERR_NOMEM;
+	}
+
+	wheel_time = csp_get_ms();
+
+	return CSP_ERR_NONE;
+
+}
+
+void csp_timer_setup(csp_timer_t * timer, csp_timer_callback_t callback, void * arg) {
+
+	timer->next = NULL;
+	timer->pprev = NULL;
+	timer->expires = 0;
+	timer->callback = callback;
+	timer->arg = arg;
+
+}
+
+void csp_timer_set(csp_timer_t * timer, uint32_t expires) {
+
+	int wake = 0;
+
+	if (csp_bin_sem_wait(&timer_lock, CSP_MAX_DELAY) != CSP_SEMAPHORE_OK)
+		return;
+
+	if (timer->pprev != NULL)
+		csp_timer_unlink(timer);
+
+	timer->expires = expires;
+	csp_timer_add(timer);
+
+	/* Wake the router if it sleeps past the new expiry time */
+	if (wheel_sleeping && csp_timer_before(expires, wheel_deadline)) {
+		wheel_deadline = expires;
+		wake = 1;
+	}
+
+	csp_bin_sem_post(&timer_lock);
+
+	if (wake)
+		csp_qfifo_wake_up();
+
+}
+
+void csp_timer_cancel(csp_timer_t * timer) {
+
+	if (csp_bin_sem_wait(&timer_lock, CSP_MAX_DELAY) != CSP_SEMAPHORE_OK)
+		return;
+
+	if (timer->pprev != NULL)
+		csp_timer_unlink(timer);
+
+	csp_bin_sem_post(&timer_lock);
+
+}
+
+int csp_timer_pending(csp_timer_t * timer) {
+
+	return timer->pprev != NULL;
+
+}
+
+void csp_timer_run(void) {
+
+	csp_timer_t * timer;
+	csp_timer_callback_t callback;
+	void * arg;
+	uint32_t now = csp_get_ms();
+	uint32_t ticks;
+	unsigned int idx;
+
+	if (csp_bin_sem_wait(&timer_lock, CSP_MAX_DELAY) != CSP_SEMAPHORE_OK)
+		return;
+
+	wheel_sleeping = 0;
+
+	while (!csp_timer_before(now, wheel_time)) {
+
+		/* Skip ticks without work */
+		ticks = csp_timer_ticks();
+		if (ticks > now - wheel_time) {
+			wheel_time = now + 1;
+			break;
+		}
+		wheel_time += ticks;
+
+		/* Cascade upper levels when the first level wraps */
+		idx = wheel_time & TV1_MASK;
+		if (idx == 0 && csp_timer_cascade(tv2, &tv2_map, (wheel_time >> TV1_BITS) & TVN_MASK) == 0)
+			csp_timer_cascade(tv3, &tv3_map, (wheel_time >> (TV1_BITS + TVN_BITS)) & TVN_MASK);
+
+		/* Move expired timers to run list */
+		while ((timer = tv1[idx]) != NULL) {
+			csp_timer_unlink(timer);
+			csp_timer_link(&run_list, timer);
+		}
+
+		wheel_time++;
+	}
+
+	/* Callbacks are called without the lock held, so they can set and cancel timers */
+	while ((timer = run_list) != NULL) {
+		csp_timer_unlink(timer);
+		callback = timer->callback;
+		arg = timer->arg;
+		csp_bin_sem_post(&timer_lock);
+
+		callback(arg);
+
+		if (csp_bin_sem_wait(&timer_lock, CSP_MAX_DELAY) != CSP_SEMAPHORE_OK)
+			return;
+	}
+
+	csp_bin_sem_post(&timer_lock);
+
+}
+
+uint32_t csp_timer_next(void) {
+
+	uint32_t ticks, expires, now, timeout;
+
+	if (csp_bin_sem_wait(&timer_lock, CSP_MAX_DELAY) != CSP_SEMAPHORE_OK)
+		return 0;
+
+	now = csp_get_ms();
+	ticks = csp_timer_ticks();
+
+	if (ticks == UINT32_MAX) {
+		timeout = CSP_MAX_DELAY;
+		wheel_deadline = now + INT32_MAX;
+	} else {
+		expires = wheel_time + ticks;
+		timeout = csp_timer_before(now, expires) ? expires - now : 0;
+		wheel_deadline = expires;
+	}
+
+	wheel_sleeping = 1;
+
+	csp_bin_sem_post(&timer_lock);
+
+	return timeout;
+
+}
@@ -0,0 +1,87 @@
+/*
+Cubesat Space Protocol - A small network-layer protocol designed for Cubesats
+Copyright (C) 2012 GomSpace ApS (http://www.gomspace.com)
+Copyright (C) 2012 AAUSAT3 Project (http://aausat3.space.aau.dk)
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#ifndef CSP_TIMER_H_
+#define CSP_TIMER_H_
+
+#include <stdint.h>
+
+/**
+ * Timer callback, called from the router task when the timer expires
+ * @param arg argument given to csp_timer_setup
+ */
+typedef void (*csp_timer_callback_t)(void * arg);
+
+/** @brief Timer, embed in the structure owning it */
+typedef struct csp_timer_s {
+	struct csp_timer_s * next;	/**< Next timer in wheel slot */
+	struct csp_timer_s ** pprev;	/**< Link pointing to this timer, NULL if not pending */
+	uint32_t expires;		/**< Expiry time in ms (csp_get_ms) */
+	csp_timer_callback_t callback;	/**< Function to call on expiry */
+	void * arg;			/**< Argument for callback */
+} csp_timer_t;
+
+/**
+ * Init timer wheel
+ * @return CSP_ERR type
+ */
+int csp_timer_init(void);
+
+/**
+ * Prepare a timer for use
+ * @param timer pointer to timer
+ * @param callback function to call on expiry
+ * @param arg argument for callback
+ */
+void csp_timer_setup(csp_timer_t * timer, csp_timer_callback_t callback, void * arg);
+
+/**
+ * Start or restart a timer. A pending timer is moved to the new expiry time.
+ * @param timer pointer to timer
+ * @param expires absolute expiry time in ms (csp_get_ms)
+ */
+void csp_timer_set(csp_timer_t * timer, uint32_t expires);
+
+/**
+ * Stop a timer. Does nothing if the timer is not pending.
+ * @param timer pointer to timer
+ */
+void csp_timer_cancel(csp_timer_t * timer);
+
+/**
+ * Check if timer is pending
+ * @param timer pointer to timer
+ * @return 1 if pending, 0 otherwise
+ */
+int csp_timer_pending(csp_timer_t * timer);
+
+/**
+ * Call the callback of all expired timers. Must be called from the router task.
+ */
+void csp_timer_run(void);
+
+/**
+ * Get time until the next timer expires. The router sleeps at most this long,
+ * and is woken up if an earlier timer is set while it sleeps.
+ * @return time in ms, or CSP_MAX_DELAY if no timers are pending
+ */
+uint32_t csp_timer_next(void);
+
+#endif /* CSP_TIMER_H_ */
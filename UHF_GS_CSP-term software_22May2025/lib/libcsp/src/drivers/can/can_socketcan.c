@@ -20,6 +20,9 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
 
 /* SocketCAN driver */
 
+/* recvmmsg and sendmmsg */
+#define _GNU_SOURCE
+
 #include <stdint.h>
 #include <stdio.h>
 
@@ -58,72 +61,150 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
 
 static int can_socket; /** SocketCAN socket handle */
 
+/* Number of frames read or written per system call */
+#define SOCKETCAN_BATCH		32
+
+#ifdef CSP_CAN_FD
+typedef struct canfd_frame socketcan_frame_t;
+#else
+typedef struct can_frame socketcan_frame_t;
+#endif
+
 static void * socketcan_rx_thread(void * parameters)
 {
-	struct can_frame frame;
-	int nbytes;
+	socketcan_frame_t frames[SOCKETCAN_BATCH];
+	struct iovec iov[SOCKETCAN_BATCH];
+	struct mmsghdr msgs[SOCKETCAN_BATCH];
+	int i, count;
+
+	memset(msgs, 0, sizeof(msgs));
+	for (i = 0; i < SOCKETCAN_BATCH; i++) {
+		iov[i].iov_base = &frames[i];
+		iov[i].iov_len = sizeof(frames[i]);
+		msgs[i].msg_hdr.msg_iov = &iov[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+	}
 
 	while (1) {
-		/* Read CAN frame */
-		nbytes = read(can_socket, &frame, sizeof(frame));
-		if (nbytes < 0) {
-			csp_log_error("read: %s", strerror(errno));
+		/* Read the frames that are available, waiting for the first */
+		count = recvmmsg(can_socket, msgs, SOCKETCAN_BATCH, MSG_WAITFORONE, NULL);
+		if (count < 0) {
+			if (errno != EINTR)
+				csp_log_error("recvmmsg: %s", strerror(errno));
 			continue;
 		}
 
-		if (nbytes != sizeof(frame)) {
-			csp_log_warn("Read incomplete CAN frame");
-			continue;
-		}
+		for (i = 0; i < count; i++) {
+			socketcan_frame_t * frame = &frames[i];
 
-		/* Frame type */
-		if (frame.can_id & (CAN_ERR_FLAG | CAN_RTR_FLAG) || !(frame.can_id & CAN_EFF_FLAG)) {
-			/* Drop error and remote frames */
-			csp_log_warn("Discarding ERR/RTR/SFF frame");
-			continue;
+#ifdef CSP_CAN_FD
+			if (msgs[i].msg_len != CAN_MTU && msgs[i].msg_len != CANFD_MTU) {
+#else
+			if (msgs[i].msg_len != CAN_MTU) {
+#endif
+				csp_log_warn("Read incomplete CAN frame");
+				continue;
+			}
+
+			/* Frame type */
+			if (frame->can_id & (CAN_ERR_FLAG | CAN_RTR_FLAG) || !(frame->can_id & CAN_EFF_FLAG)) {
+				/* Drop error and remote frames */
+				csp_log_warn("Discarding ERR/RTR/SFF frame");
+				continue;
+			}
+
+			/* Strip flags */
+			frame->can_id &= CAN_EFF_MASK;
+
+			/* Call RX callback */
+			csp_can_rx_frame((can_frame_t *)frame, NULL);
 		}
-
-		/* Strip flags */
-		frame.can_id &= CAN_EFF_MASK;
-
-		/* Call RX callback */
-		csp_can_rx_frame((can_frame_t *)&frame, NULL);
 	}
 
 	/* We should never reach this point */
 	pthread_exit(NULL);
 }
 
-int can_send(can_id_t id, uint8_t data[], uint8_t dlc)
+#ifdef CSP_CAN_FD
+/* Round a length up to a valid CAN FD frame length */
+static uint8_t socketcan_fd_len(uint8_t len)
 {
-	struct can_frame frame;
-	int i, tries = 0;
+	static const uint8_t lengths[] = {12, 16, 20, 24, 32, 48, 64};
+	unsigned int i;
 
-	if (dlc > 8)
-		return -1;
+	if (len <= 8)
+		return len;
 
-	/* Copy identifier */
-	frame.can_id = id | CAN_EFF_FLAG;
+	for (i = 0; i < sizeof(lengths) - 1; i++)
+		if (len <= lengths[i])
+			break;
 
-	/* Copy data to frame */
-	for (i = 0; i < dlc; i++)
-		frame.data[i] = data[i];
+	return lengths[i];
+}
+#endif
 
-	/* Set DLC */
-	frame.can_dlc = dlc;
+int can_send_batch(can_frame_t * frames, int count)
+{
+	socketcan_frame_t out[SOCKETCAN_BATCH];
+	struct iovec iov[SOCKETCAN_BATCH];
+	struct mmsghdr msgs[SOCKETCAN_BATCH];
+	int i, n, ret, sent = 0, tries = 0;
+
+	while (sent < count) {
+		n = (count - sent < SOCKETCAN_BATCH) ? count - sent : SOCKETCAN_BATCH;
+
+		memset(msgs, 0, n * sizeof(msgs[0]));
+		for (i = 0; i < n; i++) {
+			can_frame_t * frame = &frames[sent + i];
+			if (frame->dlc > CAN_FRAME_DATA_MAX)
+				return sent;
+
+			memset(&out[i], 0, sizeof(out[i]));
+			out[i].can_id = frame->id | CAN_EFF_FLAG;
+			memcpy(out[i].data, frame->data, frame->dlc);
+#ifdef CSP_CAN_FD
+			/* Padded to a valid length, the receiver knows the packet length */
+			out[i].len = socketcan_fd_len(frame->dlc);
+			out[i].flags = CANFD_BRS;
+			iov[i].iov_len = CANFD_MTU;
+#else
+			out[i].can_dlc = frame->dlc;
+			iov[i].iov_len = CAN_MTU;
+#endif
+			iov[i].iov_base = &out[i];
+			msgs[i].msg_hdr.msg_iov = &iov[i];
+			msgs[i].msg_hdr.msg_iovlen = 1;
+		}
 
-	/* Send frame */
-	while (write(can_socket, &frame, sizeof(frame)) != sizeof(frame)) {
-		if (++tries < 1000 && errno == ENOBUFS) {
-			/* Wait 10 ms and try again */
-			usleep(10000);
+		/* Send frames, retrying while the transmit queue is full */
+		ret = sendmmsg(can_socket, msgs, n, 0);
+		if (ret > 0) {
+			sent += ret;
+			tries = 0;
+		} else if (ret < 0 && errno == ENOBUFS && ++tries < 10000) {
+			/* Wait 1 ms and try again */
+			usleep(1000);
 		} else {
-			csp_log_error("write: %s", strerror(errno));
+			csp_log_error("sendmmsg: %s", strerror(errno));
 			break;
 		}
 	}
 
-	return 0;
+	return sent;
+}
+
+int can_send(can_id_t id, uint8_t data[], uint8_t dlc)
+{
+	can_frame_t frame;
+
+	if (dlc > CAN_FRAME_DATA_MAX)
+		return -1;
+
+	frame.id = id;
+	frame.dlc = dlc;
+	memcpy(frame.data, data, dlc);
+
+	return (can_send_batch(&frame, 1) == 1) ? 0 : -1;
 }
 
 int can_init(uint32_t id, uint32_t mask, struct csp_can_config *conf)
@@ -156,6 +237,15 @@ int can_init(uint32_t id, uint32_t mask, struct csp_can_config *conf)
 		return -1;
 	}
 
+#ifdef CSP_CAN_FD
+	/* Enable CAN FD frames */
+	int enable_fd = 1;
+	if (setsockopt(can_socket, SOL_CAN_RAW, CAN_RAW_FD_FRAMES, &enable_fd, sizeof(enable_fd)) < 0) {
+		csp_log_error("CAN FD not supported: %s", strerror(errno));
+		return -1;
+	}
+#endif
+
 	/* Bind the socket to CAN interface */
 	addr.can_family = AF_CAN;
 	addr.can_ifindex = ifr.ifr_ifindex;
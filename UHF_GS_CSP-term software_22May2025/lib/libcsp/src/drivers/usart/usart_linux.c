@@ -29,14 +29,46 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
 #include <errno.h>
 #include <termios.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+#ifdef __linux__
+#include <linux/serial.h>
+#endif
 
 #include <csp/csp.h>
 #include <sys/time.h>
 
+/** Maximum number of open serial devices */
+#define USART_MAX_HANDLES	8
+/** Size of the receive buffer of a device */
+#define USART_RX_BUF_SIZE	4096
+/** Interval between attempts to reopen a lost device in ms */
+#define USART_REOPEN_MS		1000
+
+struct usart_handle_s {
+	char * device;			/**< Device path */
+	uint32_t baudrate;		/**< Baud rate */
+	int fd;				/**< File descriptor, -1 while the device is closed */
+	int lost;			/**< Set by the serial thread when the device fails */
+	pthread_mutex_t lock;		/**< Serialises writes and protects fd against reopen */
+	usart_rx_callback_t callback;	/**< Receive callback */
+	void * user;			/**< User pointer passed to the callback */
+	uint8_t rxbuf[USART_RX_BUF_SIZE];
+};
+
 int usart_stdio_id = 0;
-int fd;
 usart_callback_t usart_callback = NULL;
 
+/* Devices served by the serial thread */
+static pthread_mutex_t usart_lock = PTHREAD_MUTEX_INITIALIZER;
+static usart_handle_t * usart_handles[USART_MAX_HANDLES];
+static int usart_count = 0;
+static int usart_wakeup[2] = {-1, -1};
+static pthread_t usart_thread;
+
+/* Device used by the single device API */
+static usart_handle_t * usart_default = NULL;
+
 static void *serial_rx_thread(void *vptr_args);
 
 int getbaud(int fd) {
@@ -130,20 +162,17 @@ int getbaud(int fd) {
 
 }
 
-void usart_init(struct usart_conf * conf) {
+/* Open and configure the device of a handle, returns the file descriptor or -1 */
+static int usart_open_fd(usart_handle_t * handle) {
 
 	struct termios options;
-	pthread_t rx_thread;
 
-	fd = open(conf->device, O_RDWR | O_NOCTTY | O_NONBLOCK);
-
-	if (fd < 0) {
-		printf("Failed to open %s: %s\r\n", conf->device, strerror(errno));
-		return;
-	}
+	int fd = open(handle->device, O_RDWR | O_NOCTTY | O_NONBLOCK);
+	if (fd < 0)
+		return -1;
 
 	int brate = 0;
-    switch(conf->baudrate) {
+    switch(handle->baudrate) {
     case 4800:    brate=B4800;    break;
     case 9600:    brate=B9600;    break;
     case 19200:   brate=B19200;   break;
@@ -180,13 +209,161 @@ void usart_init(struct usart_conf * conf) {
 		perror("error setting options");
 	fcntl(fd, F_SETFL, 0);
 
+#ifdef ASYNC_LOW_LATENCY
+	/* Ask USB serial adapters to pass on data without their usual delay,
+	 * devices that do not support it are left as they are */
+	struct serial_struct serial;
+	if (ioctl(fd, TIOCGSERIAL, &serial) == 0) {
+		serial.flags |= ASYNC_LOW_LATENCY;
+		ioctl(fd, TIOCSSERIAL, &serial);
+	}
+#endif
+
 	/* Flush old transmissions */
 	if (tcflush(fd, TCIOFLUSH) == -1)
 		printf("Error flushing serial port - %s(%d).\n", strerror(errno), errno);
 
-	if (pthread_create(&rx_thread, NULL, serial_rx_thread, NULL) != 0)
+	return fd;
+
+}
+
+/* Mark a device that has failed. The write lock is not taken here, since a
+ * writer may hold it while blocked on the device, the serial thread closes
+ * and reopens the device once the writer has let go. */
+static void usart_lost(usart_handle_t * handle, int err) {
+
+	if (__atomic_load_n(&handle->lost, __ATOMIC_RELAXED))
+		return;
+
+	printf("Lost %s: %s, reopening\r\n", handle->device, err ? strerror(err) : "end of file");
+	__atomic_store_n(&handle->lost, 1, __ATOMIC_RELEASE);
+
+}
+
+/* Close and reopen a lost device, retried later if a writer still holds it */
+static void usart_reopen(usart_handle_t * handle) {
+
+	/* Close the old descriptor when no write is in progress */
+	if (handle->fd >= 0) {
+		if (pthread_mutex_trylock(&handle->lock) != 0)
+			return;
+		close(handle->fd);
+		handle->fd = -1;
+		pthread_mutex_unlock(&handle->lock);
+	}
+
+	int fd = usart_open_fd(handle);
+	if (fd < 0)
 		return;
 
+	/* Writers fail at once while fd is -1, so the lock is free shortly */
+	pthread_mutex_lock(&handle->lock);
+	handle->fd = fd;
+	__atomic_store_n(&handle->lost, 0, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&handle->lock);
+	printf("Reopened %s\r\n", handle->device);
+
+}
+
+usart_handle_t * usart_open(const struct usart_conf * conf, usart_rx_callback_t callback, void * user) {
+
+	if (conf == NULL || conf->device == NULL)
+		return NULL;
+
+	usart_handle_t * handle = calloc(1, sizeof(*handle));
+	if (handle == NULL)
+		return NULL;
+
+	handle->device = strdup(conf->device);
+	if (handle->device == NULL) {
+		free(handle);
+		return NULL;
+	}
+
+	handle->baudrate = conf->baudrate;
+	handle->callback = callback;
+	handle->user = user;
+	pthread_mutex_init(&handle->lock, NULL);
+
+	/* A device that is not present yet is opened when it appears */
+	handle->fd = usart_open_fd(handle);
+	if (handle->fd < 0) {
+		printf("Failed to open %s: %s, retrying\r\n", conf->device, strerror(errno));
+		handle->lost = 1;
+	}
+
+	pthread_mutex_lock(&usart_lock);
+
+	if (usart_count == USART_MAX_HANDLES) {
+		pthread_mutex_unlock(&usart_lock);
+		if (handle->fd >= 0)
+			close(handle->fd);
+		pthread_mutex_destroy(&handle->lock);
+		free(handle->device);
+		free(handle);
+		return NULL;
+	}
+
+	/* Start the serial thread with the first device */
+	if (usart_wakeup[0] < 0) {
+		if (pipe(usart_wakeup) != 0 || pthread_create(&usart_thread, NULL, serial_rx_thread, NULL) != 0) {
+			pthread_mutex_unlock(&usart_lock);
+			printf("Failed to start serial thread\r\n");
+			exit(1);
+		}
+	}
+
+	usart_handles[usart_count++] = handle;
+	pthread_mutex_unlock(&usart_lock);
+
+	/* Let the serial thread pick up the new device */
+	if (write(usart_wakeup[1], "", 1) != 1)
+		printf("Failed to wake serial thread\r\n");
+
+	return handle;
+
+}
+
+int usart_write(usart_handle_t * handle, const void * buf, int len) {
+
+	const uint8_t * data = buf;
+	int ret = len;
+
+	if (handle == NULL)
+		return -1;
+
+	pthread_mutex_lock(&handle->lock);
+
+	if (handle->fd < 0 || __atomic_load_n(&handle->lost, __ATOMIC_ACQUIRE)) {
+		pthread_mutex_unlock(&handle->lock);
+		return -1;
+	}
+
+	while (len > 0) {
+		ssize_t written = write(handle->fd, data, len);
+		if (written < 0) {
+			if (errno == EINTR)
+				continue;
+			ret = -1;
+			break;
+		}
+		data += written;
+		len -= written;
+	}
+
+	pthread_mutex_unlock(&handle->lock);
+
+	return ret;
+
+}
+
+static void usart_default_rx(uint8_t * buf, int len, void * user) {
+	if (usart_callback)
+		usart_callback(buf, len, NULL);
+}
+
+void usart_init(struct usart_conf * conf) {
+	usart_default = usart_open(conf, usart_default_rx, NULL);
 }
 
 void usart_set_callback(usart_callback_t callback) {
@@ -198,18 +375,18 @@ void usart_insert(char c, void * pxTaskWoken) {
 }
 
 void usart_putstr(char * buf, int len) {
-	if (write(fd, buf, len) != len)
-		return;
+	if (usart_default != NULL)
+		usart_write(usart_default, buf, len);
 }
 
 void usart_putc(char c) {
-	if (write(fd, &c, 1) != 1)
-		return;
+	if (usart_default != NULL)
+		usart_write(usart_default, &c, 1);
 }
 
 char usart_getc(void) {
 	char c;
-	if (read(fd, &c, 1) != 1) return 0;
+	if (usart_default == NULL || read(usart_default->fd, &c, 1) != 1) return 0;
 	return c;
 }
 
@@ -224,19 +401,83 @@ int usart_messages_waiting(int handle) {
   return (FD_ISSET(0, &fds));
 }
 
+/* Serve all open devices from one thread. Devices that fail, for example
+ * when a USB adapter is unplugged, are closed and reopened periodically. */
 static void *serial_rx_thread(void *vptr_args) {
-	unsigned int length;
-	uint8_t * cbuf = malloc(100000);
 
-	// Receive loop
+	struct pollfd fds[USART_MAX_HANDLES + 1];
+	usart_handle_t * handles[USART_MAX_HANDLES];
+	struct timespec now, next_reopen = {0, 0};
+
 	while (1) {
-		length = read(fd, cbuf, 300);
-		if (length <= 0) {
+
+		/* Poll the wakeup pipe and all devices that are open */
+		int count = 0, lost = 0;
+		fds[count].fd = usart_wakeup[0];
+		fds[count++].events = POLLIN;
+
+		pthread_mutex_lock(&usart_lock);
+		for (int i = 0; i < usart_count; i++) {
+			usart_handle_t * handle = usart_handles[i];
+			if (handle->lost) {
+				lost++;
+				continue;
+			}
+			handles[count - 1] = handle;
+			fds[count].fd = handle->fd;
+			fds[count++].events = POLLIN;
+		}
+		pthread_mutex_unlock(&usart_lock);
+
+		int ret = poll(fds, count, lost ? USART_REOPEN_MS : -1);
+		if (ret < 0 && errno != EINTR) {
 			perror("Error: ");
 			exit(1);
 		}
-		if (usart_callback)
-			usart_callback(cbuf, length, NULL);
+
+		if (fds[0].revents & POLLIN) {
+			char dummy[16];
+			if (read(usart_wakeup[0], dummy, sizeof(dummy)) < 0)
+				perror("Error: ");
+		}
+
+		for (int i = 1; ret > 0 && i < count; i++) {
+			usart_handle_t * handle = handles[i - 1];
+			if (fds[i].revents & POLLIN) {
+				ssize_t length = read(handle->fd, handle->rxbuf, sizeof(handle->rxbuf));
+				if (length > 0) {
+					if (handle->callback)
+						handle->callback(handle->rxbuf, length, handle->user);
+				} else if (length == 0) {
+					usart_lost(handle, 0);
+				} else if (errno != EINTR && errno != EAGAIN) {
+					usart_lost(handle, errno);
+				}
+			} else if (fds[i].revents & (POLLERR | POLLHUP | POLLNVAL)) {
+				usart_lost(handle, EIO);
+			}
+		}
+
+		/* Try to reopen lost devices, at most once per interval */
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		if (lost && (now.tv_sec > next_reopen.tv_sec ||
+				(now.tv_sec == next_reopen.tv_sec && now.tv_nsec >= next_reopen.tv_nsec))) {
+			next_reopen.tv_sec = now.tv_sec + USART_REOPEN_MS / 1000;
+			next_reopen.tv_nsec = now.tv_nsec + (USART_REOPEN_MS % 1000) * 1000000;
+			if (next_reopen.tv_nsec >= 1000000000) {
+				next_reopen.tv_sec++;
+				next_reopen.tv_nsec -= 1000000000;
+			}
+			pthread_mutex_lock(&usart_lock);
+			for (int i = 0; i < usart_count; i++) {
+				if (usart_handles[i]->lost)
+					usart_reopen(usart_handles[i]);
+			}
+			pthread_mutex_unlock(&usart_lock);
+		}
+
 	}
+
 	return NULL;
+
 }
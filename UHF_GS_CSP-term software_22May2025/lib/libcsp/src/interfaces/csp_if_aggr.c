@@ -0,0 +1,230 @@
+/*
+Cubesat Space Protocol - A small network-layer protocol designed for Cubesats
+Copyright (C) 2012 GomSpace ApS (http://www.gomspace.com)
+Copyright (C) 2012 AAUSAT3 Project (http://aausat3.space.aau.dk)
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#include <stdint.h>
+#include <string.h>
+
+#include <csp/csp.h>
+#include <csp/csp_endian.h>
+#include <csp/csp_interface.h>
+#include <csp/csp_rtable.h>
+#include <csp/interfaces/csp_if_aggr.h>
+#include <csp/arch/csp_malloc.h>
+#include <csp/arch/csp_semaphore.h>
+#include <csp/arch/csp_time.h>
+
+#include "../csp_timer.h"
+
+/**
+ * Frame format:
+ * The data of an aggregated frame is a sequence of packets, each stored as
+ * a 16 bit length and the 32 bit CSP identifier in network byte order,
+ * followed by the packet data. The frame has the identifier of its first
+ * packet, with only the CSP_FAGGR flag set.
+ */
+typedef struct __attribute__((__packed__)) {
+	uint16_t length;
+	uint32_t id;
+} aggr_entry_t;
+
+typedef struct {
+	csp_iface_t * lower;		/**< Interface frames are sent on */
+	uint16_t max_packet;		/**< Largest packet that is aggregated */
+	uint32_t latency;		/**< Longest time a packet is held back in ms */
+	csp_mutex_t lock;		/**< Protects the pending frame */
+	csp_packet_t * frame;		/**< Pending frame, NULL if none */
+	uint8_t nexthop;		/**< Next hop address of the pending frame */
+	csp_timer_t timer;		/**< Latency timer of the pending frame */
+} aggr_handle_t;
+
+/* Send the pending frame, the caller holds the lock */
+static int csp_aggr_send_frame(csp_iface_t * interface, aggr_handle_t * aggr) {
+
+	csp_packet_t * frame = aggr->frame;
+	if (frame == NULL)
+		return CSP_ERR_NONE;
+
+	aggr->frame = NULL;
+	csp_timer_cancel(&aggr->timer);
+
+	uint16_t bytes = frame->length;
+	if ((*aggr->lower->nexthop)(aggr->lower, frame, 0) != CSP_ERR_NONE) {
+		csp_buffer_free(frame);
+		aggr->lower->tx_error++;
+		return CSP_ERR_TX;
+	}
+
+	aggr->lower->tx++;
+	aggr->lower->txbytes += bytes;
+	return CSP_ERR_NONE;
+
+}
+
+static void csp_aggr_timeout(void * arg) {
+	csp_aggr_flush(arg);
+}
+
+static int csp_aggr_tx(csp_iface_t * interface, csp_packet_t * packet, uint32_t timeout) {
+
+	aggr_handle_t * aggr = interface->driver;
+	int ret = CSP_ERR_NONE;
+
+	if (csp_mutex_lock(&aggr->lock, timeout) != CSP_MUTEX_OK)
+		return CSP_ERR_TIMEDOUT;
+
+	/* Large packets go out as they are, after the pending frame */
+	if (packet->length > aggr->max_packet) {
+		csp_aggr_send_frame(interface, aggr);
+		uint16_t bytes = packet->length;
+		ret = (*aggr->lower->nexthop)(aggr->lower, packet, timeout);
+		if (ret == CSP_ERR_NONE) {
+			aggr->lower->tx++;
+			aggr->lower->txbytes += bytes;
+		}
+		csp_mutex_unlock(&aggr->lock);
+		return ret;
+	}
+
+	/* Frames only hold packets for one next hop */
+	uint8_t mac = csp_rtable_find_mac(packet->id.dst);
+	uint8_t nexthop = (mac != CSP_NODE_MAC) ? mac : packet->id.dst;
+
+	if (aggr->frame != NULL) {
+		unsigned int size = aggr->frame->length + sizeof(aggr_entry_t) + packet->length;
+		if (nexthop != aggr->nexthop || size > aggr->lower->mtu)
+			csp_aggr_send_frame(interface, aggr);
+	}
+
+	/* Start a new frame */
+	if (aggr->frame == NULL) {
+		aggr->frame = csp_buffer_get(aggr->lower->mtu);
+		if (aggr->frame == NULL) {
+			csp_mutex_unlock(&aggr->lock);
+			return CSP_ERR_NOBUFS;
+		}
+		aggr->frame->id.ext = packet->id.ext;
+		aggr->frame->id.flags = CSP_FAGGR;
+		aggr->frame->length = 0;
+		aggr->nexthop = nexthop;
+		csp_timer_set(&aggr->timer, csp_get_ms() + aggr->latency);
+	}
+
+	/* Append packet */
+	aggr_entry_t entry;
+	entry.length = csp_hton16(packet->length);
+	entry.id = csp_hton32(packet->id.ext);
+	memcpy(&aggr->frame->data[aggr->frame->length], &entry, sizeof(entry));
+	aggr->frame->length += sizeof(entry);
+	memcpy(&aggr->frame->data[aggr->frame->length], packet->data, packet->length);
+	aggr->frame->length += packet->length;
+	csp_buffer_free(packet);
+
+	/* Send when full or if packets are not held back */
+	if (aggr->latency == 0 || aggr->frame->length + sizeof(aggr_entry_t) >= aggr->lower->mtu)
+		csp_aggr_send_frame(interface, aggr);
+
+	csp_mutex_unlock(&aggr->lock);
+	return CSP_ERR_NONE;
+
+}
+
+void csp_aggr_flush(csp_iface_t * interface) {
+
+	aggr_handle_t * aggr = interface->driver;
+
+	if (csp_mutex_lock(&aggr->lock, CSP_MAX_DELAY) != CSP_MUTEX_OK)
+		return;
+
+	csp_aggr_send_frame(interface, aggr);
+	csp_mutex_unlock(&aggr->lock);
+
+}
+
+void csp_aggr_rx(csp_iface_t * interface, csp_packet_t * packet) {
+
+	unsigned int offset = 0;
+
+	while (offset + sizeof(aggr_entry_t) <= packet->length) {
+
+		aggr_entry_t entry;
+		memcpy(&entry, &packet->data[offset], sizeof(entry));
+		offset += sizeof(entry);
+
+		uint16_t length = csp_ntoh16(entry.length);
+		if (offset + length > packet->length) {
+			csp_log_warn("Truncated packet in aggregated frame");
+			interface->frame++;
+			break;
+		}
+
+		csp_packet_t * inner = csp_buffer_get(length);
+		if (inner == NULL) {
+			interface->drop++;
+			offset += length;
+			continue;
+		}
+
+		inner->id.ext = csp_ntoh32(entry.id);
+		inner->length = length;
+		memcpy(inner->data, &packet->data[offset], length);
+		offset += length;
+
+		csp_qfifo_write(inner, interface, NULL);
+
+	}
+
+	csp_buffer_free(packet);
+
+}
+
+int csp_aggr_init(csp_iface_t * interface, const char * name, csp_iface_t * lower, uint16_t max_packet, uint32_t latency) {
+
+	if (interface == NULL || lower == NULL || lower->nexthop == NULL || lower->mtu <= sizeof(aggr_entry_t))
+		return CSP_ERR_INVAL;
+
+	aggr_handle_t * aggr = csp_malloc(sizeof(*aggr));
+	if (aggr == NULL)
+		return CSP_ERR_NOMEM;
+
+	if (csp_mutex_create(&aggr->lock) != CSP_MUTEX_OK) {
+		csp_free(aggr);
+		return CSP_ERR_NOMEM;
+	}
+
+	/* A packet must fit in a frame with its entry header */
+	if (max_packet > lower->mtu - sizeof(aggr_entry_t))
+		max_packet = lower->mtu - sizeof(aggr_entry_t);
+
+	aggr->lower = lower;
+	aggr->max_packet = max_packet;
+	aggr->latency = latency;
+	aggr->frame = NULL;
+	csp_timer_setup(&aggr->timer, csp_aggr_timeout, interface);
+
+	interface->driver = aggr;
+	interface->name = name;
+	interface->mtu = lower->mtu;
+	interface->nexthop = csp_aggr_tx;
+
+	csp_iflist_add(interface);
+
+	return CSP_ERR_NONE;
+
+}
@@ -90,12 +90,27 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
 /* Maximum number of frames in RX queue */
 #define CSP_CAN_RX_QUEUE_SIZE	100
 
+/* Maximum number of frames processed per wakeup of the RX task */
+#define CSP_CAN_RX_BATCH	32
+
+/* Data bytes per CAN frame, 64 with CAN FD */
+#define CFP_FRAME_DATA		CAN_FRAME_DATA_MAX
+
+/* Frames passed to the driver at once, enough for a packet of the full MTU */
+#define CSP_CAN_TX_BATCH	((CSP_CAN_MTU + sizeof(csp_id_t) + sizeof(uint16_t) + CFP_FRAME_DATA - 1) / CFP_FRAME_DATA)
+
 /* Number of packet buffer elements */
 #define PBUF_ELEMENTS		CSP_CONN_MAX
 
+/* Number of hash buckets for packet buffer lookup, must be a power of two */
+#define PBUF_HASH_SIZE		32
+
 /* Buffer element timeout in ms */
 #define PBUF_TIMEOUT_MS		10000
 
+/* Interval between checks for timed out buffer elements in ms */
+#define PBUF_CLEANUP_MS		1000
+
 /* CFP Frame Types */
 enum cfp_frame_t {
 	CFP_BEGIN = 0,
@@ -153,16 +168,31 @@ typedef struct {
 	csp_packet_t *packet;		/* Pointer to packet buffer */
 	csp_can_pbuf_state_t state;	/* Element state */
 	uint32_t last_used;		/* Timestamp in ms for last use of buffer */
+	int16_t next;			/* Next element in hash chain or free list, -1 if last */
 } csp_can_pbuf_element_t;
 
 static csp_can_pbuf_element_t csp_can_pbuf[PBUF_ELEMENTS];
 
+/* Used elements are chained by the hash of their connection, free elements in a list */
+static int16_t csp_can_pbuf_hash[PBUF_HASH_SIZE];
+static int16_t csp_can_pbuf_free_list;
+
+static inline unsigned int csp_can_pbuf_bucket(uint32_t id)
+{
+	/* Fold the source and destination onto the incrementing CFP identifier */
+	uint32_t key = id & CFP_ID_CONN_MASK;
+	return (key ^ (key >> CFP_ID_SIZE) ^ (key >> (CFP_ID_SIZE + CFP_REMAIN_SIZE + CFP_TYPE_SIZE))) & (PBUF_HASH_SIZE - 1);
+}
+
 static int csp_can_pbuf_init(void)
 {
 	/* Initialize packet buffers */
 	int i;
 	csp_can_pbuf_element_t *buf;
 
+	for (i = 0; i < PBUF_HASH_SIZE; i++)
+		csp_can_pbuf_hash[i] = -1;
+
 	for (i = 0; i < PBUF_ELEMENTS; i++) {
 		buf = &csp_can_pbuf[i];
 		buf->rx_count = 0;
@@ -171,22 +201,29 @@ static int csp_can_pbuf_init(void)
 		buf->state = BUF_FREE;
 		buf->last_used = 0;
 		buf->remain = 0;
+		buf->next = (i + 1 < PBUF_ELEMENTS) ? i + 1 : -1;
 	}
 
-	return CSP_ERR_NONE;
-}
+	csp_can_pbuf_free_list = 0;
 
-static void csp_can_pbuf_timestamp(csp_can_pbuf_element_t *buf)
-{
-	buf->last_used = csp_get_ms();
+	return CSP_ERR_NONE;
 }
 
 static int csp_can_pbuf_free(csp_can_pbuf_element_t *buf)
 {
+	int16_t index = buf - csp_can_pbuf;
+
 	/* Free CSP packet */
 	if (buf->packet != NULL)
 		csp_buffer_free(buf->packet);
 
+	/* Unlink from hash chain */
+	int16_t *link = &csp_can_pbuf_hash[csp_can_pbuf_bucket(buf->cfpid)];
+	while (*link != -1 && *link != index)
+		link = &csp_can_pbuf[*link].next;
+	if (*link == index)
+		*link = buf->next;
+
 	/* Mark buffer element free */
 	buf->packet = NULL;
 	buf->state = BUF_FREE;
@@ -194,49 +231,53 @@ static int csp_can_pbuf_free(csp_can_pbuf_element_t *buf)
 	buf->cfpid = 0;
 	buf->last_used = 0;
 	buf->remain = 0;
+	buf->next = csp_can_pbuf_free_list;
+	csp_can_pbuf_free_list = index;
 
 	return CSP_ERR_NONE;
 }
 
-static csp_can_pbuf_element_t *csp_can_pbuf_new(uint32_t id)
+static csp_can_pbuf_element_t *csp_can_pbuf_new(uint32_t id, uint32_t now)
 {
-	int i;
-	csp_can_pbuf_element_t *buf, *ret = NULL;
+	csp_can_pbuf_element_t *buf;
 
-	for (i = 0; i < PBUF_ELEMENTS; i++) {
-		buf = &csp_can_pbuf[i];
-		if (buf->state == BUF_FREE) {
-			buf->state = BUF_USED;
-			buf->cfpid = id;
-			buf->remain = 0;
-			csp_can_pbuf_timestamp(buf);
-			ret = buf;
-			break;
-		}
-	}
+	if (csp_can_pbuf_free_list == -1)
+		return NULL;
 
-	return ret;
+	int16_t index = csp_can_pbuf_free_list;
+	buf = &csp_can_pbuf[index];
+	csp_can_pbuf_free_list = buf->next;
+
+	buf->state = BUF_USED;
+	buf->cfpid = id;
+	buf->remain = 0;
+	buf->last_used = now;
+
+	/* Insert in hash chain */
+	unsigned int bucket = csp_can_pbuf_bucket(id);
+	buf->next = csp_can_pbuf_hash[bucket];
+	csp_can_pbuf_hash[bucket] = index;
+
+	return buf;
 }
 
-static csp_can_pbuf_element_t *csp_can_pbuf_find(uint32_t id, uint32_t mask)
+static csp_can_pbuf_element_t *csp_can_pbuf_find(uint32_t id, uint32_t now)
 {
-	int i;
-	csp_can_pbuf_element_t *buf, *ret = NULL;
+	int16_t index = csp_can_pbuf_hash[csp_can_pbuf_bucket(id)];
 
-	for (i = 0; i < PBUF_ELEMENTS; i++) {
-		buf = &csp_can_pbuf[i];
-
-		if ((buf->state == BUF_USED) && ((buf->cfpid & mask) == (id & mask))) {
-			csp_can_pbuf_timestamp(buf);
-			ret = buf;
-			break;
+	while (index != -1) {
+		csp_can_pbuf_element_t *buf = &csp_can_pbuf[index];
+		if ((buf->cfpid & CFP_ID_CONN_MASK) == (id & CFP_ID_CONN_MASK)) {
+			buf->last_used = now;
+			return buf;
 		}
+		index = buf->next;
 	}
 
-	return ret;
+	return NULL;
 }
 
-static void csp_can_pbuf_cleanup(void)
+static void csp_can_pbuf_cleanup(uint32_t now)
 {
 	int i;
 	csp_can_pbuf_element_t *buf;
@@ -249,7 +290,6 @@ static void csp_can_pbuf_cleanup(void)
 			continue;
 
 		/* Check timeout */
-		uint32_t now = csp_get_ms();
 		if (now - buf->last_used > PBUF_TIMEOUT_MS) {
 			csp_log_warn("CAN Buffer element timed out");
 			/* Recycle packet buffer */
@@ -258,7 +298,7 @@ static void csp_can_pbuf_cleanup(void)
 	}
 }
 
-static int csp_can_process_frame(can_frame_t *frame)
+static int csp_can_process_frame(can_frame_t *frame, uint32_t now)
 {
 	csp_can_pbuf_element_t *buf;
 	uint8_t offset;
@@ -266,12 +306,12 @@ static int csp_can_process_frame(can_frame_t *frame)
 	can_id_t id = frame->id;
 
 	/* Bind incoming frame to a packet buffer */
-	buf = csp_can_pbuf_find(id, CFP_ID_CONN_MASK);
+	buf = csp_can_pbuf_find(id, now);
 
 	/* Check returned buffer */
 	if (buf == NULL) {
 		if (CFP_TYPE(id) == CFP_BEGIN) {
-			buf = csp_can_pbuf_new(id);
+			buf = csp_can_pbuf_new(id, now);
 			if (buf == NULL) {
 				csp_log_warn("No available packet buffer for CAN");
 				csp_if_can.rx_error++;
@@ -345,6 +385,12 @@ static int csp_can_process_frame(can_frame_t *frame)
 		/* Decrement remaining frames */
 		buf->remain--;
 
+#ifdef CSP_CAN_FD
+		/* The last CAN FD frame is padded up to a valid frame length */
+		if (buf->remain == 0 && (buf->rx_count + frame->dlc - offset) > buf->packet->length)
+			frame->dlc = buf->packet->length - buf->rx_count + offset;
+#endif
+
 		/* Check for overflow */
 		if ((buf->rx_count + frame->dlc - offset) > buf->packet->length) {
 			csp_log_error("RX buffer overflow");
@@ -384,17 +430,27 @@ static int csp_can_process_frame(can_frame_t *frame)
 
 static CSP_DEFINE_TASK(csp_can_rx_task)
 {
-	int ret;
+	int ret, count;
 	can_frame_t frame;
+	uint32_t now, last_cleanup = csp_get_ms();
 
 	while (1) {
 		ret = csp_queue_dequeue(csp_can_rx_queue, &frame, 1000);
-		if (ret != CSP_QUEUE_OK) {
-			csp_can_pbuf_cleanup();
-			continue;
+
+		/* Process the frames that are queued, reading the time once */
+		now = csp_get_ms();
+		for (count = 0; ret == CSP_QUEUE_OK; ) {
+			csp_can_process_frame(&frame, now);
+			if (++count == CSP_CAN_RX_BATCH)
+				break;
+			ret = csp_queue_dequeue(csp_can_rx_queue, &frame, 0);
 		}
 
-		csp_can_process_frame(&frame);
+		/* Time out stale buffer elements, also under continuous load */
+		if (now - last_cleanup >= PBUF_CLEANUP_MS) {
+			csp_can_pbuf_cleanup(now);
+			last_cleanup = now;
+		}
 	}
 
 	csp_thread_exit();
@@ -408,11 +464,49 @@ int csp_can_rx_frame(can_frame_t *frame, CSP_BASE_TYPE *task_woken)
 	return CSP_ERR_NONE;
 }
 
-int csp_can_tx(csp_iface_t *interface, csp_packet_t *packet, uint32_t timeout)
+/* Drivers without batch support send one frame at a time */
+int __attribute__((weak)) can_send_batch(can_frame_t *frames, int count)
+{
+	int i;
+
+	for (i = 0; i < count; i++)
+		if (can_send(frames[i].id, frames[i].data, frames[i].dlc) != 0)
+			break;
+
+	return i;
+}
+
+/* Pass the collected frames to the driver, and return the number of frames sent */
+static int csp_can_tx_flush(can_frame_t *frames, int *count)
+{
+	int n = *count, sent = 0;
+
+	*count = 0;
+	if (n > 0) {
+		sent = can_send_batch(frames, n);
+		if (sent != n) {
+			csp_log_warn("Failed to send CAN frame in csp_tx_can");
+			csp_if_can.tx_error++;
+			if (sent < 0)
+				sent = 0;
+		}
+	}
+
+	return sent;
+}
+
+/* Number of frames a packet is sent in */
+static inline int csp_can_tx_frames(csp_packet_t *packet)
+{
+	return (packet->length + sizeof(csp_id_t) + sizeof(uint16_t) + CFP_FRAME_DATA - 1) / CFP_FRAME_DATA;
+}
+
+/* Split a packet into frames, appended to the frames collected so far.
+ * The caller makes sure they fit. */
+static int csp_can_tx_packet(csp_packet_t *packet, can_frame_t *frames, int *count)
 {
 	uint16_t tx_count;
 	uint8_t bytes, overhead, avail, dest;
-	uint8_t frame_buf[8];
 
 	/* Get CFP identification number */
 	int ident = csp_can_id_get();
@@ -430,63 +524,116 @@ int csp_can_tx(csp_iface_t *interface, csp_packet_t *packet, uint32_t timeout)
 		dest = packet->id.dst;
 
 	/* Create CAN identifier */
-	can_id_t id = 0;
-	id |= CFP_MAKE_SRC(packet->id.src);
-	id |= CFP_MAKE_DST(dest);
-	id |= CFP_MAKE_ID(ident);
-	id |= CFP_MAKE_TYPE(CFP_BEGIN);
-	id |= CFP_MAKE_REMAIN((packet->length + overhead - 1) / 8);
+	can_frame_t *frame = &frames[(*count)++];
+	frame->id = 0;
+	frame->id |= CFP_MAKE_SRC(packet->id.src);
+	frame->id |= CFP_MAKE_DST(dest);
+	frame->id |= CFP_MAKE_ID(ident);
+	frame->id |= CFP_MAKE_TYPE(CFP_BEGIN);
+	frame->id |= CFP_MAKE_REMAIN((packet->length + overhead - 1) / CFP_FRAME_DATA);
 
 	/* Calculate first frame data bytes */
-	avail = 8 - overhead;
+	avail = CFP_FRAME_DATA - overhead;
 	bytes = (packet->length <= avail) ? packet->length : avail;
 
 	/* Copy CSP headers and data */
 	uint32_t csp_id_be = csp_hton32(packet->id.ext);
 	uint16_t csp_length_be = csp_hton16(packet->length);
 
-	memcpy(frame_buf, &csp_id_be, sizeof(csp_id_be));
-	memcpy(frame_buf + sizeof(csp_id_be), &csp_length_be, sizeof(csp_length_be));
-	memcpy(frame_buf + overhead, packet->data, bytes);
+	memcpy(frame->data, &csp_id_be, sizeof(csp_id_be));
+	memcpy(frame->data + sizeof(csp_id_be), &csp_length_be, sizeof(csp_length_be));
+	memcpy(frame->data + overhead, packet->data, bytes);
+	frame->dlc = overhead + bytes;
 
 	/* Increment tx counter */
 	tx_count = bytes;
 
-	/* Send first frame */
-	if (can_send(id, frame_buf, overhead + bytes)) {
-		csp_log_warn("Failed to send CAN frame in csp_tx_can");
-		return CSP_ERR_DRIVER;
-	}
-
-	/* Send next frames if not complete */
+	/* Add next frames if not complete */
 	while (tx_count < packet->length) {
 		/* Calculate frame data bytes */
-		bytes = (packet->length - tx_count >= 8) ? 8 : packet->length - tx_count;
+		bytes = (packet->length - tx_count >= CFP_FRAME_DATA) ? CFP_FRAME_DATA : packet->length - tx_count;
 
 		/* Prepare identifier */
-		can_id_t id = 0;
-		id |= CFP_MAKE_SRC(packet->id.src);
-		id |= CFP_MAKE_DST(dest);
-		id |= CFP_MAKE_ID(ident);
-		id |= CFP_MAKE_TYPE(CFP_MORE);
-		id |= CFP_MAKE_REMAIN((packet->length - tx_count - bytes + 7) / 8);
+		frame = &frames[(*count)++];
+		frame->id = 0;
+		frame->id |= CFP_MAKE_SRC(packet->id.src);
+		frame->id |= CFP_MAKE_DST(dest);
+		frame->id |= CFP_MAKE_ID(ident);
+		frame->id |= CFP_MAKE_TYPE(CFP_MORE);
+		frame->id |= CFP_MAKE_REMAIN((packet->length - tx_count - bytes + CFP_FRAME_DATA - 1) / CFP_FRAME_DATA);
+
+		memcpy(frame->data, packet->data + tx_count, bytes);
+		frame->dlc = bytes;
 
 		/* Increment tx counter */
 		tx_count += bytes;
-
-		/* Send frame */
-		if (can_send(id, packet->data + tx_count - bytes, bytes)) {
-			csp_log_warn("Failed to send CAN frame in Tx callback");
-			csp_if_can.tx_error++;
-			return CSP_ERR_DRIVER;
-		}
 	}
 
+	return CSP_ERR_NONE;
+}
+
+int csp_can_tx(csp_iface_t *interface, csp_packet_t *packet, uint32_t timeout)
+{
+	can_frame_t frames[CSP_CAN_TX_BATCH];
+	int count = 0;
+
+	if (csp_can_tx_frames(packet) > CSP_CAN_TX_BATCH)
+		return CSP_ERR_TX;
+
+	if (csp_can_tx_packet(packet, frames, &count) != CSP_ERR_NONE)
+		return CSP_ERR_DRIVER;
+
+	int n = count;
+	if (csp_can_tx_flush(frames, &count) != n)
+		return CSP_ERR_DRIVER;
+
 	csp_buffer_free(packet);
 
 	return CSP_ERR_NONE;
 }
 
+/* Send a batch of packets, with the frames of consecutive packets passed
+ * to the driver together */
+static int csp_can_tx_batch(csp_iface_t *interface, csp_packet_t **packets, int count, uint32_t timeout)
+{
+	can_frame_t frames[CSP_CAN_TX_BATCH];
+	/* Frame count at the end of each collected packet, a packet takes at least one frame */
+	int ends[CSP_CAN_TX_BATCH];
+	int i, first = 0, sent = 0, frame_count = 0, flushed;
+
+	for (i = 0; i < count; i++) {
+		if (csp_can_tx_frames(packets[i]) > CSP_CAN_TX_BATCH)
+			break;
+
+		/* Send the collected frames when the next packet does not fit */
+		if (frame_count + csp_can_tx_frames(packets[i]) > CSP_CAN_TX_BATCH) {
+			flushed = csp_can_tx_flush(frames, &frame_count);
+			while (sent < i && ends[sent - first] <= flushed)
+				sent++;
+			if (sent < i)
+				break;
+			first = i;
+		}
+
+		if (csp_can_tx_packet(packets[i], frames, &frame_count) != CSP_ERR_NONE)
+			break;
+		ends[i - first] = frame_count;
+	}
+
+	/* Send the rest, a failed flush leaves nothing collected */
+	if (frame_count > 0) {
+		flushed = csp_can_tx_flush(frames, &frame_count);
+		while (sent < i && ends[sent - first] <= flushed)
+			sent++;
+	}
+
+	/* Packets are sent once all their frames are, the rest are left to the caller */
+	for (i = 0; i < sent; i++)
+		csp_buffer_free(packets[i]);
+
+	return sent;
+}
+
 int csp_can_init(uint8_t mode, struct csp_can_config *conf)
 {
 	int ret;
@@ -541,5 +688,6 @@ int csp_can_init(uint8_t mode, struct csp_can_config *conf)
 csp_iface_t csp_if_can = {
 	.name = "CAN",
 	.nexthop = csp_can_tx,
+	.nexthop_batch = csp_can_tx_batch,
 	.mtu = CSP_CAN_MTU,
 };
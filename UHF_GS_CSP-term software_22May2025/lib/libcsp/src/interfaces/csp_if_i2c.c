@@ -32,6 +32,15 @@ static int csp_i2c_handle = 0;
 
 int csp_i2c_tx(csp_iface_t * interface, csp_packet_t * packet, uint32_t timeout) {
 
+	/* The frame is built in the packet buffer, so a shared buffer is copied */
+	csp_packet_t * shared = NULL;
+	if (csp_buffer_refc(packet) > 1) {
+		shared = packet;
+		packet = csp_buffer_clone(shared);
+		if (packet == NULL)
+			return CSP_ERR_NOMEM;
+	}
+
 	/* Cast the CSP packet buffer into an i2c frame */
 	i2c_frame_t * frame = (i2c_frame_t *) packet;
 
@@ -56,8 +65,15 @@ int csp_i2c_tx(csp_iface_t * interface, csp_packet_t * packet, uint32_t timeout)
 	frame->retries = 0;
 
 	/* enqueue the frame */
-	if (i2c_send(csp_i2c_handle, frame, timeout) != E_NO_ERR)
+	if (i2c_send(csp_i2c_handle, frame, timeout) != E_NO_ERR) {
+		if (shared != NULL)
+			csp_buffer_free(packet);
 		return CSP_ERR_DRIVER;
+	}
+
+	/* The copy was consumed by the driver */
+	if (shared != NULL)
+		csp_buffer_free(shared);
 
 	return CSP_ERR_NONE;
 
@@ -31,7 +31,7 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
 #include <csp/arch/csp_semaphore.h>
 #include <csp/csp_crc32.h>
 
-#define KISS_MTU				256
+#define KISS_MTU				CSP_KISS_MTU
 
 #define FEND  					0xC0
 #define FESC  					0xDB
@@ -42,63 +42,268 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
 #define TNC_SET_HARDWARE		0x06
 #define TNC_RETURN				0xFF
 
-static int kiss_lock_init = 0;
-static csp_bin_sem_handle_t kiss_lock;
+/* The high nibble of the command byte is the TNC port, the low nibble the command */
+#define TNC_PORT(cmd)			((cmd) >> 4)
+#define TNC_COMMAND(cmd)		((cmd) & 0x0F)
+
+#define KISS_TXBUF_SIZE			CSP_KISS_TXBUF_SIZE
+
+/* Bytes with the value b in every position of a word */
+#define KISS_WORD(b)			(((uintptr_t) -1 / 0xFF) * (b))
+/* Nonzero if any byte in the word x is zero */
+#define KISS_HASZERO(x)			(((x) - KISS_WORD(0x01)) & ~(x) & KISS_WORD(0x80))
+
+/* Return the number of bytes at the start of buf that need no escaping.
+ * A word at a time is tested for FEND and FESC, and the exact position
+ * is then found byte by byte. */
+static inline unsigned int csp_kiss_clean_run(const uint8_t * buf, unsigned int len) {
+
+	unsigned int i = 0;
+
+	for (; i + sizeof(uintptr_t) <= len; i += sizeof(uintptr_t)) {
+		uintptr_t word;
+		memcpy(&word, &buf[i], sizeof(word));
+		if (KISS_HASZERO(word ^ KISS_WORD(FEND)) || KISS_HASZERO(word ^ KISS_WORD(FESC)))
+			break;
+	}
+
+	while (i < len && buf[i] != FEND && buf[i] != FESC)
+		i++;
+
+	return i;
+
+}
+
+/* Write the transmit buffer to the driver, the caller holds the TX lock.
+ * Only the write function can report an error, putstr and putc cannot. */
+static int csp_kiss_tx_flush(csp_kiss_handle_t * driver) {
+
+	int result = CSP_ERR_NONE;
+
+	if (driver->tx_length == 0)
+		return CSP_ERR_NONE;
+
+	if (driver->kiss_write != NULL) {
+		if (driver->kiss_write(driver->kiss_write_user, driver->tx_buf, driver->tx_length) < 0)
+			result = CSP_ERR_TX;
+	} else if (driver->kiss_putstr != NULL) {
+		driver->kiss_putstr((char *) driver->tx_buf, driver->tx_length);
+	} else {
+		for (unsigned int i = 0; i < driver->tx_length; i++)
+			driver->kiss_putc(driver->tx_buf[i]);
+	}
+
+	driver->tx_length = 0;
+
+	return result;
+
+}
+
+/* Append a byte to the transmit buffer without escaping */
+static inline void csp_kiss_tx_raw(csp_kiss_handle_t * driver, uint8_t c) {
+	if (driver->tx_length == KISS_TXBUF_SIZE)
+		csp_kiss_tx_flush(driver);
+	driver->tx_buf[driver->tx_length++] = c;
+}
+
+/* Append data to the transmit buffer, escaping FEND and FESC */
+static void csp_kiss_tx_escape(csp_kiss_handle_t * driver, const uint8_t * data, unsigned int len) {
+
+	while (len > 0) {
+
+		/* Copy the bytes up to the next special character as a block */
+		unsigned int run = csp_kiss_clean_run(data, len);
+		while (run > 0) {
+			if (driver->tx_length == KISS_TXBUF_SIZE)
+				csp_kiss_tx_flush(driver);
+			unsigned int n = KISS_TXBUF_SIZE - driver->tx_length;
+			if (n > run)
+				n = run;
+			memcpy(&driver->tx_buf[driver->tx_length], data, n);
+			driver->tx_length += n;
+			data += n;
+			len -= n;
+			run -= n;
+		}
+
+		if (len == 0)
+			break;
+
+		/* Escape the special character */
+		if (driver->tx_length + 2 > KISS_TXBUF_SIZE)
+			csp_kiss_tx_flush(driver);
+		driver->tx_buf[driver->tx_length++] = FESC;
+		driver->tx_buf[driver->tx_length++] = (*data == FEND) ? TFEND : TFESC;
+		data++;
+		len--;
+
+	}
+
+}
+
+/* Find the TNC port of an interface */
+static uint8_t csp_kiss_port(csp_kiss_handle_t * driver, csp_iface_t * interface) {
+
+	for (uint8_t port = 0; port < CSP_KISS_PORTS; port++) {
+		if (driver->ports[port] == interface)
+			return port;
+	}
+
+	return 0;
+
+}
+
+/* Encode a frame into the transmit buffer, the caller holds the TX lock
+ * and flushes the buffer. The buffer holds a worst case frame, so a frame
+ * started in an empty buffer is never flushed part way. */
+static void csp_kiss_tx_frame(csp_kiss_handle_t * driver, uint8_t port, csp_packet_t * packet) {
+
+	/* The packet may be shared, so the header and CRC32 checksum
+	 * are built on the side instead of in the buffer */
+	uint32_t id_be = csp_hton32(packet->id.ext);
+	uint32_t crc_be = csp_hton32(csp_crc32_memory(packet->data, packet->length));
+
+	/* Port 12 gives a data command byte equal to FEND, which is escaped */
+	uint8_t command = (port << 4) | TNC_DATA;
+
+	csp_kiss_tx_raw(driver, FEND);
+	csp_kiss_tx_escape(driver, &command, 1);
+	csp_kiss_tx_escape(driver, (uint8_t *) &id_be, sizeof(id_be));
+	csp_kiss_tx_escape(driver, packet->data, packet->length);
+	csp_kiss_tx_escape(driver, (uint8_t *) &crc_be, sizeof(crc_be));
+	csp_kiss_tx_raw(driver, FEND);
+
+}
 
-/* Send a CSP packet over the KISS RS232 protocol */
 static int csp_kiss_tx(csp_iface_t * interface, csp_packet_t * packet, uint32_t timeout) {
 
 	if (interface == NULL || interface->driver == NULL)
 		return CSP_ERR_DRIVER;
 
-	/* Add CRC32 checksum */
-	csp_crc32_append(packet, false);
-
-	/* Save the outgoing id in the buffer */
-	packet->id.ext = csp_hton32(packet->id.ext);
-	packet->length += sizeof(packet->id.ext);
+	csp_kiss_handle_t * driver = interface->driver;
 
 	/* Lock */
-	csp_bin_sem_wait(&kiss_lock, 1000);
+	csp_bin_sem_wait(&driver->tx_lock, 1000);
 
 	/* Transmit data */
+	csp_kiss_tx_frame(driver, csp_kiss_port(driver, interface), packet);
+	int result = csp_kiss_tx_flush(driver);
+
+	/* Free data, on error the caller keeps the packet */
+	if (result == CSP_ERR_NONE)
+		csp_buffer_free(packet);
+
+	/* Unlock */
+	csp_bin_sem_post(&driver->tx_lock);
+
+	return result;
+}
+
+/* Send a batch of packets back to back, taking the lock once */
+static int csp_kiss_tx_batch(csp_iface_t * interface, csp_packet_t ** packets, int count, uint32_t timeout) {
+
+	if (interface == NULL || interface->driver == NULL)
+		return 0;
+
 	csp_kiss_handle_t * driver = interface->driver;
-	driver->kiss_putc(FEND);
-	driver->kiss_putc(TNC_DATA);
-	for (unsigned int i = 0; i < packet->length; i++) {
-		if (((unsigned char *) &packet->id.ext)[i] == FEND) {
-			((unsigned char *) &packet->id.ext)[i] = TFEND;
-			driver->kiss_putc(FESC);
-		} else if (((unsigned char *) &packet->id.ext)[i] == FESC) {
-			((unsigned char *) &packet->id.ext)[i] = TFESC;
-			driver->kiss_putc(FESC);
+	uint8_t port = csp_kiss_port(driver, interface);
+
+	csp_bin_sem_wait(&driver->tx_lock, 1000);
+
+	/* Frames are written together while they fit in the transmit buffer,
+	 * and packets are freed once the write that carried them succeeded */
+	int sent = 0;
+	for (int i = 0; i < count; i++) {
+		if (driver->tx_length > 0 && driver->tx_length + 2 * (CSP_HEADER_LENGTH + packets[i]->length + sizeof(uint32_t)) + 4 > KISS_TXBUF_SIZE) {
+			if (csp_kiss_tx_flush(driver) != CSP_ERR_NONE)
+				goto out;
+			for (; sent < i; sent++)
+				csp_buffer_free(packets[sent]);
 		}
-		driver->kiss_putc(((unsigned char *) &packet->id.ext)[i]);
+		csp_kiss_tx_frame(driver, port, packets[i]);
+	}
+	if (csp_kiss_tx_flush(driver) == CSP_ERR_NONE) {
+		for (; sent < count; sent++)
+			csp_buffer_free(packets[sent]);
 	}
-	driver->kiss_putc(FEND);
 
-	/* Free data */
-	csp_buffer_free(packet);
+out:
+	/* Frames of unsent packets are discarded, the caller keeps the packets */
+	driver->tx_length = 0;
+	csp_bin_sem_post(&driver->tx_lock);
 
-	/* Unlock */
-	csp_bin_sem_post(&kiss_lock);
+	return sent;
+}
+
+/* Handle the command byte after FEND, data frames for a registered port
+ * are received on that port's interface and everything else is skipped */
+static void csp_kiss_rx_command(csp_iface_t * interface, csp_kiss_handle_t * driver, uint8_t command) {
+
+	driver->rx_first = 0;
+	driver->rx_iface = NULL;
+
+	if (TNC_COMMAND(command) == TNC_DATA)
+		driver->rx_iface = driver->ports[TNC_PORT(command)];
+
+	if (driver->rx_iface == NULL) {
+		if (TNC_COMMAND(command) == TNC_DATA)
+			interface->drop++;
+		driver->rx_mode = KISS_MODE_SKIP_FRAME;
+	}
+
+}
+
+/* Handle the end of a frame, the frame is passed to CSP if it is valid */
+static void csp_kiss_rx_frame(csp_kiss_handle_t * driver, void * pxTaskWoken) {
+
+	/* Statistics are kept on the interface of the frame's port */
+	csp_iface_t * interface = driver->rx_iface;
+
+	/* Check for valid length */
+	if (driver->rx_length < CSP_HEADER_LENGTH + sizeof(uint32_t)) {
+		csp_log_warn("KISS short frame skipped, len: %u", driver->rx_length);
+		interface->rx_error++;
+		driver->rx_mode = KISS_MODE_NOT_STARTED;
+		return;
+	}
+
+	/* Count received frame */
+	interface->frame++;
+
+	/* The CSP packet length is without the header */
+	driver->rx_packet->length = driver->rx_length - CSP_HEADER_LENGTH;
+
+	/* Convert the packet from network to host order */
+	driver->rx_packet->id.ext = csp_ntoh32(driver->rx_packet->id.ext);
+
+	/* Validate CRC */
+	if (csp_crc32_verify(driver->rx_packet, false) != CSP_ERR_NONE) {
+		csp_log_warn("KISS invalid crc frame skipped, len: %u", driver->rx_packet->length);
+		interface->rx_error++;
+		driver->rx_mode = KISS_MODE_NOT_STARTED;
+		return;
+	}
+
+	/* Send back into CSP, notice calling from task so last argument must be NULL! */
+	csp_qfifo_write(driver->rx_packet, interface, pxTaskWoken);
+	driver->rx_packet = NULL;
+	driver->rx_mode = KISS_MODE_NOT_STARTED;
 
-	return CSP_ERR_NONE;
 }
 
 /**
  * When a frame is received, decode the kiss-stuff
  * and eventually send it directly to the CSP new packet function.
+ *
+ * Data between delimiters is located with a word at a time scan and
+ * copied as blocks, only FEND and FESC are handled byte by byte.
  */
 void csp_kiss_rx(csp_iface_t * interface, uint8_t * buf, int len, void * pxTaskWoken) {
 
 	/* Driver handle */
 	csp_kiss_handle_t * driver = interface->driver;
 
-	while (len--) {
-
-		/* Input */
-		unsigned char inputbyte = *buf++;
+	while (len > 0) {
 
 		/* If packet was too long */
 		if (driver->rx_length > interface->mtu) {
@@ -110,14 +315,23 @@ void csp_kiss_rx(csp_iface_t * interface, uint8_t * buf, int len, void * pxTaskW
 
 		switch (driver->rx_mode) {
 
-		case KISS_MODE_NOT_STARTED:
+		case KISS_MODE_NOT_STARTED: {
 
 			/* Send normal chars back to usart driver */
-			if (inputbyte != FEND) {
-				if (driver->kiss_discard != NULL)
-					driver->kiss_discard(inputbyte, pxTaskWoken);
-				break;
+			uint8_t * fend = memchr(buf, FEND, len);
+			int skip = (fend != NULL) ? fend - buf : len;
+			if (driver->kiss_discard != NULL) {
+				for (int i = 0; i < skip; i++)
+					driver->kiss_discard(buf[i], pxTaskWoken);
 			}
+			buf += skip;
+			len -= skip;
+			if (len == 0)
+				break;
+
+			/* Consume the FEND */
+			buf++;
+			len--;
 
 			/* Try to allocate new buffer */
 			if (driver->rx_packet == NULL) {
@@ -139,90 +353,91 @@ void csp_kiss_rx(csp_iface_t * interface, uint8_t * buf, int len, void * pxTaskW
 			driver->rx_mode = KISS_MODE_STARTED;
 			driver->rx_first = 1;
 			break;
+		}
 
-		case KISS_MODE_STARTED:
-
-			/* Escape char */
-			if (inputbyte == FESC) {
-				driver->rx_mode = KISS_MODE_ESCAPED;
-				break;
-			}
-
-			/* End Char */
-			if (inputbyte == FEND) {
+		case KISS_MODE_STARTED: {
 
-				/* Accept message */
-				if (driver->rx_length > 0) {
+			/* Copy data up to the next special char as a block */
+			unsigned int run = csp_kiss_clean_run(buf, len);
+			if (run > 0) {
 
-					/* Check for valid length */
-					if (driver->rx_length < CSP_HEADER_LENGTH + sizeof(uint32_t)) {
-						csp_log_warn("KISS short frame skipped, len: %u", driver->rx_length);
-						interface->rx_error++;
-						driver->rx_mode = KISS_MODE_NOT_STARTED;
+				/* The first char after FEND is the TNC command and port */
+				if (driver->rx_first) {
+					csp_kiss_rx_command(interface, driver, *buf);
+					buf++;
+					len--;
+					run--;
+					if (driver->rx_mode != KISS_MODE_STARTED)
 						break;
-					}
-
-					/* Count received frame */
-					interface->frame++;
-
-					/* The CSP packet length is without the header */
-					driver->rx_packet->length = driver->rx_length - CSP_HEADER_LENGTH;
-
-					/* Convert the packet from network to host order */
-					driver->rx_packet->id.ext = csp_ntoh32(driver->rx_packet->id.ext);
+				}
 
-					/* Validate CRC */
-					if (csp_crc32_verify(driver->rx_packet, false) != CSP_ERR_NONE) {
-						csp_log_warn("KISS invalid crc frame skipped, len: %u", driver->rx_packet->length);
-						interface->rx_error++;
-						driver->rx_mode = KISS_MODE_NOT_STARTED;
-						break;
-					}
+				/* Stop one byte past the MTU, so the overflow is caught */
+				unsigned int room = interface->mtu + 1 - driver->rx_length;
+				if (run > room)
+					run = room;
 
-					/* Send back into CSP, notice calling from task so last argument must be NULL! */
-					csp_qfifo_write(driver->rx_packet, interface, pxTaskWoken);
-					driver->rx_packet = NULL;
-					driver->rx_mode = KISS_MODE_NOT_STARTED;
-					break;
+				memcpy(((uint8_t *) &driver->rx_packet->id.ext) + driver->rx_length, buf, run);
+				driver->rx_length += run;
+				buf += run;
+				len -= run;
+				break;
+			}
 
-				}
+			unsigned char inputbyte = *buf++;
+			len--;
 
-				/* Break after the end char */
+			/* Escape char */
+			if (inputbyte == FESC) {
+				driver->rx_mode = KISS_MODE_ESCAPED;
 				break;
 			}
 
-			/* Skip the first char after FEND which is TNC_DATA (0x00) */
-			if (driver->rx_first) {
-				driver->rx_first = 0;
+			/* End char, accept message */
+			if (driver->rx_length > 0) {
+				csp_kiss_rx_frame(driver, pxTaskWoken);
 				break;
 			}
 
-			/* Valid data char */
-			((char *) &driver->rx_packet->id.ext)[driver->rx_length++] = inputbyte;
-
+			/* An empty frame starts over, the next char is a command again */
+			driver->rx_first = 1;
 			break;
+		}
 
-		case KISS_MODE_ESCAPED:
-
-			/* Escaped escape char */
-			if (inputbyte == TFESC)
-				((char *) &driver->rx_packet->id.ext)[driver->rx_length++] = FESC;
+		case KISS_MODE_ESCAPED: {
 
-			/* Escaped fend char */
-			if (inputbyte == TFEND)
-				((char *) &driver->rx_packet->id.ext)[driver->rx_length++] = FEND;
+			unsigned char inputbyte = *buf++;
+			len--;
 
 			/* Go back to started mode */
 			driver->rx_mode = KISS_MODE_STARTED;
+
+			if (inputbyte != TFESC && inputbyte != TFEND)
+				break;
+			inputbyte = (inputbyte == TFESC) ? FESC : FEND;
+
+			/* Escaped command byte, a data frame for TNC port 12 */
+			if (driver->rx_first) {
+				csp_kiss_rx_command(interface, driver, inputbyte);
+				break;
+			}
+
+			((char *) &driver->rx_packet->id.ext)[driver->rx_length++] = inputbyte;
 			break;
+		}
 
-		case KISS_MODE_SKIP_FRAME:
+		case KISS_MODE_SKIP_FRAME: {
 
 			/* Just wait for end char */
-			if (inputbyte == FEND)
-				driver->rx_mode = KISS_MODE_NOT_STARTED;
-
+			uint8_t * fend = memchr(buf, FEND, len);
+			if (fend == NULL) {
+				len = 0;
+				break;
+			}
+			len -= fend + 1 - buf;
+			buf = fend + 1;
+			driver->rx_mode = KISS_MODE_NOT_STARTED;
 			break;
+		}
 
 		}
 
@@ -230,27 +445,60 @@ void csp_kiss_rx(csp_iface_t * interface, uint8_t * buf, int len, void * pxTaskW
 
 }
 
-void csp_kiss_init(csp_iface_t * csp_iface, csp_kiss_handle_t * csp_kiss_handle, csp_kiss_putc_f kiss_putc_f, csp_kiss_discard_f kiss_discard_f, const char * name) {
-
-	/* Init lock only once */
-	if (kiss_lock_init == 0) {
-		csp_bin_sem_create(&kiss_lock);
-		kiss_lock_init = 1;
-	}
+/* Set up an interface for one TNC port of a KISS handle */
+static void csp_kiss_port_init(csp_iface_t * csp_iface, csp_kiss_handle_t * csp_kiss_handle, uint8_t port, const char * name) {
 
 	/* Register device handle as member of interface */
 	csp_iface->driver = csp_kiss_handle;
-	csp_kiss_handle->kiss_discard = kiss_discard_f;
-	csp_kiss_handle->kiss_putc = kiss_putc_f;
-	csp_kiss_handle->rx_packet = NULL;
-	csp_kiss_handle->rx_mode = KISS_MODE_NOT_STARTED;
+	csp_kiss_handle->ports[port] = csp_iface;
 
 	/* Setop other mandatories */
 	csp_iface->mtu = KISS_MTU;
 	csp_iface->nexthop = csp_kiss_tx;
+	csp_iface->nexthop_batch = csp_kiss_tx_batch;
 	csp_iface->name = name;
 
 	/* Regsiter interface */
 	csp_iflist_add(csp_iface);
 
 }
+
+void csp_kiss_init(csp_iface_t * csp_iface, csp_kiss_handle_t * csp_kiss_handle, csp_kiss_putc_f kiss_putc_f, csp_kiss_discard_f kiss_discard_f, const char * name) {
+
+	/* Each serial link has its own transmit lock and buffer */
+	csp_bin_sem_create(&csp_kiss_handle->tx_lock);
+	csp_kiss_handle->tx_length = 0;
+
+	csp_kiss_handle->kiss_discard = kiss_discard_f;
+	csp_kiss_handle->kiss_putc = kiss_putc_f;
+	csp_kiss_handle->kiss_putstr = NULL;
+	csp_kiss_handle->kiss_write = NULL;
+	csp_kiss_handle->kiss_write_user = NULL;
+	csp_kiss_handle->rx_packet = NULL;
+	csp_kiss_handle->rx_iface = NULL;
+	csp_kiss_handle->rx_mode = KISS_MODE_NOT_STARTED;
+	memset(csp_kiss_handle->ports, 0, sizeof(csp_kiss_handle->ports));
+
+	/* The first interface is TNC port 0 */
+	csp_kiss_port_init(csp_iface, csp_kiss_handle, 0, name);
+
+}
+
+int csp_kiss_add_port(csp_kiss_handle_t * csp_kiss_handle, csp_iface_t * csp_iface, uint8_t port, const char * name) {
+
+	if (port >= CSP_KISS_PORTS || csp_kiss_handle->ports[port] != NULL)
+		return CSP_ERR_INVAL;
+
+	csp_kiss_port_init(csp_iface, csp_kiss_handle, port, name);
+
+	return CSP_ERR_NONE;
+
+}
+void csp_kiss_set_putstr(csp_kiss_handle_t * csp_kiss_handle, csp_kiss_putstr_f kiss_putstr_f) {
+	csp_kiss_handle->kiss_putstr = kiss_putstr_f;
+}
+
+void csp_kiss_set_write(csp_kiss_handle_t * csp_kiss_handle, csp_kiss_write_f kiss_write_f, void * user) {
+	csp_kiss_handle->kiss_write = kiss_write_f;
+	csp_kiss_handle->kiss_write_user = user;
+}
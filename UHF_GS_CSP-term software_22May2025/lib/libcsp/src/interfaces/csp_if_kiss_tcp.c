@@ -0,0 +1,325 @@
+/*
+Cubesat Space Protocol - A small network-layer protocol designed for Cubesats
+Copyright (C) 2012 GomSpace ApS (http://www.gomspace.com)
+Copyright (C) 2012 AAUSAT3 Project (http://aausat3.space.aau.dk)
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+#include <csp/csp.h>
+#include <csp/csp_interface.h>
+#include <csp/interfaces/csp_if_kiss.h>
+#include <csp/interfaces/csp_if_kiss_tcp.h>
+#include <csp/arch/csp_malloc.h>
+#include <csp/arch/csp_thread.h>
+#include <csp/arch/csp_time.h>
+
+/** Size of the receive buffer */
+#define KISS_TCP_RX_BUF_SIZE	4096
+/** Interval between connection attempts in ms */
+#define KISS_TCP_RECONNECT_MS	1000
+/** Longest time to wait for a connection to be established in ms */
+#define KISS_TCP_CONNECT_MS	5000
+/** Longest time to wait for the peer to take data in ms */
+#define KISS_TCP_TX_TIMEOUT_MS	1000
+
+typedef struct {
+	csp_kiss_handle_t kiss;		/**< KISS state, must be first as it is the interface driver */
+	csp_iface_t * interface;	/**< Interface */
+	char * host;			/**< Host to connect to, NULL in server mode */
+	uint16_t port;			/**< TCP port */
+	int listen_fd;			/**< Listening socket in server mode, else -1 */
+	int fd;				/**< Connected socket, -1 while not connected */
+	int warned;			/**< A failed connection attempt has been logged */
+	pthread_mutex_t lock;		/**< Serialises writes and protects fd */
+	uint8_t rxbuf[KISS_TCP_RX_BUF_SIZE];
+} kiss_tcp_t;
+
+static int kiss_tcp_nonblock(int fd) {
+	int flags = fcntl(fd, F_GETFL, 0);
+	return (flags < 0) ? -1 : fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+/* Write a block of encoded frames, called by the KISS interface */
+static int kiss_tcp_write(void * user, const uint8_t * buf, int len) {
+
+	kiss_tcp_t * tcp = user;
+	int ret = len;
+
+	pthread_mutex_lock(&tcp->lock);
+
+	while (len > 0) {
+
+		if (tcp->fd < 0) {
+			ret = -1;
+			break;
+		}
+
+		ssize_t written = send(tcp->fd, buf, len, MSG_NOSIGNAL);
+		if (written > 0) {
+			buf += written;
+			len -= written;
+			continue;
+		}
+
+		if (written < 0 && errno == EINTR)
+			continue;
+
+		if (written < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			struct pollfd pfd = {.fd = tcp->fd, .events = POLLOUT};
+			if (poll(&pfd, 1, KISS_TCP_TX_TIMEOUT_MS) > 0)
+				continue;
+		}
+
+		/* Drop a peer that fails or stops taking data. The socket is only
+		 * shut down here, the RX task closes it and reconnects. */
+		csp_log_warn("KISS TCP %s write failed, dropping connection", tcp->interface->name);
+		shutdown(tcp->fd, SHUT_RDWR);
+		ret = -1;
+		break;
+
+	}
+
+	pthread_mutex_unlock(&tcp->lock);
+
+	return ret;
+
+}
+
+/* Connect to the peer, returns the socket or -1 */
+static int kiss_tcp_connect(kiss_tcp_t * tcp) {
+
+	struct addrinfo hints, * result, * ai;
+	char port[6];
+	int fd = -1;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	snprintf(port, sizeof(port), "%u", tcp->port);
+
+	int err = getaddrinfo(tcp->host, port, &hints, &result);
+	if (err != 0) {
+		if (!tcp->warned)
+			csp_log_warn("KISS TCP %s cannot resolve %s: %s", tcp->interface->name, tcp->host, gai_strerror(err));
+		tcp->warned = 1;
+		return -1;
+	}
+
+	for (ai = result; ai != NULL; ai = ai->ai_next) {
+
+		fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+		if (fd < 0)
+			continue;
+
+		/* Connect without blocking beyond the connect timeout */
+		if (kiss_tcp_nonblock(fd) == 0) {
+			if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0)
+				break;
+			if (errno == EINPROGRESS) {
+				struct pollfd pfd = {.fd = fd, .events = POLLOUT};
+				int so_error = 0;
+				socklen_t optlen = sizeof(so_error);
+				if (poll(&pfd, 1, KISS_TCP_CONNECT_MS) > 0 &&
+						getsockopt(fd, SOL_SOCKET, SO_ERROR, &so_error, &optlen) == 0 && so_error == 0)
+					break;
+			}
+		}
+
+		close(fd);
+		fd = -1;
+
+	}
+
+	freeaddrinfo(result);
+
+	if (fd < 0) {
+		if (!tcp->warned)
+			csp_log_warn("KISS TCP %s cannot connect to %s:%u", tcp->interface->name, tcp->host, tcp->port);
+		tcp->warned = 1;
+	}
+
+	return fd;
+
+}
+
+/* Serve a connection until it is lost, or replaced by a new peer */
+static void kiss_tcp_serve(kiss_tcp_t * tcp, int fd) {
+
+	struct pollfd fds[2];
+	int count = 1;
+
+	fds[0].fd = fd;
+	fds[0].events = POLLIN;
+	if (tcp->listen_fd >= 0) {
+		fds[1].fd = tcp->listen_fd;
+		fds[1].events = POLLIN;
+		count = 2;
+	}
+
+	while (1) {
+
+		if (poll(fds, count, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			return;
+		}
+
+		if (fds[0].revents) {
+			ssize_t length = recv(fd, tcp->rxbuf, sizeof(tcp->rxbuf), 0);
+			if (length > 0) {
+				csp_kiss_rx(tcp->interface, tcp->rxbuf, length, NULL);
+			} else if (length == 0 || (errno != EINTR && errno != EAGAIN && errno != EWOULDBLOCK)) {
+				return;
+			}
+		}
+
+		/* A new peer replaces the current one */
+		if (count == 2 && (fds[1].revents & POLLIN))
+			return;
+
+	}
+
+}
+
+static CSP_DEFINE_TASK(kiss_tcp_task) {
+
+	kiss_tcp_t * tcp = param;
+
+	while (1) {
+
+		int fd;
+		if (tcp->host != NULL) {
+			fd = kiss_tcp_connect(tcp);
+		} else {
+			fd = accept(tcp->listen_fd, NULL, NULL);
+		}
+
+		if (fd < 0) {
+			csp_sleep_ms(KISS_TCP_RECONNECT_MS);
+			continue;
+		}
+
+		int one = 1;
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+		kiss_tcp_nonblock(fd);
+
+		pthread_mutex_lock(&tcp->lock);
+		tcp->fd = fd;
+		pthread_mutex_unlock(&tcp->lock);
+
+		csp_log_info("KISS TCP %s connected", tcp->interface->name);
+		tcp->warned = 0;
+
+		kiss_tcp_serve(tcp, fd);
+
+		pthread_mutex_lock(&tcp->lock);
+		tcp->fd = -1;
+		close(fd);
+		pthread_mutex_unlock(&tcp->lock);
+
+		csp_log_info("KISS TCP %s disconnected", tcp->interface->name);
+
+		/* Discard any partial frame from the lost connection */
+		tcp->kiss.rx_mode = KISS_MODE_NOT_STARTED;
+
+	}
+
+	return CSP_TASK_RETURN;
+
+}
+
+/* Open the listening socket for server mode */
+static int kiss_tcp_listen(uint16_t port) {
+
+	struct sockaddr_in addr;
+	int one = 1;
+
+	int fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (fd < 0)
+		return -1;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_ANY);
+	addr.sin_port = htons(port);
+
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) != 0 || listen(fd, 1) != 0) {
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+
+}
+
+int csp_kiss_tcp_init(csp_iface_t * interface, const char * name, const char * host, uint16_t port) {
+
+	if (interface == NULL || name == NULL)
+		return CSP_ERR_INVAL;
+
+	kiss_tcp_t * tcp = csp_malloc(sizeof(*tcp));
+	if (tcp == NULL)
+		return CSP_ERR_NOMEM;
+
+	memset(tcp, 0, sizeof(*tcp));
+	tcp->interface = interface;
+	tcp->port = port;
+	tcp->fd = -1;
+	tcp->listen_fd = -1;
+	pthread_mutex_init(&tcp->lock, NULL);
+
+	if (host != NULL) {
+		tcp->host = strdup(host);
+		if (tcp->host == NULL) {
+			csp_free(tcp);
+			return CSP_ERR_NOMEM;
+		}
+	} else {
+		tcp->listen_fd = kiss_tcp_listen(port);
+		if (tcp->listen_fd < 0) {
+			csp_log_error("KISS TCP %s cannot listen on port %u: %s", name, port, strerror(errno));
+			csp_free(tcp);
+			return CSP_ERR_DRIVER;
+		}
+	}
+
+	csp_kiss_init(interface, &tcp->kiss, NULL, NULL, name);
+	csp_kiss_set_write(&tcp->kiss, kiss_tcp_write, tcp);
+
+	csp_thread_handle_t handle;
+	if (csp_thread_create(kiss_tcp_task, "KISSTCP", 1000, tcp, 0, &handle) != 0) {
+		csp_log_error("KISS TCP %s failed to start task", name);
+		return CSP_ERR_NOMEM;
+	}
+
+	return CSP_ERR_NONE;
+
+}
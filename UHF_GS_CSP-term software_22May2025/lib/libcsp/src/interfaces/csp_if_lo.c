@@ -27,6 +27,7 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
 #include <csp/arch/csp_semaphore.h>
 #include <csp/arch/csp_queue.h>
 
+#include "../csp_promisc.h"
 #include "../csp_route.h"
 
 /**
@@ -47,6 +48,22 @@ int csp_lo_tx(csp_iface_t * interface, csp_packet_t * packet, uint32_t timeout)
 		return CSP_ERR_NONE;
 	}
 
+#ifdef CSP_USE_LO_DIRECT
+	/* Deliver to the socket or connection from the sender's context.
+	 * RDP packets still go through the router task, which owns the RDP
+	 * state and its timers. The duplicate filter is skipped, as packets
+	 * sent to ourselves are not repeated by any link. */
+	if (!(packet->id.flags & (CSP_FRDP | CSP_FAGGR))) {
+		interface->rx++;
+		interface->rxbytes += packet->length;
+#ifdef CSP_USE_PROMISC
+		csp_promisc_add(packet);
+#endif
+		csp_route_local(interface, packet);
+		return CSP_ERR_NONE;
+	}
+#endif
+
 	/* Send back into CSP, notice calling from task so last argument must be NULL! */
 	csp_qfifo_write(packet, &csp_if_lo, NULL);
 
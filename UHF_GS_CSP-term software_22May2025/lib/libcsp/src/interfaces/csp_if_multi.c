@@ -0,0 +1,395 @@
+/*
+Cubesat Space Protocol - A small network-layer protocol designed for Cubesats
+Copyright (C) 2012 GomSpace ApS (http://www.gomspace.com)
+Copyright (C) 2012 AAUSAT3 Project (http://aausat3.space.aau.dk)
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#include <stdint.h>
+#include <string.h>
+
+#include <csp/csp.h>
+#include <csp/csp_interface.h>
+#include <csp/interfaces/csp_if_multi.h>
+#include <csp/arch/csp_malloc.h>
+#include <csp/arch/csp_semaphore.h>
+#include <csp/arch/csp_time.h>
+
+/** Interval between score updates in ms */
+#define MULTI_INTERVAL_MS	100
+/** Time a member is out of use after a failed send in ms */
+#define MULTI_HOLDDOWN_MS	1000
+/** Score difference needed to move traffic in failover mode */
+#define MULTI_HYSTERESIS	10
+/** Members below this score are only used when no member is better */
+#define MULTI_MIN_SCORE		20
+/** Packets received by other members before a silent member counts as failing */
+#define MULTI_SILENT_RX		3
+/** Age after which an RSSI report is ignored in ms */
+#define MULTI_RSSI_AGE_MS	10000
+/** RSSI in dBm that scales the score to 0 */
+#define MULTI_RSSI_FLOOR	-120
+/** RSSI in dBm from which the score is not scaled */
+#define MULTI_RSSI_GOOD		-90
+
+typedef struct {
+	csp_iface_t * iface;		/**< Member interface */
+	uint8_t health;			/**< Score from the interface counters */
+	uint8_t down;			/**< Out of use after a failed send */
+	uint8_t has_rssi;		/**< An RSSI has been reported */
+	int16_t rssi;			/**< Last reported RSSI in dBm */
+	uint32_t rssi_time;		/**< Time of the last RSSI report */
+	uint32_t down_until;		/**< End of the hold down */
+	int32_t weight;			/**< Running weight for load sharing */
+	uint32_t good;			/**< Packets sent and received at the last update */
+	uint32_t bad;			/**< Errors at the last update */
+	uint32_t rx;			/**< Packets received at the last update */
+} multi_member_t;
+
+typedef struct {
+	uint8_t mode;			/**< CSP_MULTI_FAILOVER, CSP_MULTI_BALANCE or CSP_MULTI_DUPLICATE */
+	uint8_t count;			/**< Number of members */
+	uint8_t active;			/**< Member in use in failover mode */
+	csp_mutex_t lock;		/**< Protects the member state */
+	uint32_t updated;		/**< Time of the last score update */
+	multi_member_t member[CSP_MULTI_MAX_MEMBERS];
+} multi_handle_t;
+
+static uint32_t csp_multi_good(csp_iface_t * iface) {
+	return iface->tx + iface->rx;
+}
+
+static uint32_t csp_multi_bad(csp_iface_t * iface) {
+	return iface->tx_error + iface->rx_error + iface->drop;
+}
+
+/* Current score of a member, the caller holds the lock */
+static int csp_multi_score(multi_member_t * m, uint32_t now) {
+
+	if (m->down) {
+		if ((int32_t) (now - m->down_until) < 0)
+			return 0;
+		m->down = 0;
+	}
+
+	int score = m->health;
+	if (m->has_rssi && now - m->rssi_time < MULTI_RSSI_AGE_MS) {
+		int factor = (m->rssi - MULTI_RSSI_FLOOR) * 100 / (MULTI_RSSI_GOOD - MULTI_RSSI_FLOOR);
+		if (factor < 0)
+			factor = 0;
+		if (factor > 100)
+			factor = 100;
+		score = score * factor / 100;
+	}
+
+	return score;
+
+}
+
+/* Update the health of members from their counters, the caller holds the lock */
+static void csp_multi_update(multi_handle_t * multi, uint32_t now) {
+
+	if (now - multi->updated < MULTI_INTERVAL_MS)
+		return;
+	multi->updated = now;
+
+	uint32_t max_rx = 0;
+	for (int i = 0; i < multi->count; i++) {
+		uint32_t rx = multi->member[i].iface->rx - multi->member[i].rx;
+		if (rx > max_rx)
+			max_rx = rx;
+	}
+
+	for (int i = 0; i < multi->count; i++) {
+		multi_member_t * m = &multi->member[i];
+		uint32_t good = csp_multi_good(m->iface);
+		uint32_t bad = csp_multi_bad(m->iface);
+		uint32_t rx = m->iface->rx;
+		uint32_t dgood = good - m->good;
+		uint32_t dbad = bad - m->bad;
+
+		/* Hearing nothing while another member hears the far end */
+		if (rx == m->rx && max_rx >= MULTI_SILENT_RX)
+			dbad += max_rx;
+
+		/* Idle members recover */
+		unsigned int sample = 100;
+		if (dgood + dbad > 0)
+			sample = (uint64_t) dgood * 100 / (dgood + dbad);
+
+		m->health = (3 * m->health + sample + 3) / 4;
+		m->good = good;
+		m->bad = bad;
+		m->rx = rx;
+	}
+
+}
+
+/* Move a member to the front of the order, keeping the others in order */
+static void csp_multi_first(int * order, int member) {
+
+	int j = 0;
+	while (order[j] != member)
+		j++;
+	for (; j > 0; j--)
+		order[j] = order[j - 1];
+	order[0] = member;
+
+}
+
+/* Order members by preference for a packet, the caller holds the lock.
+ * Returns the number of members to use. */
+static int csp_multi_select(csp_iface_t * interface, multi_handle_t * multi, uint32_t now, int * order) {
+
+	int score[CSP_MULTI_MAX_MEMBERS];
+	int count = 0;
+
+	/* Sort by score, members added first win ties */
+	for (int i = 0; i < multi->count; i++) {
+		score[i] = csp_multi_score(&multi->member[i], now);
+		int j = count++;
+		while (j > 0 && score[order[j - 1]] < score[i]) {
+			order[j] = order[j - 1];
+			j--;
+		}
+		order[j] = i;
+	}
+
+	if (count == 0)
+		return 0;
+
+	switch (multi->mode) {
+	case CSP_MULTI_FAILOVER: {
+		/* Stay on the active member unless another is clearly better */
+		int active = multi->active;
+		if (score[active] >= MULTI_MIN_SCORE && score[order[0]] - score[active] <= MULTI_HYSTERESIS)
+			csp_multi_first(order, active);
+		if (order[0] != multi->active) {
+			csp_log_info("%s: traffic moved from %s to %s", interface->name,
+					multi->member[multi->active].iface->name, multi->member[order[0]].iface->name);
+			multi->active = order[0];
+		}
+		return count;
+	}
+
+	case CSP_MULTI_BALANCE: {
+		/* Smooth weighted round robin over the usable members */
+		int total = 0, pick = -1;
+		for (int i = 0; i < multi->count; i++) {
+			if (score[i] < MULTI_MIN_SCORE)
+				continue;
+			multi->member[i].weight += score[i];
+			total += score[i];
+			if (pick < 0 || multi->member[i].weight > multi->member[pick].weight)
+				pick = i;
+		}
+		if (pick < 0)
+			return count;
+		multi->member[pick].weight -= total;
+		csp_multi_first(order, pick);
+		return count;
+	}
+
+	default: {
+		/* Every usable member, or the best if none is usable */
+		int usable = 0;
+		while (usable < count && score[order[usable]] >= MULTI_MIN_SCORE)
+			usable++;
+		return usable > 0 ? usable : 1;
+	}
+	}
+
+}
+
+/* Send a packet on a member */
+static int csp_multi_send(multi_handle_t * multi, multi_member_t * m, csp_packet_t * packet, uint32_t timeout) {
+
+	csp_iface_t * iface = m->iface;
+	uint16_t bytes = packet->length;
+
+	if ((*iface->nexthop)(iface, packet, timeout) != CSP_ERR_NONE) {
+		iface->tx_error++;
+		if (csp_mutex_lock(&multi->lock, CSP_MAX_DELAY) == CSP_MUTEX_OK) {
+			if (!m->down)
+				csp_log_warn("%s failed to send, out of use for %u ms", iface->name, MULTI_HOLDDOWN_MS);
+			m->down = 1;
+			m->down_until = csp_get_ms() + MULTI_HOLDDOWN_MS;
+			csp_mutex_unlock(&multi->lock);
+		}
+		return CSP_ERR_TX;
+	}
+
+	iface->tx++;
+	iface->txbytes += bytes;
+	return CSP_ERR_NONE;
+
+}
+
+static int csp_multi_tx(csp_iface_t * interface, csp_packet_t * packet, uint32_t timeout) {
+
+	multi_handle_t * multi = interface->driver;
+	int order[CSP_MULTI_MAX_MEMBERS];
+
+	if (csp_mutex_lock(&multi->lock, timeout) != CSP_MUTEX_OK)
+		return CSP_ERR_TIMEDOUT;
+
+	uint32_t now = csp_get_ms();
+	csp_multi_update(multi, now);
+	int count = csp_multi_select(interface, multi, now, order);
+
+	csp_mutex_unlock(&multi->lock);
+
+	/* Each member gets a reference to the packet, so none of them
+	 * modifies it, and the caller keeps it if all of them fail */
+	if (multi->mode == CSP_MULTI_DUPLICATE) {
+		int sent = 0;
+		for (int i = 0; i < count; i++) {
+			csp_buffer_refc_inc(packet);
+			if (csp_multi_send(multi, &multi->member[order[i]], packet, timeout) == CSP_ERR_NONE) {
+				sent++;
+			} else {
+				csp_buffer_free(packet);
+			}
+		}
+		if (sent == 0)
+			return CSP_ERR_TX;
+		csp_buffer_free(packet);
+		return CSP_ERR_NONE;
+	}
+
+	/* Fail over to the next member at once */
+	for (int i = 0; i < count; i++) {
+		if (csp_multi_send(multi, &multi->member[order[i]], packet, timeout) == CSP_ERR_NONE)
+			return CSP_ERR_NONE;
+	}
+
+	return CSP_ERR_TX;
+
+}
+
+/* Find a member, returns NULL if not a member */
+static multi_member_t * csp_multi_member(multi_handle_t * multi, csp_iface_t * member) {
+
+	for (int i = 0; i < multi->count; i++) {
+		if (multi->member[i].iface == member)
+			return &multi->member[i];
+	}
+
+	return NULL;
+
+}
+
+int csp_multi_add(csp_iface_t * interface, csp_iface_t * member) {
+
+	if (interface == NULL || interface->driver == NULL || member == NULL || member->nexthop == NULL)
+		return CSP_ERR_INVAL;
+
+	multi_handle_t * multi = interface->driver;
+
+	if (csp_mutex_lock(&multi->lock, CSP_MAX_DELAY) != CSP_MUTEX_OK)
+		return CSP_ERR_TIMEDOUT;
+
+	if (multi->count == CSP_MULTI_MAX_MEMBERS || csp_multi_member(multi, member) != NULL) {
+		csp_mutex_unlock(&multi->lock);
+		return CSP_ERR_INVAL;
+	}
+
+	multi_member_t * m = &multi->member[multi->count];
+	memset(m, 0, sizeof(*m));
+	m->iface = member;
+	m->health = 100;
+	m->good = csp_multi_good(member);
+	m->bad = csp_multi_bad(member);
+	m->rx = member->rx;
+	multi->count++;
+
+	/* Packets must fit on every member */
+	if (member->mtu > 0 && (interface->mtu == 0 || member->mtu < interface->mtu))
+		interface->mtu = member->mtu;
+
+	csp_mutex_unlock(&multi->lock);
+
+	return CSP_ERR_NONE;
+
+}
+
+void csp_multi_set_rssi(csp_iface_t * interface, csp_iface_t * member, int16_t rssi) {
+
+	multi_handle_t * multi = interface->driver;
+
+	if (csp_mutex_lock(&multi->lock, CSP_MAX_DELAY) != CSP_MUTEX_OK)
+		return;
+
+	multi_member_t * m = csp_multi_member(multi, member);
+	if (m != NULL) {
+		m->has_rssi = 1;
+		m->rssi = rssi;
+		m->rssi_time = csp_get_ms();
+	}
+
+	csp_mutex_unlock(&multi->lock);
+
+}
+
+int csp_multi_get_score(csp_iface_t * interface, csp_iface_t * member) {
+
+	multi_handle_t * multi = interface->driver;
+	int score = -1;
+
+	if (csp_mutex_lock(&multi->lock, CSP_MAX_DELAY) != CSP_MUTEX_OK)
+		return -1;
+
+	multi_member_t * m = csp_multi_member(multi, member);
+	if (m != NULL) {
+		uint32_t now = csp_get_ms();
+		csp_multi_update(multi, now);
+		score = csp_multi_score(m, now);
+	}
+
+	csp_mutex_unlock(&multi->lock);
+
+	return score;
+
+}
+
+int csp_multi_init(csp_iface_t * interface, const char * name, uint8_t mode) {
+
+	if (interface == NULL || mode > CSP_MULTI_DUPLICATE)
+		return CSP_ERR_INVAL;
+
+	multi_handle_t * multi = csp_malloc(sizeof(*multi));
+	if (multi == NULL)
+		return CSP_ERR_NOMEM;
+
+	memset(multi, 0, sizeof(*multi));
+	if (csp_mutex_create(&multi->lock) != CSP_MUTEX_OK) {
+		csp_free(multi);
+		return CSP_ERR_NOMEM;
+	}
+
+	multi->mode = mode;
+	multi->updated = csp_get_ms();
+
+	interface->driver = multi;
+	interface->name = name;
+	interface->mtu = 0;
+	interface->nexthop = csp_multi_tx;
+
+	csp_iflist_add(interface);
+
+	return CSP_ERR_NONE;
+
+}
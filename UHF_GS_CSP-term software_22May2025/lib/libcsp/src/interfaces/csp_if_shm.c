@@ -0,0 +1,343 @@
+/*
+Cubesat Space Protocol - A small network-layer protocol designed for Cubesats
+Copyright (C) 2012 GomSpace ApS (http://www.gomspace.com)
+Copyright (C) 2012 AAUSAT3 Project (http://aausat3.space.aau.dk)
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#include <csp/csp.h>
+#include <csp/csp_interface.h>
+#include <csp/interfaces/csp_if_shm.h>
+#include <csp/arch/csp_malloc.h>
+#include <csp/arch/csp_thread.h>
+
+#define SHM_MAGIC		0x4353484d	/* "CSHM" */
+#define SHM_VERSION		1
+#define SHM_CACHE_LINE		64
+/** Default number of slots in each direction */
+#define SHM_SLOTS		256
+/** Number of times the receiver polls an empty ring before it sleeps */
+#define SHM_SPIN		1000
+/** Longest time the receiver sleeps without being woken in ms */
+#define SHM_WAIT_MS		1000
+
+/* Ring control. The producer and consumer indices are on separate cache
+ * lines, so the two processes do not write to the same line. */
+typedef struct {
+	uint32_t head;			/**< Slots written, only written by the producer */
+	uint32_t sleeping;		/**< The consumer is waiting for head to change */
+	uint8_t pad0[SHM_CACHE_LINE - 2 * sizeof(uint32_t)];
+	uint32_t tail;			/**< Slots read, only written by the consumer */
+	uint8_t pad1[SHM_CACHE_LINE - sizeof(uint32_t)];
+} shm_ring_t;
+
+/* Start of the segment, followed by the slots of each ring */
+typedef struct {
+	uint32_t magic;			/**< Written last by the creator */
+	uint32_t version;
+	uint32_t slots;			/**< Slots in each ring, a power of two */
+	uint32_t slot_size;		/**< Size of a slot in bytes */
+	uint8_t pad[SHM_CACHE_LINE - 4 * sizeof(uint32_t)];
+	shm_ring_t ring[2];		/**< Ring 0 is sent by the creator, ring 1 by the other process */
+} shm_header_t;
+
+/* Packet slot */
+typedef struct {
+	uint32_t id;			/**< CSP identifier */
+	uint16_t length;		/**< Data length */
+	uint16_t reserved;
+	uint8_t data[];
+} shm_slot_t;
+
+typedef struct {
+	csp_iface_t * interface;	/**< Interface */
+	shm_header_t * header;		/**< Mapped segment */
+	shm_ring_t * tx;		/**< Ring this process produces */
+	shm_ring_t * rx;		/**< Ring this process consumes */
+	uint8_t * tx_slots;
+	uint8_t * rx_slots;
+	uint32_t mask;			/**< Slots minus one */
+	uint32_t slot_size;
+	pthread_mutex_t lock;		/**< Serialises senders, the ring has a single producer */
+} shm_t;
+
+static inline shm_slot_t * csp_shm_slot(shm_t * shm, uint8_t * slots, uint32_t index) {
+	return (shm_slot_t *) (slots + (index & shm->mask) * shm->slot_size);
+}
+
+/* Send a batch of packets, returns the number sent, which are freed */
+static int csp_shm_tx_batch(csp_iface_t * interface, csp_packet_t ** packets, int count, uint32_t timeout) {
+
+	shm_t * shm = interface->driver;
+	int sent;
+
+	pthread_mutex_lock(&shm->lock);
+
+	uint32_t head = shm->tx->head;
+	uint32_t tail = __atomic_load_n(&shm->tx->tail, __ATOMIC_ACQUIRE);
+
+	for (sent = 0; sent < count; sent++) {
+		csp_packet_t * packet = packets[sent];
+		if (packet->length > interface->mtu)
+			break;
+		if (head - tail > shm->mask) {
+			tail = __atomic_load_n(&shm->tx->tail, __ATOMIC_ACQUIRE);
+			if (head - tail > shm->mask)
+				break;
+		}
+		shm_slot_t * slot = csp_shm_slot(shm, shm->tx_slots, head);
+		slot->id = packet->id.ext;
+		slot->length = packet->length;
+		memcpy(slot->data, packet->data, packet->length);
+		head++;
+	}
+
+	/* Publish the batch, then wake the receiver if it sleeps. The order
+	 * pairs with the receiver setting sleeping before it checks head. */
+	if (sent > 0) {
+		__atomic_store_n(&shm->tx->head, head, __ATOMIC_SEQ_CST);
+		if (__atomic_load_n(&shm->tx->sleeping, __ATOMIC_SEQ_CST))
+			syscall(SYS_futex, &shm->tx->head, FUTEX_WAKE, 1, NULL, NULL, 0);
+	}
+
+	pthread_mutex_unlock(&shm->lock);
+
+	for (int i = 0; i < sent; i++)
+		csp_buffer_free(packets[i]);
+
+	return sent;
+
+}
+
+static int csp_shm_tx(csp_iface_t * interface, csp_packet_t * packet, uint32_t timeout) {
+	return (csp_shm_tx_batch(interface, &packet, 1, timeout) == 1) ? CSP_ERR_NONE : CSP_ERR_NOBUFS;
+}
+
+/* Wait for the ring to move past tail */
+static void csp_shm_wait(shm_ring_t * ring, uint32_t tail) {
+
+	for (int i = 0; i < SHM_SPIN; i++) {
+		if (__atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) != tail)
+			return;
+	}
+
+	__atomic_store_n(&ring->sleeping, 1, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&ring->head, __ATOMIC_SEQ_CST) == tail) {
+		struct timespec ts = {SHM_WAIT_MS / 1000, (SHM_WAIT_MS % 1000) * 1000000};
+		syscall(SYS_futex, &ring->head, FUTEX_WAIT, tail, &ts, NULL, 0);
+	}
+	__atomic_store_n(&ring->sleeping, 0, __ATOMIC_RELAXED);
+
+}
+
+static CSP_DEFINE_TASK(csp_shm_task) {
+
+	shm_t * shm = param;
+	csp_iface_t * interface = shm->interface;
+	uint32_t tail = shm->rx->tail;
+
+	while (1) {
+
+		uint32_t head = __atomic_load_n(&shm->rx->head, __ATOMIC_ACQUIRE);
+		if (head == tail) {
+			csp_shm_wait(shm->rx, tail);
+			continue;
+		}
+
+		/* Copy each slot out and hand it back to the sender at once */
+		while (tail != head) {
+			shm_slot_t * slot = csp_shm_slot(shm, shm->rx_slots, tail);
+			uint16_t length = slot->length;
+			if (length > interface->mtu) {
+				interface->rx_error++;
+			} else {
+				csp_packet_t * packet = csp_buffer_get(length);
+				if (packet == NULL) {
+					interface->drop++;
+				} else {
+					packet->id.ext = slot->id;
+					packet->length = length;
+					memcpy(packet->data, slot->data, length);
+					csp_qfifo_write(packet, interface, NULL);
+				}
+			}
+			tail++;
+			__atomic_store_n(&shm->rx->tail, tail, __ATOMIC_RELEASE);
+		}
+
+	}
+
+	return CSP_TASK_RETURN;
+
+}
+
+/* Create and set up a new segment, returns the mapping or NULL */
+static shm_header_t * csp_shm_create(const char * name, uint32_t slots, uint32_t slot_size, size_t * size) {
+
+	*size = sizeof(shm_header_t) + 2 * (size_t) slots * slot_size;
+
+	/* Replace any old segment, a process still attached to it keeps its own copy */
+	shm_unlink(name);
+	int fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0660);
+	if (fd < 0)
+		return NULL;
+
+	if (ftruncate(fd, *size) != 0) {
+		close(fd);
+		shm_unlink(name);
+		return NULL;
+	}
+
+	shm_header_t * header = mmap(NULL, *size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (header == MAP_FAILED) {
+		shm_unlink(name);
+		return NULL;
+	}
+
+	header->version = SHM_VERSION;
+	header->slots = slots;
+	header->slot_size = slot_size;
+	__atomic_store_n(&header->magic, SHM_MAGIC, __ATOMIC_RELEASE);
+
+	return header;
+
+}
+
+/* Attach to a segment set up by another process, returns the mapping or NULL */
+static shm_header_t * csp_shm_attach(const char * name, size_t * size) {
+
+	struct stat st;
+	int fd = shm_open(name, O_RDWR, 0);
+	if (fd < 0)
+		return NULL;
+
+	if (fstat(fd, &st) != 0 || st.st_size < (off_t) sizeof(shm_header_t)) {
+		close(fd);
+		errno = EINVAL;
+		return NULL;
+	}
+
+	*size = st.st_size;
+	shm_header_t * header = mmap(NULL, *size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (header == MAP_FAILED)
+		return NULL;
+
+	if (__atomic_load_n(&header->magic, __ATOMIC_ACQUIRE) != SHM_MAGIC ||
+			header->version != SHM_VERSION ||
+			header->slots == 0 || (header->slots & (header->slots - 1)) != 0 ||
+			header->slot_size <= sizeof(shm_slot_t) ||
+			*size < sizeof(shm_header_t) + 2 * (size_t) header->slots * header->slot_size) {
+		munmap(header, *size);
+		errno = EINVAL;
+		return NULL;
+	}
+
+	return header;
+
+}
+
+int csp_shm_init(csp_iface_t * interface, const char * name, const struct csp_shm_config * conf) {
+
+	if (interface == NULL || name == NULL || conf == NULL || conf->name == NULL)
+		return CSP_ERR_INVAL;
+
+	int buffer_mtu = csp_buffer_size() - CSP_BUFFER_PACKET_OVERHEAD;
+	if (buffer_mtu <= 0) {
+		csp_log_error("SHM %s needs the CSP buffers to be initialised", name);
+		return CSP_ERR_INVAL;
+	}
+
+	shm_header_t * header;
+	size_t size;
+
+	if (conf->create) {
+		uint32_t slots = conf->slots ? conf->slots : SHM_SLOTS;
+		int mtu = (conf->mtu > 0 && conf->mtu < buffer_mtu) ? conf->mtu : buffer_mtu;
+		if ((slots & (slots - 1)) != 0)
+			return CSP_ERR_INVAL;
+		uint32_t slot_size = (sizeof(shm_slot_t) + mtu + 7) & ~7;
+		header = csp_shm_create(conf->name, slots, slot_size, &size);
+	} else {
+		header = csp_shm_attach(conf->name, &size);
+	}
+
+	if (header == NULL) {
+		csp_log_error("SHM %s cannot %s %s: %s", name, conf->create ? "create" : "attach to", conf->name, strerror(errno));
+		return CSP_ERR_DRIVER;
+	}
+
+	/* Packets are received into CSP buffers, which must hold the largest slot */
+	int mtu = header->slot_size - sizeof(shm_slot_t);
+	if (mtu > UINT16_MAX)
+		mtu = UINT16_MAX;
+	if (mtu > buffer_mtu) {
+		csp_log_error("SHM %s MTU %d is larger than the CSP buffers", name, mtu);
+		munmap(header, size);
+		return CSP_ERR_INVAL;
+	}
+
+	shm_t * shm = csp_malloc(sizeof(*shm));
+	if (shm == NULL) {
+		munmap(header, size);
+		return CSP_ERR_NOMEM;
+	}
+
+	uint8_t * slots = (uint8_t *) (header + 1);
+	size_t ring_size = (size_t) header->slots * header->slot_size;
+	int side = conf->create ? 0 : 1;
+
+	memset(shm, 0, sizeof(*shm));
+	shm->interface = interface;
+	shm->header = header;
+	shm->tx = &header->ring[side];
+	shm->rx = &header->ring[1 - side];
+	shm->tx_slots = slots + side * ring_size;
+	shm->rx_slots = slots + (1 - side) * ring_size;
+	shm->mask = header->slots - 1;
+	shm->slot_size = header->slot_size;
+	pthread_mutex_init(&shm->lock, NULL);
+
+	interface->driver = shm;
+	interface->name = name;
+	interface->nexthop = csp_shm_tx;
+	interface->nexthop_batch = csp_shm_tx_batch;
+	interface->mtu = mtu;
+
+	csp_thread_handle_t handle;
+	if (csp_thread_create(csp_shm_task, "SHM", 1000, shm, 0, &handle) != 0) {
+		csp_log_error("SHM %s failed to start task", name);
+		return CSP_ERR_NOMEM;
+	}
+
+	csp_iflist_add(interface);
+
+	return CSP_ERR_NONE;
+
+}
@@ -0,0 +1,340 @@
+/*
+Cubesat Space Protocol - A small network-layer protocol designed for Cubesats
+Copyright (C) 2012 GomSpace ApS (http://www.gomspace.com)
+Copyright (C) 2012 AAUSAT3 Project (http://aausat3.space.aau.dk)
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include <csp/csp.h>
+#include <csp/csp_endian.h>
+#include <csp/csp_interface.h>
+#include <csp/interfaces/csp_if_udp.h>
+#include <csp/arch/csp_malloc.h>
+#include <csp/arch/csp_thread.h>
+
+/** Largest UDP payload over IPv4 */
+#define UDP_MAX_PAYLOAD		65507
+/** Number of datagrams received per system call */
+#define UDP_RX_BATCH		16
+/** Number of datagrams sent per system call, at least the number of peers */
+#define UDP_TX_BATCH		64
+
+/* Peers are indexed by node, the broadcast address holds the default peer */
+#define UDP_PEERS		(CSP_ID_HOST_MAX + 1)
+#define UDP_DEFAULT_PEER	CSP_BROADCAST_ADDR
+
+typedef struct {
+	csp_iface_t * interface;	/**< Interface */
+	int fd;				/**< Socket */
+	pthread_mutex_t lock;		/**< Protects the peer table while it is in use */
+	struct sockaddr_in peer[UDP_PEERS]; /**< Peer of each node, unset if sin_family is 0 */
+	csp_packet_t * rx[UDP_RX_BATCH]; /**< Buffers waiting to be received into */
+} udp_t;
+
+/* Find the peers of a packet, the caller holds the lock. Returns the number of peers */
+static int csp_udp_peers(udp_t * udp, csp_packet_t * packet, struct sockaddr_in ** peers) {
+
+	int count = 0;
+
+	if (packet->id.dst != CSP_BROADCAST_ADDR) {
+		uint8_t node = csp_rtable_find_mac(packet->id.dst);
+		if (node == CSP_NODE_MAC)
+			node = packet->id.dst;
+		if (node < UDP_PEERS && udp->peer[node].sin_family != 0) {
+			peers[count++] = &udp->peer[node];
+		} else if (udp->peer[UDP_DEFAULT_PEER].sin_family != 0) {
+			peers[count++] = &udp->peer[UDP_DEFAULT_PEER];
+		}
+		return count;
+	}
+
+	/* Broadcasts go to every peer once */
+	for (int i = 0; i < UDP_PEERS; i++) {
+		struct sockaddr_in * peer = &udp->peer[i];
+		if (peer->sin_family == 0)
+			continue;
+		int j;
+		for (j = 0; j < count; j++) {
+			if (peers[j]->sin_port == peer->sin_port && peers[j]->sin_addr.s_addr == peer->sin_addr.s_addr)
+				break;
+		}
+		if (j == count)
+			peers[count++] = peer;
+	}
+
+	return count;
+
+}
+
+/* Send a batch of packets, returns the number sent, which are freed */
+static int csp_udp_tx_batch(csp_iface_t * interface, csp_packet_t ** packets, int count, uint32_t timeout) {
+
+	udp_t * udp = interface->driver;
+	struct mmsghdr msgs[UDP_TX_BATCH];
+	struct iovec iov[UDP_TX_BATCH][2];
+	uint32_t header[UDP_TX_BATCH];
+	int last[UDP_TX_BATCH];
+	int done = 0;
+
+	pthread_mutex_lock(&udp->lock);
+
+	while (done < count) {
+
+		/* Fill the batch with whole packets, one message per peer.
+		 * The identifier is sent from a copy, so shared buffers are
+		 * not modified. */
+		int nmsg = 0, npkt = 0;
+		while (done + npkt < count) {
+			csp_packet_t * packet = packets[done + npkt];
+			struct sockaddr_in * peers[UDP_PEERS];
+			int n = csp_udp_peers(udp, packet, peers);
+			if (n == 0) {
+				csp_log_warn("UDP %s has no peer for node %u", interface->name, packet->id.dst);
+				break;
+			}
+			if (nmsg + n > UDP_TX_BATCH)
+				break;
+			header[npkt] = csp_hton32(packet->id.ext);
+			for (int i = 0; i < n; i++, nmsg++) {
+				iov[nmsg][0].iov_base = &header[npkt];
+				iov[nmsg][0].iov_len = sizeof(header[npkt]);
+				iov[nmsg][1].iov_base = packet->data;
+				iov[nmsg][1].iov_len = packet->length;
+				memset(&msgs[nmsg].msg_hdr, 0, sizeof(msgs[nmsg].msg_hdr));
+				msgs[nmsg].msg_hdr.msg_name = peers[i];
+				msgs[nmsg].msg_hdr.msg_namelen = sizeof(*peers[i]);
+				msgs[nmsg].msg_hdr.msg_iov = iov[nmsg];
+				msgs[nmsg].msg_hdr.msg_iovlen = 2;
+			}
+			last[npkt++] = nmsg;
+		}
+
+		if (npkt == 0)
+			break;
+
+		/* Send until the batch is out or an error stops it */
+		int sent = 0;
+		while (sent < nmsg) {
+			int ret = sendmmsg(udp->fd, &msgs[sent], nmsg - sent, 0);
+			if (ret < 0) {
+				if (errno == EINTR)
+					continue;
+				csp_log_warn("UDP %s send failed: %s", interface->name, strerror(errno));
+				break;
+			}
+			sent += ret;
+		}
+
+		/* Packets are sent once all their messages are */
+		int i;
+		for (i = 0; i < npkt && last[i] <= sent; i++)
+			csp_buffer_free(packets[done + i]);
+		done += i;
+
+		if (i < npkt)
+			break;
+
+	}
+
+	pthread_mutex_unlock(&udp->lock);
+
+	return done;
+
+}
+
+static int csp_udp_tx(csp_iface_t * interface, csp_packet_t * packet, uint32_t timeout) {
+	return (csp_udp_tx_batch(interface, &packet, 1, timeout) == 1) ? CSP_ERR_NONE : CSP_ERR_TX;
+}
+
+static CSP_DEFINE_TASK(csp_udp_task) {
+
+	udp_t * udp = param;
+	csp_iface_t * interface = udp->interface;
+	struct mmsghdr msgs[UDP_RX_BATCH];
+	struct iovec iov[UDP_RX_BATCH];
+	size_t capacity = sizeof(csp_id_t) + interface->mtu;
+
+	while (1) {
+
+		/* Refill the buffers used by the previous call */
+		int count;
+		for (count = 0; count < UDP_RX_BATCH; count++) {
+			if (udp->rx[count] == NULL)
+				udp->rx[count] = csp_buffer_get(interface->mtu);
+			if (udp->rx[count] == NULL)
+				break;
+			/* The identifier is received in front of the data */
+			iov[count].iov_base = &udp->rx[count]->id;
+			iov[count].iov_len = capacity;
+			memset(&msgs[count].msg_hdr, 0, sizeof(msgs[count].msg_hdr));
+			msgs[count].msg_hdr.msg_iov = &iov[count];
+			msgs[count].msg_hdr.msg_iovlen = 1;
+		}
+
+		if (count == 0) {
+			/* Receive and drop the datagram */
+			char dummy;
+			if (recv(udp->fd, &dummy, sizeof(dummy), 0) >= 0)
+				interface->drop++;
+			continue;
+		}
+
+		int received = recvmmsg(udp->fd, msgs, count, MSG_WAITFORONE, NULL);
+		if (received < 0) {
+			if (errno != EINTR)
+				csp_log_error("UDP %s receive failed: %s", interface->name, strerror(errno));
+			continue;
+		}
+
+		for (int i = 0; i < received; i++) {
+			unsigned int length = msgs[i].msg_len;
+			if (length < sizeof(csp_id_t) || (msgs[i].msg_hdr.msg_flags & MSG_TRUNC)) {
+				interface->rx_error++;
+				continue;
+			}
+
+			csp_packet_t * packet = udp->rx[i];
+			udp->rx[i] = NULL;
+			packet->id.ext = csp_ntoh32(packet->id.ext);
+			packet->length = length - sizeof(csp_id_t);
+			csp_qfifo_write(packet, interface, NULL);
+		}
+
+	}
+
+	return CSP_TASK_RETURN;
+
+}
+
+int csp_udp_peer_add(csp_iface_t * interface, uint8_t node, const char * host, uint16_t port) {
+
+	if (interface == NULL || interface->driver == NULL || host == NULL || node >= UDP_PEERS)
+		return CSP_ERR_INVAL;
+
+	udp_t * udp = interface->driver;
+	struct addrinfo hints, * result;
+	char service[6];
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_DGRAM;
+	snprintf(service, sizeof(service), "%u", port);
+
+	int err = getaddrinfo(host, service, &hints, &result);
+	if (err != 0) {
+		csp_log_error("UDP %s cannot resolve %s: %s", interface->name, host, gai_strerror(err));
+		return CSP_ERR_INVAL;
+	}
+
+	pthread_mutex_lock(&udp->lock);
+	memcpy(&udp->peer[node], result->ai_addr, sizeof(udp->peer[node]));
+	pthread_mutex_unlock(&udp->lock);
+
+	freeaddrinfo(result);
+
+	return CSP_ERR_NONE;
+
+}
+
+int csp_udp_init(csp_iface_t * interface, const char * name, const struct csp_udp_config * conf) {
+
+	if (interface == NULL || name == NULL || conf == NULL)
+		return CSP_ERR_INVAL;
+
+	/* Datagrams are received straight into CSP buffers, so the MTU is
+	 * bounded by the buffer size as well as by UDP */
+	int mtu = csp_buffer_size() - CSP_BUFFER_PACKET_OVERHEAD;
+	if (mtu > UDP_MAX_PAYLOAD - (int) sizeof(csp_id_t))
+		mtu = UDP_MAX_PAYLOAD - sizeof(csp_id_t);
+	if (conf->mtu > 0 && conf->mtu < mtu)
+		mtu = conf->mtu;
+	if (mtu <= 0) {
+		csp_log_error("UDP %s needs the CSP buffers to be initialised", name);
+		return CSP_ERR_INVAL;
+	}
+
+	udp_t * udp = csp_malloc(sizeof(*udp));
+	if (udp == NULL)
+		return CSP_ERR_NOMEM;
+
+	memset(udp, 0, sizeof(*udp));
+	udp->interface = interface;
+	pthread_mutex_init(&udp->lock, NULL);
+
+	udp->fd = socket(AF_INET, SOCK_DGRAM, 0);
+	if (udp->fd < 0)
+		goto err;
+
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_ANY);
+	addr.sin_port = htons(conf->lport);
+	if (bind(udp->fd, (struct sockaddr *) &addr, sizeof(addr)) != 0)
+		goto err;
+
+	if (conf->busy_poll > 0) {
+#ifdef SO_BUSY_POLL
+		if (setsockopt(udp->fd, SOL_SOCKET, SO_BUSY_POLL, &conf->busy_poll, sizeof(conf->busy_poll)) != 0)
+			csp_log_warn("UDP %s cannot set busy poll: %s", name, strerror(errno));
+#else
+		csp_log_warn("UDP %s busy poll is not supported", name);
+#endif
+	}
+
+	interface->driver = udp;
+	interface->name = name;
+	interface->nexthop = csp_udp_tx;
+	interface->nexthop_batch = csp_udp_tx_batch;
+	interface->mtu = mtu;
+
+	if (conf->host != NULL && csp_udp_peer_add(interface, UDP_DEFAULT_PEER, conf->host, conf->port) != CSP_ERR_NONE) {
+		interface->driver = NULL;
+		close(udp->fd);
+		csp_free(udp);
+		return CSP_ERR_INVAL;
+	}
+
+	csp_thread_handle_t handle;
+	if (csp_thread_create(csp_udp_task, "UDP", 1000, udp, 0, &handle) != 0) {
+		csp_log_error("UDP %s failed to start task", name);
+		return CSP_ERR_NOMEM;
+	}
+
+	csp_iflist_add(interface);
+
+	return CSP_ERR_NONE;
+
+err:
+	csp_log_error("UDP %s cannot open port %u: %s", name, conf->lport, strerror(errno));
+	if (udp->fd >= 0)
+		close(udp->fd);
+	csp_free(udp);
+	return CSP_ERR_DRIVER;
+
+}
@@ -18,85 +18,181 @@ License along with this library; if not, write to the Free Software
 Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
 */
 
-#include <assert.h>
+#include <stdio.h>
+#include <string.h>
 
 /* CSP includes */
 #include <csp/csp.h>
 #include <csp/csp_debug.h>
 #include <csp/csp_interface.h>
+#include <csp/arch/csp_malloc.h>
+#include <csp/arch/csp_semaphore.h>
 #include <csp/arch/csp_thread.h>
 #include <csp/interfaces/csp_if_zmqhub.h>
 
 /* ZMQ */
 #include <zmq.h>
 
+/* Messages are the destination mac, followed by the CSP identifier and data */
+#define ZMQHUB_OVERHEAD		(sizeof(char) + sizeof(csp_id_t))
+
+/* Per interface state */
+typedef struct {
+	void * publisher;		/**< Socket packets are sent on */
+	void * subscriber;		/**< Socket packets are received on */
+	csp_mutex_t lock;		/**< ZMQ sockets may only be used by one thread at a time */
+} zmqhub_t;
+
+/* One context is shared by all hub interfaces */
 static void * context;
-static void * publisher;
-static void * subscriber;
 
-/**
- * Interface transmit function
- * @param packet Packet to transmit
- * @param timeout Timout in ms
- * @return 1 if packet was successfully transmitted, 0 on error
- */
-int csp_zmqhub_tx(csp_iface_t * interface, csp_packet_t * packet, uint32_t timeout) {
+/* Called by ZMQ when a zero copy message has been sent */
+static void csp_zmqhub_free(void * data, void * hint) {
+	csp_buffer_free(hint);
+}
+
+/* Send one packet, the caller holds the lock */
+static int csp_zmqhub_send(zmqhub_t * hub, csp_packet_t * packet) {
 
 	/* Send envelope */
 	char satid = (char) csp_rtable_find_mac(packet->id.dst);
 	if (satid == (char) 255)
 		satid = packet->id.dst;
 
+	int result;
 	uint16_t length = packet->length;
+	if (csp_buffer_refc(packet) > 1) {
+		/* The byte before the id is part of the length field, which
+		 * must not be modified in a shared buffer, so send a copy */
+		char frame[ZMQHUB_OVERHEAD + length];
+		frame[0] = satid;
+		memcpy(&frame[1], &packet->id, sizeof(packet->id) + length);
+		result = zmq_send(hub->publisher, frame, sizeof(frame), 0);
+		if (result < 0)
+			return CSP_ERR_TX;
+		csp_buffer_free(packet);
+		return CSP_ERR_NONE;
+	}
+
+	/* Hand the buffer itself to ZMQ, which frees it once it is sent.
+	 * The envelope overwrites the high byte of the length field, which
+	 * is restored if the buffer is given back to the caller. */
 	char * satidptr = ((char *) &packet->id) - 1;
-	memcpy(satidptr, &satid, 1);
-	int result = zmq_send(publisher, satidptr, length + sizeof(packet->id) + sizeof(char), 0);
-	if (result < 0)
-		csp_log_error("ZMQ send error: %u %s\r\n", result, strerror(result));
+	char saved = *satidptr;
+	*satidptr = satid;
 
-	csp_buffer_free(packet);
+	zmq_msg_t msg;
+	if (zmq_msg_init_data(&msg, satidptr, ZMQHUB_OVERHEAD + length, csp_zmqhub_free, packet) != 0) {
+		*satidptr = saved;
+		return CSP_ERR_NOMEM;
+	}
+
+	result = zmq_msg_send(&msg, hub->publisher, 0);
+	if (result < 0) {
+		/* Closing the message frees the buffer, keep it for the caller */
+		csp_buffer_refc_inc(packet);
+		zmq_msg_close(&msg);
+		*satidptr = saved;
+		return CSP_ERR_TX;
+	}
 
 	return CSP_ERR_NONE;
 
 }
 
+/**
+ * Interface transmit function
+ * @param packet Packet to transmit
+ * @param timeout Timout in ms
+ * @return CSP_ERR_NONE if packet was successfully transmitted, CSP_ERR type on error
+ */
+int csp_zmqhub_tx(csp_iface_t * interface, csp_packet_t * packet, uint32_t timeout) {
+
+	zmqhub_t * hub = interface->driver;
+
+	if (csp_mutex_lock(&hub->lock, timeout) != CSP_MUTEX_OK)
+		return CSP_ERR_TIMEDOUT;
+
+	int result = csp_zmqhub_send(hub, packet);
+	if (result != CSP_ERR_NONE)
+		csp_log_error("ZMQ send error: %s", zmq_strerror(zmq_errno()));
+
+	csp_mutex_unlock(&hub->lock);
+
+	return result;
+
+}
+
+/* Send a batch of packets, taking the lock once */
+static int csp_zmqhub_tx_batch(csp_iface_t * interface, csp_packet_t ** packets, int count, uint32_t timeout) {
+
+	zmqhub_t * hub = interface->driver;
+	int sent;
+
+	if (csp_mutex_lock(&hub->lock, timeout) != CSP_MUTEX_OK)
+		return 0;
+
+	for (sent = 0; sent < count; sent++) {
+		if (csp_zmqhub_send(hub, packets[sent]) != CSP_ERR_NONE) {
+			csp_log_error("ZMQ send error: %s", zmq_strerror(zmq_errno()));
+			break;
+		}
+	}
+
+	csp_mutex_unlock(&hub->lock);
+
+	return sent;
+
+}
+
 CSP_DEFINE_TASK(csp_zmqhub_task) {
 
+	csp_iface_t * interface = param;
+	zmqhub_t * hub = interface->driver;
+
+	/* Packets are received directly into CSP buffers of the full size */
+	size_t capacity = csp_buffer_size() - CSP_BUFFER_PACKET_OVERHEAD;
+
 	while(1) {
-		zmq_msg_t msg;
-		assert(zmq_msg_init_size(&msg, 1024) == 0);
+
+		csp_packet_t * packet = csp_buffer_get(capacity);
+		if (packet == NULL) {
+			/* Receive and drop the message */
+			char dummy;
+			if (zmq_recv(hub->subscriber, &dummy, sizeof(dummy), 0) >= 0)
+				interface->drop++;
+			continue;
+		}
 
 		/* Receive data */
-		if (zmq_msg_recv(&msg, subscriber, 0) < 0) {
-			zmq_msg_close(&msg);
+		char * satidptr = ((char *) &packet->id) - 1;
+		int datalen = zmq_recv(hub->subscriber, satidptr, ZMQHUB_OVERHEAD + capacity, 0);
+		if (datalen < 0) {
 			csp_log_error("ZMQ: %s", zmq_strerror(zmq_errno()));
+			csp_buffer_free(packet);
 			continue;
 		}
 
-		int datalen = zmq_msg_size(&msg);
-		if (datalen < 5) {
+		if (datalen < (int) ZMQHUB_OVERHEAD) {
 			csp_log_warn("ZMQ: Too short datalen: %u", datalen);
-			while(zmq_msg_recv(&msg, subscriber, ZMQ_NOBLOCK) > 0)
-			zmq_msg_close(&msg);
+			interface->rx_error++;
+			csp_buffer_free(packet);
 			continue;
 		}
 
-		/* Create new csp packet */
-		csp_packet_t * packet = csp_buffer_get(256);
-		if (packet == NULL) {
-			zmq_msg_close(&msg);
+		/* ZMQ reports the full length of a message that was truncated */
+		if (datalen > (int) (ZMQHUB_OVERHEAD + capacity)) {
+			csp_log_warn("ZMQ: Too long datalen: %u", datalen);
+			interface->rx_error++;
+			csp_buffer_free(packet);
 			continue;
 		}
 
-		/* Copy the data from zmq to csp */
-		char * satidptr = ((char *) &packet->id) - 1;
-		memcpy(satidptr, zmq_msg_data(&msg), datalen);
-		packet->length = datalen - 4 - 1;
+		packet->length = datalen - ZMQHUB_OVERHEAD;
 
 		/* Queue up packet to router */
-		csp_qfifo_write(packet, &csp_if_zmqhub, NULL);
+		csp_qfifo_write(packet, interface, NULL);
 
-		zmq_msg_close(&msg);
 	}
 
 	return CSP_TASK_RETURN;
@@ -115,41 +211,78 @@ int csp_zmqhub_init(char _addr, char * host) {
 
 int csp_zmqhub_init_w_endpoints(char _addr, char * publisher_endpoint,
 		char * subscriber_endpoint) {
+	return csp_zmqhub_init_iface(&csp_if_zmqhub, csp_if_zmqhub.name, _addr, publisher_endpoint, subscriber_endpoint);
+}
+
+int csp_zmqhub_init_iface(csp_iface_t * interface, const char * name, char addr,
+		const char * publisher_endpoint, const char * subscriber_endpoint) {
 
-	context = zmq_ctx_new();
-	assert(context);
+	if (context == NULL) {
+		context = zmq_ctx_new();
+		if (context == NULL) {
+			csp_log_error("ZMQ: %s", zmq_strerror(zmq_errno()));
+			return CSP_ERR_DRIVER;
+		}
+	}
 
-	char addr = _addr;
+	zmqhub_t * hub = csp_malloc(sizeof(*hub));
+	if (hub == NULL)
+		return CSP_ERR_NOMEM;
+
+	if (csp_mutex_create(&hub->lock) != CSP_MUTEX_OK) {
+		csp_free(hub);
+		return CSP_ERR_NOMEM;
+	}
 
 	csp_log_info("INIT ZMQ with addr %hhu to servers %s / %s\r\n", addr,
 		publisher_endpoint, subscriber_endpoint);
 
 	/* Publisher (TX) */
-    publisher = zmq_socket(context, ZMQ_PUB);
-    assert(publisher);
-    assert(zmq_connect(publisher, publisher_endpoint) == 0);
+	hub->publisher = zmq_socket(context, ZMQ_PUB);
+	hub->subscriber = NULL;
+	if (hub->publisher == NULL || zmq_connect(hub->publisher, publisher_endpoint) != 0)
+		goto err;
 
-    /* Subscriber (RX) */
-    subscriber = zmq_socket(context, ZMQ_SUB);
-    assert(subscriber);
-	assert(zmq_connect(subscriber, subscriber_endpoint) == 0);
+	/* Subscriber (RX) */
+	hub->subscriber = zmq_socket(context, ZMQ_SUB);
+	if (hub->subscriber == NULL || zmq_connect(hub->subscriber, subscriber_endpoint) != 0)
+		goto err;
 
 	if (addr == (char) 255) {
-		assert(zmq_setsockopt(subscriber, ZMQ_SUBSCRIBE, "", 0) == 0);
+		if (zmq_setsockopt(hub->subscriber, ZMQ_SUBSCRIBE, "", 0) != 0)
+			goto err;
 	} else {
-		assert(zmq_setsockopt(subscriber, ZMQ_SUBSCRIBE, &addr, 1) == 0);
+		if (zmq_setsockopt(hub->subscriber, ZMQ_SUBSCRIBE, &addr, 1) != 0)
+			goto err;
 	}
 
+	interface->driver = hub;
+	interface->name = name;
+	interface->nexthop = csp_zmqhub_tx;
+	interface->nexthop_batch = csp_zmqhub_tx_batch;
+
 	/* Start RX thread */
-	static csp_thread_handle_t handle_subscriber;
-	int ret = csp_thread_create(csp_zmqhub_task, "ZMQ", 10000, NULL, 0, &handle_subscriber);
+	csp_thread_handle_t handle_subscriber;
+	int ret = csp_thread_create(csp_zmqhub_task, "ZMQ", 10000, interface, 0, &handle_subscriber);
 	csp_log_info("Task start %d\r\n", ret);
+	if (ret != 0)
+		return CSP_ERR_NOMEM;
 
 	/* Regsiter interface */
-	csp_iflist_add(&csp_if_zmqhub);
+	csp_iflist_add(interface);
 
 	return CSP_ERR_NONE;
 
+err:
+	csp_log_error("ZMQ: %s", zmq_strerror(zmq_errno()));
+	if (hub->subscriber != NULL)
+		zmq_close(hub->subscriber);
+	if (hub->publisher != NULL)
+		zmq_close(hub->publisher);
+	csp_mutex_remove(&hub->lock);
+	csp_free(hub);
+	return CSP_ERR_DRIVER;
+
 }
 
 /* Interface definition */
@@ -37,6 +37,19 @@ typedef struct __attribute__((__packed__)) csp_rtable_s {
 /* Routing entries are stored in a linked list*/
 static csp_rtable_t * rtable = NULL;
 
+/* Lookups use a table with the resolved route for each host address. It is
+ * rebuilt from the linked list after every change, in the copy not in use,
+ * and then published with a single pointer store. Readers never walk the
+ * list, and never see a half-updated table. Changes to the routing table
+ * must not be made from more than one task at a time. */
+typedef struct {
+	csp_iface_t * interface;
+	uint8_t mac;
+} csp_rtable_route_t;
+
+static csp_rtable_route_t rtable_routes[2][CSP_ID_HOST_MAX + 1];
+static csp_rtable_route_t * rtable_active = rtable_routes[0];
+
 static csp_rtable_t * csp_rtable_find(uint8_t addr, uint8_t netmask, uint8_t exact) {
 
 	/* Remember best result */
@@ -88,6 +101,22 @@ static csp_rtable_t * csp_rtable_find(uint8_t addr, uint8_t netmask, uint8_t exa
 
 }
 
+static void csp_rtable_compile(void) {
+
+	csp_rtable_route_t * routes = rtable_routes[0];
+	if (__atomic_load_n(&rtable_active, __ATOMIC_ACQUIRE) == routes)
+		routes = rtable_routes[1];
+
+	for (int id = 0; id <= CSP_ID_HOST_MAX; id++) {
+		csp_rtable_t * entry = csp_rtable_find(id, CSP_ID_HOST_SIZE, 0);
+		routes[id].interface = entry ? entry->interface : NULL;
+		routes[id].mac = entry ? entry->mac : CSP_NODE_MAC;
+	}
+
+	__atomic_store_n(&rtable_active, routes, __ATOMIC_RELEASE);
+
+}
+
 void csp_rtable_clear(void) {
 	for (csp_rtable_t * i = rtable; (i);) {
 		void * freeme = i;
@@ -158,17 +187,23 @@ int csp_rtable_save(char * buffer, int maxlen) {
 }
 
 csp_iface_t * csp_rtable_find_iface(uint8_t id) {
-	csp_rtable_t * entry = csp_rtable_find(id, CSP_ID_HOST_SIZE, 0);
-	if (entry == NULL)
-		return NULL;
-	return entry->interface;
+	if (id > CSP_ID_HOST_MAX) {
+		csp_rtable_t * entry = csp_rtable_find(id, CSP_ID_HOST_SIZE, 0);
+		if (entry == NULL)
+			return NULL;
+		return entry->interface;
+	}
+	return __atomic_load_n(&rtable_active, __ATOMIC_ACQUIRE)[id].interface;
 }
 
 uint8_t csp_rtable_find_mac(uint8_t id) {
-	csp_rtable_t * entry = csp_rtable_find(id, CSP_ID_HOST_SIZE, 0);
-	if (entry == NULL)
-		return 255;
-	return entry->mac;
+	if (id > CSP_ID_HOST_MAX) {
+		csp_rtable_t * entry = csp_rtable_find(id, CSP_ID_HOST_SIZE, 0);
+		if (entry == NULL)
+			return 255;
+		return entry->mac;
+	}
+	return __atomic_load_n(&rtable_active, __ATOMIC_ACQUIRE)[id].mac;
 }
 
 int csp_rtable_set(uint8_t _address, uint8_t _netmask, csp_iface_t *ifc, uint8_t mac) {
@@ -215,6 +250,9 @@ int csp_rtable_set(uint8_t _address, uint8_t _netmask, csp_iface_t *ifc, uint8_t
 	entry->interface = ifc;
 	entry->mac = mac;
 
+	/* Publish new lookup table */
+	csp_rtable_compile();
+
 	return CSP_ERR_NONE;
 }
 
@@ -0,0 +1,463 @@
+/*
+Cubesat Space Protocol - A small network-layer protocol designed for Cubesats
+Copyright (C) 2012 GomSpace ApS (http://www.gomspace.com)
+Copyright (C) 2012 AAUSAT3 Project (http://aausat3.space.aau.dk)
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <csp/csp.h>
+#include <csp/csp_endian.h>
+#include <csp/csp_fec.h>
+#include <csp/arch/csp_malloc.h>
+
+#include "../csp_conn.h"
+
+/** FEC header, appended to each symbol */
+typedef struct __attribute__((__packed__)) {
+	uint32_t totalsize;	/**< Size of the data */
+	uint16_t block;		/**< Block number */
+	uint8_t k;		/**< Source symbols per block, the last block may have fewer */
+	uint8_t r;		/**< Repair symbols per block */
+	uint8_t index;		/**< Symbol index, repair symbols follow the source symbols */
+} fec_header_t;
+
+/** Status sent by the receiver when the stream has ended */
+typedef struct __attribute__((__packed__)) {
+	uint16_t blocks;	/**< Number of blocks in the transfer */
+	uint16_t lost;		/**< Blocks that could not be rebuilt */
+} fec_status_t;
+
+/**
+ * GF(256) arithmetic:
+ * Uses the polynomial x^8 + x^4 + x^3 + x^2 + 1. The exp table is doubled so
+ * the sum of two logarithms can index it directly. Symbols are multiplied
+ * with a full table, which holds one row of products per coefficient.
+ */
+static uint8_t gf_exp[512];
+static uint8_t gf_log[256];
+static uint8_t gf_table[256][256];
+static int gf_ready = 0;
+
+static void gf_init(void) {
+
+	if (gf_ready)
+		return;
+
+	unsigned int x = 1;
+	for (int i = 0; i < 255; i++) {
+		gf_exp[i] = x;
+		gf_log[x] = i;
+		x <<= 1;
+		if (x & 0x100)
+			x ^= 0x11d;
+	}
+	for (int i = 255; i < 512; i++)
+		gf_exp[i] = gf_exp[i - 255];
+
+	for (int c = 1; c < 256; c++)
+		for (int b = 1; b < 256; b++)
+			gf_table[c][b] = gf_exp[gf_log[b] + gf_log[c]];
+
+	gf_ready = 1;
+
+}
+
+static inline uint8_t gf_mul(uint8_t a, uint8_t b) {
+	if (a == 0 || b == 0)
+		return 0;
+	return gf_exp[gf_log[a] + gf_log[b]];
+}
+
+static inline uint8_t gf_inv(uint8_t a) {
+	return gf_exp[255 - gf_log[a]];
+}
+
+/* dst += c * src, using the multiplication table row of c */
+static void gf_addmul(uint8_t * dst, const uint8_t * src, uint8_t c, int size) {
+
+	if (c == 0)
+		return;
+
+	const uint8_t * table = gf_table[c];
+	for (int n = 0; n < size; n++)
+		dst[n] ^= table[src[n]];
+
+}
+
+/**
+ * Coefficient of source symbol i in repair symbol j. The repair symbols are
+ * the rows of a Cauchy matrix with x_j = k + j and y_i = i, so any square
+ * submatrix can be inverted and any k symbols rebuild the block.
+ */
+static inline uint8_t fec_coef(int k, int j, int i) {
+	return gf_inv((k + j) ^ i);
+}
+
+void csp_fec_encode(int k, int r, int size, uint8_t * const * src, uint8_t * const * repair) {
+
+	gf_init();
+
+	for (int j = 0; j < r; j++) {
+		memset(repair[j], 0, size);
+		for (int i = 0; i < k; i++)
+			gf_addmul(repair[j], src[i], fec_coef(k, j, i), size);
+	}
+
+}
+
+int csp_fec_decode(int k, int size, uint8_t * const * src, const uint8_t * present, uint8_t * const * repair, const uint8_t * repair_index, int repairs) {
+
+	gf_init();
+
+	uint8_t missing[255];
+	int m = 0;
+	for (int i = 0; i < k; i++)
+		if (!present[i])
+			missing[m++] = i;
+
+	if (m == 0)
+		return 0;
+	if (m > repairs)
+		return -1;
+
+	/* Allocate first, the repair symbols must be left as they are on failure */
+	uint8_t * mat = csp_malloc(2 * m * m);
+	if (mat == NULL)
+		return -1;
+	uint8_t * inv = mat + m * m;
+
+	/* Remove the known source symbols from the repair symbols used */
+	for (int a = 0; a < m; a++)
+		for (int i = 0; i < k; i++)
+			if (present[i])
+				gf_addmul(repair[a], src[i], fec_coef(k, repair_index[a], i), size);
+
+	/* Invert the m x m matrix of coefficients of the missing symbols */
+	for (int a = 0; a < m; a++) {
+		for (int b = 0; b < m; b++) {
+			mat[a * m + b] = fec_coef(k, repair_index[a], missing[b]);
+			inv[a * m + b] = (a == b);
+		}
+	}
+
+	for (int c = 0; c < m; c++) {
+
+		/* Find pivot, there is none if a repair symbol was given twice */
+		int p = c;
+		while (p < m && mat[p * m + c] == 0)
+			p++;
+		if (p == m) {
+			csp_free(mat);
+			return -1;
+		}
+
+		if (p != c) {
+			for (int b = 0; b < m; b++) {
+				uint8_t t = mat[c * m + b];
+				mat[c * m + b] = mat[p * m + b];
+				mat[p * m + b] = t;
+				t = inv[c * m + b];
+				inv[c * m + b] = inv[p * m + b];
+				inv[p * m + b] = t;
+			}
+		}
+
+		uint8_t scale = gf_inv(mat[c * m + c]);
+		for (int b = 0; b < m; b++) {
+			mat[c * m + b] = gf_mul(mat[c * m + b], scale);
+			inv[c * m + b] = gf_mul(inv[c * m + b], scale);
+		}
+
+		for (int a = 0; a < m; a++) {
+			uint8_t f = mat[a * m + c];
+			if (a == c || f == 0)
+				continue;
+			for (int b = 0; b < m; b++) {
+				mat[a * m + b] ^= gf_mul(f, mat[c * m + b]);
+				inv[a * m + b] ^= gf_mul(f, inv[c * m + b]);
+			}
+		}
+
+	}
+
+	/* Missing symbols are the inverse applied to the reduced repair symbols */
+	for (int b = 0; b < m; b++) {
+		memset(src[missing[b]], 0, size);
+		for (int a = 0; a < m; a++)
+			gf_addmul(src[missing[b]], repair[a], inv[b * m + a], size);
+	}
+
+	csp_free(mat);
+	return 0;
+
+}
+
+static int csp_fec_send_symbol(csp_conn_t * conn, const uint8_t * symbol, int size, const fec_header_t * header, uint32_t timeout) {
+
+	csp_packet_t * packet = csp_buffer_get(size + sizeof(fec_header_t));
+	if (packet == NULL)
+		return CSP_ERR_NOBUFS;
+
+	memcpy(packet->data, symbol, size);
+	memcpy(&packet->data[size], header, sizeof(fec_header_t));
+	packet->length = size + sizeof(fec_header_t);
+
+	if (!csp_send(conn, packet, timeout)) {
+		csp_buffer_free(packet);
+		return CSP_ERR_TX;
+	}
+
+	return CSP_ERR_NONE;
+
+}
+
+int csp_fec_send(csp_conn_t * conn, const void * data, int totalsize, int k, int r, int mtu, uint32_t timeout) {
+
+	if (conn == NULL || data == NULL || totalsize <= 0 || mtu <= 0 || k < 1 || r < 0 || k + r > 255)
+		return CSP_ERR_INVAL;
+	if (mtu + sizeof(fec_header_t) > csp_buffer_size() - CSP_BUFFER_PACKET_OVERHEAD)
+		return CSP_ERR_INVAL;
+
+	int symbols = (totalsize + mtu - 1) / mtu;
+	int blocks = (symbols + k - 1) / k;
+	if (blocks > UINT16_MAX)
+		return CSP_ERR_INVAL;
+
+	/* Symbol pointers, repair symbols and a padded copy of the last symbol */
+	uint8_t ** src = csp_malloc((k + r) * sizeof(uint8_t *) + (r + 1) * mtu);
+	if (src == NULL)
+		return CSP_ERR_NOMEM;
+	uint8_t ** repair = src + k;
+	uint8_t * scratch = (uint8_t *) (repair + r);
+	for (int j = 0; j < r; j++)
+		repair[j] = scratch + j * mtu;
+	uint8_t * pad = scratch + r * mtu;
+
+	fec_header_t header;
+	header.totalsize = csp_hton32(totalsize);
+	header.k = k;
+	header.r = r;
+
+	/* Mark packets as fragments, as for SFP */
+	conn->idout.flags |= CSP_FFRAG;
+
+	int ret = CSP_ERR_NONE;
+	for (int b = 0; b < blocks && ret == CSP_ERR_NONE; b++) {
+
+		int first = b * k;
+		int kb = (symbols - first < k) ? symbols - first : k;
+
+		for (int i = 0; i < kb; i++) {
+			int offset = (first + i) * mtu;
+			if (offset + mtu <= totalsize) {
+				src[i] = (uint8_t *) data + offset;
+			} else {
+				memcpy(pad, (const uint8_t *) data + offset, totalsize - offset);
+				memset(pad + totalsize - offset, 0, offset + mtu - totalsize);
+				src[i] = pad;
+			}
+		}
+
+		csp_fec_encode(kb, r, mtu, src, repair);
+
+		csp_debug(CSP_PROTOCOL, "Sending FEC block %u/%u, %u+%u symbols", b + 1, blocks, kb, r);
+
+		header.block = csp_hton16(b);
+		for (int i = 0; i < kb + r && ret == CSP_ERR_NONE; i++) {
+			header.index = i;
+			ret = csp_fec_send_symbol(conn, (i < kb) ? src[i] : repair[i - kb], mtu, &header, timeout);
+		}
+
+	}
+
+	csp_free(src);
+
+	if (ret != CSP_ERR_NONE)
+		return ret;
+
+	/* Wait for the receiver status */
+	csp_packet_t * packet = csp_read(conn, timeout);
+	if (packet == NULL)
+		return CSP_ERR_TIMEDOUT;
+
+	if (packet->length != sizeof(fec_status_t)) {
+		csp_buffer_free(packet);
+		return CSP_ERR_INVAL;
+	}
+
+	fec_status_t status;
+	memcpy(&status, packet->data, sizeof(status));
+	csp_buffer_free(packet);
+
+	return csp_ntoh16(status.lost);
+
+}
+
+int csp_fec_recv(csp_conn_t * conn, void ** dataout, int * datasize, uint32_t timeout) {
+
+	uint32_t totalsize = 0;
+	int size = 0, k = 0, r = 0, blocks = 0, symbols = 0;
+
+	/* Current block */
+	int cur = -1, kb = 0, have = 0, repairs = 0, done = 0;
+	uint8_t present[255];
+	uint8_t repair_index[255];
+
+	int decoded = 0;
+	uint8_t ** src = NULL;
+	uint8_t ** repair = NULL;
+
+	if (conn == NULL || dataout == NULL || datasize == NULL)
+		return -1;
+
+	csp_packet_t * packet;
+	while ((packet = csp_read(conn, timeout)) != NULL) {
+
+		/* Check that FEC header is present */
+		if ((packet->id.flags & CSP_FFRAG) == 0 || packet->length <= sizeof(fec_header_t)) {
+			csp_debug(CSP_ERROR, "Missing FEC header");
+			csp_buffer_free(packet);
+			continue;
+		}
+
+		fec_header_t header;
+		int len = packet->length - sizeof(fec_header_t);
+		memcpy(&header, &packet->data[len], sizeof(header));
+		header.totalsize = csp_ntoh32(header.totalsize);
+		header.block = csp_ntoh16(header.block);
+
+		/* The first symbol sets up the transfer */
+		if (src == NULL) {
+			if (header.totalsize == 0 || header.totalsize > CSP_FEC_RECV_MAX || header.k < 1 || header.k + header.r > 255) {
+				csp_buffer_free(packet);
+				continue;
+			}
+
+			totalsize = header.totalsize;
+			size = len;
+			k = header.k;
+			r = header.r;
+			symbols = (totalsize + size - 1) / size;
+			blocks = (symbols + k - 1) / k;
+
+			int allocated = 0;
+			if (*dataout == NULL) {
+				*dataout = csp_malloc((size_t) symbols * size);
+				allocated = 1;
+			}
+			src = csp_malloc((k + r) * sizeof(uint8_t *) + r * size);
+			if (*dataout == NULL || src == NULL) {
+				csp_debug(CSP_ERROR, "No dyn-memory for FEC transfer");
+				if (allocated) {
+					csp_free(*dataout);
+					*dataout = NULL;
+				}
+				csp_buffer_free(packet);
+				break;
+			}
+			*datasize = totalsize;
+			repair = src + k;
+			for (int j = 0; j < r; j++)
+				repair[j] = (uint8_t *) (repair + r) + j * size;
+		}
+
+		if (header.totalsize != totalsize || len != size || header.k != k || header.r != r || header.block >= blocks) {
+			csp_debug(CSP_ERROR, "FEC symbol does not match transfer");
+			csp_buffer_free(packet);
+			continue;
+		}
+
+		/* A new block starts, symbols of earlier blocks are dropped */
+		if ((int) header.block != cur) {
+			if ((int) header.block < cur) {
+				csp_buffer_free(packet);
+				continue;
+			}
+			cur = header.block;
+			kb = (symbols - cur * k < k) ? symbols - cur * k : k;
+			have = 0;
+			repairs = 0;
+			done = 0;
+			memset(present, 0, kb);
+			for (int i = 0; i < kb; i++)
+				src[i] = (uint8_t *) *dataout + (cur * k + i) * size;
+		}
+
+		int last = (cur == blocks - 1) && (header.index >= kb + r - 1);
+
+		if (!done && header.index < kb + r) {
+			if (header.index < kb) {
+				if (!present[header.index]) {
+					memcpy(src[header.index], packet->data, size);
+					present[header.index] = 1;
+					have++;
+				}
+			} else {
+				int j = header.index - kb, dup = 0;
+				for (int a = 0; a < repairs; a++)
+					if (repair_index[a] == j)
+						dup = 1;
+				if (!dup) {
+					memcpy(repair[repairs], packet->data, size);
+					repair_index[repairs++] = j;
+					have++;
+				}
+			}
+
+			if (have >= kb && csp_fec_decode(kb, size, src, present, repair, repair_index, repairs) == 0) {
+				csp_debug(CSP_PROTOCOL, "FEC block %u/%u complete", cur + 1, blocks);
+				done = 1;
+				decoded++;
+			}
+		}
+
+		csp_buffer_free(packet);
+
+		/* Stop at the end of the stream */
+		if (last)
+			break;
+
+	}
+
+	csp_free(src);
+
+	if (blocks == 0)
+		return -1;
+
+	/* Reply with the status */
+	csp_packet_t * reply = csp_buffer_get(sizeof(fec_status_t));
+	if (reply != NULL) {
+		fec_status_t status;
+		status.blocks = csp_hton16(blocks);
+		status.lost = csp_hton16(blocks - decoded);
+		memcpy(reply->data, &status, sizeof(status));
+		reply->length = sizeof(status);
+		if (!csp_send(conn, reply, timeout))
+			csp_buffer_free(reply);
+	}
+
+	if (decoded < blocks) {
+		csp_debug(CSP_ERROR, "FEC lost %u of %u blocks", blocks - decoded, blocks);
+		return -1;
+	}
+
+	return 0;
+
+}
@@ -40,6 +40,7 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
 #include "../csp_port.h"
 #include "../csp_conn.h"
 #include "../csp_io.h"
+#include "../csp_timer.h"
 #include "csp_transport.h"
 
 #ifdef CSP_USE_RDP
@@ -49,6 +50,9 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
 #define RDP_EAK 0x04
 #define RDP_RST	0x08
 
+/* Lower bound of the retransmission timeout in ms, on top of the ACK timeout */
+#define RDP_RTO_MIN 50
+
 static uint32_t csp_rdp_window_size = 4;
 static uint32_t csp_rdp_conn_timeout = 10000;
 static uint32_t csp_rdp_packet_timeout = 1000;
@@ -56,9 +60,6 @@ static uint32_t csp_rdp_delayed_acks = 1;
 static uint32_t csp_rdp_ack_timeout = 1000 / 4;
 static uint32_t csp_rdp_ack_delay_count = 4 / 2;
 
-/* Used for queue calls */
-static CSP_BASE_TYPE pdTrue = 1;
-
 typedef struct __attribute__((__packed__)) {
 	/* The timestamp is placed in the padding bytes */
 	uint8_t padding[CSP_PADDING_BYTES - 2 * sizeof(uint32_t)];
@@ -149,6 +150,120 @@ static inline int csp_rdp_time_after(uint32_t time, uint32_t cmp) {
 	return csp_rdp_time_before(cmp, time);
 }
 
+/**
+ * WINDOWS:
+ * Segments waiting for acknowledgement and segments received out of sequence
+ * are kept in arrays with a power of two number of slots, indexed by sequence
+ * number. Both windows are at most twice the window size, which is smaller
+ * than the number of slots, so a sequence number always has its own slot.
+ */
+#define csp_rdp_slot(conn, seq) ((uint16_t)(seq) & (conn)->rdp.win_mask)
+
+static inline uint16_t csp_rdp_tx_seq(csp_packet_t * packet) {
+	return csp_ntoh16(csp_rdp_header_ref(packet)->seq_nr);
+}
+
+/* RX segments have their header converted to host byte-order on reception */
+static inline uint16_t csp_rdp_rx_seq(csp_packet_t * packet) {
+	return csp_rdp_header_ref(packet)->seq_nr;
+}
+
+static int csp_rdp_tx_add(csp_conn_t * conn, rdp_packet_t * packet, uint16_t seq_nr) {
+	csp_packet_t ** slot = &conn->rdp.tx_win[csp_rdp_slot(conn, seq_nr)];
+	if (*slot != NULL)
+		return CSP_ERR_NOBUFS;
+	*slot = (csp_packet_t *) packet;
+	conn->rdp.tx_count++;
+	return CSP_ERR_NONE;
+}
+
+static void csp_rdp_tx_free(csp_conn_t * conn, uint16_t slot) {
+	csp_buffer_free(conn->rdp.tx_win[slot]);
+	conn->rdp.tx_win[slot] = NULL;
+	conn->rdp.tx_count--;
+}
+
+/**
+ * ROUND TRIP TIME:
+ * The retransmission timeout is computed from the smoothed round trip time and
+ * its variation (Jacobson/Karels), starting from the packet timeout until the
+ * first measurement. One segment at a time is timed, and a retransmitted
+ * segment is never timed (Karn). The timeout doubles on every consecutive
+ * retransmission timeout. The timeout is kept above the ACK timeout when ACKs
+ * are delayed, and below the connection timeout.
+ */
+static void csp_rdp_rto_set(csp_conn_t * conn, uint32_t rto) {
+
+	uint32_t min = RDP_RTO_MIN;
+	if (conn->rdp.delayed_acks)
+		min += conn->rdp.ack_timeout;
+
+	if (rto < min)
+		rto = min;
+	if (rto > conn->rdp.conn_timeout)
+		rto = conn->rdp.conn_timeout;
+
+	conn->rdp.rto = rto;
+
+}
+
+static void csp_rdp_rtt_init(csp_conn_t * conn) {
+
+	conn->rdp.srtt = 0;
+	conn->rdp.rttvar = 0;
+	conn->rdp.rtt_active = 0;
+	conn->rdp.backoff = 0;
+	conn->rdp.cwnd = conn->rdp.window_size;
+	conn->rdp.cwnd_acked = 0;
+	conn->rdp.tx_segments = 0;
+	conn->rdp.retransmits = 0;
+	conn->rdp.timeouts = 0;
+	csp_rdp_rto_set(conn, conn->rdp.packet_timeout);
+
+}
+
+static void csp_rdp_rtt_sample(csp_conn_t * conn, uint32_t rtt) {
+
+	if (conn->rdp.srtt == 0) {
+		/* First measurement */
+		conn->rdp.srtt = rtt << 3;
+		conn->rdp.rttvar = rtt << 1;
+	} else {
+		int32_t delta = (int32_t) rtt - (int32_t) (conn->rdp.srtt >> 3);
+		conn->rdp.srtt += delta;
+		if (delta < 0)
+			delta = -delta;
+		conn->rdp.rttvar += delta - (int32_t) (conn->rdp.rttvar >> 2);
+	}
+
+	if (conn->rdp.srtt == 0)
+		conn->rdp.srtt = 1;
+
+	conn->rdp.backoff = 0;
+	csp_rdp_rto_set(conn, (conn->rdp.srtt >> 3) + conn->rdp.rttvar);
+	csp_log_protocol("RDP: RTT %u, srtt %u, rttvar %u, rto %u", rtt, conn->rdp.srtt >> 3, conn->rdp.rttvar >> 2, conn->rdp.rto);
+
+}
+
+/* Take an RTT sample if the timed segment has been acknowledged */
+static void csp_rdp_rtt_acked(csp_conn_t * conn, uint16_t seq_nr) {
+	if (conn->rdp.rtt_active && conn->rdp.rtt_seq == seq_nr) {
+		conn->rdp.rtt_active = 0;
+		csp_rdp_rtt_sample(conn, csp_get_ms() - conn->rdp.rtt_timestamp);
+	}
+}
+
+/* Start the retransmission timer, unless it already runs for an older segment */
+static void csp_rdp_arm_tx(csp_conn_t * conn, uint32_t timestamp) {
+	if (!csp_timer_pending(&conn->rdp.timer_tx))
+		csp_timer_set(&conn->rdp.timer_tx, timestamp + conn->rdp.rto + 1);
+}
+
+/* Start the connection timer, used for both connection and CLOSE-WAIT timeout */
+static void csp_rdp_arm_conn(csp_conn_t * conn) {
+	csp_timer_set(&conn->rdp.timer_conn, conn->timestamp + conn->rdp.conn_timeout + 1);
+}
+
 /**
  * CONTROL MESSAGES
  * The following function is used to send empty messages,
@@ -175,13 +290,14 @@ static int csp_rdp_send_cmp(csp_conn_t * conn, csp_packet_t * packet, int flags,
 	header->syn = (flags & RDP_SYN) ? 1 : 0;
 	header->rst = (flags & RDP_RST) ? 1 : 0;
 
-	/* Send copy to tx_queue, before sending packet to IF */
+	/* Keep a reference in the TX window, before sending packet to IF */
 	if (flags & RDP_SYN) {
-		rdp_packet_t * rdp_packet = csp_buffer_clone(packet);
-		if (rdp_packet == NULL) return CSP_ERR_NOMEM;
+		rdp_packet_t * rdp_packet = (rdp_packet_t *) packet;
 		rdp_packet->timestamp = csp_get_ms();
-		if (csp_queue_enqueue(conn->rdp.tx_queue, &rdp_packet, 0) != CSP_QUEUE_OK)
-			csp_buffer_free(rdp_packet);
+		if (csp_rdp_tx_add(conn, rdp_packet, seq_nr) == CSP_ERR_NONE) {
+			csp_buffer_refc_inc(packet);
+			csp_rdp_arm_tx(conn, rdp_packet->timestamp);
+		}
 	}
 
 	/* Send control messages with high priority */
@@ -217,25 +333,21 @@ static int csp_rdp_send_eack(csp_conn_t * conn) {
 	if (packet_eack == NULL) return CSP_ERR_NOMEM;
 	packet_eack->length = 0;
 
-	/* Loop through RX queue */
-	int i, count;
-	csp_packet_t * packet;
-	count = csp_queue_size(conn->rdp.rx_queue);
-	for (i = 0; i < count; i++) {
+	/* Loop through RX window */
+	unsigned int max = (csp_buffer_size() - CSP_BUFFER_PACKET_OVERHEAD - sizeof(rdp_header_t)) / sizeof(uint16_t);
+	uint16_t seq_nr = conn->rdp.rcv_cur + 1;
+	for (unsigned int i = 0; i < conn->rdp.window_size * 2; i++, seq_nr++) {
 
-		if (csp_queue_dequeue_isr(conn->rdp.rx_queue, &packet, &pdTrue) != CSP_QUEUE_OK) {
-			csp_log_error("Cannot dequeue from rx_queue in queue deliver");
-			break;
-		}
+		csp_packet_t * packet = conn->rdp.rx_win[csp_rdp_slot(conn, seq_nr)];
+		if (packet == NULL || csp_rdp_rx_seq(packet) != seq_nr)
+			continue;
 
 		/* Add seq nr to EACK packet */
-		rdp_header_t * header = csp_rdp_header_ref(packet);
-		packet_eack->data16[packet_eack->length/sizeof(uint16_t)] = csp_hton16(header->seq_nr);
+		if (packet_eack->length / sizeof(uint16_t) >= max)
+			break;
+		packet_eack->data16[packet_eack->length/sizeof(uint16_t)] = csp_hton16(seq_nr);
 		packet_eack->length += sizeof(uint16_t);
-		csp_log_protocol("Added EACK nr %u", header->seq_nr);
-
-		/* Requeue */
-		csp_queue_enqueue_isr(conn->rdp.rx_queue, &packet, &pdTrue);
+		csp_log_protocol("Added EACK nr %u", seq_nr);
 
 	}
 
@@ -298,120 +410,117 @@ static inline int csp_rdp_receive_data(csp_conn_t * conn, csp_packet_t * packet)
 
 }
 
-static inline void csp_rdp_rx_queue_flush(csp_conn_t * conn) {
-
-	/* Loop through RX queue */
-	int i, count;
-	csp_packet_t * packet;
+static inline void csp_rdp_rx_window_flush(csp_conn_t * conn) {
 
-front:
-	count = csp_queue_size(conn->rdp.rx_queue);
-	for (i = 0; i < count; i++) {
+	/* Deliver segments that are now in sequence */
+	while (1) {
 
-		if (csp_queue_dequeue_isr(conn->rdp.rx_queue, &packet, &pdTrue) != CSP_QUEUE_OK) {
-			csp_log_error("Cannot dequeue from rx_queue in queue deliver");
+		uint16_t seq_nr = conn->rdp.rcv_cur + 1;
+		csp_packet_t ** slot = &conn->rdp.rx_win[csp_rdp_slot(conn, seq_nr)];
+		if (*slot == NULL || csp_rdp_rx_seq(*slot) != seq_nr)
 			break;
-		}
 
-		rdp_header_t * header = csp_rdp_header_ref(packet);
-		csp_log_protocol("RX Queue deliver matching Element, seq %u", header->seq_nr);
+		csp_packet_t * packet = *slot;
+		*slot = NULL;
 
-		/* If the matching packet was found: */
-		if (header->seq_nr == (uint16_t)(conn->rdp.rcv_cur + 1)) {
-			csp_log_protocol("Deliver seq %u", header->seq_nr);
-			csp_rdp_receive_data(conn, packet);
-			conn->rdp.rcv_cur++;
-			/* Loop from first element again */
-			goto front;
-
-		/* Otherwise, requeue */
-		} else {
-			csp_queue_enqueue_isr(conn->rdp.rx_queue, &packet, &pdTrue);
-		}
+		csp_log_protocol("Deliver seq %u", seq_nr);
+		if (csp_rdp_receive_data(conn, packet) != CSP_ERR_NONE)
+			csp_buffer_free(packet);
+		conn->rdp.rcv_cur++;
 
 	}
 
 }
 
-static inline bool csp_rdp_seq_in_rx_queue(csp_conn_t * conn, uint16_t seq_nr) {
+static inline int csp_rdp_rx_window_add(csp_conn_t * conn, csp_packet_t * packet, uint16_t seq_nr) {
 
-	/* Loop through RX queue */
-	int i, count;
-	rdp_packet_t * packet;
-	count = csp_queue_size(conn->rdp.rx_queue);
-	for (i = 0; i < count; i++) {
+	csp_packet_t ** slot = &conn->rdp.rx_win[csp_rdp_slot(conn, seq_nr)];
 
-		if (csp_queue_dequeue_isr(conn->rdp.rx_queue, &packet, &pdTrue) != CSP_QUEUE_OK) {
-			csp_log_error("Cannot dequeue from rx_queue in queue exists");
-			break;
-		}
+	if (*slot != NULL) {
+		if (csp_rdp_rx_seq(*slot) == seq_nr)
+			return CSP_QUEUE_ERROR;
+		/* Left behind by an earlier pass through the window */
+		csp_buffer_free(*slot);
+	}
 
-		csp_queue_enqueue_isr(conn->rdp.rx_queue, &packet, &pdTrue);
+	*slot = packet;
+	return CSP_QUEUE_OK;
 
-		rdp_header_t * header = csp_rdp_header_ref((csp_packet_t *) packet);
-		csp_log_protocol("RX Queue exists matching Element, seq %u", header->seq_nr);
+}
 
-		/* If the matching packet was found, deliver */
-		if (header->seq_nr == seq_nr) {
-			csp_log_protocol("We have a match");
-			return true;
-		}
+static void csp_rdp_retransmit(csp_conn_t * conn, rdp_packet_t * packet) {
+
+	rdp_header_t * header = csp_rdp_header_ref((csp_packet_t *) packet);
+
+	/* Do not time retransmitted segments */
+	if (conn->rdp.rtt_active && conn->rdp.rtt_seq == csp_ntoh16(header->seq_nr))
+		conn->rdp.rtt_active = 0;
 
+	/* Send the segment again, the TX window keeps its own reference. A
+	 * previous send may still be queued in an interface, and a shared
+	 * buffer is read-only, so the ACK is then updated on a copy */
+	csp_packet_t * new_packet;
+	if (csp_buffer_refc(packet) > 1) {
+		new_packet = csp_buffer_clone(packet);
+		if (new_packet == NULL) {
+			csp_log_warn("No buffer for retransmission");
+			return;
+		}
+		header = csp_rdp_header_ref(new_packet);
+	} else {
+		new_packet = csp_buffer_refc_inc(packet);
 	}
 
-	return false;
+	/* Update to latest outgoing ACK */
+	header->ack_nr = csp_hton16(conn->rdp.rcv_cur);
 
-}
+	packet->timestamp = csp_get_ms();
+	conn->rdp.retransmits++;
+	csp_iface_t * ifout = csp_rtable_find_iface(conn->idout.dst);
 
-static inline int csp_rdp_rx_queue_add(csp_conn_t * conn, csp_packet_t * packet, uint16_t seq_nr) {
+	/* Compression is decided per segment, and kept in the segment id */
+	csp_id_t idout = conn->idout;
+	idout.flags |= packet->id.flags & CSP_FCOMP;
 
-	if (csp_rdp_seq_in_rx_queue(conn, seq_nr))
-		return CSP_QUEUE_ERROR;
-	return csp_queue_enqueue_isr(conn->rdp.rx_queue, &packet, &pdTrue);
+	if (csp_send_direct(idout, new_packet, ifout, 0) != CSP_ERR_NONE) {
+		csp_log_warn("Retransmission failed");
+		csp_buffer_free(new_packet);
+	}
 
 }
 
 static void csp_rdp_flush_eack(csp_conn_t * conn, csp_packet_t * eack_packet) {
 
-	/* Loop through TX queue */
-	int i, j, count;
-	rdp_packet_t * packet;
-	count = csp_queue_size(conn->rdp.tx_queue);
-	for (i = 0; i < count; i++) {
+	int j, count = (eack_packet->length - sizeof(rdp_header_t)) / sizeof(uint16_t);
+	uint16_t eack_max = conn->rdp.snd_una;
 
-		if (csp_queue_dequeue(conn->rdp.tx_queue, &packet, 0) != CSP_QUEUE_OK) {
-			csp_log_error("Cannot dequeue from tx_queue in flush EACK");
-			break;
-		}
-
-		rdp_header_t * header = csp_rdp_header_ref((csp_packet_t *) packet);
-		csp_log_protocol("EACK compare element, time %u, seq %u", packet->timestamp, csp_ntoh16(header->seq_nr));
-
-		/* Look for this element in EACKs */
-		int match = 0;
-		for (j = 0; j < (int)((eack_packet->length - sizeof(rdp_header_t)) / sizeof(uint16_t)); j++) {
-			if (csp_ntoh16(eack_packet->data16[j]) == csp_ntoh16(header->seq_nr))
-				match = 1;
-
-			/* Enable this if you want EACK's to trigger retransmission */
-			if (csp_ntoh16(eack_packet->data16[j]) > csp_ntoh16(header->seq_nr)) {
-				uint32_t time_now = csp_get_ms();
-				if (csp_rdp_time_after(time_now, packet->quarantine)) {
-					packet->timestamp = time_now - conn->rdp.packet_timeout - 1;
-					packet->quarantine = time_now +	conn->rdp.packet_timeout / 2;
-				}
-			}
+	/* Free segments in EACKs and find the newest one */
+	for (j = 0; j < count; j++) {
+		uint16_t seq_nr = csp_ntoh16(eack_packet->data16[j]);
+		uint16_t slot = csp_rdp_slot(conn, seq_nr);
+		if (!csp_rdp_seq_between(seq_nr, conn->rdp.snd_una, conn->rdp.snd_nxt - 1))
+			continue;
+		if (csp_rdp_seq_after(seq_nr, eack_max))
+			eack_max = seq_nr;
+		if (conn->rdp.tx_win[slot] != NULL && csp_rdp_tx_seq(conn->rdp.tx_win[slot]) == seq_nr) {
+			csp_log_protocol("TX Element %u freed", seq_nr);
+			csp_rdp_rtt_acked(conn, seq_nr);
+			csp_rdp_tx_free(conn, slot);
 		}
+	}
 
-		if (match == 0) {
-			/* If not found, put back on tx queue */
-			csp_queue_enqueue(conn->rdp.tx_queue, &packet, 0);
-		} else {
-			/* Found, free */
-			csp_log_protocol("TX Element %u freed", csp_ntoh16(header->seq_nr));
-			csp_buffer_free(packet);
+	/* Segments before the newest EACK are missing at the receiver, retransmit them */
+	uint32_t time_now = csp_get_ms();
+	for (uint16_t seq_nr = conn->rdp.snd_una; csp_rdp_seq_before(seq_nr, eack_max); seq_nr++) {
+		rdp_packet_t * packet = (rdp_packet_t *) conn->rdp.tx_win[csp_rdp_slot(conn, seq_nr)];
+		if (packet == NULL || csp_rdp_tx_seq((csp_packet_t *) packet) != seq_nr)
+			continue;
+		csp_log_protocol("EACK compare element, time %u, seq %u", packet->timestamp, seq_nr);
+		if (csp_rdp_time_after(time_now, packet->quarantine)) {
+			csp_log_protocol("EACK retransmitting seq %u", seq_nr);
+			packet->quarantine = time_now + conn->rdp.rto / 2;
+			csp_rdp_retransmit(conn, packet);
 		}
-
 	}
 
 }
@@ -442,26 +551,26 @@ static inline bool csp_rdp_should_ack(csp_conn_t * conn) {
 
 void csp_rdp_flush_all(csp_conn_t * conn) {
 
-	if ((conn == NULL) || conn->rdp.tx_queue == NULL) {
+	if ((conn == NULL) || conn->rdp.tx_win == NULL) {
 		csp_log_error("Null pointer passed to rdp flush all");
 		return;
 	}
 
-	rdp_packet_t * packet;
+	/* Stop timers */
+	csp_timer_cancel(&conn->rdp.timer_tx);
+	csp_timer_cancel(&conn->rdp.timer_ack);
+	csp_timer_cancel(&conn->rdp.timer_conn);
 
-	/* Empty TX queue */
-	while (csp_queue_dequeue_isr(conn->rdp.tx_queue, &packet, &pdTrue) == CSP_QUEUE_OK) {
-		if (packet != NULL) {
-			csp_log_protocol("Flush TX Element, time %u, seq %u", packet->timestamp, csp_ntoh16(csp_rdp_header_ref((csp_packet_t *) packet)->seq_nr));
-			csp_buffer_free(packet);
+	/* Empty windows */
+	for (unsigned int i = 0; i <= conn->rdp.win_mask; i++) {
+		if (conn->rdp.tx_win[i] != NULL) {
+			csp_log_protocol("Flush TX Element, seq %u", csp_rdp_tx_seq(conn->rdp.tx_win[i]));
+			csp_rdp_tx_free(conn, i);
 		}
-	}
-
-	/* Empty RX queue */
-	while (csp_queue_dequeue_isr(conn->rdp.rx_queue, &packet, &pdTrue) == CSP_QUEUE_OK) {
-		if (packet != NULL) {
-			csp_log_protocol("Flush RX Element, time %u, seq %u", packet->timestamp, csp_ntoh16(csp_rdp_header_ref((csp_packet_t *) packet)->seq_nr));
-			csp_buffer_free(packet);
+		if (conn->rdp.rx_win[i] != NULL) {
+			csp_log_protocol("Flush RX Element, seq %u", csp_rdp_rx_seq(conn->rdp.rx_win[i]));
+			csp_buffer_free(conn->rdp.rx_win[i]);
+			conn->rdp.rx_win[i] = NULL;
 		}
 	}
 
@@ -482,57 +591,116 @@ int csp_rdp_check_ack(csp_conn_t * conn) {
 	if (avail && csp_rdp_should_ack(conn))
 		csp_rdp_send_cmp(conn, NULL, RDP_ACK, conn->rdp.snd_nxt, conn->rdp.rcv_cur);
 
+	/* Send delayed ACK when the ACK timeout expires. If the RX queues are full,
+	 * the ACK is sent from csp_read once the user has made room. */
+	if (avail && conn->rdp.rcv_lsa != conn->rdp.rcv_cur) {
+		uint32_t time_now = csp_get_ms();
+		uint32_t expires = conn->rdp.ack_timestamp + conn->rdp.ack_timeout + 1;
+		if (csp_rdp_time_before(expires, time_now))
+			expires = time_now + conn->rdp.ack_timeout + 1;
+		csp_timer_set(&conn->rdp.timer_ack, expires);
+	}
+
 	return CSP_ERR_NONE;
 
 }
 
+/* Wake user task if TX window is ready for more data */
+static void csp_rdp_tx_wake(csp_conn_t * conn) {
+
+	if (conn->rdp.state == RDP_OPEN)
+		if (conn->rdp.tx_count < conn->rdp.cwnd)
+			if (csp_rdp_seq_before(conn->rdp.snd_nxt - conn->rdp.snd_una, conn->rdp.cwnd * 2))
+				csp_bin_sem_post(&conn->rdp.tx_wait);
+
+}
+
+/* Free acknowledged segments from TX window */
+static void csp_rdp_tx_acked(csp_conn_t * conn) {
+
+	unsigned int acked = 0;
+
+	for (unsigned int i = 0; i <= conn->rdp.win_mask && conn->rdp.tx_count > 0; i++) {
+
+		rdp_packet_t * packet = (rdp_packet_t *) conn->rdp.tx_win[i];
+		if (packet == NULL)
+			continue;
+
+		uint16_t seq_nr = csp_rdp_tx_seq((csp_packet_t *) packet);
+		if (csp_rdp_seq_before(seq_nr, conn->rdp.snd_una)) {
+			csp_log_protocol("TX Element Free, time %u, seq %u, una %u", packet->timestamp, seq_nr, conn->rdp.snd_una);
+			csp_rdp_rtt_acked(conn, seq_nr);
+			csp_rdp_tx_free(conn, i);
+			acked++;
+		}
+
+	}
+
+	/* Grow the send window by one segment per window of acknowledged segments */
+	conn->rdp.cwnd_acked += acked;
+	if (conn->rdp.cwnd < conn->rdp.window_size && conn->rdp.cwnd_acked >= conn->rdp.cwnd) {
+		conn->rdp.cwnd_acked = 0;
+		conn->rdp.cwnd++;
+	}
+
+	if (conn->rdp.tx_count == 0)
+		csp_timer_cancel(&conn->rdp.timer_tx);
+
+	csp_rdp_tx_wake(conn);
+
+}
+
 /**
- * This function must be called with regular intervals for the
- * RDP protocol to work as expected. This takes care of closing
- * stale connections and retransmitting traffic. A good place to
- * call this function is from the CSP router task.
+ * TIMERS:
+ * The following functions are called from the router task when one of the
+ * connection timers expires. The connection may have changed state since the
+ * timer was set, so the conditions are checked again.
  */
-void csp_rdp_check_timeouts(csp_conn_t * conn) {
 
-	rdp_packet_t * packet;
+/* CONNECTION TIMEOUT and CLOSE-WAIT TIMEOUT */
+static void csp_rdp_timeout_conn(void * arg) {
+
+	csp_conn_t * conn = arg;
+
+	if (conn->state != CONN_OPEN || !(conn->idin.flags & CSP_FRDP))
+		return;
+
+	/* Only connections not yet accepted by userspace, or waiting to close, time out */
+	if (conn->socket == NULL && conn->rdp.state != RDP_CLOSE_WAIT)
+		return;
+
+	/* Timestamp has moved since the timer was set */
+	if (csp_rdp_time_before(csp_get_ms(), conn->timestamp + conn->rdp.conn_timeout + 1)) {
+		csp_rdp_arm_conn(conn);
+		return;
+	}
 
-	/**
-	 * CONNECTION TIMEOUT:
-	 * Check that connection has not timed out inside the network stack
-	 * */
-	uint32_t time_now = csp_get_ms();
 	if (conn->socket != NULL) {
-		if (csp_rdp_time_after(time_now, conn->timestamp + conn->rdp.conn_timeout)) {
-			csp_log_warn("Found a lost connection, closing now");
-			csp_close(conn);
-			return;
-		}
+		csp_log_warn("Found a lost connection, closing now");
+	} else {
+		csp_log_protocol("CLOSE_WAIT timeout");
 	}
 
-	/**
-	 * CLOSE-WAIT TIMEOUT:
-	 * After waiting a while in CLOSE-WAIT, the connection should be closed.
-	 */
-	if (conn->rdp.state == RDP_CLOSE_WAIT) {
-		if (csp_rdp_time_after(time_now, conn->timestamp + conn->rdp.conn_timeout)) {
-			csp_log_protocol("CLOSE_WAIT timeout");
-			csp_close(conn);
-		}
+	csp_close(conn);
+
+}
+
+/* MESSAGE TIMEOUT: retransmit timed out segments */
+static void csp_rdp_timeout_tx(void * arg) {
+
+	csp_conn_t * conn = arg;
+	uint32_t time_now = csp_get_ms();
+	uint32_t next = 0;
+	bool pending = false, timeout = false;
+
+	if (conn->state != CONN_OPEN || !(conn->idin.flags & CSP_FRDP) || conn->rdp.state == RDP_CLOSE_WAIT)
 		return;
-	}
 
-	/**
-	 * MESSAGE TIMEOUT:
-	 * Check each outgoing message for TX timeout
-	 */
-	int i, count;
-	count = csp_queue_size(conn->rdp.tx_queue);
-	for (i = 0; i < count; i++) {
+	for (unsigned int i = 0; i <= conn->rdp.win_mask && conn->rdp.tx_count > 0; i++) {
 
-		if ((csp_queue_dequeue_isr(conn->rdp.tx_queue, &packet, &pdTrue) != CSP_QUEUE_OK) || packet == NULL) {
-			csp_log_warn("Cannot dequeue from tx_queue in check timeout");
-			break;
-		}
+		rdp_packet_t * packet = (rdp_packet_t *) conn->rdp.tx_win[i];
+		if (packet == NULL)
+			continue;
 
 		/* Get header */
 		rdp_header_t * header = csp_rdp_header_ref((csp_packet_t *) packet);
@@ -540,44 +708,53 @@ void csp_rdp_check_timeouts(csp_conn_t * conn) {
 		/* If acked, do not retransmit */
 		if (csp_rdp_seq_before(csp_ntoh16(header->seq_nr), conn->rdp.snd_una)) {
 			csp_log_protocol("TX Element Free, time %u, seq %u, una %u", packet->timestamp, csp_ntoh16(header->seq_nr), conn->rdp.snd_una);
-			csp_buffer_free(packet);
+			csp_rdp_tx_free(conn, i);
 			continue;
 		}
 
 		/* Check timestamp and retransmit if needed */
-		if (csp_rdp_time_after(time_now, packet->timestamp + conn->rdp.packet_timeout)) {
+		if (csp_rdp_time_after(time_now, packet->timestamp + conn->rdp.rto)) {
 			csp_log_protocol("TX Element timed out, retransmitting seq %u", csp_ntoh16(header->seq_nr));
+			csp_rdp_retransmit(conn, packet);
+			timeout = true;
+		}
 
-			/* Update to latest outgoing ACK */
-			header->ack_nr = csp_hton16(conn->rdp.rcv_cur);
+		/* Track the next segment to time out */
+		if (!pending || csp_rdp_time_before(packet->timestamp, next)) {
+			next = packet->timestamp;
+			pending = true;
+		}
 
-			/* Send copy to tx_queue */
-			packet->timestamp = csp_get_ms();
-			csp_packet_t * new_packet = csp_buffer_clone(packet);
-			csp_iface_t * ifout = csp_rtable_find_iface(conn->idout.dst);
-			if (csp_send_direct(conn->idout, new_packet, ifout, 0) != CSP_ERR_NONE) {
-				csp_log_warn("Retransmission failed");
-				csp_buffer_free(new_packet);
-			}
+	}
 
+	/* Back off and halve the send window */
+	if (timeout) {
+		conn->rdp.timeouts++;
+		if (conn->rdp.backoff < 16) {
+			conn->rdp.backoff++;
+			csp_rdp_rto_set(conn, conn->rdp.rto * 2);
 		}
+		conn->rdp.cwnd = (conn->rdp.cwnd + 1) / 2;
+		conn->rdp.cwnd_acked = 0;
+		csp_log_protocol("RDP: Retransmission timeout, rto %u, window %u", conn->rdp.rto, conn->rdp.cwnd);
+	}
 
-		/* Requeue the TX element */
-		csp_queue_enqueue_isr(conn->rdp.tx_queue, &packet, &pdTrue);
+	if (pending)
+		csp_timer_set(&conn->rdp.timer_tx, next + conn->rdp.rto + 1);
 
-	}
+	csp_rdp_tx_wake(conn);
 
-	/**
-	 * ACK TIMEOUT:
-	 * Check ACK timeouts, if we have unacknowledged segments
-	 */
-	csp_rdp_check_ack(conn);
+}
 
-	/* Wake user task if TX queue is ready for more data */
-	if (conn->rdp.state == RDP_OPEN)
-		if (csp_queue_size(conn->rdp.tx_queue) < (int)conn->rdp.window_size)
-			if (csp_rdp_seq_before(conn->rdp.snd_nxt - conn->rdp.snd_una, conn->rdp.window_size * 2))
-				csp_bin_sem_post(&conn->rdp.tx_wait);
+/* ACK TIMEOUT: send delayed ACK for unacknowledged segments */
+static void csp_rdp_timeout_ack(void * arg) {
+
+	csp_conn_t * conn = arg;
+
+	if (conn->state != CONN_OPEN || !(conn->idin.flags & CSP_FRDP) || conn->rdp.state == RDP_CLOSE_WAIT)
+		return;
+
+	csp_rdp_check_ack(conn);
 
 }
 
@@ -614,6 +791,7 @@ void csp_rdp_new_packet(csp_conn_t * conn, csp_packet_t * packet) {
 				csp_log_protocol("RESET in sequence, no more data incoming, reply with RESET");
 				conn->rdp.state = RDP_CLOSE_WAIT;
 				conn->timestamp = csp_get_ms();
+				csp_rdp_arm_conn(conn);
 				csp_rdp_send_cmp(conn, NULL, RDP_ACK | RDP_RST, conn->rdp.snd_nxt, conn->rdp.rcv_cur);
 				goto discard_close;
 			} else {
@@ -651,8 +829,10 @@ void csp_rdp_new_packet(csp_conn_t * conn, csp_packet_t * packet) {
 		conn->rdp.rcv_irs = rx_header->seq_nr;
 		conn->rdp.rcv_lsa = rx_header->seq_nr;
 
-		/* Store RDP options */
+		/* Store RDP options, the window must fit the window arrays */
 		conn->rdp.window_size 		= csp_ntoh32(packet->data32[0]);
+		if (conn->rdp.window_size > CSP_RDP_MAX_WINDOW)
+			conn->rdp.window_size = CSP_RDP_MAX_WINDOW;
 		conn->rdp.conn_timeout 		= csp_ntoh32(packet->data32[1]);
 		conn->rdp.packet_timeout 	= csp_ntoh32(packet->data32[2]);
 		conn->rdp.delayed_acks 		= csp_ntoh32(packet->data32[3]);
@@ -662,10 +842,15 @@ void csp_rdp_new_packet(csp_conn_t * conn, csp_packet_t * packet) {
 				conn->rdp.window_size, conn->rdp.conn_timeout, conn->rdp.packet_timeout);
 		csp_log_protocol("RDP: Delayed acks: %u, ack timeout %u, ack each %u packet",
 				conn->rdp.delayed_acks, conn->rdp.ack_timeout, conn->rdp.ack_delay_count);
+		csp_rdp_rtt_init(conn);
 
 		/* Connection accepted */
 		conn->rdp.state = RDP_SYN_RCVD;
 
+		/* Close the connection if userspace does not accept it in time */
+		if (conn->socket != NULL)
+			csp_rdp_arm_conn(conn);
+
 		/* Send SYN/ACK */
 		csp_rdp_send_cmp(conn, NULL, RDP_ACK | RDP_SYN, conn->rdp.snd_iss, conn->rdp.rcv_irs);
 
@@ -775,6 +960,7 @@ void csp_rdp_new_packet(csp_conn_t * conn, csp_packet_t * packet) {
 
 		/* Store current ack'ed sequence number */
 		conn->rdp.snd_una = rx_header->ack_nr + 1;
+		csp_rdp_tx_acked(conn);
 
 		/* We have an EACK */
 		if (rx_header->eak) {
@@ -789,7 +975,7 @@ void csp_rdp_new_packet(csp_conn_t * conn, csp_packet_t * packet) {
 
 		/* If message is not in sequence, send EACK and store packet */
 		if (rx_header->seq_nr != (uint16_t)(conn->rdp.rcv_cur + 1)) {
-			if (csp_rdp_rx_queue_add(conn, packet, rx_header->seq_nr) != CSP_QUEUE_OK) {
+			if (csp_rdp_rx_window_add(conn, packet, rx_header->seq_nr) != CSP_QUEUE_OK) {
 				csp_log_protocol("Duplicate sequence number");
 				goto discard_open;
 			}
@@ -808,12 +994,12 @@ void csp_rdp_new_packet(csp_conn_t * conn, csp_packet_t * packet) {
 		conn->rdp.rcv_cur = seq_nr;
 
 		/* Only ACK the message if there is room for a full window in the RX buffer.
-		 * Unacknowledged segments are ACKed by csp_rdp_check_timeouts when the buffer is
+		 * Unacknowledged segments are ACKed by csp_read when the buffer is
 		 * no longer full. */
 		csp_rdp_check_ack(conn);
 
-		/* Flush RX queue */
-		csp_rdp_rx_queue_flush(conn);
+		/* Flush RX window */
+		csp_rdp_rx_window_flush(conn);
 
 		goto accepted_open;
 
@@ -870,12 +1056,15 @@ int csp_rdp_connect(csp_conn_t * conn, uint32_t timeout) {
 	int retry = 1;
 
 	conn->rdp.window_size	 = csp_rdp_window_size;
+	if (conn->rdp.window_size > CSP_RDP_MAX_WINDOW)
+		conn->rdp.window_size = CSP_RDP_MAX_WINDOW;
 	conn->rdp.conn_timeout	= csp_rdp_conn_timeout;
 	conn->rdp.packet_timeout  = csp_rdp_packet_timeout;
 	conn->rdp.delayed_acks	= csp_rdp_delayed_acks;
 	conn->rdp.ack_timeout 	  = csp_rdp_ack_timeout;
 	conn->rdp.ack_delay_count = csp_rdp_ack_delay_count;
 	conn->rdp.ack_timestamp   = csp_get_ms();
+	csp_rdp_rtt_init(conn);
 
 retry:
 	csp_log_protocol("RDP: Active connect, conn state %u", conn->rdp.state);
@@ -940,7 +1129,7 @@ int csp_rdp_send(csp_conn_t * conn, csp_packet_t * packet, uint32_t timeout) {
 	}
 
 	/* If TX window is full, wait here */
-	while (csp_rdp_seq_after(conn->rdp.snd_nxt, conn->rdp.snd_una + (uint16_t)conn->rdp.window_size)) {
+	while (csp_rdp_seq_after(conn->rdp.snd_nxt, conn->rdp.snd_una + (uint16_t)conn->rdp.cwnd)) {
 		csp_log_protocol("RDP: Waiting for window update before sending seq %u", conn->rdp.snd_nxt);
 		csp_bin_sem_wait(&conn->rdp.tx_wait, 0);
 		if ((csp_bin_sem_wait(&conn->rdp.tx_wait, conn->rdp.conn_timeout)) != CSP_SEMAPHORE_OK) {
@@ -960,20 +1149,25 @@ int csp_rdp_send(csp_conn_t * conn, csp_packet_t * packet, uint32_t timeout) {
 	tx_header->seq_nr = csp_hton16(conn->rdp.snd_nxt);
 	tx_header->ack = 1;
 
-	/* Send copy to tx_queue */
-	rdp_packet_t * rdp_packet = csp_buffer_clone(packet);
-	if (rdp_packet == NULL) {
-		csp_log_error("Failed to allocate packet buffer");
-		return CSP_ERR_NOMEM;
-	}
-
+	/* Keep a reference in the TX window, the packet is shared from here on */
+	rdp_packet_t * rdp_packet = (rdp_packet_t *) packet;
 	rdp_packet->timestamp = csp_get_ms();
 	rdp_packet->quarantine = 0;
-	if (csp_queue_enqueue(conn->rdp.tx_queue, &rdp_packet, 0) != CSP_QUEUE_OK) {
-		csp_log_error("No more space in RDP retransmit queue");
-		csp_buffer_free(rdp_packet);
+	if (csp_rdp_tx_add(conn, rdp_packet, conn->rdp.snd_nxt) != CSP_ERR_NONE) {
+		csp_log_error("No more space in RDP retransmit window");
+		csp_rdp_header_remove(packet);
 		return CSP_ERR_NOBUFS;
 	}
+	csp_buffer_refc_inc(packet);
+	csp_rdp_arm_tx(conn, rdp_packet->timestamp);
+
+	/* Time this segment, if no other is being timed */
+	if (!conn->rdp.rtt_active) {
+		conn->rdp.rtt_seq = conn->rdp.snd_nxt;
+		conn->rdp.rtt_timestamp = rdp_packet->timestamp;
+		conn->rdp.rtt_active = 1;
+	}
+	conn->rdp.tx_segments++;
 
 	csp_log_protocol("RDP: Sending  in S %u: syn %u, ack %u, eack %u, "
 				"rst %u, seq_nr %5u, ack_nr %5u, packet_len %u (%u)",
@@ -988,35 +1182,39 @@ int csp_rdp_send(csp_conn_t * conn, csp_packet_t * packet, uint32_t timeout) {
 
 int csp_rdp_allocate(csp_conn_t * conn) {
 
-	csp_log_buffer("RDP: Creating RDP queues for conn %p", conn);
+	csp_log_buffer("RDP: Creating RDP windows for conn %p", conn);
 
 	/* Set initial state */
 	conn->rdp.state = RDP_CLOSED;
 	conn->rdp.conn_timeout = csp_rdp_conn_timeout;
 	conn->rdp.packet_timeout = csp_rdp_packet_timeout;
 
+	/* Timers are run from the router task */
+	csp_timer_setup(&conn->rdp.timer_tx, csp_rdp_timeout_tx, conn);
+	csp_timer_setup(&conn->rdp.timer_ack, csp_rdp_timeout_ack, conn);
+	csp_timer_setup(&conn->rdp.timer_conn, csp_rdp_timeout_conn, conn);
+
 	/* Create a binary semaphore to wait on for tasks */
 	if (csp_bin_sem_create(&conn->rdp.tx_wait) != CSP_SEMAPHORE_OK) {
 		csp_log_error("Failed to initialize semaphore");
 		return CSP_ERR_NOMEM;
 	}
 
-	/* Create TX queue */
-	conn->rdp.tx_queue = csp_queue_create(CSP_RDP_MAX_WINDOW, sizeof(csp_packet_t *));
-	if (conn->rdp.tx_queue == NULL) {
-		csp_log_error("Failed to create TX queue for conn");
-		csp_bin_sem_remove(&conn->rdp.tx_wait);
-		return CSP_ERR_NOMEM;
-	}
+	/* Create TX and RX windows with room for twice the maximum window */
+	unsigned int slots = 1;
+	while (slots < CSP_RDP_MAX_WINDOW * 2)
+		slots <<= 1;
 
-	/* Create RX queue */
-	conn->rdp.rx_queue = csp_queue_create(CSP_RDP_MAX_WINDOW * 2, sizeof(csp_packet_t *));
-	if (conn->rdp.rx_queue == NULL) {
-		csp_log_error("Failed to create RX queue for conn");
+	conn->rdp.win_mask = slots - 1;
+	conn->rdp.tx_count = 0;
+	conn->rdp.tx_win = csp_malloc(2 * slots * sizeof(csp_packet_t *));
+	if (conn->rdp.tx_win == NULL) {
+		csp_log_error("Failed to create RDP windows for conn");
 		csp_bin_sem_remove(&conn->rdp.tx_wait);
-		csp_queue_remove(conn->rdp.tx_queue);
 		return CSP_ERR_NOMEM;
 	}
+	memset(conn->rdp.tx_win, 0, 2 * slots * sizeof(csp_packet_t *));
+	conn->rdp.rx_win = conn->rdp.tx_win + slots;
 
 	return CSP_ERR_NONE;
 
@@ -1035,6 +1233,7 @@ int csp_rdp_close(csp_conn_t * conn) {
 	if (conn->rdp.state != RDP_CLOSE_WAIT) {
 		conn->rdp.state = RDP_CLOSE_WAIT;
 		conn->timestamp = csp_get_ms();
+		csp_rdp_arm_conn(conn);
 		csp_rdp_send_cmp(conn, NULL, RDP_ACK | RDP_RST, conn->rdp.snd_nxt, conn->rdp.rcv_cur);
 		csp_log_protocol("RDP Close, sent RST on conn %p", conn);
 		return CSP_ERR_AGAIN;
@@ -1081,14 +1280,37 @@ void csp_rdp_get_opt(unsigned int * window_size, unsigned int * conn_timeout_ms,
 		*ack_delay_count = csp_rdp_ack_delay_count;
 }
 
+int csp_rdp_get_conn_info(csp_conn_t * conn, csp_rdp_conn_info_t * info) {
+
+	if (conn == NULL || info == NULL || !(conn->idin.flags & CSP_FRDP))
+		return CSP_ERR_INVAL;
+
+	info->state = conn->rdp.state;
+	info->window_size = conn->rdp.window_size;
+	info->cwnd = conn->rdp.cwnd;
+	info->in_flight = conn->rdp.tx_count;
+	info->srtt = conn->rdp.srtt >> 3;
+	info->rttvar = conn->rdp.rttvar >> 2;
+	info->rto = conn->rdp.rto;
+	info->backoff = conn->rdp.backoff;
+	info->tx_segments = conn->rdp.tx_segments;
+	info->retransmits = conn->rdp.retransmits;
+	info->timeouts = conn->rdp.timeouts;
+
+	return CSP_ERR_NONE;
+
+}
+
 #ifdef CSP_DEBUG
 void csp_rdp_conn_print(csp_conn_t * conn) {
 
 	if (conn == NULL)
 		return;
 
-	printf("\tRDP: State %"PRIu16", rcv %"PRIu16", snd %"PRIu16", win %"PRIu32"\r\n",
-			conn->rdp.state, conn->rdp.rcv_cur, conn->rdp.snd_una, conn->rdp.window_size);
+	printf("\tRDP: State %"PRIu16", rcv %"PRIu16", snd %"PRIu16", win %"PRIu32"/%"PRIu32"\r\n",
+			conn->rdp.state, conn->rdp.rcv_cur, conn->rdp.snd_una, conn->rdp.cwnd, conn->rdp.window_size);
+	printf("\t     srtt %"PRIu32", rttvar %"PRIu32", rto %"PRIu32", retransmits %"PRIu32", timeouts %"PRIu32"\r\n",
+			conn->rdp.srtt >> 3, conn->rdp.rttvar >> 2, conn->rdp.rto, conn->rdp.retransmits, conn->rdp.timeouts);
 
 }
 #endif
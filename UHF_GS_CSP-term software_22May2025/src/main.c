@@ -28,6 +28,10 @@
 /* CSP */
 #include <csp/csp.h>
 #include <csp/interfaces/csp_if_kiss.h>
+#include <csp/interfaces/csp_if_kiss_tcp.h>
+#include <csp/interfaces/csp_if_udp.h>
+#include <csp/interfaces/csp_if_shm.h>
+#include <csp/interfaces/csp_if_multi.h>
 #include <csp/interfaces/csp_if_can.h>
 #include <csp/interfaces/csp_if_zmqhub.h>
 #include <csp/drivers/usart.h>
@@ -46,13 +50,43 @@
 //---------------------------------------------------------------------------------------------
 const vmem_t vmem_map[] = {{0}};
 
+/* Serial radios, each with its own KISS interface */
+static usart_handle_t * radio_usart[2];
+static csp_iface_t radio_if[2];
+static csp_kiss_handle_t radio_kiss[2];
+
+/* KISS write function, the user pointer is the radio's entry in radio_usart.
+ * Write errors are returned, so a multi interface fails over at once. */
+static int radio_write(void * user, const uint8_t * buf, int len) {
+	usart_handle_t ** usart = user;
+	return usart_write(*usart, buf, len);
+}
+
+/* Further TNC ports of the first radio's serial link */
+static csp_iface_t radio_port_if[CSP_KISS_PORTS];
+static char radio_port_name[CSP_KISS_PORTS][8];
+
+static void radio_rx(uint8_t * buf, int len, void * user) {
+	csp_kiss_rx(user, buf, len, NULL);
+}
+
 static void print_help(void) {
-	printf(" usage: csp-term <-d|-c|-z> [optargs]\r\n");
+	printf(" usage: csp-term <-d|-c|-z|-t|-l|-u> [optargs]\r\n");
 	printf("  -d DEVICE,\tSet device (default: /dev/ttyUSB0)\r\n");
+	printf("  -e DEVICE,\tSet second radio device, interface KISS2\r\n");
+	printf("  -k PORTS,\tUse TNC ports 1 to PORTS-1 of DEVICE as interfaces TNC1...\r\n");
+	printf("  -M MODE,\tUse both radios as interface RADIO: failover, balance or duplicate\r\n");
 	printf("  -c DEVICE,\tSet can device (default: can0)\r\n");
 	printf("  -z SERVER,\tSet ZMQ server (default: localhost)\r\n");
+	printf("  -t HOST:PORT,\tConnect to KISS over TCP peer\r\n");
+	printf("  -l PORT,\tListen for KISS over TCP peer\r\n");
+	printf("  -u PORT,\tReceive CSP over UDP on PORT\r\n");
+	printf("  -p [NODE@]HOST:PORT,\tAdd UDP peer for NODE, or the default peer\r\n");
+	printf("  -m NAME,\tShare packets with a local process through /dev/shm/NAME, route with -r\r\n");
 	printf("  -a ADDRESS,\tSet address (default: 8)\r\n");
 	printf("  -b BAUD,\tSet baud rate (default: 500000)\r\n");
+	printf("  -r ROUTES,\tLoad routes, e.g. \"5/5 KISS2\"\r\n");
+	printf("  -B IFA,IFB,\tBridge all traffic between two interfaces, e.g. \"KISS,UDP\"\r\n");
 	printf("  -h,\t\tPrint help and exit\r\n");
 }
 
@@ -82,6 +116,25 @@ int main(int argc, char * argv[]) {
 	char * device = "/dev/ttyUSB0";
 	uint32_t baud = 500000;
 	uint8_t use_kiss = 0;
+	int kiss_ports = 1;
+	char * device2 = NULL;
+	int radio_mode = -1;
+	char * routes = NULL;
+	char * bridge = NULL;
+
+	/* KISS over TCP STUFF */
+	char * tcp_host = NULL;
+	uint16_t tcp_port = 0;
+	uint8_t use_tcp = 0;
+
+	/* UDP STUFF */
+	uint16_t udp_port = 0;
+	uint8_t use_udp = 0;
+	char * udp_peers[CSP_ID_HOST_MAX + 1];
+	int udp_peer_count = 0;
+
+	/* SHM STUFF */
+	char * shm_name = NULL;
 
 	/* CAN STUFF */
 	char * ifc = "can0";
@@ -106,7 +159,7 @@ int main(int argc, char * argv[]) {
 	 * Parser
 	 **/
 	int c;
-	while ((c = getopt(argc, argv, "a:b:c:d:hz:")) != -1) {
+	while ((c = getopt(argc, argv, "a:b:c:d:e:hk:l:m:p:r:t:u:z:B:M:")) != -1) {
 		switch (c) {
 		case 'a':
 			addr = atoi(optarg);
@@ -122,9 +175,65 @@ int main(int argc, char * argv[]) {
 			device = optarg;
 			use_kiss = 1;
 			break;
+		case 'e':
+			device2 = optarg;
+			break;
+		case 'k':
+			kiss_ports = atoi(optarg);
+			break;
 		case 'h':
 			print_help();
 			exit(0);
+		case 'l':
+			tcp_port = atoi(optarg);
+			use_tcp = 1;
+			break;
+		case 'B':
+			bridge = optarg;
+			break;
+		case 'M':
+			if (strcmp(optarg, "failover") == 0) {
+				radio_mode = CSP_MULTI_FAILOVER;
+			} else if (strcmp(optarg, "balance") == 0) {
+				radio_mode = CSP_MULTI_BALANCE;
+			} else if (strcmp(optarg, "duplicate") == 0) {
+#ifdef CSP_USE_DEDUP
+				radio_mode = CSP_MULTI_DUPLICATE;
+#else
+				printf("Duplicate mode needs CSP built with the duplicate filter\r\n");
+				exit(EXIT_FAILURE);
+#endif
+			} else {
+				print_help();
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case 'm':
+			shm_name = optarg;
+			break;
+		case 'p':
+			if (udp_peer_count < CSP_ID_HOST_MAX + 1)
+				udp_peers[udp_peer_count++] = optarg;
+			break;
+		case 'r':
+			routes = optarg;
+			break;
+		case 't': {
+			char * colon = strrchr(optarg, ':');
+			if (colon == NULL) {
+				print_help();
+				exit(EXIT_FAILURE);
+			}
+			*colon = '\0';
+			tcp_host = optarg;
+			tcp_port = atoi(colon + 1);
+			use_tcp = 1;
+			break;
+		}
+		case 'u':
+			udp_port = atoi(optarg);
+			use_udp = 1;
+			break;
 		case 'z':
 			strcpy(zmqhost, optarg);
 			use_zmq = 1;
@@ -152,18 +261,46 @@ int main(int argc, char * argv[]) {
 	 * KISS interface
 	 */
 	if (use_kiss == 1) {
-		static csp_iface_t csp_if_kiss;
-		static csp_kiss_handle_t csp_kiss_driver;
-		static const char * kiss_name = "KISS";
-		csp_route_set(CSP_DEFAULT_ROUTE, &csp_if_kiss, CSP_NODE_MAC);
+		csp_route_set(CSP_DEFAULT_ROUTE, &radio_if[0], CSP_NODE_MAC);
 
-		csp_kiss_init(&csp_if_kiss, &csp_kiss_driver, usart_putc, usart_insert, kiss_name);
+		csp_kiss_init(&radio_if[0], &radio_kiss[0], NULL, usart_insert, "KISS");
+		csp_kiss_set_write(&radio_kiss[0], radio_write, &radio_usart[0]);
 		struct usart_conf conf = {.device = device, .baudrate = baud};
-		usart_init(&conf);
-		void my_usart_rx(uint8_t * buf, int len, void * pxTaskWoken) {
-			csp_kiss_rx(&csp_if_kiss, buf, len, pxTaskWoken);
+		radio_usart[0] = usart_open(&conf, radio_rx, &radio_if[0]);
+		if (radio_usart[0] == NULL) {
+			printf("Cannot open %s\r\n", device);
+			exit(EXIT_FAILURE);
+		}
+
+		for (int port = 1; port < kiss_ports && port < CSP_KISS_PORTS; port++) {
+			sprintf(radio_port_name[port], "TNC%d", port);
+			csp_kiss_add_port(&radio_kiss[0], &radio_port_if[port], port, radio_port_name[port]);
+		}
+	}
+
+	if (device2 != NULL) {
+		csp_kiss_init(&radio_if[1], &radio_kiss[1], NULL, usart_insert, "KISS2");
+		csp_kiss_set_write(&radio_kiss[1], radio_write, &radio_usart[1]);
+		struct usart_conf conf = {.device = device2, .baudrate = baud};
+		radio_usart[1] = usart_open(&conf, radio_rx, &radio_if[1]);
+		if (radio_usart[1] == NULL) {
+			printf("Cannot open %s\r\n", device2);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	/**
+	 * Both radios behind one interface, for redundancy or load sharing
+	 */
+	if (radio_mode >= 0 && use_kiss == 1 && device2 != NULL) {
+		static csp_iface_t csp_if_radio;
+		if (csp_multi_init(&csp_if_radio, "RADIO", radio_mode) != CSP_ERR_NONE
+				|| csp_multi_add(&csp_if_radio, &radio_if[0]) != CSP_ERR_NONE
+				|| csp_multi_add(&csp_if_radio, &radio_if[1]) != CSP_ERR_NONE) {
+			printf("Cannot set up interface RADIO\r\n");
+			exit(EXIT_FAILURE);
 		}
-		usart_set_callback(my_usart_rx);
+		csp_route_set(CSP_DEFAULT_ROUTE, &csp_if_radio, CSP_NODE_MAC);
 	}
 
 	/**
@@ -174,6 +311,55 @@ int main(int argc, char * argv[]) {
 		csp_route_set(CSP_DEFAULT_ROUTE, &csp_if_zmqhub, CSP_NODE_MAC);
 	}
 
+	/**
+	 * KISS over TCP interface
+	 */
+	if (use_tcp == 1) {
+		static csp_iface_t csp_if_kiss_tcp;
+		if (csp_kiss_tcp_init(&csp_if_kiss_tcp, "KTCP", tcp_host, tcp_port) != CSP_ERR_NONE)
+			exit(EXIT_FAILURE);
+		csp_route_set(CSP_DEFAULT_ROUTE, &csp_if_kiss_tcp, CSP_NODE_MAC);
+	}
+
+	/**
+	 * UDP interface
+	 */
+	if (use_udp == 1) {
+		static csp_iface_t csp_if_udp;
+		struct csp_udp_config conf = {.lport = udp_port};
+		if (csp_udp_init(&csp_if_udp, "UDP", &conf) != CSP_ERR_NONE)
+			exit(EXIT_FAILURE);
+		for (int i = 0; i < udp_peer_count; i++) {
+			uint8_t node = CSP_BROADCAST_ADDR;
+			char * host = udp_peers[i];
+			char * at = strchr(host, '@');
+			if (at != NULL) {
+				*at = '\0';
+				node = atoi(host);
+				host = at + 1;
+			}
+			char * colon = strrchr(host, ':');
+			if (colon == NULL) {
+				print_help();
+				exit(EXIT_FAILURE);
+			}
+			*colon = '\0';
+			if (csp_udp_peer_add(&csp_if_udp, node, host, atoi(colon + 1)) != CSP_ERR_NONE)
+				exit(EXIT_FAILURE);
+		}
+		csp_route_set(CSP_DEFAULT_ROUTE, &csp_if_udp, CSP_NODE_MAC);
+	}
+
+	/**
+	 * Shared memory interface, routes to local processes are given with -r
+	 */
+	if (shm_name != NULL) {
+		static csp_iface_t csp_if_shm;
+		struct csp_shm_config conf = {.name = shm_name, .create = 1};
+		if (csp_shm_init(&csp_if_shm, "SHM", &conf) != CSP_ERR_NONE)
+			exit(EXIT_FAILURE);
+	}
+
 	/**
 	 * CAN Interface
 	 */
@@ -183,6 +369,30 @@ int main(int argc, char * argv[]) {
 		csp_route_set(CSP_DEFAULT_ROUTE, &csp_if_can, CSP_NODE_MAC);
 	}
 
+	/**
+	 * Routes, loaded after all interfaces exist
+	 */
+	if (routes != NULL)
+		csp_rtable_load(routes);
+
+	/**
+	 * Bridge, packets from the two interfaces bypass the router
+	 */
+	if (bridge != NULL) {
+		char * comma = strchr(bridge, ',');
+		if (comma == NULL) {
+			print_help();
+			exit(EXIT_FAILURE);
+		}
+		*comma = '\0';
+		csp_iface_t * if_a = csp_iflist_get_by_name(bridge);
+		csp_iface_t * if_b = csp_iflist_get_by_name(comma + 1);
+		if (if_a == NULL || if_b == NULL || csp_bridge_start(1000, 0, if_a, if_b) != CSP_ERR_NONE) {
+			printf("Cannot bridge %s and %s\r\n", bridge, comma + 1);
+			exit(EXIT_FAILURE);
+		}
+	}
+
 	/**
 	 * liblog setup
 	 */